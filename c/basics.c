@@ -118,11 +118,29 @@ int names_equal(char **a, char **b)
 
 int common_prefix_size(struct strbuf *a, struct strbuf *b)
 {
-	int p = 0;
-	for (; p < a->len && p < b->len; p++) {
+	size_t max = a->len < b->len ? a->len : b->len;
+	size_t p = 0;
+
+	/* Sorted keys share long prefixes, so compare a word at a time
+	 * first. */
+	for (; p + sizeof(uint64_t) <= max; p += sizeof(uint64_t)) {
+		uint64_t x, y;
+		memcpy(&x, a->buf + p, sizeof(x));
+		memcpy(&y, b->buf + p, sizeof(y));
+		if (x != y)
+			break;
+	}
+	for (; p < max; p++) {
 		if (a->buf[p] != b->buf[p])
 			break;
 	}
 
 	return p;
 }
+
+uint64_t monotonic_nsec(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
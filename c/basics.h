@@ -57,4 +57,7 @@ void *reftable_calloc(size_t sz);
 struct strbuf;
 int common_prefix_size(struct strbuf *a, struct strbuf *b);
 
+/* returns a monotonic clock reading in nanoseconds, for timing stats. */
+uint64_t monotonic_nsec(void);
+
 #endif
@@ -9,6 +9,7 @@ https://developers.google.com/open-source/licenses/bsd
 #include "block.h"
 
 #include "blocksource.h"
+#include "codec.h"
 #include "constants.h"
 #include "record.h"
 #include "reftable-error.h"
@@ -130,7 +131,7 @@ done:
 	return -1;
 }
 
-int block_writer_finish(struct block_writer *w)
+int block_writer_finish_uncompressed(struct block_writer *w)
 {
 	int i;
 	for (i = 0; i < w->restart_len; i++) {
@@ -141,39 +142,109 @@ int block_writer_finish(struct block_writer *w)
 	put_be16(w->buf + w->next, w->restart_len);
 	w->next += 2;
 	put_be24(w->buf + 1 + w->header_off, w->next);
+	return w->next;
+}
+
+int block_compress(struct strbuf *dest, const uint8_t *block, size_t len,
+		   uint32_t header_off, enum reftable_compression compression,
+		   int sized)
+{
+	const struct block_codec *codec = block_codec_get(compression);
+	int block_header_skip = 4 + header_off;
+	int body_off = block_header_skip + CODEC_MARK_SIZE;
+	int n = 0;
+
+	if (!codec)
+		return REFTABLE_API_ERROR;
+	if (block[header_off] == BLOCK_TYPE_LOG &&
+	    codec->compression == REFTABLE_COMPRESSION_ZLIB && !sized)
+		body_off = block_header_skip;
+
+	strbuf_reset(dest);
+	strbuf_add(dest, block, block_header_skip);
+	strbuf_grow(dest, CODEC_MARK_SIZE + codec->bound(len - block_header_skip));
+	n = codec->compress((uint8_t *)dest->buf + body_off,
+			    block + block_header_skip, len - block_header_skip);
+	if (n < 0)
+		return n;
+	if (n >= (1 << 24))
+		return REFTABLE_API_ERROR;
+
+	if (body_off > block_header_skip) {
+		dest->buf[block_header_skip] = codec->mark;
+		put_be24((uint8_t *)dest->buf + block_header_skip + 1, n);
+	}
+	strbuf_setlen(dest, body_off + n);
+	return dest->len;
+}
 
+int block_writer_finish(struct block_writer *w)
+{
+	int n = block_writer_finish_uncompressed(w);
 	if (block_writer_type(w) == BLOCK_TYPE_LOG) {
-		int block_header_skip = 4 + w->header_off;
-		uLongf src_len = w->next - block_header_skip;
-		uLongf dest_cap = src_len * 1.001 + 12;
-
-		uint8_t *compressed = reftable_malloc(dest_cap);
-		while (1) {
-			uLongf out_dest_len = dest_cap;
-			int zresult = compress2(compressed, &out_dest_len,
-						w->buf + block_header_skip,
-						src_len, 9);
-			if (zresult == Z_BUF_ERROR && dest_cap < LONG_MAX) {
-				dest_cap *= 2;
-				compressed =
-					reftable_realloc(compressed, dest_cap);
-				if (compressed)
-					continue;
-			}
-
-			if (Z_OK != zresult) {
-				reftable_free(compressed);
-				return REFTABLE_ZLIB_ERROR;
-			}
-
-			memcpy(w->buf + block_header_skip, compressed,
-			       out_dest_len);
-			w->next = out_dest_len + block_header_skip;
-			reftable_free(compressed);
-			break;
+		struct strbuf compressed = STRBUF_INIT;
+		n = block_compress(&compressed, w->buf, w->next, w->header_off,
+				   REFTABLE_COMPRESSION_ZLIB, 0);
+		if (n > w->block_size)
+			n = REFTABLE_API_ERROR;
+		if (n > 0) {
+			memcpy(w->buf, compressed.buf, compressed.len);
+			w->next = n;
 		}
+		strbuf_release(&compressed);
 	}
-	return w->next;
+	return n;
+}
+
+/* returns whether the body of a block of type `typ`, starting with
+ * `first_byte`, is marked with its codec; see codec.h. */
+static int block_body_is_marked(uint8_t typ, uint8_t first_byte)
+{
+	if (typ == BLOCK_TYPE_LOG)
+		return !block_codec_is_zlib_stream(first_byte);
+	return first_byte != 0;
+}
+
+uint32_t block_stored_size(const uint8_t *block, size_t len,
+			   uint32_t header_off)
+{
+	int block_header_skip = 4 + header_off;
+
+	if (len < block_header_skip + CODEC_MARK_SIZE ||
+	    !block_body_is_marked(block[header_off], block[block_header_skip]))
+		return 0;
+	return block_header_skip + CODEC_MARK_SIZE +
+	       get_be24((uint8_t *)block + block_header_skip + 1);
+}
+
+/* decompresses the body of a block of type `typ` at `src`, of at most
+ * `*src_len` bytes, into `len` bytes at `dest`, and sets `*src_len` to its
+ * stored size. */
+static int block_decompress(uint8_t typ, uint8_t *dest, size_t len,
+			    const uint8_t *src, size_t *src_len)
+{
+	const struct block_codec *codec = NULL;
+	size_t compressed_len = 0;
+	int err = 0;
+
+	if (*src_len == 0)
+		return REFTABLE_FORMAT_ERROR;
+	if (!block_body_is_marked(typ, src[0]))
+		return block_codec_get(REFTABLE_COMPRESSION_ZLIB)
+			->decompress(dest, len, src, src_len);
+
+	codec = block_codec_by_mark(src[0]);
+	if (!codec || *src_len < CODEC_MARK_SIZE)
+		return REFTABLE_FORMAT_ERROR;
+	compressed_len = get_be24((uint8_t *)src + 1);
+	if (compressed_len > *src_len - CODEC_MARK_SIZE)
+		return REFTABLE_FORMAT_ERROR;
+	err = codec->decompress(dest, len, src + CODEC_MARK_SIZE,
+				&compressed_len);
+	if (err < 0)
+		return err;
+	*src_len = CODEC_MARK_SIZE + compressed_len;
+	return 0;
 }
 
 uint8_t block_reader_type(struct block_reader *r)
@@ -196,29 +267,30 @@ int block_reader_init(struct block_reader *br, struct reftable_block *block,
 	if (!reftable_is_block_type(typ))
 		return REFTABLE_FORMAT_ERROR;
 
-	if (typ == BLOCK_TYPE_LOG) {
+	if (block->len <= 4 + header_off || sz <= 4 + header_off)
+		return REFTABLE_FORMAT_ERROR;
+
+	if (typ == BLOCK_TYPE_LOG ||
+	    block_body_is_marked(typ, block->data[4 + header_off])) {
 		int block_header_skip = 4 + header_off;
-		uLongf dst_len = sz - block_header_skip; /* total size of dest
-							    buffer. */
-		uLongf src_len = block->len - block_header_skip;
-		/* Log blocks specify the *uncompressed* size in their header.
-		 */
+		size_t src_len = block->len - block_header_skip;
+		/* Compressed blocks specify the *uncompressed* size in their
+		 * header. */
 		uint8_t *uncompressed = reftable_malloc(sz);
+		int err = 0;
 
 		/* Copy over the block header verbatim. It's not compressed. */
 		memcpy(uncompressed, block->data, block_header_skip);
 
-		/* Uncompress */
-		if (Z_OK !=
-		    uncompress2(uncompressed + block_header_skip, &dst_len,
-				block->data + block_header_skip, &src_len)) {
+		err = block_decompress(typ, uncompressed + block_header_skip,
+				       sz - block_header_skip,
+				       block->data + block_header_skip,
+				       &src_len);
+		if (err < 0) {
 			reftable_free(uncompressed);
-			return REFTABLE_ZLIB_ERROR;
+			return err;
 		}
 
-		if (dst_len + block_header_skip != sz)
-			return REFTABLE_FORMAT_ERROR;
-
 		/* We're done with the input data. */
 		reftable_block_done(block);
 		block->data = uncompressed;
@@ -272,6 +344,27 @@ struct restart_find_args {
 	struct block_reader *r;
 };
 
+/* compares `a` with the key formed by `prefix` bytes of `b` followed by
+ * `suffix`, without materializing the latter. */
+static int key_cmp(struct strbuf *a, struct strbuf *b, size_t prefix,
+		   uint8_t *suffix, size_t suffix_len)
+{
+	size_t n = prefix < a->len ? prefix : a->len;
+	int cmp = memcmp(a->buf, b->buf, n);
+	if (cmp)
+		return cmp;
+	if (a->len <= prefix)
+		return a->len < prefix + suffix_len ? -1 : 0;
+
+	n = a->len - prefix;
+	cmp = memcmp(a->buf + prefix, suffix, n < suffix_len ? n : suffix_len);
+	if (cmp)
+		return cmp;
+	if (n == suffix_len)
+		return 0;
+	return n < suffix_len ? -1 : 1;
+}
+
 static int restart_key_less(size_t idx, void *args)
 {
 	struct restart_find_args *a = args;
@@ -280,22 +373,19 @@ static int restart_key_less(size_t idx, void *args)
 		.buf = a->r->block.data + off,
 		.len = a->r->block_len - off,
 	};
-
-	/* the restart key is verbatim in the block, so this could avoid the
-	   alloc for decoding the key */
-	struct strbuf rkey = STRBUF_INIT;
-	struct strbuf last_key = STRBUF_INIT;
+	uint64_t prefix_len = 0;
+	uint64_t suffix_len = 0;
 	uint8_t unused_extra;
-	int n = reftable_decode_key(&rkey, &unused_extra, last_key, in);
-	int result;
-	if (n < 0) {
+
+	/* restart keys are stored verbatim, so compare them in place. */
+	int n = reftable_decode_keylen(in, &prefix_len, &suffix_len,
+				       &unused_extra);
+	if (n < 0 || prefix_len != 0) {
 		a->error = 1;
 		return -1;
 	}
 
-	result = strbuf_cmp(&a->key, &rkey);
-	strbuf_release(&rkey);
-	return result;
+	return key_cmp(&a->key, &a->key, 0, in.buf + n, suffix_len) < 0;
 }
 
 void block_iter_copy_from(struct block_iter *dest, struct block_iter *src)
@@ -313,27 +403,25 @@ int block_iter_next(struct block_iter *it, struct reftable_record *rec)
 		.len = it->br->block_len - it->next_off,
 	};
 	struct string_view start = in;
-	struct strbuf key = STRBUF_INIT;
 	uint8_t extra = 0;
 	int n = 0;
 
 	if (it->next_off >= it->br->block_len)
 		return 1;
 
-	n = reftable_decode_key(&key, &extra, it->last_key, in);
+	/* decode in place, so views can point into last_key. */
+	n = reftable_decode_next_key(&it->last_key, &extra, in);
 	if (n < 0)
 		return -1;
 
 	string_view_consume(&in, n);
-	n = reftable_record_decode(rec, key, extra, in, it->br->hash_size);
+	n = reftable_record_decode(rec, it->last_key, extra, in,
+				   it->br->hash_size);
 	if (n < 0)
 		return -1;
 	string_view_consume(&in, n);
 
-	strbuf_reset(&it->last_key);
-	strbuf_addbuf(&it->last_key, &key);
 	it->next_off += start.len - in.len;
-	strbuf_release(&key);
 	return 0;
 }
 
@@ -354,6 +442,52 @@ int block_reader_first_key(struct block_reader *br, struct strbuf *key)
 	return 0;
 }
 
+/* most keys fit in this many bytes, so peeking at the first key of a block
+ * rarely needs to decompress more. */
+#define PEEK_KEY_BYTES 256
+
+int block_peek_first_key(const uint8_t *block, uint32_t stored,
+			 uint32_t header_off, struct strbuf *key)
+{
+	struct strbuf empty = STRBUF_INIT;
+	int block_header_skip = 4 + header_off;
+	uint32_t sz = get_be24((uint8_t *)block + header_off + 1);
+	const struct block_codec *codec = block_codec_by_mark(
+		block[block_header_skip]);
+	size_t body_len = 0;
+	size_t len = 0;
+	uint8_t *body = NULL;
+	int err = 0;
+
+	if (!codec || sz <= block_header_skip ||
+	    stored < block_header_skip + CODEC_MARK_SIZE)
+		return REFTABLE_FORMAT_ERROR;
+
+	body_len = sz - block_header_skip;
+	len = body_len < PEEK_KEY_BYTES ? body_len : PEEK_KEY_BYTES;
+	body = reftable_malloc(body_len);
+	while (1) {
+		struct string_view in = {
+			.buf = body,
+			.len = len,
+		};
+		uint8_t extra = 0;
+
+		err = codec->decompress_prefix(
+			body, len, block + block_header_skip + CODEC_MARK_SIZE,
+			stored - block_header_skip - CODEC_MARK_SIZE);
+		if (err < 0)
+			break;
+		err = reftable_decode_key(key, &extra, empty, in);
+		if (err >= 0 || len == body_len)
+			break;
+		/* a long key; decompress the whole body. */
+		len = body_len;
+	}
+	reftable_free(body);
+	return err < 0 ? err : 0;
+}
+
 int block_iter_seek(struct block_iter *it, struct strbuf *want)
 {
 	return block_reader_seek(it->br, it, want);
@@ -371,20 +505,14 @@ int block_reader_seek(struct block_reader *br, struct block_iter *it,
 		.key = *want,
 		.r = br,
 	};
-	struct reftable_record rec = reftable_new_record(block_reader_type(br));
-	struct strbuf key = STRBUF_INIT;
-	int err = 0;
-	struct block_iter next = {
-		.last_key = STRBUF_INIT,
-	};
-
+	uint8_t typ = block_reader_type(br);
 	int i = binsearch(br->restart_count, &restart_key_less, &args);
-	if (args.error) {
-		err = REFTABLE_FORMAT_ERROR;
-		goto done;
-	}
+	if (args.error)
+		return REFTABLE_FORMAT_ERROR;
 
+	/* `i` is the first restart with a key larger than `want`. */
 	it->br = br;
+	strbuf_reset(&it->last_key);
 	if (i > 0) {
 		i--;
 		it->next_off = block_reader_restart_offset(br, i);
@@ -392,30 +520,39 @@ int block_reader_seek(struct block_reader *br, struct block_iter *it,
 		it->next_off = br->header_off + 4;
 	}
 
-	/* We're looking for the last entry less/equal than the wanted key, so
-	   we have to go one entry too far and then back up.
-	*/
-	while (1) {
-		block_iter_copy_from(&next, it);
-		err = block_iter_next(&next, &rec);
-		if (err < 0)
-			goto done;
+	/* Position `it` at the first entry whose key is at least `want`. Only
+	   keys are decoded; values are skipped over. */
+	while (it->next_off < br->block_len) {
+		struct string_view in = {
+			.buf = br->block.data + it->next_off,
+			.len = br->block_len - it->next_off,
+		};
+		uint64_t prefix_len = 0;
+		uint64_t suffix_len = 0;
+		uint8_t extra = 0;
+		uint8_t *suffix = NULL;
+		int n = reftable_decode_keylen(in, &prefix_len, &suffix_len,
+					       &extra);
+		int m = 0;
+		if (n < 0 || prefix_len > it->last_key.len)
+			return REFTABLE_FORMAT_ERROR;
+		suffix = in.buf + n;
 
-		reftable_record_key(&rec, &key);
-		if (err > 0 || strbuf_cmp(&key, want) >= 0) {
-			err = 0;
-			goto done;
-		}
+		if (key_cmp(want, &it->last_key, prefix_len, suffix,
+			    suffix_len) <= 0)
+			break;
 
-		block_iter_copy_from(it, &next);
-	}
+		string_view_consume(&in, n + suffix_len);
+		m = reftable_record_skip_value(typ, extra, in, br->hash_size);
+		if (m < 0)
+			return REFTABLE_FORMAT_ERROR;
 
-done:
-	strbuf_release(&key);
-	strbuf_release(&next.last_key);
-	reftable_record_destroy(&rec);
+		it->last_key.len = prefix_len;
+		strbuf_add(&it->last_key, suffix, suffix_len);
+		it->next_off += n + suffix_len + m;
+	}
 
-	return err;
+	return 0;
 }
 
 void block_writer_release(struct block_writer *bw)
@@ -12,6 +12,7 @@ https://developers.google.com/open-source/licenses/bsd
 #include "basics.h"
 #include "record.h"
 #include "reftable-blocksource.h"
+#include "reftable-writer.h"
 
 /*
  * Writes reftable blocks. The block_writer is reused across blocks to minimize
@@ -53,6 +54,23 @@ int block_writer_add(struct block_writer *w, struct reftable_record *rec);
 /* appends the key restarts, and compress the block if necessary. */
 int block_writer_finish(struct block_writer *w);
 
+/* appends the key restarts, but leaves log blocks uncompressed, for
+ * compressing them elsewhere with block_compress. Returns the block size. */
+int block_writer_finish_uncompressed(struct block_writer *w);
+
+/* sets `dest` to the finished, uncompressed block of `len` bytes at
+ * `block`, with its data compressed as `compression` says. With `sized`, zlib
+ * log blocks record their compressed size too. Returns the new size, or an
+ * error. */
+int block_compress(struct strbuf *dest, const uint8_t *block, size_t len,
+		   uint32_t header_off, enum reftable_compression compression,
+		   int sized);
+
+/* returns the size that the compressed block starting with `len` bytes at
+ * `block` takes in the file, or 0 if that can't be told from its header. */
+uint32_t block_stored_size(const uint8_t *block, size_t len,
+			   uint32_t header_off);
+
 /* clears out internally allocated block_writer members. */
 void block_writer_release(struct block_writer *bw);
 
@@ -104,6 +122,12 @@ uint8_t block_reader_type(struct block_reader *r);
 /* Decodes the first key in the block */
 int block_reader_first_key(struct block_reader *br, struct strbuf *key);
 
+/* Decodes the first key of the compressed block of `stored` bytes at `block`,
+ * whose size block_stored_size returned, decompressing only as much of it as
+ * needed. */
+int block_peek_first_key(const uint8_t *block, uint32_t stored,
+			 uint32_t header_off, struct strbuf *key);
+
 void block_iter_copy_from(struct block_iter *dest, struct block_iter *src);
 
 /* return < 0 for error, 0 for OK, > 0 for EOF. */
@@ -0,0 +1,365 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+/* Microbenchmarks for seeking inside a single block, and for encoding and
+ * decoding its keys. */
+
+#include "block.h"
+
+#include "system.h"
+#include "blocksource.h"
+#include "basics.h"
+#include "constants.h"
+#include "record.h"
+#include "test_framework.h"
+#include "reftable-malloc.h"
+#include "reftable-tests.h"
+
+static uint64_t alloc_count;
+
+static void *counting_malloc(size_t sz)
+{
+	alloc_count++;
+	return malloc(sz);
+}
+
+static void *counting_realloc(void *p, size_t sz)
+{
+	alloc_count++;
+	return realloc(p, sz);
+}
+
+/* The seek as it was before comparing keys in place: it decodes every restart
+ * key into a new strbuf, and decodes full records while scanning. Unlike the
+ * original, the restart predicate is 'want < restart key', so it finds keys
+ * and can be timed against block_reader_seek. */
+struct decoding_restart_args {
+	int error;
+	struct strbuf key;
+	struct block_reader *r;
+};
+
+static int decoding_restart_key_less(size_t idx, void *args)
+{
+	struct decoding_restart_args *a = args;
+	uint32_t off = get_be24(a->r->restart_bytes + 3 * idx);
+	struct string_view in = {
+		.buf = a->r->block.data + off,
+		.len = a->r->block_len - off,
+	};
+	struct strbuf rkey = STRBUF_INIT;
+	struct strbuf last_key = STRBUF_INIT;
+	uint8_t unused_extra;
+	int n = reftable_decode_key(&rkey, &unused_extra, last_key, in);
+	int result;
+	if (n < 0) {
+		a->error = 1;
+		return -1;
+	}
+
+	result = strbuf_cmp(&a->key, &rkey) < 0;
+	strbuf_release(&rkey);
+	return result;
+}
+
+static int decoding_seek(struct block_reader *br, struct block_iter *it,
+			 struct strbuf *want)
+{
+	struct decoding_restart_args args = {
+		.key = *want,
+		.r = br,
+	};
+	struct reftable_record rec = reftable_new_record(block_reader_type(br));
+	struct strbuf key = STRBUF_INIT;
+	int err = 0;
+	struct block_iter next = {
+		.last_key = STRBUF_INIT,
+	};
+
+	int i = binsearch(br->restart_count, &decoding_restart_key_less, &args);
+	if (args.error) {
+		err = REFTABLE_FORMAT_ERROR;
+		goto done;
+	}
+
+	it->br = br;
+	strbuf_reset(&it->last_key);
+	if (i > 0) {
+		i--;
+		it->next_off = get_be24(br->restart_bytes + 3 * i);
+	} else {
+		it->next_off = br->header_off + 4;
+	}
+
+	while (1) {
+		block_iter_copy_from(&next, it);
+		err = block_iter_next(&next, &rec);
+		if (err < 0)
+			goto done;
+
+		reftable_record_key(&rec, &key);
+		if (err > 0 || strbuf_cmp(&key, want) >= 0) {
+			err = 0;
+			goto done;
+		}
+
+		block_iter_copy_from(it, &next);
+	}
+
+done:
+	strbuf_release(&key);
+	strbuf_release(&next.last_key);
+	reftable_record_destroy(&rec);
+	return err;
+}
+
+static void bench_seek(const char *label, struct block_reader *br,
+		       struct strbuf *wants, int wants_len, int rounds,
+		       int (*seek)(struct block_reader *, struct block_iter *,
+				   struct strbuf *))
+{
+	struct block_iter it = { .last_key = STRBUF_INIT };
+	struct reftable_record rec = reftable_new_record(block_reader_type(br));
+	struct strbuf key = STRBUF_INIT;
+	uint64_t start, elapsed, allocs;
+	int seeks = rounds * wants_len;
+	int i, j;
+
+	/* warm up, so the iterator's key buffer has its final size, and check
+	 * that each seek lands on the wanted key. */
+	for (i = 0; i < wants_len; i++) {
+		EXPECT(seek(br, &it, &wants[i]) == 0);
+		EXPECT(block_iter_next(&it, &rec) == 0);
+		reftable_record_key(&rec, &key);
+		EXPECT(0 == strbuf_cmp(&key, &wants[i]));
+	}
+	strbuf_release(&key);
+	reftable_record_destroy(&rec);
+
+	alloc_count = 0;
+	start = test_now_nsec();
+	for (j = 0; j < rounds; j++) {
+		for (i = 0; i < wants_len; i++) {
+			int err = seek(br, &it, &wants[i]);
+			EXPECT(err == 0);
+		}
+	}
+	elapsed = test_now_nsec() - start;
+	allocs = alloc_count;
+	block_iter_close(&it);
+
+	printf("%-20s %10.0f seeks/s %8.2f allocs/seek\n", label,
+	       seeks / (elapsed / 1e9), (double)allocs / seeks);
+}
+
+/* common_prefix_size as it was before comparing words. */
+static int legacy_common_prefix_size(struct strbuf *a, struct strbuf *b)
+{
+	int p = 0;
+	for (; p < a->len && p < b->len; p++) {
+		if (a->buf[p] != b->buf[p])
+			break;
+	}
+
+	return p;
+}
+
+/* refs/changes/NN/NNNNN/N, as written by Gerrit. */
+static void gerrit_name(char *name, size_t sz, int i)
+{
+	int change = i / 3 + 1;
+	snprintf(name, sz, "refs/changes/%02d/%05d/%d", change % 100, change,
+		 i % 3 + 1);
+}
+
+/* refs/pull/N/head, as written by GitHub. */
+static void pull_name(char *name, size_t sz, int i)
+{
+	snprintf(name, sz, "refs/pull/%d/head", i + 1);
+}
+
+static int strbuf_cmp_void(const void *a, const void *b)
+{
+	return strbuf_cmp((struct strbuf *)a, (struct strbuf *)b);
+}
+
+/* Times prefix computation, block writing and key-only block scans over
+ * `n` sorted names from `gen`. */
+static void bench_keys(const char *label,
+		       void (*gen)(char *name, size_t sz, int i), int n,
+		       int rounds)
+{
+	const int block_size = 65536;
+	struct strbuf *names = reftable_calloc(sizeof(struct strbuf) * n);
+	uint8_t *buf = reftable_calloc(block_size);
+	uint8_t hash[GIT_SHA1_RAWSZ] = { 0 };
+	uint64_t start, elapsed;
+	int64_t sum = 0;
+	int written = 0;
+	int decoded = 0;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		char name[100];
+		gen(name, sizeof(name), i);
+		strbuf_init(&names[i], 0);
+		strbuf_addstr(&names[i], name);
+	}
+	QSORT(names, n, strbuf_cmp_void);
+	printf("%s, %d names\n", label, n);
+
+	start = test_now_nsec();
+	for (j = 0; j < rounds; j++)
+		for (i = 1; i < n; i++)
+			sum += legacy_common_prefix_size(&names[i - 1],
+							 &names[i]);
+	elapsed = test_now_nsec() - start;
+	printf("  %-26s %8.2f ns/key\n", "legacy common prefix",
+	       (double)elapsed / (rounds * (n - 1)));
+
+	start = test_now_nsec();
+	for (j = 0; j < rounds; j++)
+		for (i = 1; i < n; i++)
+			sum -= common_prefix_size(&names[i - 1], &names[i]);
+	elapsed = test_now_nsec() - start;
+	printf("  %-26s %8.2f ns/key\n", "common_prefix_size",
+	       (double)elapsed / (rounds * (n - 1)));
+	EXPECT(sum == 0);
+
+	start = test_now_nsec();
+	for (j = 0; j < rounds; j++) {
+		struct block_writer bw = {
+			.last_key = STRBUF_INIT,
+		};
+		struct reftable_ref_record ref = {
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		struct reftable_record rec = { NULL };
+		reftable_record_from_ref(&rec, &ref);
+		block_writer_init(&bw, BLOCK_TYPE_REF, buf, block_size, 0,
+				  GIT_SHA1_RAWSZ);
+		for (i = 0; i < n; i++) {
+			ref.refname = names[i].buf;
+			if (block_writer_add(&bw, &rec) < 0)
+				break;
+		}
+		written = i;
+		EXPECT(block_writer_finish(&bw) > 0);
+		block_writer_release(&bw);
+	}
+	elapsed = test_now_nsec() - start;
+	printf("  %-26s %8.2f ns/key\n", "block_writer_add",
+	       (double)elapsed / (rounds * written));
+
+	start = test_now_nsec();
+	for (j = 0; j < rounds; j++) {
+		/* the reader takes over the block, but not the buffer. */
+		struct reftable_block block = {
+			.data = buf,
+			.len = block_size,
+			.source = malloc_block_source(),
+		};
+		struct block_reader br = { 0 };
+		struct block_iter it = { .last_key = STRBUF_INIT };
+		struct reftable_ref_record_view key = { NULL };
+		struct reftable_record rec = { NULL };
+		reftable_record_from_ref_key(&rec, &key);
+		EXPECT(block_reader_init(&br, &block, 0, block_size,
+					 GIT_SHA1_RAWSZ) == 0);
+		block_reader_start(&br, &it);
+		for (decoded = 0; block_iter_next(&it, &rec) == 0; decoded++)
+			;
+		block_iter_close(&it);
+	}
+	elapsed = test_now_nsec() - start;
+	EXPECT(decoded == written);
+	printf("  %-26s %8.2f ns/key\n", "block_iter_next, keys",
+	       (double)elapsed / (rounds * decoded));
+
+	for (i = 0; i < n; i++)
+		strbuf_release(&names[i]);
+	reftable_free(names);
+	reftable_free(buf);
+}
+
+int block_bench_main(int argc, const char *argv[])
+{
+	const int block_size = 65536;
+	struct reftable_block block = { NULL };
+	struct block_writer bw = {
+		.last_key = STRBUF_INIT,
+	};
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_record rec = { NULL };
+	struct block_reader br = { 0 };
+	struct strbuf wants[512];
+	/* more than fit in the block. */
+	int names_len = 4000;
+	struct strbuf *names =
+		reftable_calloc(sizeof(struct strbuf) * names_len);
+	uint8_t hash[GIT_SHA1_RAWSZ] = { 0 };
+	int rounds = argc > 1 ? atoi(argv[1]) : 200;
+	int N = 0;
+	int i;
+
+	block.data = reftable_calloc(block_size);
+	block.len = block_size;
+	block.source = malloc_block_source();
+	block_writer_init(&bw, BLOCK_TYPE_REF, block.data, block_size, 0,
+			  GIT_SHA1_RAWSZ);
+	reftable_record_from_ref(&rec, &ref);
+
+	/* keys must be added in order. */
+	for (i = 0; i < names_len; i++) {
+		char name[100];
+		gerrit_name(name, sizeof(name), i);
+		strbuf_init(&names[i], 0);
+		strbuf_addstr(&names[i], name);
+	}
+	QSORT(names, names_len, strbuf_cmp_void);
+
+	for (N = 0; N < names_len; N++) {
+		ref.refname = names[N].buf;
+		ref.value_type = REFTABLE_REF_VAL1;
+		ref.value.val1 = hash;
+		set_test_hash(hash, N);
+		if (block_writer_add(&bw, &rec) < 0)
+			break;
+	}
+	EXPECT(N < names_len);
+	EXPECT(block_writer_finish(&bw) > 0);
+	block_writer_release(&bw);
+	EXPECT(block_reader_init(&br, &block, 0, block_size, GIT_SHA1_RAWSZ) ==
+	       0);
+
+	for (i = 0; i < ARRAY_SIZE(wants); i++) {
+		strbuf_init(&wants[i], 0);
+		strbuf_addbuf(&wants[i], &names[(i * 7919) % N]);
+	}
+
+	printf("block of %d bytes, %d refs, %d restarts\n", block_size, N,
+	       br.restart_count);
+	reftable_set_alloc(&counting_malloc, &counting_realloc, &free);
+	bench_seek("decoding seek", &br, wants, ARRAY_SIZE(wants), rounds,
+		   &decoding_seek);
+	bench_seek("block_reader_seek", &br, wants, ARRAY_SIZE(wants), rounds,
+		   &block_reader_seek);
+	reftable_set_alloc(&malloc, &realloc, &free);
+
+	for (i = 0; i < ARRAY_SIZE(wants); i++)
+		strbuf_release(&wants[i]);
+	for (i = 0; i < names_len; i++)
+		strbuf_release(&names[i]);
+	reftable_free(names);
+	reftable_block_done(&br.block);
+
+	bench_keys("refs/changes/NN/NNNNN/N", &gerrit_name, 3000, rounds);
+	bench_keys("refs/pull/N/head", &pull_name, 3000, rounds);
+	return 0;
+}
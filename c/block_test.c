@@ -113,8 +113,100 @@ static void test_block_read_write(void)
 	}
 }
 
+static void test_block_seek_skips_values(void)
+{
+	char *names[100];
+	const int N = ARRAY_SIZE(names);
+	const int block_size = 8192;
+	struct reftable_block block = { NULL };
+	struct block_writer bw = {
+		.last_key = STRBUF_INIT,
+	};
+	struct reftable_log_record log = { NULL };
+	struct reftable_record rec = { NULL };
+	struct block_reader br = { 0 };
+	struct strbuf want = STRBUF_INIT;
+	uint8_t hash[GIT_SHA1_RAWSZ] = { 0 };
+	int i = 0;
+	int n;
+
+	block.data = reftable_calloc(block_size);
+	block.len = block_size;
+	block.source = malloc_block_source();
+	block_writer_init(&bw, BLOCK_TYPE_LOG, block.data, block_size, 0,
+			  hash_size(GIT_SHA1_FORMAT_ID));
+	reftable_record_from_log(&rec, &log);
+
+	for (i = 0; i < N; i++) {
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/branch%02d", i);
+		names[i] = xstrdup(name);
+
+		log.refname = names[i];
+		log.update_index = i;
+		/* mix deletions and updates of varying size. */
+		log.value_type = (i % 3) ? REFTABLE_LOG_UPDATE :
+					   REFTABLE_LOG_DELETION;
+		log.value.update.old_hash = hash;
+		log.value.update.new_hash = hash;
+		log.value.update.name = "name";
+		log.value.update.email = "email";
+		log.value.update.message = (i % 2) ? "message\n" : "";
+		n = block_writer_add(&bw, &rec);
+		EXPECT(n == 0);
+	}
+
+	n = block_writer_finish(&bw);
+	EXPECT(n > 0);
+	block_writer_release(&bw);
+	memset(&log, 0, sizeof(log));
+
+	n = block_reader_init(&br, &block, 0, block_size, GIT_SHA1_RAWSZ);
+	EXPECT(n == 0);
+
+	for (i = 0; i < N; i++) {
+		struct block_iter it = { .last_key = STRBUF_INIT };
+		struct reftable_log_record key = {
+			.refname = names[i],
+			.update_index = i,
+		};
+		struct reftable_record key_rec = { NULL };
+		reftable_record_from_log(&key_rec, &key);
+		reftable_record_key(&key_rec, &want);
+
+		n = block_reader_seek(&br, &it, &want);
+		EXPECT(n == 0);
+		n = block_iter_next(&it, &rec);
+		EXPECT(n == 0);
+		EXPECT_STREQ(names[i], log.refname);
+		EXPECT(log.update_index == i);
+
+		/* in between two keys, we land on the next one. */
+		want.len = strlen(names[i]);
+		strbuf_addstr(&want, "/");
+		n = block_reader_seek(&br, &it, &want);
+		EXPECT(n == 0);
+		n = block_iter_next(&it, &rec);
+		if (i == N - 1) {
+			EXPECT(n > 0);
+		} else {
+			EXPECT(n == 0);
+			EXPECT_STREQ(names[i + 1], log.refname);
+		}
+		block_iter_close(&it);
+	}
+
+	reftable_log_record_release(&log);
+	reftable_block_done(&br.block);
+	strbuf_release(&want);
+	for (i = 0; i < N; i++) {
+		reftable_free(names[i]);
+	}
+}
+
 int block_test_main(int argc, const char *argv[])
 {
 	RUN_TEST(test_block_read_write);
+	RUN_TEST(test_block_seek_skips_values);
 	return 0;
 }
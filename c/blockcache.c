@@ -0,0 +1,406 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "blockcache.h"
+
+#include "system.h"
+#include "basics.h"
+#include "blocksource.h"
+
+struct block_cache_entry {
+	struct block_cache *cache;
+	struct block_cache_account *account;
+
+	/* chain of entries in the same hash bucket. */
+	struct block_cache_entry *next;
+
+	/* LRU list; the head is the most recently used entry. */
+	struct block_cache_entry *lru_prev, *lru_next;
+
+	char *name;
+	uint64_t off;
+	uint32_t hash;
+
+	/* One reference is held by the cache itself, one by each block
+	 * handed out. */
+	int refcount;
+	int evicted;
+
+	/* bytes accounted to this entry. */
+	uint64_t size;
+
+	/* template for handing out readers. The block data is owned by the
+	 * entry. */
+	struct block_reader br;
+};
+
+struct block_cache {
+	struct block_cache_entry **buckets;
+	size_t bucket_count; /* a power of 2 */
+	size_t entry_count;
+
+	struct block_cache_entry *lru_head, *lru_tail;
+
+	uint64_t max_bytes;
+	struct reftable_block_cache_stats stats;
+
+	/* entries not yet freed, including evicted ones still handed out. The
+	 * cache itself is freed with the last of them. */
+	size_t live;
+	int closed;
+
+#ifndef NO_PTHREADS
+	/* guards the cache and the reference counts of its entries. */
+	pthread_mutex_t mutex;
+#endif
+};
+
+static void block_cache_lock(struct block_cache *c)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&c->mutex);
+#endif
+}
+
+static void block_cache_unlock(struct block_cache *c)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&c->mutex);
+#endif
+}
+
+static void block_cache_destroy(struct block_cache *c)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_destroy(&c->mutex);
+#endif
+	reftable_free(c->buckets);
+	reftable_free(c);
+}
+
+/* Unlocks `c`, and frees it if it was closed and has no entries left. */
+static void block_cache_unlock_maybe_destroy(struct block_cache *c)
+{
+	int destroy = c->closed && c->live == 0;
+	block_cache_unlock(c);
+	if (destroy)
+		block_cache_destroy(c);
+}
+
+static uint32_t block_cache_hash(const char *name, uint64_t off)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	int i;
+	for (; *name; name++) {
+		h ^= (uint8_t)*name;
+		h *= 16777619u;
+	}
+	for (i = 0; i < 8; i++) {
+		h ^= (uint8_t)(off >> (8 * i));
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void block_cache_entry_unref(struct block_cache_entry *e)
+{
+	e->refcount--;
+	if (e->refcount > 0)
+		return;
+
+	assert(e->evicted);
+	e->cache->live--;
+	reftable_free(e->br.block.data);
+	reftable_free(e->name);
+	reftable_free(e);
+}
+
+static void cache_return_block(void *arg, struct reftable_block *block)
+{
+	struct block_cache_entry *e = arg;
+	struct block_cache *c = e->cache;
+	block_cache_lock(c);
+	block_cache_entry_unref(e);
+	block_cache_unlock_maybe_destroy(c);
+}
+
+static struct reftable_block_source_vtable cache_vtable = {
+	.return_block = &cache_return_block,
+};
+
+struct block_cache *block_cache_new(uint64_t max_bytes)
+{
+	struct block_cache *c = reftable_calloc(sizeof(struct block_cache));
+	c->bucket_count = 64;
+	c->buckets = reftable_calloc(sizeof(struct block_cache_entry *) *
+				     c->bucket_count);
+	c->max_bytes = max_bytes;
+	c->stats.capacity = max_bytes;
+#ifndef NO_PTHREADS
+	pthread_mutex_init(&c->mutex, NULL);
+#endif
+	return c;
+}
+
+static void lru_unlink(struct block_cache *c, struct block_cache_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		c->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		c->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(struct block_cache *c, struct block_cache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = c->lru_head;
+	if (c->lru_head)
+		c->lru_head->lru_prev = e;
+	c->lru_head = e;
+	if (!c->lru_tail)
+		c->lru_tail = e;
+}
+
+static void block_cache_remove(struct block_cache *c,
+			       struct block_cache_entry *e)
+{
+	struct block_cache_entry **pp =
+		&c->buckets[e->hash & (c->bucket_count - 1)];
+	while (*pp != e)
+		pp = &(*pp)->next;
+	*pp = e->next;
+	e->next = NULL;
+
+	lru_unlink(c, e);
+	c->entry_count--;
+	c->stats.entries--;
+	c->stats.bytes -= e->size;
+	if (e->account)
+		e->account->bytes -= e->size;
+	e->evicted = 1;
+	block_cache_entry_unref(e);
+}
+
+static void block_cache_grow(struct block_cache *c)
+{
+	size_t new_count = 2 * c->bucket_count;
+	struct block_cache_entry **new_buckets =
+		reftable_calloc(sizeof(struct block_cache_entry *) * new_count);
+	size_t i;
+	for (i = 0; i < c->bucket_count; i++) {
+		struct block_cache_entry *e = c->buckets[i];
+		while (e) {
+			struct block_cache_entry *next = e->next;
+			size_t b = e->hash & (new_count - 1);
+			e->next = new_buckets[b];
+			new_buckets[b] = e;
+			e = next;
+		}
+	}
+	reftable_free(c->buckets);
+	c->buckets = new_buckets;
+	c->bucket_count = new_count;
+}
+
+void block_cache_free(struct block_cache *c)
+{
+	if (!c)
+		return;
+	block_cache_lock(c);
+	while (c->lru_tail)
+		block_cache_remove(c, c->lru_tail);
+	c->closed = 1;
+	block_cache_unlock_maybe_destroy(c);
+}
+
+static void block_cache_handout(struct block_cache_entry *e,
+				struct block_reader *br)
+{
+	*br = e->br;
+	br->block.source.ops = &cache_vtable;
+	br->block.source.arg = e;
+	e->refcount++;
+}
+
+static struct block_cache_entry *
+block_cache_find(struct block_cache *c, struct block_cache_account *a,
+		 const char *name, uint64_t off, uint32_t hash)
+{
+	struct block_cache_entry *e = c->buckets[hash & (c->bucket_count - 1)];
+	for (; e; e = e->next) {
+		if (e->hash == hash && e->off == off && e->account == a &&
+		    !strcmp(e->name, name))
+			break;
+	}
+	return e;
+}
+
+/* evicts the least recently used blocks until the cache fits its capacity. */
+static void block_cache_shrink(struct block_cache *c)
+{
+	while (c->stats.bytes > c->max_bytes) {
+		block_cache_remove(c, c->lru_tail);
+		c->stats.evictions++;
+	}
+}
+
+void block_cache_set_capacity(struct block_cache *c, uint64_t max_bytes)
+{
+	block_cache_lock(c);
+	c->max_bytes = max_bytes;
+	c->stats.capacity = max_bytes;
+	block_cache_shrink(c);
+	block_cache_unlock(c);
+}
+
+int block_cache_lookup(struct block_cache *c, struct block_cache_account *a,
+		       const char *name, uint64_t off, struct block_reader *br)
+{
+	uint32_t hash = block_cache_hash(name, off);
+	struct block_cache_entry *e = NULL;
+
+	block_cache_lock(c);
+	e = block_cache_find(c, a, name, off, hash);
+	if (!e) {
+		c->stats.misses++;
+		block_cache_unlock(c);
+		return 1;
+	}
+
+	c->stats.hits++;
+	lru_unlink(c, e);
+	lru_push_front(c, e);
+	block_cache_handout(e, br);
+	block_cache_unlock(c);
+	return 0;
+}
+
+void block_cache_insert(struct block_cache *c, struct block_cache_account *a,
+			const char *name, uint64_t off,
+			struct block_reader *br)
+{
+	struct block_cache_entry *e = NULL;
+	struct reftable_block *block = &br->block;
+	size_t restart_off = br->restart_bytes - block->data;
+	/* The block reader only looks at data up to the end of the restart
+	 * table; the rest is padding or the next block. */
+	size_t len = restart_off + 3 * br->restart_count + 2;
+	uint64_t size = len + sizeof(struct block_cache_entry) + strlen(name);
+	uint32_t hash = block_cache_hash(name, off);
+	size_t b = 0;
+
+	block_cache_lock(c);
+	if (size > c->max_bytes) {
+		block_cache_unlock(c);
+		return;
+	}
+	e = block_cache_find(c, a, name, off, hash);
+	if (e) {
+		struct reftable_block read = *block;
+		block_cache_handout(e, br);
+		block_cache_unlock(c);
+		reftable_block_done(&read);
+		return;
+	}
+
+	e = reftable_calloc(sizeof(struct block_cache_entry));
+	e->cache = c;
+	e->account = a;
+	e->name = xstrdup(name);
+	e->off = off;
+	e->hash = hash;
+	e->size = size;
+	e->refcount = 1;
+	e->br = *br;
+
+	if (block->source.ops == malloc_block_source().ops) {
+		/* inflated log blocks are already ours to keep. */
+		e->br.block.len = block->len;
+	} else {
+		e->br.block.data = reftable_malloc(len);
+		memcpy(e->br.block.data, block->data, len);
+		e->br.block.len = len;
+		e->br.restart_bytes = e->br.block.data + restart_off;
+		reftable_block_done(block);
+	}
+	e->br.block.source.ops = NULL;
+	e->br.block.source.arg = NULL;
+
+	if (c->entry_count >= c->bucket_count)
+		block_cache_grow(c);
+	b = e->hash & (c->bucket_count - 1);
+	e->next = c->buckets[b];
+	c->buckets[b] = e;
+	lru_push_front(c, e);
+	c->entry_count++;
+	c->live++;
+	c->stats.entries++;
+	c->stats.bytes += size;
+	if (a)
+		a->bytes += size;
+
+	block_cache_handout(e, br);
+	block_cache_shrink(c);
+	block_cache_unlock(c);
+}
+
+void block_cache_purge(struct block_cache *c, struct block_cache_account *a,
+		       const char *name)
+{
+	struct block_cache_entry *e = NULL;
+
+	block_cache_lock(c);
+	e = c->lru_head;
+	while (e) {
+		struct block_cache_entry *next = e->lru_next;
+		if (e->account == a && !strcmp(e->name, name))
+			block_cache_remove(c, e);
+		e = next;
+	}
+	block_cache_unlock(c);
+}
+
+void block_cache_purge_account(struct block_cache *c,
+			       struct block_cache_account *a)
+{
+	struct block_cache_entry *e = NULL;
+
+	block_cache_lock(c);
+	e = c->lru_head;
+	while (e) {
+		struct block_cache_entry *next = e->lru_next;
+		if (e->account == a)
+			block_cache_remove(c, e);
+		e = next;
+	}
+	block_cache_unlock(c);
+}
+
+uint64_t block_cache_account_bytes(struct block_cache *c,
+				   struct block_cache_account *a)
+{
+	uint64_t bytes = 0;
+	block_cache_lock(c);
+	bytes = a->bytes;
+	block_cache_unlock(c);
+	return bytes;
+}
+
+void block_cache_stats(struct block_cache *c,
+		       struct reftable_block_cache_stats *dest)
+{
+	block_cache_lock(c);
+	*dest = c->stats;
+	block_cache_unlock(c);
+}
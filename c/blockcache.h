@@ -0,0 +1,72 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "block.h"
+#include "reftable-stack.h"
+
+/*
+ * A bounded cache of decoded blocks, keyed by table name and block offset.
+ * Tables are immutable, so an entry stays valid for as long as a table with
+ * that name exists.
+ *
+ * Entries are reference counted: blocks handed out by the cache keep their
+ * entry alive until they are returned through reftable_block_done(), even if
+ * the entry is evicted in the meantime.
+ *
+ * The cache may be used from several threads at once.
+ */
+struct block_cache;
+
+/* The bytes a cache holds for one of its users. Blocks are keyed by their
+ * account as well, so users sharing a cache may have tables of the same name.
+ * Updated under the lock of the cache. */
+struct block_cache_account {
+	uint64_t bytes;
+};
+
+/* creates a cache holding at most `max_bytes` of block data. */
+struct block_cache *block_cache_new(uint64_t max_bytes);
+
+/* drops all entries, and frees the cache. Outstanding blocks stay valid. */
+void block_cache_free(struct block_cache *c);
+
+/* sets the capacity of the cache, evicting blocks to fit. */
+void block_cache_set_capacity(struct block_cache *c, uint64_t max_bytes);
+
+/* Looks up the block at `off` of table `name` of account `a`, which may be
+ * NULL. On a hit, initializes `br` to read the cached block, and returns 0.
+ * Returns 1 on a miss. */
+int block_cache_lookup(struct block_cache *c, struct block_cache_account *a,
+		       const char *name, uint64_t off, struct block_reader *br);
+
+/* Adds the block read by `br` to the cache, accounting it to `a`. On return,
+ * `br` reads from the cached copy. */
+void block_cache_insert(struct block_cache *c, struct block_cache_account *a,
+			const char *name, uint64_t off,
+			struct block_reader *br);
+
+/* Evicts all blocks of table `name` of account `a`. */
+void block_cache_purge(struct block_cache *c, struct block_cache_account *a,
+		       const char *name);
+
+/* Evicts all blocks of account `a`. */
+void block_cache_purge_account(struct block_cache *c,
+			       struct block_cache_account *a);
+
+/* returns the bytes cached for account `a`. */
+uint64_t block_cache_account_bytes(struct block_cache *c,
+				   struct block_cache_account *a);
+
+/* Copies out the statistics of the cache. */
+void block_cache_stats(struct block_cache *c,
+		       struct reftable_block_cache_stats *dest);
+
+#endif
@@ -74,10 +74,113 @@ struct reftable_block_source malloc_block_source(void)
 }
 
 struct file_block_source {
+	/* -1 while the descriptor is closed by the open files limit. */
 	int fd;
 	uint64_t size;
+
+	/* to reopen the file, and check it is the same one. */
+	char *path;
+	dev_t dev;
+	ino_t ino;
+
+	/* number of reads using `fd` right now; it is only closed at 0. */
+	int busy;
+
+	/* neighbours in the list of open files, most recently read first. */
+	struct file_block_source *prev;
+	struct file_block_source *next;
+};
+
+/* The files of all file block sources in the process with an open
+ * descriptor. */
+static struct {
+#ifndef NO_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	struct file_block_source *head;
+	struct file_block_source *tail;
+	int limit;
+	struct reftable_open_files_stats stats;
+} open_files = {
+#ifndef NO_PTHREADS
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+#endif
 };
 
+static void open_files_lock(void)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&open_files.mutex);
+#endif
+}
+
+static void open_files_unlock(void)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&open_files.mutex);
+#endif
+}
+
+static void open_files_remove(struct file_block_source *b)
+{
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		open_files.head = b->next;
+	if (b->next)
+		b->next->prev = b->prev;
+	else
+		open_files.tail = b->prev;
+	b->prev = b->next = NULL;
+}
+
+static void open_files_push(struct file_block_source *b)
+{
+	b->prev = NULL;
+	b->next = open_files.head;
+	if (open_files.head)
+		open_files.head->prev = b;
+	else
+		open_files.tail = b;
+	open_files.head = b;
+}
+
+/* closes the least recently read files that aren't being read until the
+ * number of open files is within the limit. */
+static void open_files_evict(void)
+{
+	struct file_block_source *b = open_files.tail;
+
+	while (open_files.limit > 0 && b &&
+	       open_files.stats.open > open_files.limit) {
+		struct file_block_source *prev = b->prev;
+		if (!b->busy) {
+			open_files_remove(b);
+			close(b->fd);
+			b->fd = -1;
+			open_files.stats.open--;
+			open_files.stats.evictions++;
+		}
+		b = prev;
+	}
+}
+
+void reftable_set_open_files_limit(int limit)
+{
+	open_files_lock();
+	open_files.limit = limit;
+	open_files_evict();
+	open_files_unlock();
+}
+
+void reftable_get_open_files_stats(struct reftable_open_files_stats *dest)
+{
+	open_files_lock();
+	*dest = open_files.stats;
+	dest->limit = open_files.limit > 0 ? open_files.limit : 0;
+	open_files_unlock();
+}
+
 static uint64_t file_size(void *b)
 {
 	return ((struct file_block_source *)b)->size;
@@ -89,25 +192,101 @@ static void file_return_block(void *b, struct reftable_block *dest)
 	reftable_free(dest->data);
 }
 
-static void file_close(void *b)
+static void file_close(void *v)
 {
-	int fd = ((struct file_block_source *)b)->fd;
-	if (fd > 0) {
-		close(fd);
-		((struct file_block_source *)b)->fd = 0;
+	struct file_block_source *b = v;
+
+	open_files_lock();
+	if (b->fd >= 0) {
+		open_files_remove(b);
+		close(b->fd);
+		open_files.stats.open--;
 	}
+	open_files_unlock();
 
+	reftable_free(b->path);
 	reftable_free(b);
 }
 
+static int file_block_source_open(const char *name, int *fdp,
+				  struct stat *st)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			return REFTABLE_NOT_EXIST_ERROR;
+		}
+		return -1;
+	}
+
+	if (fstat(fd, st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	*fdp = fd;
+	return 0;
+}
+
+/* reopens a file closed by the open files limit. Tables are never rewritten
+ * in place, so the file is the same if it still exists under its name. */
+static int file_block_source_reopen(struct file_block_source *b)
+{
+	struct stat st = { 0 };
+	int fd = -1;
+	int err = file_block_source_open(b->path, &fd, &st);
+	if (err == 0 && (st.st_dev != b->dev || st.st_ino != b->ino ||
+			 st.st_size != b->size)) {
+		close(fd);
+		err = REFTABLE_NOT_EXIST_ERROR;
+	}
+	if (err < 0) {
+		open_files.stats.reopen_failures++;
+		return err;
+	}
+
+	b->fd = fd;
+	open_files.stats.open++;
+	open_files.stats.reopens++;
+	return 0;
+}
+
 static int file_read_block(void *v, struct reftable_block *dest, uint64_t off,
 			   uint32_t size)
 {
 	struct file_block_source *b = v;
+	int err = 0;
+	int fd = -1;
+	ssize_t n = 0;
+
 	assert(off + size <= b->size);
+	open_files_lock();
+	if (b->fd < 0)
+		err = file_block_source_reopen(b);
+	else
+		open_files_remove(b);
+	if (err == 0) {
+		open_files_push(b);
+		b->busy++;
+		fd = b->fd;
+		open_files_evict();
+	}
+	open_files_unlock();
+	if (err < 0)
+		return err;
+
 	dest->data = reftable_malloc(size);
-	if (pread(b->fd, dest->data, size, off) != size)
+	n = pread(fd, dest->data, size, off);
+
+	open_files_lock();
+	b->busy--;
+	open_files_evict();
+	open_files_unlock();
+
+	if (n != size) {
+		FREE_AND_NULL(dest->data);
 		return -1;
+	}
 	dest->len = size;
 	return size;
 }
@@ -119,30 +298,116 @@ static struct reftable_block_source_vtable file_vtable = {
 	.close = &file_close,
 };
 
+static void file_block_source_init(struct reftable_block_source *bs, int fd,
+				   const char *name, struct stat *st)
+{
+	struct file_block_source *p =
+		reftable_calloc(sizeof(struct file_block_source));
+	p->size = st->st_size;
+	p->fd = fd;
+	p->path = xstrdup(name);
+	p->dev = st->st_dev;
+	p->ino = st->st_ino;
+
+	open_files_lock();
+	open_files_push(p);
+	open_files.stats.open++;
+	open_files.stats.opens++;
+	open_files_evict();
+	open_files_unlock();
+
+	assert(!bs->ops);
+	bs->ops = &file_vtable;
+	bs->arg = p;
+}
+
 int reftable_block_source_from_file(struct reftable_block_source *bs,
 				    const char *name)
 {
 	struct stat st = { 0 };
-	int err = 0;
-	int fd = open(name, O_RDONLY);
-	struct file_block_source *p = NULL;
-	if (fd < 0) {
-		if (errno == ENOENT) {
-			return REFTABLE_NOT_EXIST_ERROR;
-		}
-		return -1;
-	}
+	int fd = -1;
+	int err = file_block_source_open(name, &fd, &st);
+	if (err < 0)
+		return err;
+
+	file_block_source_init(bs, fd, name, &st);
+	return 0;
+}
+
+#ifndef NO_MMAP
+struct mmap_block_source {
+	uint8_t *data;
+	uint64_t size;
+};
 
-	err = fstat(fd, &st);
+static uint64_t mmap_size(void *b)
+{
+	return ((struct mmap_block_source *)b)->size;
+}
+
+static void mmap_return_block(void *b, struct reftable_block *dest)
+{
+	/* the block points into the mapping; nothing to release. */
+}
+
+static void mmap_close(void *b)
+{
+	struct mmap_block_source *p = b;
+	munmap(p->data, p->size);
+	reftable_free(p);
+}
+
+static int mmap_read_block(void *v, struct reftable_block *dest, uint64_t off,
+			   uint32_t size)
+{
+	struct mmap_block_source *b = v;
+	assert(off + size <= b->size);
+	dest->data = b->data + off;
+	dest->len = size;
+	return size;
+}
+
+static struct reftable_block_source_vtable mmap_vtable = {
+	.size = &mmap_size,
+	.read_block = &mmap_read_block,
+	.return_block = &mmap_return_block,
+	.close = &mmap_close,
+};
+#endif
+
+int reftable_block_source_from_mmap_file(struct reftable_block_source *bs,
+					 const char *name)
+{
+	struct stat st = { 0 };
+	int fd = -1;
+	int err = file_block_source_open(name, &fd, &st);
+#ifndef NO_MMAP
+	uint64_t size = st.st_size;
+	void *data = NULL;
+	struct mmap_block_source *p = NULL;
+#endif
 	if (err < 0)
-		return -1;
+		return err;
 
-	p = reftable_calloc(sizeof(struct file_block_source));
-	p->size = st.st_size;
-	p->fd = fd;
+#ifndef NO_MMAP
+	/* zero-length files cannot be mapped; leave those to pread. */
+	if (size > 0 && size == (size_t)size)
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data && data != MAP_FAILED) {
+		/* the mapping stays valid after closing the descriptor. */
+		close(fd);
 
-	assert(!bs->ops);
-	bs->ops = &file_vtable;
-	bs->arg = p;
+		p = reftable_calloc(sizeof(struct mmap_block_source));
+		p->data = data;
+		p->size = size;
+
+		assert(!bs->ops);
+		bs->ops = &mmap_vtable;
+		bs->arg = p;
+		return 0;
+	}
+#endif
+
+	file_block_source_init(bs, fd, name, &st);
 	return 0;
 }
@@ -0,0 +1,91 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "bloom.h"
+
+#include "system.h"
+#include "basics.h"
+
+uint64_t bloom_hash(const void *key, size_t len)
+{
+	const uint8_t *p = key;
+	uint64_t h = 14695981039346656037ULL;
+	size_t i = 0;
+
+	/* FNV-1a, followed by the murmur3 finalizer to spread the bits. */
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+void bloom_filter_init(struct bloom_filter *f, size_t keys, int bits_per_key)
+{
+	/* k = bits_per_key * ln(2) minimizes the false positive rate. */
+	int hashes = (bits_per_key * 69 + 50) / 100;
+	size_t bits = keys * bits_per_key;
+
+	if (hashes < 1)
+		hashes = 1;
+	if (hashes > 30)
+		hashes = 30;
+	if (bits < 64)
+		bits = 64;
+
+	f->len = (bits + 7) / 8;
+	f->bits = reftable_calloc(f->len);
+	f->hashes = hashes;
+}
+
+/* Probes use double hashing, with the second hash derived from the first by
+ * rotation. */
+#define BLOOM_PROBE_DELTA(h) (((h) >> 17 | (h) << 47) | 1)
+
+void bloom_filter_add(struct bloom_filter *f, uint64_t h)
+{
+	uint64_t nbits = (uint64_t)f->len * 8;
+	uint64_t delta = BLOOM_PROBE_DELTA(h);
+	int i = 0;
+
+	for (i = 0; i < f->hashes; i++) {
+		uint64_t bit = h % nbits;
+		f->bits[bit / 8] |= 1 << (bit % 8);
+		h += delta;
+	}
+}
+
+int bloom_filter_may_contain(const struct bloom_filter *f, uint64_t h)
+{
+	uint64_t nbits = (uint64_t)f->len * 8;
+	uint64_t delta = BLOOM_PROBE_DELTA(h);
+	int i = 0;
+
+	if (nbits == 0)
+		return 1;
+
+	for (i = 0; i < f->hashes; i++) {
+		uint64_t bit = h % nbits;
+		if (!(f->bits[bit / 8] & (1 << (bit % 8))))
+			return 0;
+		h += delta;
+	}
+	return 1;
+}
+
+void bloom_filter_release(struct bloom_filter *f)
+{
+	FREE_AND_NULL(f->bits);
+	f->len = 0;
+	f->hashes = 0;
+}
@@ -0,0 +1,44 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include "system.h"
+
+/*
+ * A bloom filter over keys. The hash function and probe sequence are part of
+ * the file format, as filters are stored in the metadata block of tables.
+ */
+struct bloom_filter {
+	uint8_t *bits;
+	/* size of `bits`, in bytes. */
+	size_t len;
+	/* number of bits probed per key. */
+	int hashes;
+};
+
+/* returns the hash of `key`, for use with bloom_filter_add and
+ * bloom_filter_may_contain. */
+uint64_t bloom_hash(const void *key, size_t len);
+
+/* initializes an empty filter, sized for `keys` keys at `bits_per_key` bits
+ * each. */
+void bloom_filter_init(struct bloom_filter *f, size_t keys, int bits_per_key);
+
+/* adds the key with hash `h`. */
+void bloom_filter_add(struct bloom_filter *f, uint64_t h);
+
+/* returns 0 if the key with hash `h` was definitely not added, and 1 if it
+ * may have been. */
+int bloom_filter_may_contain(const struct bloom_filter *f, uint64_t h);
+
+/* frees the bits, and zeroes `f`. */
+void bloom_filter_release(struct bloom_filter *f);
+
+#endif
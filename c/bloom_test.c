@@ -0,0 +1,82 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "system.h"
+
+#include "bloom.h"
+#include "test_framework.h"
+#include "reftable-tests.h"
+
+static uint64_t test_key_hash(const char *fmt, int i)
+{
+	char key[100];
+	snprintf(key, sizeof(key), fmt, i);
+	return bloom_hash(key, strlen(key));
+}
+
+static void test_bloom_filter(void)
+{
+	struct bloom_filter f = { NULL };
+	int N = 1000;
+	int false_positives = 0;
+	int i = 0;
+
+	bloom_filter_init(&f, N, 10);
+	EXPECT(f.hashes == 7);
+	EXPECT(f.len == N * 10 / 8);
+
+	for (i = 0; i < N; i++)
+		bloom_filter_add(&f, test_key_hash("refs/heads/branch%d", i));
+
+	for (i = 0; i < N; i++)
+		EXPECT(bloom_filter_may_contain(
+			&f, test_key_hash("refs/heads/branch%d", i)));
+
+	for (i = 0; i < 10 * N; i++)
+		false_positives += bloom_filter_may_contain(
+			&f, test_key_hash("refs/tags/v%d", i));
+
+	/* about 1% is expected at 10 bits per key. */
+	EXPECT(false_positives < N / 4);
+
+	bloom_filter_release(&f);
+	EXPECT(!f.bits);
+}
+
+static void test_bloom_filter_empty(void)
+{
+	struct bloom_filter f = { NULL };
+	int i = 0;
+
+	/* a zeroed filter may contain anything. */
+	EXPECT(bloom_filter_may_contain(&f, bloom_hash("a", 1)));
+
+	bloom_filter_init(&f, 0, 10);
+	EXPECT(f.len > 0);
+	for (i = 0; i < 100; i++)
+		EXPECT(!bloom_filter_may_contain(
+			&f, test_key_hash("refs/heads/branch%d", i)));
+	bloom_filter_release(&f);
+}
+
+static void test_bloom_hash_stable(void)
+{
+	/* the hash is part of the file format. */
+	EXPECT(bloom_hash("", 0) == bloom_hash("", 0));
+	EXPECT(bloom_hash("refs/heads/main", 15) !=
+	       bloom_hash("refs/heads/maim", 15));
+	EXPECT(bloom_hash("a", 1) == 0x82a2a958a9bece5bULL);
+}
+
+int bloom_test_main(int argc, const char *argv[])
+{
+	RUN_TEST(test_bloom_filter);
+	RUN_TEST(test_bloom_filter_empty);
+	RUN_TEST(test_bloom_hash_stable);
+	return 0;
+}
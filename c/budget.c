@@ -0,0 +1,154 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "budget.h"
+
+#include "system.h"
+#include "basics.h"
+
+static struct {
+#ifndef NO_PTHREADS
+	/* guards the budget and all accounts. Taken before the lock of the
+	 * shared cache. */
+	pthread_mutex_t mutex;
+#endif
+	uint64_t budget;
+	/* shared by the registered accounts; NULL without a budget. */
+	struct block_cache *cache;
+	uint64_t stacks;
+	/* totals of the registered accounts. */
+	uint64_t pinned;
+	uint64_t readers;
+} memory_budget = {
+#ifndef NO_PTHREADS
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static void memory_budget_lock(void)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&memory_budget.mutex);
+#endif
+}
+
+static void memory_budget_unlock(void)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&memory_budget.mutex);
+#endif
+}
+
+static uint64_t memory_budget_fixed(void)
+{
+	return memory_budget.pinned + memory_budget.readers;
+}
+
+/* gives the shared cache what the rest leaves of the budget, and frees it
+ * once it is not needed anymore. */
+static void memory_budget_update(void)
+{
+	uint64_t fixed = memory_budget_fixed();
+
+	if (!memory_budget.cache)
+		return;
+	if (!memory_budget.budget && !memory_budget.stacks) {
+		block_cache_free(memory_budget.cache);
+		memory_budget.cache = NULL;
+		return;
+	}
+	block_cache_set_capacity(memory_budget.cache,
+				 memory_budget.budget > fixed ?
+					 memory_budget.budget - fixed :
+					 0);
+}
+
+void reftable_set_memory_budget(uint64_t bytes)
+{
+	memory_budget_lock();
+	memory_budget.budget = bytes;
+	if (bytes > 0 && !memory_budget.cache)
+		memory_budget.cache = block_cache_new(bytes);
+	memory_budget_update();
+	memory_budget_unlock();
+}
+
+void reftable_get_memory_budget_stats(struct reftable_memory_budget_stats *dest)
+{
+	struct reftable_block_cache_stats cache = { 0 };
+
+	memory_budget_lock();
+	if (memory_budget.cache)
+		block_cache_stats(memory_budget.cache, &cache);
+	dest->budget = memory_budget.budget;
+	dest->stacks = memory_budget.stacks;
+	dest->usage.blocks = cache.bytes;
+	dest->usage.pinned = memory_budget.pinned;
+	dest->usage.readers = memory_budget.readers;
+	dest->evictions = cache.evictions;
+	memory_budget_unlock();
+}
+
+struct block_cache *memory_budget_register(struct memory_account *a)
+{
+	struct block_cache *c = NULL;
+
+	memory_budget_lock();
+	if (memory_budget.budget > 0) {
+		a->registered = 1;
+		memory_budget.stacks++;
+		memory_budget.pinned += a->pinned;
+		memory_budget.readers += a->readers;
+		memory_budget_update();
+		c = memory_budget.cache;
+	}
+	memory_budget_unlock();
+	return c;
+}
+
+void memory_budget_unregister(struct memory_account *a)
+{
+	memory_budget_lock();
+	if (a->registered) {
+		a->registered = 0;
+		memory_budget.stacks--;
+		memory_budget.pinned -= a->pinned;
+		memory_budget.readers -= a->readers;
+		block_cache_purge_account(memory_budget.cache, &a->blocks);
+		memory_budget_update();
+	}
+	memory_budget_unlock();
+}
+
+int memory_account_charge(struct memory_account *a, int64_t pinned,
+			  int64_t readers)
+{
+	int over = 0;
+
+	memory_budget_lock();
+	a->pinned += pinned;
+	a->readers += readers;
+	if (a->registered) {
+		memory_budget.pinned += pinned;
+		memory_budget.readers += readers;
+		memory_budget_update();
+		over = memory_budget_fixed() > memory_budget.budget;
+	}
+	memory_budget_unlock();
+	return over;
+}
+
+void memory_account_usage(struct memory_account *a, struct block_cache *c,
+			  struct reftable_memory_usage *dest)
+{
+	dest->blocks = c ? block_cache_account_bytes(c, &a->blocks) : 0;
+	memory_budget_lock();
+	dest->pinned = a->pinned;
+	dest->readers = a->readers;
+	memory_budget_unlock();
+}
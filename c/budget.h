@@ -0,0 +1,52 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "system.h"
+#include "blockcache.h"
+#include "reftable-stack.h"
+
+/*
+ * Each stack accounts for the memory its tables use: decoded blocks in the
+ * block cache, pinned index blocks, and the metadata of open readers.
+ *
+ * Stacks created while a memory budget is set register their account with it,
+ * and read through a block cache shared by all registered stacks. The cache
+ * gets what the pinned blocks and readers of all of them leave of the budget,
+ * so hot stacks take cache space from cold ones.
+ */
+struct memory_account {
+	/* blocks in the block cache, maintained by the cache. */
+	struct block_cache_account blocks;
+	uint64_t pinned;
+	uint64_t readers;
+
+	/* whether the account is registered with the budget. */
+	int registered;
+};
+
+/* registers `a` if a budget is set. Returns the block cache shared by the
+ * registered stacks, or NULL if there is no budget. */
+struct block_cache *memory_budget_register(struct memory_account *a);
+
+/* unregisters `a`, and drops its blocks from the shared block cache. */
+void memory_budget_unregister(struct memory_account *a);
+
+/* adds `pinned` and `readers` bytes, which may be negative, to `a`. Returns 1
+ * if the registered accounts then use more than the budget outside the block
+ * cache. */
+int memory_account_charge(struct memory_account *a, int64_t pinned,
+			  int64_t readers);
+
+/* copies out the usage of `a`, whose blocks are in `c`, which may be NULL. */
+void memory_account_usage(struct memory_account *a, struct block_cache *c,
+			  struct reftable_memory_usage *dest);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "codec.h"
+
+#include "reftable-error.h"
+
+static size_t zlib_bound(size_t len)
+{
+	return compressBound(len);
+}
+
+static int zlib_compress(uint8_t *dest, const uint8_t *src, size_t len)
+{
+	uLongf dest_len = compressBound(len);
+	if (Z_OK != compress2(dest, &dest_len, src, len, 9))
+		return REFTABLE_ZLIB_ERROR;
+	return dest_len;
+}
+
+static int zlib_decompress(uint8_t *dest, size_t len, const uint8_t *src,
+			   size_t *src_len)
+{
+	uLongf dest_len = len;
+	uLong consumed = *src_len;
+	if (Z_OK != uncompress2(dest, &dest_len, src, &consumed))
+		return REFTABLE_ZLIB_ERROR;
+	if (dest_len != len)
+		return REFTABLE_FORMAT_ERROR;
+	*src_len = consumed;
+	return 0;
+}
+
+static int zlib_decompress_prefix(uint8_t *dest, size_t len,
+				  const uint8_t *src, size_t src_len)
+{
+	z_stream z = { 0 };
+	int res = 0;
+
+	if (Z_OK != inflateInit(&z))
+		return REFTABLE_ZLIB_ERROR;
+	z.next_in = (Bytef *)src;
+	z.avail_in = src_len;
+	z.next_out = dest;
+	z.avail_out = len;
+	res = inflate(&z, Z_SYNC_FLUSH);
+	inflateEnd(&z);
+	if (res != Z_OK && res != Z_STREAM_END)
+		return REFTABLE_ZLIB_ERROR;
+	if (z.avail_out)
+		return REFTABLE_FORMAT_ERROR;
+	return 0;
+}
+
+/* marks follow the compression-algorithm byte of reftable-v2-proposal.md. */
+static const struct block_codec zlib_codec = {
+	.compression = REFTABLE_COMPRESSION_ZLIB,
+	.mark = 1,
+	.bound = &zlib_bound,
+	.compress = &zlib_compress,
+	.decompress = &zlib_decompress,
+	.decompress_prefix = &zlib_decompress_prefix,
+};
+
+static size_t none_bound(size_t len)
+{
+	return len;
+}
+
+static int none_compress(uint8_t *dest, const uint8_t *src, size_t len)
+{
+	memcpy(dest, src, len);
+	return len;
+}
+
+static int none_decompress(uint8_t *dest, size_t len, const uint8_t *src,
+			   size_t *src_len)
+{
+	if (*src_len != len)
+		return REFTABLE_FORMAT_ERROR;
+	memcpy(dest, src, len);
+	return 0;
+}
+
+static int none_decompress_prefix(uint8_t *dest, size_t len,
+				  const uint8_t *src, size_t src_len)
+{
+	if (src_len < len)
+		return REFTABLE_FORMAT_ERROR;
+	memcpy(dest, src, len);
+	return 0;
+}
+
+static const struct block_codec none_codec = {
+	.compression = REFTABLE_COMPRESSION_NONE,
+	.mark = 0,
+	.bound = &none_bound,
+	.compress = &none_compress,
+	.decompress = &none_decompress,
+	.decompress_prefix = &none_decompress_prefix,
+};
+
+#ifdef USE_ZSTD
+
+static size_t zstd_bound(size_t len)
+{
+	return ZSTD_compressBound(len);
+}
+
+static int zstd_compress(uint8_t *dest, const uint8_t *src, size_t len)
+{
+	size_t n = ZSTD_compress(dest, ZSTD_compressBound(len), src, len,
+				 ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(n))
+		return REFTABLE_ZLIB_ERROR;
+	return n;
+}
+
+static int zstd_decompress(uint8_t *dest, size_t len, const uint8_t *src,
+			   size_t *src_len)
+{
+	size_t n = ZSTD_decompress(dest, len, src, *src_len);
+	if (ZSTD_isError(n))
+		return REFTABLE_ZLIB_ERROR;
+	if (n != len)
+		return REFTABLE_FORMAT_ERROR;
+	return 0;
+}
+
+static int zstd_decompress_prefix(uint8_t *dest, size_t len,
+				  const uint8_t *src, size_t src_len)
+{
+	ZSTD_DStream *z = ZSTD_createDStream();
+	ZSTD_inBuffer in = { src, src_len, 0 };
+	ZSTD_outBuffer out = { dest, len, 0 };
+	int err = 0;
+
+	if (!z)
+		return REFTABLE_ZLIB_ERROR;
+	while (out.pos < len) {
+		size_t n = ZSTD_decompressStream(z, &out, &in);
+		if (ZSTD_isError(n)) {
+			err = REFTABLE_ZLIB_ERROR;
+			break;
+		}
+		if (out.pos < len && (n == 0 || in.pos == in.size)) {
+			err = REFTABLE_FORMAT_ERROR;
+			break;
+		}
+	}
+	ZSTD_freeDStream(z);
+	return err;
+}
+
+static const struct block_codec zstd_codec = {
+	.compression = REFTABLE_COMPRESSION_ZSTD,
+	.mark = 2,
+	.bound = &zstd_bound,
+	.compress = &zstd_compress,
+	.decompress = &zstd_decompress,
+	.decompress_prefix = &zstd_decompress_prefix,
+};
+
+#endif
+
+#ifdef USE_LZ4
+
+static size_t lz4_bound(size_t len)
+{
+	return LZ4_compressBound(len);
+}
+
+static int lz4_compress(uint8_t *dest, const uint8_t *src, size_t len)
+{
+	int n = LZ4_compress_default((const char *)src, (char *)dest, len,
+				     LZ4_compressBound(len));
+	if (n <= 0)
+		return REFTABLE_ZLIB_ERROR;
+	return n;
+}
+
+static int lz4_decompress(uint8_t *dest, size_t len, const uint8_t *src,
+			  size_t *src_len)
+{
+	int n = LZ4_decompress_safe((const char *)src, (char *)dest, *src_len,
+				    len);
+	if (n < 0)
+		return REFTABLE_ZLIB_ERROR;
+	if (n != len)
+		return REFTABLE_FORMAT_ERROR;
+	return 0;
+}
+
+static int lz4_decompress_prefix(uint8_t *dest, size_t len,
+				 const uint8_t *src, size_t src_len)
+{
+	int n = LZ4_decompress_safe_partial((const char *)src, (char *)dest,
+					    src_len, len, len);
+	if (n < 0)
+		return REFTABLE_ZLIB_ERROR;
+	if (n != len)
+		return REFTABLE_FORMAT_ERROR;
+	return 0;
+}
+
+static const struct block_codec lz4_codec = {
+	.compression = REFTABLE_COMPRESSION_LZ4,
+	.mark = 3,
+	.bound = &lz4_bound,
+	.compress = &lz4_compress,
+	.decompress = &lz4_decompress,
+	.decompress_prefix = &lz4_decompress_prefix,
+};
+
+#endif
+
+static const struct block_codec *codecs[] = {
+	&zlib_codec,
+	&none_codec,
+#ifdef USE_ZSTD
+	&zstd_codec,
+#endif
+#ifdef USE_LZ4
+	&lz4_codec,
+#endif
+};
+
+const struct block_codec *block_codec_get(enum reftable_compression c)
+{
+	int i = 0;
+	for (i = 0; i < ARRAY_SIZE(codecs); i++)
+		if (codecs[i]->compression == c)
+			return codecs[i];
+	return NULL;
+}
+
+int block_codec_is_zlib_stream(uint8_t first_byte)
+{
+	return (first_byte & 0x0f) == Z_DEFLATED;
+}
+
+const struct block_codec *block_codec_by_mark(uint8_t mark)
+{
+	int i = 0;
+	for (i = 0; i < ARRAY_SIZE(codecs); i++)
+		if (codecs[i]->mark == mark)
+			return codecs[i];
+	return NULL;
+}
+
+int reftable_compression_supported(enum reftable_compression compression)
+{
+	return block_codec_get(compression) != NULL;
+}
@@ -0,0 +1,67 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "system.h"
+
+#include "reftable-writer.h"
+
+/*
+ * Codecs compress the body of blocks, ie. everything after the 4-byte block
+ * header.
+ *
+ * Compressed bodies start with a byte marking the codec, followed by the
+ * uint24 size of the compressed data. The exception are zlib compressed log
+ * blocks, which are stored as a bare zlib stream, as the reftable spec
+ * prescribes. The first byte of a zlib stream always has 8 (deflate) in its
+ * low nibble, which marks don't, so readers can tell them apart.
+ *
+ * Bodies of other blocks start with the first key, whose prefix length is
+ * encoded as a 0 byte. Marks of codecs other than "none" aren't 0, so ref, obj
+ * and index blocks can be compressed too.
+ */
+struct block_codec {
+	enum reftable_compression compression;
+	uint8_t mark;
+
+	/* returns an upper bound for the compressed size of `len` bytes. */
+	size_t (*bound)(size_t len);
+
+	/* compresses `len` bytes at `src` into `dest`, which has room for
+	 * bound(len) bytes. Returns the compressed size, or an error. */
+	int (*compress)(uint8_t *dest, const uint8_t *src, size_t len);
+
+	/* decompresses `src` into exactly `len` bytes at `dest`. `src_len` is
+	 * the available input, and is set to the size of the compressed data.
+	 * Returns 0, or an error. */
+	int (*decompress)(uint8_t *dest, size_t len, const uint8_t *src,
+			  size_t *src_len);
+
+	/* decompresses only the first `len` bytes of the `src_len` bytes of
+	 * compressed data at `src` into `dest`. Returns 0, or an error. */
+	int (*decompress_prefix)(uint8_t *dest, size_t len, const uint8_t *src,
+				 size_t src_len);
+};
+
+/* size of the mark and compressed size preceding marked bodies. */
+#define CODEC_MARK_SIZE 4
+
+/* returns the codec for `compression`, or NULL if it isn't supported. */
+const struct block_codec *block_codec_get(enum reftable_compression c);
+
+/* returns whether a log block body starting with `first_byte` is a bare
+ * zlib stream. */
+int block_codec_is_zlib_stream(uint8_t first_byte);
+
+/* returns the codec for `mark`, or NULL if it is unknown or isn't
+ * supported. */
+const struct block_codec *block_codec_by_mark(uint8_t mark);
+
+#endif
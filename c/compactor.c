@@ -0,0 +1,245 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "compactor.h"
+
+#include "system.h"
+#include "basics.h"
+#include "stack.h"
+
+#ifndef NO_PTHREADS
+
+struct stack_compactor {
+	pthread_t thread;
+
+	/* the list lock; see compactor.h. */
+	pthread_mutex_t list_mutex;
+
+	/* guards the fields below. */
+	pthread_mutex_t mutex;
+	/* signals new requests, and finished compactions. */
+	pthread_cond_t cond;
+
+	int pending;
+	int running;
+	int stop;
+	int err;
+
+	struct reftable_compaction_stats stats;
+	struct reftable_compaction_stats reported;
+
+	/* only used by the thread. */
+	struct reftable_stack *st;
+};
+
+static uint64_t compactor_now_us(void)
+{
+	struct timeval tv = { 0 };
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int compactor_run(struct stack_compactor *c)
+{
+	int err = reftable_stack_reload(c->st);
+	if (err < 0)
+		return err;
+	return reftable_stack_auto_compact(c->st);
+}
+
+static void *compactor_main(void *arg)
+{
+	struct stack_compactor *c = arg;
+
+	pthread_mutex_lock(&c->mutex);
+	while (1) {
+		uint64_t start = 0;
+		uint64_t duration = 0;
+		int err = 0;
+
+		while (!c->pending && !c->stop)
+			pthread_cond_wait(&c->cond, &c->mutex);
+		if (c->stop)
+			break;
+
+		c->pending = 0;
+		c->running = 1;
+		pthread_mutex_unlock(&c->mutex);
+
+		start = compactor_now_us();
+		err = compactor_run(c);
+		duration = compactor_now_us() - start;
+
+		pthread_mutex_lock(&c->mutex);
+		c->running = 0;
+		if (err < 0 && !c->err)
+			c->err = err;
+		c->stats.bytes = c->st->stats.bytes;
+		c->stats.entries_written = c->st->stats.entries_written;
+		c->stats.attempts = c->st->stats.attempts;
+		c->stats.failures = c->st->stats.failures;
+		c->stats.parallel_compactions =
+			c->st->stats.parallel_compactions;
+		c->stats.duration_us += duration;
+		if (duration > c->stats.max_duration_us)
+			c->stats.max_duration_us = duration;
+		pthread_cond_broadcast(&c->cond);
+	}
+	pthread_mutex_unlock(&c->mutex);
+	return NULL;
+}
+
+int stack_compactor_start(struct stack_compactor **dest, const char *dir,
+			  struct reftable_write_options config)
+{
+	struct stack_compactor *c = NULL;
+	int err = 0;
+
+	/* the private stack only serves compaction. */
+	config.background_compaction = 0;
+	config.block_cache_size = 0;
+	config.pin_index_levels = 0;
+	config.watch_tables_list = 0;
+
+	*dest = NULL;
+	c = reftable_calloc(sizeof(struct stack_compactor));
+	/* its tables are those of the stack it compacts, which is already
+	 * accounted for. */
+	err = stack_new(&c->st, dir, config, 0);
+	if (err < 0) {
+		reftable_free(c);
+		return err;
+	}
+	c->st->compactor = c;
+
+	pthread_mutex_init(&c->list_mutex, NULL);
+	pthread_mutex_init(&c->mutex, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if (pthread_create(&c->thread, NULL, &compactor_main, c)) {
+		c->st->compactor = NULL;
+		reftable_stack_destroy(c->st);
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->mutex);
+		pthread_mutex_destroy(&c->list_mutex);
+		reftable_free(c);
+		return 0;
+	}
+
+	*dest = c;
+	return 0;
+}
+
+void stack_compactor_stop(struct stack_compactor *c)
+{
+	if (!c)
+		return;
+
+	pthread_mutex_lock(&c->mutex);
+	c->stop = 1;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+	pthread_join(c->thread, NULL);
+
+	c->st->compactor = NULL;
+	reftable_stack_destroy(c->st);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->mutex);
+	pthread_mutex_destroy(&c->list_mutex);
+	reftable_free(c);
+}
+
+void stack_compactor_schedule(struct stack_compactor *c)
+{
+	pthread_mutex_lock(&c->mutex);
+	c->pending++;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+}
+
+int stack_compactor_wait(struct stack_compactor *c)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&c->mutex);
+	while ((c->pending || c->running) && !c->stop)
+		pthread_cond_wait(&c->cond, &c->mutex);
+	err = c->err;
+	c->err = 0;
+	pthread_mutex_unlock(&c->mutex);
+	return err;
+}
+
+void stack_compactor_lock_list(struct stack_compactor *c)
+{
+	if (c)
+		pthread_mutex_lock(&c->list_mutex);
+}
+
+void stack_compactor_unlock_list(struct stack_compactor *c)
+{
+	if (c)
+		pthread_mutex_unlock(&c->list_mutex);
+}
+
+struct reftable_compaction_stats *
+stack_compactor_stats(struct stack_compactor *c,
+		      struct reftable_compaction_stats *fg)
+{
+	pthread_mutex_lock(&c->mutex);
+	c->reported = *fg;
+	c->reported.bytes += c->stats.bytes;
+	c->reported.entries_written += c->stats.entries_written;
+	c->reported.attempts += c->stats.attempts;
+	c->reported.failures += c->stats.failures;
+	c->reported.parallel_compactions += c->stats.parallel_compactions;
+	c->reported.duration_us += c->stats.duration_us;
+	if (c->stats.max_duration_us > c->reported.max_duration_us)
+		c->reported.max_duration_us = c->stats.max_duration_us;
+	c->reported.queue_depth = c->pending;
+	pthread_mutex_unlock(&c->mutex);
+	return &c->reported;
+}
+
+#else
+
+int stack_compactor_start(struct stack_compactor **dest, const char *dir,
+			  struct reftable_write_options config)
+{
+	*dest = NULL;
+	return 0;
+}
+
+void stack_compactor_stop(struct stack_compactor *c)
+{
+}
+
+void stack_compactor_schedule(struct stack_compactor *c)
+{
+}
+
+int stack_compactor_wait(struct stack_compactor *c)
+{
+	return 0;
+}
+
+void stack_compactor_lock_list(struct stack_compactor *c)
+{
+}
+
+void stack_compactor_unlock_list(struct stack_compactor *c)
+{
+}
+
+struct reftable_compaction_stats *
+stack_compactor_stats(struct stack_compactor *c,
+		      struct reftable_compaction_stats *fg)
+{
+	return fg;
+}
+
+#endif
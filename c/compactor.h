@@ -0,0 +1,52 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef COMPACTOR_H
+#define COMPACTOR_H
+
+#include "reftable-stack.h"
+
+/*
+ * A thread compacting a stack in the background. It works on a private
+ * reftable_stack for the same directory, so the stack of the writer is never
+ * touched from the compactor's thread.
+ *
+ * tables.list.lock can't be taken recursively, so the compactor and the
+ * writers of the process also serialize on a mutex, the list lock. It is held
+ * whenever tables.list.lock is, which is never during a table rewrite.
+ */
+struct stack_compactor;
+
+/* Starts compacting the stack in `dir` in the background. Sets `dest` to NULL
+ * if threads are not available. */
+int stack_compactor_start(struct stack_compactor **dest, const char *dir,
+			  struct reftable_write_options config);
+
+/* Stops the thread after the compaction in progress, and frees `c`. */
+void stack_compactor_stop(struct stack_compactor *c);
+
+/* Requests a compaction. Requests that pile up while the thread is busy are
+ * served by a single compaction. */
+void stack_compactor_schedule(struct stack_compactor *c);
+
+/* Waits until all requests have been served. Returns the first error of a
+ * background compaction since the last call, if any. */
+int stack_compactor_wait(struct stack_compactor *c);
+
+/* Acquires and releases the list lock. Both are no-ops if `c` is NULL. */
+void stack_compactor_lock_list(struct stack_compactor *c);
+void stack_compactor_unlock_list(struct stack_compactor *c);
+
+/* Returns the sum of `fg`, the stats of the compactions done by the writer,
+ * and those done in the background. The result is valid until the next
+ * call. */
+struct reftable_compaction_stats *
+stack_compactor_stats(struct stack_compactor *c,
+		      struct reftable_compaction_stats *fg);
+
+#endif
@@ -15,6 +15,23 @@ https://developers.google.com/open-source/licenses/bsd
 #define BLOCK_TYPE_OBJ 'o'
 #define BLOCK_TYPE_ANY 0
 
+/* Optional metadata block, written after the last section. Readers that don't
+ * know it stop at it, like at any block of an unexpected type. It holds
+ * (varint tag, varint length, value) fields and ends in a trailer of be32
+ * block length, be32 CRC32 of the preceding bytes and META_MAGIC. */
+#define BLOCK_TYPE_META 'm'
+#define META_MAGIC "RTMD"
+#define META_TRAILER_SIZE 12
+
+#define META_FIELD_FIRST_REF 1
+#define META_FIELD_LAST_REF 2
+/* 1 byte of probe count, followed by the filter bits. */
+#define META_FIELD_REF_BLOOM 3
+/* the log time index, see logtime.h. */
+#define META_FIELD_LOG_TIMES 4
+
+#define META_BLOOM_BITS_PER_KEY 10
+
 #define MAX_RESTARTS ((1 << 16) - 1)
 #define DEFAULT_BLOCK_SIZE 4096
 
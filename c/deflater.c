@@ -0,0 +1,213 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "deflater.h"
+
+#include "basics.h"
+#include "block.h"
+
+#ifndef NO_PTHREADS
+
+struct block_deflater {
+	pthread_t *threads;
+	int threads_len;
+
+	/* guards the fields below, and the `done` flags of the jobs. */
+	pthread_mutex_t mutex;
+	/* signals submitted jobs to the threads, and compressed ones to the
+	 * writer. */
+	pthread_cond_t cond;
+
+	/* ring of `cap` jobs; job i lives at jobs[i % cap]. Jobs in [head,
+	 * started) are being compressed or done, those in [started, tail) are
+	 * queued. */
+	struct deflate_job *jobs;
+	uint64_t cap;
+	uint64_t head;
+	uint64_t started;
+	uint64_t tail;
+
+	enum reftable_compression compression;
+	int sized;
+	int stop;
+};
+
+static void *block_deflater_main(void *arg)
+{
+	struct block_deflater *d = arg;
+
+	pthread_mutex_lock(&d->mutex);
+	while (1) {
+		struct deflate_job *job = NULL;
+		uint64_t start = 0;
+		int n = 0;
+
+		if (d->stop)
+			break;
+		if (d->started == d->tail) {
+			pthread_cond_wait(&d->cond, &d->mutex);
+			continue;
+		}
+
+		job = &d->jobs[d->started++ % d->cap];
+		pthread_mutex_unlock(&d->mutex);
+
+		start = monotonic_nsec();
+		n = block_compress(&job->out, (uint8_t *)job->raw.buf,
+				   job->raw.len, 0, d->compression, d->sized);
+		job->nsec = monotonic_nsec() - start;
+
+		pthread_mutex_lock(&d->mutex);
+		job->err = n < 0 ? n : 0;
+		job->done = 1;
+		pthread_cond_broadcast(&d->cond);
+	}
+	pthread_mutex_unlock(&d->mutex);
+	return NULL;
+}
+
+struct block_deflater *block_deflater_new(int threads, int max_in_flight,
+					  enum reftable_compression compression,
+					  int sized)
+{
+	struct block_deflater *d = reftable_calloc(sizeof(*d));
+	int i = 0;
+
+	d->compression = compression;
+	d->sized = sized;
+	d->cap = max_in_flight > 0 ? max_in_flight : 1;
+	d->jobs = reftable_calloc(sizeof(struct deflate_job) * d->cap);
+	for (i = 0; i < d->cap; i++) {
+		strbuf_init(&d->jobs[i].raw, 0);
+		strbuf_init(&d->jobs[i].out, 0);
+		strbuf_init(&d->jobs[i].last_key, 0);
+	}
+	pthread_mutex_init(&d->mutex, NULL);
+	pthread_cond_init(&d->cond, NULL);
+
+	d->threads = reftable_calloc(sizeof(pthread_t) * threads);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&d->threads[i], NULL, &block_deflater_main,
+				   d))
+			break;
+		d->threads_len++;
+	}
+
+	if (d->threads_len == 0) {
+		block_deflater_free(d);
+		return NULL;
+	}
+	return d;
+}
+
+struct deflate_job *block_deflater_slot(struct block_deflater *d)
+{
+	if (d->tail - d->head == d->cap)
+		return NULL;
+	return &d->jobs[d->tail % d->cap];
+}
+
+void block_deflater_submit(struct block_deflater *d)
+{
+	pthread_mutex_lock(&d->mutex);
+	d->jobs[d->tail % d->cap].done = 0;
+	d->tail++;
+	pthread_cond_signal(&d->cond);
+	pthread_mutex_unlock(&d->mutex);
+}
+
+struct deflate_job *block_deflater_peek(struct block_deflater *d, int wait)
+{
+	struct deflate_job *job = NULL;
+
+	pthread_mutex_lock(&d->mutex);
+	while (d->head < d->tail) {
+		if (d->jobs[d->head % d->cap].done) {
+			job = &d->jobs[d->head % d->cap];
+			break;
+		}
+		if (!wait)
+			break;
+		pthread_cond_wait(&d->cond, &d->mutex);
+	}
+	pthread_mutex_unlock(&d->mutex);
+	return job;
+}
+
+void block_deflater_pop(struct block_deflater *d)
+{
+	pthread_mutex_lock(&d->mutex);
+	d->head++;
+	pthread_mutex_unlock(&d->mutex);
+}
+
+int block_deflater_in_flight(struct block_deflater *d)
+{
+	return d->tail - d->head;
+}
+
+void block_deflater_free(struct block_deflater *d)
+{
+	int i = 0;
+
+	pthread_mutex_lock(&d->mutex);
+	d->stop = 1;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->mutex);
+	for (i = 0; i < d->threads_len; i++)
+		pthread_join(d->threads[i], NULL);
+
+	for (i = 0; i < d->cap; i++) {
+		strbuf_release(&d->jobs[i].raw);
+		strbuf_release(&d->jobs[i].out);
+		strbuf_release(&d->jobs[i].last_key);
+	}
+	reftable_free(d->jobs);
+	reftable_free(d->threads);
+	pthread_mutex_destroy(&d->mutex);
+	pthread_cond_destroy(&d->cond);
+	reftable_free(d);
+}
+
+#else
+
+struct block_deflater *block_deflater_new(int threads, int max_in_flight,
+					  enum reftable_compression compression,
+					  int sized)
+{
+	return NULL;
+}
+
+struct deflate_job *block_deflater_slot(struct block_deflater *d)
+{
+	return NULL;
+}
+
+void block_deflater_submit(struct block_deflater *d)
+{
+}
+
+struct deflate_job *block_deflater_peek(struct block_deflater *d, int wait)
+{
+	return NULL;
+}
+
+void block_deflater_pop(struct block_deflater *d)
+{
+}
+
+int block_deflater_in_flight(struct block_deflater *d)
+{
+	return 0;
+}
+
+void block_deflater_free(struct block_deflater *d)
+{
+}
+
+#endif
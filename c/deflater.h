@@ -0,0 +1,68 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef DEFLATER_H
+#define DEFLATER_H
+
+#include "system.h"
+
+#include "reftable-writer.h"
+
+/*
+ * Compresses log blocks on a pool of threads. Blocks are handed back in the
+ * order they were submitted, so the writer can write them out as they
+ * complete. Only the thread that created the deflater may call the functions
+ * below.
+ */
+struct block_deflater;
+
+/* a log block passing through the deflater. */
+struct deflate_job {
+	/* the finished, uncompressed block. It must not start the table. */
+	struct strbuf raw;
+	/* the compressed block, once done. */
+	struct strbuf out;
+	/* the last key of the block, for the index. */
+	struct strbuf last_key;
+	int entries;
+	int restarts;
+
+	/* set by the compressing thread. */
+	int err;
+	uint64_t nsec;
+	int done;
+};
+
+/* Starts `threads` threads, compressing up to `max_in_flight` blocks at a
+ * time with `compression`, and `sized` as for block_compress. Returns NULL
+ * without thread support, or if no thread could be started. */
+struct block_deflater *block_deflater_new(int threads, int max_in_flight,
+					  enum reftable_compression compression,
+					  int sized);
+
+/* Returns a job to fill in and submit, or NULL if `max_in_flight` blocks
+ * are still to be taken with block_deflater_pop. */
+struct deflate_job *block_deflater_slot(struct block_deflater *d);
+
+/* Queues the job returned by block_deflater_slot for compression. */
+void block_deflater_submit(struct block_deflater *d);
+
+/* Returns the oldest job if it is compressed, or NULL. With `wait`, waits
+ * for it to be compressed; NULL then means nothing is in flight. */
+struct deflate_job *block_deflater_peek(struct block_deflater *d, int wait);
+
+/* Releases the job returned by block_deflater_peek. */
+void block_deflater_pop(struct block_deflater *d);
+
+/* Returns the number of blocks submitted but not popped. */
+int block_deflater_in_flight(struct block_deflater *d);
+
+/* Stops the threads, and frees the deflater with any jobs in flight. */
+void block_deflater_free(struct block_deflater *d);
+
+#endif
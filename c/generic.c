@@ -35,27 +35,93 @@ int reftable_table_seek_log(struct reftable_table *tab,
 	return tab->ops->seek_record(tab->table_arg, it, &rec);
 }
 
-int reftable_table_read_ref(struct reftable_table *tab, const char *name,
-			    struct reftable_ref_record *ref)
+struct read_refs_entry {
+	const char *name;
+	size_t idx;
+};
+
+static int read_refs_entry_cmp(const void *a, const void *b)
 {
-	struct reftable_iterator it = { NULL };
-	int err = reftable_table_seek_ref(tab, &it, name);
-	if (err)
+	const struct read_refs_entry *ea = a;
+	const struct read_refs_entry *eb = b;
+	return strcmp(ea->name, eb->name);
+}
+
+int reftable_table_read_refs(struct reftable_table *tab, const char **names,
+			     size_t n, struct reftable_ref_record *refs)
+{
+	struct read_refs_entry *entries = NULL;
+	const char **sorted = NULL;
+	struct reftable_ref_record *found = NULL;
+	int *done = NULL;
+	int missing = 0;
+	int err = 0;
+	size_t i = 0;
+
+	if (n == 0)
+		return 0;
+
+	entries = reftable_calloc(sizeof(*entries) * n);
+	sorted = reftable_calloc(sizeof(*sorted) * n);
+	found = reftable_calloc(sizeof(*found) * n);
+	done = reftable_calloc(sizeof(*done) * n);
+	for (i = 0; i < n; i++) {
+		entries[i].name = names[i];
+		entries[i].idx = i;
+	}
+	QSORT(entries, n, read_refs_entry_cmp);
+	for (i = 0; i < n; i++)
+		sorted[i] = entries[i].name;
+
+	err = tab->ops->read_refs(tab->table_arg, sorted, n, found, done);
+	if (err < 0)
 		goto done;
 
-	err = reftable_iterator_next_ref(&it, ref);
-	if (err)
+	for (i = 0; i < n; i++) {
+		struct reftable_ref_record *dest = &refs[entries[i].idx];
+		reftable_ref_record_release(dest);
+		if (done[i] && !reftable_ref_record_is_deletion(&found[i])) {
+			struct reftable_ref_record empty = { NULL };
+			*dest = found[i];
+			found[i] = empty;
+		} else {
+			missing++;
+		}
+	}
+	err = missing;
+
+done:
+	for (i = 0; i < n; i++)
+		reftable_ref_record_release(&found[i]);
+	reftable_free(entries);
+	reftable_free(sorted);
+	reftable_free(found);
+	reftable_free(done);
+	return err;
+}
+
+int reftable_table_read_ref(struct reftable_table *tab, const char *name,
+			    struct reftable_ref_record *ref)
+{
+	/* a batch of one needs no sorting, and skips tables that lack the ref
+	 * all the same. */
+	struct reftable_ref_record found = { NULL };
+	int done = 0;
+	int err = tab->ops->read_refs(tab->table_arg, &name, 1, &found, &done);
+	if (err < 0)
 		goto done;
 
-	if (strcmp(ref->refname, name) ||
-	    reftable_ref_record_is_deletion(ref)) {
-		reftable_ref_record_release(ref);
+	reftable_ref_record_release(ref);
+	if (done && !reftable_ref_record_is_deletion(&found)) {
+		struct reftable_ref_record empty = { NULL };
+		*ref = found;
+		found = empty;
+	} else {
 		err = 1;
-		goto done;
 	}
 
 done:
-	reftable_iterator_destroy(&it);
+	reftable_ref_record_release(&found);
 	return err;
 }
 
@@ -142,6 +208,38 @@ int reftable_iterator_next_log(struct reftable_iterator *it,
 	return iterator_next(it, &rec);
 }
 
+int reftable_iterator_next_ref_view(struct reftable_iterator *it,
+				    struct reftable_ref_record_view *ref)
+{
+	struct reftable_record rec = { NULL };
+	reftable_record_from_ref_view(&rec, ref);
+	return iterator_next(it, &rec);
+}
+
+int reftable_iterator_next_log_view(struct reftable_iterator *it,
+				    struct reftable_log_record_view *log)
+{
+	struct reftable_record rec = { NULL };
+	reftable_record_from_log_view(&rec, log);
+	return iterator_next(it, &rec);
+}
+
+int reftable_iterator_next_ref_key(struct reftable_iterator *it,
+				   struct reftable_ref_record_view *ref)
+{
+	struct reftable_record rec = { NULL };
+	reftable_record_from_ref_key(&rec, ref);
+	return iterator_next(it, &rec);
+}
+
+int reftable_iterator_next_log_key(struct reftable_iterator *it,
+				   struct reftable_log_record_view *log)
+{
+	struct reftable_record rec = { NULL };
+	reftable_record_from_log_key(&rec, log);
+	return iterator_next(it, &rec);
+}
+
 int iterator_next(struct reftable_iterator *it, struct reftable_record *rec)
 {
 	return it->ops->next(it->iter_arg, rec);
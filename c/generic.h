@@ -19,6 +19,23 @@ struct reftable_table_vtable {
 	uint32_t (*hash_id)(void *tab);
 	uint64_t (*min_update_index)(void *tab);
 	uint64_t (*max_update_index)(void *tab);
+
+	/* Looks up the refs in `names`, which is sorted and has `n` entries,
+	 * skipping the ones with `done` set. Records found, including
+	 * deletions, are stored in `refs`, and their `done` entry is set. */
+	int (*read_refs)(void *tab, const char **names, size_t n,
+			 struct reftable_ref_record *refs, int *done);
+
+	/* Sets `update_index` to that of the newest log entry of `name` at or
+	 * before `time`. Returns 1 if there is none. */
+	int (*log_time_update_index)(void *tab, const char *name,
+				     uint64_t time, uint64_t *update_index);
+
+	/* Returns 0 if the table has no refs at or after the `len` bytes at
+	 * `key`, or, if `prefix` is set, no refs starting with them. May be
+	 * NULL. */
+	int (*may_have_refs)(void *tab, const char *key, size_t len,
+			     int prefix);
 };
 
 struct reftable_iterator_vtable {
@@ -24,6 +24,35 @@ https://developers.google.com/open-source/licenses/bsd
 #include <unistd.h>
 #include <zlib.h>
 
+#ifndef NO_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
+
+#if !defined(__linux__) && !defined(NO_INOTIFY)
+#define NO_INOTIFY
+#endif
+#ifndef NO_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+/* git's build sets USE_ST_TIMESPEC on macOS, where struct stat has
+ * st_mtimespec rather than st_mtim. */
+#if defined(__APPLE__) && !defined(USE_ST_TIMESPEC)
+#define USE_ST_TIMESPEC
+#endif
+
+#ifdef NO_NSEC
+#define ST_MTIME_NSEC(st) 0
+#elif defined(USE_ST_TIMESPEC)
+#define ST_MTIME_NSEC(st) ((unsigned int)((st).st_mtimespec.tv_nsec))
+#else
+#define ST_MTIME_NSEC(st) ((unsigned int)((st).st_mtim.tv_nsec))
+#endif
+
 /* functions that git-core provides, for standalone compilation */
 
 uint64_t get_be64(void *in);
@@ -46,4 +46,31 @@ struct reftable_block_source_vtable {
 int reftable_block_source_from_file(struct reftable_block_source *block_src,
 				    const char *name);
 
+/* opens a file on the file system as a block_source backed by a read-only
+ * memory mapping. Blocks returned from it point straight into the mapping, so
+ * reading does not copy or allocate. Falls back to reading with pread() if the
+ * file cannot be mapped. */
+int reftable_block_source_from_mmap_file(struct reftable_block_source *block_src,
+					 const char *name);
+
+/* Limits the number of file descriptors that block sources from
+ * reftable_block_source_from_file(), and mmap sources that fell back to pread,
+ * keep open across the process. Beyond it, the least recently read files are
+ * closed, and reopened by name when they are read again. Reading a file that
+ * was deleted meanwhile, for example by a compaction, fails with
+ * REFTABLE_NOT_EXIST_ERROR. 0, the default, is unlimited. */
+void reftable_set_open_files_limit(int limit);
+
+/* statistics on the file descriptors of file block sources. */
+struct reftable_open_files_stats {
+	uint64_t open; /* descriptors open right now */
+	uint64_t limit; /* see reftable_set_open_files_limit(); 0 if none */
+	uint64_t opens; /* files opened for new block sources */
+	uint64_t reopens; /* files reopened after being closed by the limit */
+	uint64_t reopen_failures; /* files that could not be reopened */
+	uint64_t evictions; /* descriptors closed to stay within the limit */
+};
+
+void reftable_get_open_files_stats(struct reftable_open_files_stats *dest);
+
 #endif
@@ -41,6 +41,14 @@ uint64_t reftable_table_min_update_index(struct reftable_table *tab);
 int reftable_table_read_ref(struct reftable_table *tab, const char *name,
 			    struct reftable_ref_record *ref);
 
+/* convenience function to read many refs at once, which is cheaper than
+   calling reftable_table_read_ref for each of them. On return, refs[i] holds
+   the ref named names[i], or is zeroed if there is no such ref. The entries of
+   `refs` must be zero-initialized or hold records to release. Returns < 0 for
+   error, or the number of refs not found. */
+int reftable_table_read_refs(struct reftable_table *tab, const char **names,
+			     size_t n, struct reftable_ref_record *refs);
+
 /* dump table contents onto stdout for debugging */
 int reftable_table_print(struct reftable_table *tab);
 
@@ -33,6 +33,32 @@ int reftable_iterator_next_ref(struct reftable_iterator *it,
 int reftable_iterator_next_log(struct reftable_iterator *it,
 			       struct reftable_log_record *log);
 
+/* reads the next ref as a view, see struct reftable_ref_record_view. Returns
+ * < 0 for error, 0 for OK and > 0: end of iteration. Iterators from
+ * reftable_reader_refs_for do not support views.
+ */
+int reftable_iterator_next_ref_view(struct reftable_iterator *it,
+				    struct reftable_ref_record_view *ref);
+
+/* reads the next log entry as a view, see struct reftable_log_record_view.
+ * Returns < 0 for error, 0 for OK and > 0: end of iteration.
+ */
+int reftable_iterator_next_log_view(struct reftable_iterator *it,
+				    struct reftable_log_record_view *log);
+
+/* reads the name, update index and value type of the next ref into `ref`,
+ * skipping over its value; the value fields of `ref` are left zero. This is
+ * cheaper than reading views if only names are needed. An iterator should be
+ * read either with keys or with records, not both. Returns < 0 for error, 0
+ * for OK and > 0: end of iteration.
+ */
+int reftable_iterator_next_ref_key(struct reftable_iterator *it,
+				   struct reftable_ref_record_view *ref);
+
+/* like reftable_iterator_next_ref_key, but for log entries. */
+int reftable_iterator_next_log_key(struct reftable_iterator *it,
+				   struct reftable_log_record_view *log);
+
 /* releases resources associated with an iterator. */
 void reftable_iterator_destroy(struct reftable_iterator *it);
 
@@ -36,11 +36,26 @@ int reftable_new_merged_table(struct reftable_merged_table **dest,
 			      struct reftable_table *stack, int n,
 			      uint32_t hash_id);
 
+/* selects the merge used by iterators seeked afterwards. By default, the
+   subtables are merged with a binary heap. With `enable` set, a loser tree is
+   used, which caches the current key of each subtable and needs about
+   log2(n) key comparisons and no allocations per record; this is faster for
+   long iterations over many tables, such as compaction. */
+void reftable_merged_table_set_loser_tree(struct reftable_merged_table *mt,
+					  int enable);
+
 /* returns an iterator positioned just before 'name' */
 int reftable_merged_table_seek_ref(struct reftable_merged_table *mt,
 				   struct reftable_iterator *it,
 				   const char *name);
 
+/* returns an iterator over the refs whose name starts with 'prefix'. Each
+   table is only read up to the end of the prefix, and tables without refs in
+   the prefix drop out of the merge after their first read. */
+int reftable_merged_table_seek_ref_prefix(struct reftable_merged_table *mt,
+					  struct reftable_iterator *it,
+					  const char *prefix);
+
 /* returns an iterator for log entry, at given update_index */
 int reftable_merged_table_seek_log_at(struct reftable_merged_table *mt,
 				      struct reftable_iterator *it,
@@ -51,6 +66,17 @@ int reftable_merged_table_seek_log(struct reftable_merged_table *mt,
 				   struct reftable_iterator *it,
 				   const char *name);
 
+/* seek to the newest log entry for `name` at or before `time`, see
+   reftable_reader_seek_log_time. */
+int reftable_merged_table_seek_log_time(struct reftable_merged_table *mt,
+					struct reftable_iterator *it,
+					const char *name, uint64_t time);
+
+/* reads the refs named in `names` into `refs`, see reftable_table_read_refs. */
+int reftable_merged_table_read_refs(struct reftable_merged_table *mt,
+				    const char **names, size_t n,
+				    struct reftable_ref_record *refs);
+
 /* returns the max update_index covered by this merged table. */
 uint64_t
 reftable_merged_table_max_update_index(struct reftable_merged_table *mt);
@@ -64,6 +64,13 @@ int reftable_new_reader(struct reftable_reader **pp,
 int reftable_reader_seek_ref(struct reftable_reader *r,
 			     struct reftable_iterator *it, const char *name);
 
+/* returns an iterator over the refs whose name starts with 'prefix'. The
+   iterator ends at the first ref past the prefix, rather than at the end of the
+   table. */
+int reftable_reader_seek_ref_prefix(struct reftable_reader *r,
+				    struct reftable_iterator *it,
+				    const char *prefix);
+
 /* returns the hash ID used in this table. */
 uint32_t reftable_reader_hash_id(struct reftable_reader *r);
 
@@ -78,6 +85,19 @@ int reftable_reader_seek_log_at(struct reftable_reader *r,
 int reftable_reader_seek_log(struct reftable_reader *r,
 			     struct reftable_iterator *it, const char *name);
 
+/* seek to the newest log entry for given name at or before `time`, ie. the
+   entry `name@{time}` refers to. If there is none, the iterator is empty.
+   Tables written with log_time_index find the entry without reading the whole
+   log of the ref. */
+int reftable_reader_seek_log_time(struct reftable_reader *r,
+				  struct reftable_iterator *it,
+				  const char *name, uint64_t time);
+
+/* Loads the top `levels` levels of the ref, obj and log indexes, and keeps
+ * them in memory until the reader is freed. A lookup in a table whose index
+ * has at most `levels` levels reads a single block from the block source. */
+int reftable_reader_pin_index_blocks(struct reftable_reader *r, int levels);
+
 /* closes and deallocates a reader. */
 void reftable_reader_free(struct reftable_reader *);
 
@@ -9,6 +9,7 @@ https://developers.google.com/open-source/licenses/bsd
 #ifndef REFTABLE_RECORD_H
 #define REFTABLE_RECORD_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /*
@@ -111,4 +112,62 @@ int reftable_log_record_equal(struct reftable_log_record *a,
 void reftable_log_record_print(struct reftable_log_record *log,
 			       uint32_t hash_id);
 
+/*
+ * Views are records whose fields point into the block they were read from,
+ * rather than into malloced memory, so reading them allocates nothing. A view
+ * is valid until the iterator that produced it is advanced or destroyed, and
+ * needs no release. Strings other than the refname are not 0-terminated.
+ */
+
+/* reftable_ref_record_view is a view of a reftable_ref_record. */
+struct reftable_ref_record_view {
+	const char *refname; /* 0-terminated */
+	size_t refname_len;
+	uint64_t update_index;
+	uint8_t value_type; /* one of REFTABLE_REF_* */
+	union {
+		const uint8_t *val1;
+		struct {
+			const uint8_t *value;
+			const uint8_t *target_value;
+		} val2;
+		struct {
+			const char *target;
+			size_t len;
+		} symref;
+	} value;
+};
+
+/* copies the view `src` into `dest`, whose fields are released first. */
+void reftable_ref_record_from_view(struct reftable_ref_record *dest,
+				   const struct reftable_ref_record_view *src,
+				   int hash_size);
+
+/* reftable_log_record_view is a view of a reftable_log_record. */
+struct reftable_log_record_view {
+	const char *refname; /* 0-terminated */
+	size_t refname_len;
+	uint64_t update_index;
+	uint8_t value_type; /* one of REFTABLE_LOG_* */
+	union {
+		struct {
+			const uint8_t *new_hash;
+			const uint8_t *old_hash;
+			const char *name;
+			size_t name_len;
+			const char *email;
+			size_t email_len;
+			uint64_t time;
+			int16_t tz_offset;
+			const char *message;
+			size_t message_len;
+		} update;
+	} value;
+};
+
+/* copies the view `src` into `dest`, whose fields are released first. */
+void reftable_log_record_from_view(struct reftable_log_record *dest,
+				   const struct reftable_log_record_view *src,
+				   int hash_size);
+
 #endif
@@ -9,6 +9,7 @@ https://developers.google.com/open-source/licenses/bsd
 #ifndef REFTABLE_STACK_H
 #define REFTABLE_STACK_H
 
+#include "reftable-iterator.h"
 #include "reftable-writer.h"
 
 /*
@@ -67,18 +68,52 @@ int reftable_stack_add(struct reftable_stack *st,
 		       void *write_arg);
 
 /* returns the merged_table for seeking. This table is valid until the
- * next write or reload, and should not be closed or deleted.
+ * next write or reload, and should not be closed or deleted. Threads sharing
+ * the stack should read through snapshots instead.
  */
 struct reftable_merged_table *
 reftable_stack_merged_table(struct reftable_stack *st);
 
+/* A snapshot pins a version of the stack. Its merged table stays valid and
+ * unchanged while the stack is reloaded or written, so threads can share a
+ * stack by reading through snapshots, while one of them reloads it. Tables
+ * that are compacted away are kept open, and on disk, until the last snapshot
+ * using them is released. */
+struct reftable_stack_snapshot;
+
+/* returns the current version of the stack, adding a reference to it. This
+ * may be called from any thread, also while another thread reloads the
+ * stack. */
+struct reftable_stack_snapshot *
+reftable_stack_snapshot_acquire(struct reftable_stack *st);
+
+/* returns the merged table of the snapshot. It is valid until the snapshot is
+ * released, and should not be closed or deleted. Iterators over it must be
+ * destroyed before releasing the snapshot. */
+struct reftable_merged_table *
+reftable_stack_snapshot_merged_table(struct reftable_stack_snapshot *snap);
+
+/* returns the generation of the snapshot, see reftable_stack_generation. */
+uint64_t
+reftable_stack_snapshot_generation(struct reftable_stack_snapshot *snap);
+
+/* drops a reference to the snapshot. This may be called from any thread. All
+ * snapshots must be released before the stack is destroyed. */
+void reftable_stack_snapshot_release(struct reftable_stack_snapshot *snap);
+
 /* frees all resources associated with the stack. */
 void reftable_stack_destroy(struct reftable_stack *st);
 
 /* Reloads the stack if necessary. This is very cheap to run if the stack was up
- * to date */
+ * to date: it stats tables.list, or with watch_tables_list, reads the pending
+ * inotify events. Several threads may reload the stack at once. */
 int reftable_stack_reload(struct reftable_stack *st);
 
+/* returns the generation of the stack. It grows whenever the stack is
+ * reloaded with other tables, so callers can compare it to invalidate data
+ * derived from the stack. */
+uint64_t reftable_stack_generation(struct reftable_stack *st);
+
 /* Policy for expiring reflog entries. */
 struct reftable_log_expiry_config {
 	/* Drop entries older than this timestamp */
@@ -96,6 +131,12 @@ int reftable_stack_compact_all(struct reftable_stack *st,
 /* heuristically compact unbalanced table stack. */
 int reftable_stack_auto_compact(struct reftable_stack *st);
 
+/* waits for the compactions requested so far to finish, if the stack was
+ * configured with background_compaction. Returns the first error of a
+ * background compaction since the last call, if any. The stack must be
+ * reloaded to see the result. */
+int reftable_stack_wait_for_compaction(struct reftable_stack *st);
+
 /* delete stale .ref tables. */
 int reftable_stack_clean(struct reftable_stack *st);
 
@@ -104,11 +145,32 @@ int reftable_stack_clean(struct reftable_stack *st);
 int reftable_stack_read_ref(struct reftable_stack *st, const char *refname,
 			    struct reftable_ref_record *ref);
 
+/* returns an iterator over the refs whose name starts with 'prefix', see
+ * reftable_merged_table_seek_ref_prefix. The iterator is valid until the next
+ * write or reload. */
+int reftable_stack_seek_ref_prefix(struct reftable_stack *st,
+				   struct reftable_iterator *it,
+				   const char *prefix);
+
+/* convenience function to read many refs at once. On return, refs[i] holds the
+ * ref named names[i], or is zeroed if it does not exist. The entries of `refs`
+ * must be zero-initialized or hold records to release. Returns < 0 for error,
+ * or the number of refs not found. */
+int reftable_stack_read_refs(struct reftable_stack *st, const char **names,
+			     size_t n, struct reftable_ref_record *refs);
+
 /* convenience function to read a single log. Returns < 0 for error, 0 for
  * success, and 1 if ref not found. */
 int reftable_stack_read_log(struct reftable_stack *st, const char *refname,
 			    struct reftable_log_record *log);
 
+/* seek to the log entry `refname` had at `time`, ie. the newest entry at or
+   before it. If there is none, the iterator is empty. Tables written with
+   log_time_index find the entry without reading the whole log of the ref. */
+int reftable_stack_seek_log_time(struct reftable_stack *st,
+				 struct reftable_iterator *it,
+				 const char *refname, uint64_t time);
+
 /* statistics on past compactions. */
 struct reftable_compaction_stats {
 	uint64_t bytes; /* total number of bytes written */
@@ -116,12 +178,67 @@ struct reftable_compaction_stats {
 				     failures. */
 	int attempts; /* how often we tried to compact */
 	int failures; /* failures happen on concurrent updates */
+	/* compactions that merged key ranges on several threads, see
+	 * reftable_write_options.compaction_threads. */
+	int parallel_compactions;
+
+	/* The fields below are only set with background_compaction. */
+	int queue_depth; /* compaction requests not yet started */
+	uint64_t duration_us; /* total time spent compacting */
+	uint64_t max_duration_us; /* longest single compaction */
 };
 
 /* return statistics for compaction up till now. */
 struct reftable_compaction_stats *
 reftable_stack_compaction_stats(struct reftable_stack *st);
 
+/* statistics on the block cache, see reftable_write_options.block_cache_size.
+ */
+struct reftable_block_cache_stats {
+	uint64_t hits; /* lookups served from the cache */
+	uint64_t misses; /* lookups that had to read the block source */
+	uint64_t evictions; /* blocks dropped to stay within capacity */
+	uint64_t entries; /* number of blocks currently cached */
+	uint64_t bytes; /* bytes currently cached, including overhead */
+	uint64_t capacity; /* maximum number of bytes to cache */
+};
+
+/* return statistics for the block cache. All fields are zero if the stack was
+ * configured without a block cache. */
+void reftable_stack_block_cache_stats(struct reftable_stack *st,
+				      struct reftable_block_cache_stats *dest);
+
+/* memory used by the tables of a stack, or of all stacks sharing the memory
+ * budget. */
+struct reftable_memory_usage {
+	uint64_t blocks; /* decoded blocks in the block cache */
+	uint64_t pinned; /* pinned index blocks, see pin_index_levels */
+	uint64_t readers; /* metadata of open tables, such as bloom filters */
+};
+
+/* return the memory used by the tables of the stack. */
+void reftable_stack_memory_usage(struct reftable_stack *st,
+				 struct reftable_memory_usage *dest);
+
+/* Sets a budget in bytes for the memory used by the tables of all stacks in
+ * the process. Stacks created while a budget is set are registered with it,
+ * and read through a single block cache, which gets what their pinned index
+ * blocks and open tables leave of the budget. Their block_cache_size is
+ * ignored, and index blocks are not pinned for tables that don't fit in the
+ * budget anymore. A budget of 0, the default, leaves new stacks to their own
+ * settings; stacks registered before then cache no blocks. */
+void reftable_set_memory_budget(uint64_t bytes);
+
+/* statistics on the memory budget. */
+struct reftable_memory_budget_stats {
+	uint64_t budget; /* see reftable_set_memory_budget() */
+	uint64_t stacks; /* number of registered stacks */
+	struct reftable_memory_usage usage; /* of all registered stacks */
+	uint64_t evictions; /* blocks dropped from the shared block cache */
+};
+
+void reftable_get_memory_budget_stats(struct reftable_memory_budget_stats *dest);
+
 /* print the entire stack represented by the directory */
 int reftable_stack_print_directory(const char *stackdir, uint32_t hash_id);
 
@@ -9,13 +9,18 @@ https://developers.google.com/open-source/licenses/bsd
 #ifndef REFTABLE_TESTS_H
 #define REFTABLE_TESTS_H
 
+int block_bench_main(int argc, const char **argv);
 int basics_test_main(int argc, const char **argv);
 int block_test_main(int argc, const char **argv);
+int bloom_test_main(int argc, const char **argv);
+int losertree_test_main(int argc, const char **argv);
+int merged_bench_main(int argc, const char **argv);
 int merged_test_main(int argc, const char **argv);
 int pq_test_main(int argc, const char **argv);
 int record_test_main(int argc, const char **argv);
 int refname_test_main(int argc, const char **argv);
 int readwrite_test_main(int argc, const char **argv);
+int reader_bench_main(int argc, const char **argv);
 int stack_test_main(int argc, const char **argv);
 int tree_test_main(int argc, const char **argv);
 int reftable_dump_main(int argc, char *const *argv);
@@ -16,6 +16,21 @@ https://developers.google.com/open-source/licenses/bsd
 
 /* Writing single reftables */
 
+/* compression algorithms for log blocks. */
+enum reftable_compression {
+	/* the default, readable by all reftable implementations. */
+	REFTABLE_COMPRESSION_ZLIB = 0,
+	REFTABLE_COMPRESSION_NONE = 1,
+	/* only available if the library was built with zstd or lz4
+	 * respectively; see reftable_compression_supported(). */
+	REFTABLE_COMPRESSION_ZSTD = 2,
+	REFTABLE_COMPRESSION_LZ4 = 3,
+};
+
+/* returns whether this build can read and write blocks compressed with
+ * `compression`. */
+int reftable_compression_supported(enum reftable_compression compression);
+
 /* reftable_write_options sets options for writing a single reftable. */
 struct reftable_write_options {
 	/* boolean: do not pad out blocks to block size. */
@@ -43,6 +58,99 @@ struct reftable_write_options {
 	 *   is a single line, and add '\n' if missing.
 	 */
 	unsigned exact_log_message : 1;
+
+	/* boolean: write a metadata block with the first and last ref name
+	 * and a bloom filter over the ref names, so lookups can skip tables
+	 * that can't have a ref. Tables stay readable by readers that don't
+	 * understand the block. */
+	unsigned ref_metadata : 1;
+
+	/* boolean: write an index of log times into the metadata block, so
+	 * reftable_stack_seek_log_time finds the log entry of a ref at a
+	 * given time without reading the ref's whole log. */
+	unsigned log_time_index : 1;
+
+	/* if nonzero, keep at most about this many bytes of block index
+	 * records, and as many of object ids for the SHA1 => ref index, in
+	 * memory. The rest goes to temporary files, and is read back when the
+	 * indexes are written, so writing a large table uses bounded memory.
+	 */
+	uint64_t max_index_memory;
+
+	/* directory for the temporary files of max_index_memory. If NULL,
+	 * the system's temporary directory ($TMPDIR, or /tmp), which may be
+	 * in memory. Stacks use their own directory unless this is set. */
+	const char *spill_dir;
+
+	/* how to compress log blocks. Each block records its compression, so
+	 * readers pick the right decoder, but only zlib blocks can be read by
+	 * other implementations. Adding log records fails with
+	 * REFTABLE_API_ERROR if the compression isn't supported. */
+	enum reftable_compression log_compression;
+
+	/* boolean: also compress ref, obj and index blocks with
+	 * log_compression, unless that is REFTABLE_COMPRESSION_NONE.
+	 * Compressed blocks are not padded, and record their compressed size,
+	 * so readers skip them without decompressing. Only this library can
+	 * read such tables. Use a block cache to decompress blocks only once.
+	 */
+	unsigned compress_blocks : 1;
+
+	/* boolean: have zlib compressed log blocks record their compressed
+	 * size, as blocks compressed otherwise do, so readers seeking through
+	 * the log section skip blocks without inflating them. Only this
+	 * library can read such tables. */
+	unsigned sized_log_blocks : 1;
+
+	/* if nonzero, compress log blocks on this many threads, while the
+	 * writing thread encodes the next blocks. Blocks are written in order
+	 * as they are compressed, so the table is the same as without. */
+	int log_compression_threads;
+
+	/* with log_compression_threads, the number of log blocks that may be
+	 * compressing or waiting to be written before adding a log record
+	 * waits for the oldest. Defaults to twice the number of threads. */
+	int log_blocks_in_flight;
+
+	/* Stack only: number of bytes of decoded blocks to keep in a cache
+	 * shared by all tables of the stack. 0 disables the cache. Ignored if
+	 * a memory budget is set, see reftable_set_memory_budget(). */
+	uint64_t block_cache_size;
+
+	/* Stack only: number of index levels, counting from the root, to keep
+	 * in memory for each table. See reftable_reader_pin_index_blocks(). */
+	int pin_index_levels;
+
+	/* Stack only: boolean: compact in a background thread instead of
+	 * while adding tables. Writers then never wait for a rewrite; see
+	 * reftable_stack_wait_for_compaction(). */
+	unsigned background_compaction : 1;
+
+	/* Stack only: boolean: watch the stack's directory with inotify where
+	 * available, so reftable_stack_reload doesn't even stat tables.list
+	 * while it is unchanged. */
+	unsigned watch_tables_list : 1;
+
+	/* Stack only: boolean: merge the tables of the stack for reading with
+	 * a loser tree instead of a priority queue. It compares fewer keys
+	 * per record when the stack has many tables; see
+	 * reftable_merged_table_set_loser_tree(). */
+	unsigned loser_tree_merge : 1;
+
+	/* Stack only: number of threads a compaction may use to merge and
+	 * encode key ranges of the tables concurrently. 0 or 1 merges on the
+	 * compacting thread. */
+	int compaction_threads;
+
+	/* Stack only: boolean: open tables on first use instead of when the
+	 * stack is loaded. A lookup in a table that was meanwhile compacted
+	 * away fails with REFTABLE_NOT_EXIST_ERROR; reload the stack and
+	 * retry. */
+	unsigned lazy_open_tables : 1;
+
+	/* Stack only: number of threads used to open the tables new to a
+	 * reload. 0 or 1 opens them on the reloading thread. */
+	int open_threads;
 };
 
 /* reftable_block_stats holds statistics for a single block type */
@@ -80,6 +188,14 @@ struct reftable_stats {
 
 	/* disambiguation length of shortened object IDs. */
 	int object_id_len;
+
+	/* nanoseconds spent in the stages of writing log blocks: encoding
+	 * records, compressing blocks (summed over threads), waiting for
+	 * compressed blocks, and writing them out. */
+	uint64_t log_encode_nsec;
+	uint64_t log_compress_nsec;
+	uint64_t log_wait_nsec;
+	uint64_t log_write_nsec;
 };
 
 /* reftable_new_writer creates a new writer */
@@ -34,6 +34,8 @@ static int filtering_ref_iterator_next(void *iter_arg,
 	struct filtering_ref_iterator *fri = iter_arg;
 	struct reftable_ref_record *ref = rec->data;
 	int err = 0;
+	if (reftable_record_is_view(rec))
+		return REFTABLE_API_ERROR;
 	while (1) {
 		err = reftable_iterator_next_ref(&fri->it, ref);
 		if (err != 0) {
@@ -90,6 +92,63 @@ void iterator_from_filtering_ref_iterator(struct reftable_iterator *it,
 	it->ops = &filtering_ref_iterator_vtable;
 }
 
+static void prefix_iter_close(void *iter_arg)
+{
+	struct prefix_iter *pi = iter_arg;
+	reftable_iterator_destroy(&pi->it);
+	strbuf_release(&pi->prefix);
+	strbuf_release(&pi->key);
+}
+
+static int prefix_iter_next(void *iter_arg, struct reftable_record *rec)
+{
+	struct prefix_iter *pi = iter_arg;
+	int err = 0;
+	if (iterator_is_null(&pi->it))
+		return 1;
+
+	err = iterator_next(&pi->it, rec);
+	if (err != 0)
+		return err;
+
+	reftable_record_key(rec, &pi->key);
+	if (pi->key.len >= pi->prefix.len &&
+	    !memcmp(pi->key.buf, pi->prefix.buf, pi->prefix.len))
+		return 0;
+
+	/* drop the underlying iterator, so its blocks are returned early. */
+	reftable_iterator_destroy(&pi->it);
+	reftable_record_release(rec);
+	return 1;
+}
+
+static struct reftable_iterator_vtable prefix_iter_vtable = {
+	.next = &prefix_iter_next,
+	.close = &prefix_iter_close,
+};
+
+void iterator_from_prefix_iter(struct reftable_iterator *it,
+			       struct prefix_iter *pi)
+{
+	assert(!it->ops);
+	it->iter_arg = pi;
+	it->ops = &prefix_iter_vtable;
+}
+
+void iterator_limit_to_prefix(struct reftable_iterator *it,
+			      struct strbuf *prefix)
+{
+	struct prefix_iter empty = PREFIX_ITER_INIT;
+	struct prefix_iter *pi = reftable_malloc(sizeof(struct prefix_iter));
+	*pi = empty;
+	pi->it = *it;
+	strbuf_addbuf(&pi->prefix, prefix);
+
+	it->ops = NULL;
+	it->iter_arg = NULL;
+	iterator_from_prefix_iter(it, pi);
+}
+
 static void indexed_table_ref_iter_close(void *p)
 {
 	struct indexed_table_ref_iter *it = p;
@@ -128,6 +187,8 @@ static int indexed_table_ref_iter_next(void *p, struct reftable_record *rec)
 {
 	struct indexed_table_ref_iter *it = p;
 	struct reftable_ref_record *ref = rec->data;
+	if (reftable_record_is_view(rec))
+		return REFTABLE_API_ERROR;
 
 	while (1) {
 		int err = block_iter_next(&it->cur, rec);
@@ -146,10 +207,12 @@ static int indexed_table_ref_iter_next(void *p, struct reftable_record *rec)
 			}
 			continue;
 		}
-		/* BUG */
-		if (!memcmp(it->oid.buf, ref->value.val2.target_value,
-			    it->oid.len) ||
-		    !memcmp(it->oid.buf, ref->value.val2.value, it->oid.len)) {
+		if ((reftable_ref_record_val1(ref) &&
+		     !memcmp(it->oid.buf, reftable_ref_record_val1(ref),
+			     it->oid.len)) ||
+		    (reftable_ref_record_val2(ref) &&
+		     !memcmp(it->oid.buf, reftable_ref_record_val2(ref),
+			     it->oid.len))) {
 			return 0;
 		}
 	}
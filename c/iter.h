@@ -35,6 +35,29 @@ struct filtering_ref_iterator {
 void iterator_from_filtering_ref_iterator(struct reftable_iterator *,
 					  struct filtering_ref_iterator *);
 
+/* iterator that stops at the first record whose key doesn't start with
+ * `prefix`. Since keys are sorted, no later record can match either. */
+struct prefix_iter {
+	struct reftable_iterator it;
+	struct strbuf prefix;
+
+	/* scratch space for the key of the last record. */
+	struct strbuf key;
+};
+
+#define PREFIX_ITER_INIT                                      \
+	{                                                     \
+		.prefix = STRBUF_INIT, .key = STRBUF_INIT \
+	}
+
+void iterator_from_prefix_iter(struct reftable_iterator *it,
+			       struct prefix_iter *pi);
+
+/* Replaces `it`, which should be positioned at `prefix`, with an iterator
+ * that ends once the keys leave `prefix`. */
+void iterator_limit_to_prefix(struct reftable_iterator *it,
+			      struct strbuf *prefix);
+
 /* iterator that produces only ref records that point to `oid`,
  * but using the object index.
  */
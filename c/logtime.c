@@ -0,0 +1,216 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "logtime.h"
+
+#include "system.h"
+#include "basics.h"
+#include "reftable-error.h"
+
+static void strbuf_add_varint(struct strbuf *dest, uint64_t val)
+{
+	uint8_t buf[10];
+	struct string_view sv = { buf, sizeof(buf) };
+	int n = put_var_int(&sv, val);
+	strbuf_add(dest, buf, n);
+}
+
+/* encodes the runs of the current ref. `edge` is set if the ref may be on
+ * the edge of a partition. */
+static void log_time_writer_encode(struct log_time_writer *lw, int edge)
+{
+	size_t i = 0;
+
+	if (lw->runs_len > 1 ||
+	    (lw->runs_len > 0 && edge && lw->keep_edges)) {
+		strbuf_add_varint(&lw->out, lw->name.len);
+		strbuf_addbuf(&lw->out, &lw->name);
+		strbuf_add_varint(&lw->out, lw->runs_len);
+		for (i = 0; i < lw->runs_len; i++) {
+			strbuf_add_varint(&lw->out, lw->runs[i].update_index);
+			strbuf_add_varint(&lw->out, lw->runs[i].time);
+		}
+	}
+	lw->runs_len = 0;
+	lw->refs++;
+}
+
+void log_time_writer_flush(struct log_time_writer *lw)
+{
+	log_time_writer_encode(lw, 1);
+}
+
+void log_time_writer_add(struct log_time_writer *lw, const char *name,
+			 uint64_t update_index, uint64_t time, int new_block)
+{
+	struct log_time_run *last = NULL;
+
+	if (lw->runs_len > 0 && strcmp(name, lw->name.buf))
+		log_time_writer_encode(lw, lw->refs == 0);
+	if (lw->runs_len == 0) {
+		strbuf_reset(&lw->name);
+		strbuf_addstr(&lw->name, name);
+	}
+
+	last = lw->runs_len > 0 ? &lw->runs[lw->runs_len - 1] : NULL;
+	if (last && !new_block) {
+		if (time < last->time)
+			last->time = time;
+		return;
+	}
+
+	if (lw->runs_len == lw->runs_cap) {
+		lw->runs_cap = 2 * lw->runs_cap + 1;
+		lw->runs = reftable_realloc(
+			lw->runs, sizeof(struct log_time_run) * lw->runs_cap);
+	}
+	lw->runs[lw->runs_len].update_index = update_index;
+	lw->runs[lw->runs_len].time = time;
+	lw->runs_len++;
+}
+
+void log_time_writer_release(struct log_time_writer *lw)
+{
+	strbuf_release(&lw->out);
+	strbuf_release(&lw->name);
+	FREE_AND_NULL(lw->runs);
+	lw->runs_len = 0;
+	lw->runs_cap = 0;
+}
+
+static int log_time_get_varint(uint64_t *dest, struct string_view *in)
+{
+	int n = get_var_int(dest, in);
+	if (n <= 0)
+		return REFTABLE_FORMAT_ERROR;
+	string_view_consume(in, n);
+	return 0;
+}
+
+int log_time_index_decode(struct log_time_index *idx, struct string_view in)
+{
+	while (in.len > 0) {
+		struct log_time_ref *ref = NULL;
+		uint64_t name_len = 0;
+		uint64_t runs = 0;
+		uint64_t i = 0;
+
+		if (log_time_get_varint(&name_len, &in) < 0 ||
+		    name_len > in.len)
+			return REFTABLE_FORMAT_ERROR;
+
+		ref = idx->refs_len > 0 ? &idx->refs[idx->refs_len - 1] : NULL;
+		if (!ref || ref->name_len != name_len ||
+		    memcmp(idx->names.buf + ref->name_off, in.buf, name_len)) {
+			if (idx->refs_len == idx->refs_cap) {
+				idx->refs_cap = 2 * idx->refs_cap + 1;
+				idx->refs = reftable_realloc(
+					idx->refs, sizeof(struct log_time_ref) *
+							   idx->refs_cap);
+			}
+			ref = &idx->refs[idx->refs_len++];
+			ref->name_off = idx->names.len;
+			ref->name_len = name_len;
+			ref->runs_off = idx->runs_len;
+			ref->runs_len = 0;
+			strbuf_add(&idx->names, in.buf, name_len);
+		}
+		string_view_consume(&in, name_len);
+
+		if (log_time_get_varint(&runs, &in) < 0 || runs > in.len)
+			return REFTABLE_FORMAT_ERROR;
+		for (i = 0; i < runs; i++) {
+			struct log_time_run run = { 0 };
+			if (log_time_get_varint(&run.update_index, &in) < 0 ||
+			    log_time_get_varint(&run.time, &in) < 0)
+				return REFTABLE_FORMAT_ERROR;
+
+			/* keep the oldest time up to the end of the run. */
+			if (ref->runs_len > 0 &&
+			    idx->runs[idx->runs_len - 1].time < run.time)
+				run.time = idx->runs[idx->runs_len - 1].time;
+
+			if (idx->runs_len == idx->runs_cap) {
+				idx->runs_cap = 2 * idx->runs_cap + 1;
+				idx->runs = reftable_realloc(
+					idx->runs, sizeof(struct log_time_run) *
+							   idx->runs_cap);
+			}
+			idx->runs[idx->runs_len++] = run;
+			ref->runs_len++;
+		}
+	}
+	return 0;
+}
+
+struct log_time_search_arg {
+	struct log_time_index *idx;
+	const char *name;
+	uint64_t time;
+	size_t runs_off;
+};
+
+static int log_time_ref_not_less(size_t k, void *args)
+{
+	struct log_time_search_arg *a = args;
+	struct log_time_ref *ref = &a->idx->refs[k];
+	size_t len = strlen(a->name);
+	size_t min = len < ref->name_len ? len : ref->name_len;
+	int cmp = memcmp(a->idx->names.buf + ref->name_off, a->name, min);
+	if (cmp)
+		return cmp > 0;
+	return ref->name_len >= len;
+}
+
+static int log_time_run_at_or_before(size_t k, void *args)
+{
+	struct log_time_search_arg *a = args;
+	return a->idx->runs[a->runs_off + k].time <= a->time;
+}
+
+int log_time_index_lookup(struct log_time_index *idx, const char *name,
+			  uint64_t time, uint64_t *update_index)
+{
+	struct log_time_search_arg args = {
+		.idx = idx,
+		.name = name,
+		.time = time,
+	};
+	struct log_time_ref *ref = NULL;
+	size_t i = 0;
+
+	if (idx->refs_len == 0)
+		return -1;
+	i = binsearch(idx->refs_len, &log_time_ref_not_less, &args);
+	if (i == idx->refs_len)
+		return -1;
+	ref = &idx->refs[i];
+	if (ref->name_len != strlen(name) ||
+	    memcmp(idx->names.buf + ref->name_off, name, ref->name_len))
+		return -1;
+
+	if (ref->runs_len == 0)
+		return 1;
+
+	/* the first run reaching back to `time` holds the entry. */
+	args.runs_off = ref->runs_off;
+	i = binsearch(ref->runs_len, &log_time_run_at_or_before, &args);
+	if (i == ref->runs_len)
+		return 1;
+	*update_index = idx->runs[ref->runs_off + i].update_index;
+	return 0;
+}
+
+void log_time_index_release(struct log_time_index *idx)
+{
+	strbuf_release(&idx->names);
+	FREE_AND_NULL(idx->refs);
+	FREE_AND_NULL(idx->runs);
+	idx->refs_len = idx->refs_cap = 0;
+	idx->runs_len = idx->runs_cap = 0;
+}
@@ -0,0 +1,95 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef LOGTIME_H
+#define LOGTIME_H
+
+#include "system.h"
+
+#include "record.h"
+
+/*
+ * The log time index finds the log entry a ref had at a given time without
+ * reading the ref's whole log. It is stored in the metadata block of tables.
+ *
+ * The log of a ref is cut into runs where it enters a new block. For each
+ * run, the index holds the update index of its first (newest) entry, and the
+ * oldest time in it. Logs within a single run are left out, as reading them
+ * whole is cheap.
+ *
+ * Encoded, refs follow in key order as (varint name length, name, varint
+ * number of runs, runs), and runs as (varint update index, varint time).
+ */
+struct log_time_run {
+	uint64_t update_index;
+	uint64_t time;
+};
+
+/* Collects the runs of the logs added to a table. */
+struct log_time_writer {
+	/* the runs of previous refs, encoded. */
+	struct strbuf out;
+
+	/* the ref whose log is being added, and its runs so far. */
+	struct strbuf name;
+	struct log_time_run *runs;
+	size_t runs_len;
+	size_t runs_cap;
+
+	/* number of refs whose runs were encoded or dropped. */
+	size_t refs;
+
+	/* keep the first and last ref even if they have a single run, as
+	 * their logs may continue in neighbouring partitions. */
+	int keep_edges;
+};
+
+/* records the log entry of `name` at `update_index` and `time`. Entries must
+ * be added in key order. `new_block` is set if the entry starts a block. */
+void log_time_writer_add(struct log_time_writer *lw, const char *name,
+			 uint64_t update_index, uint64_t time, int new_block);
+
+/* encodes the runs of the last ref added into `out`. */
+void log_time_writer_flush(struct log_time_writer *lw);
+
+void log_time_writer_release(struct log_time_writer *lw);
+
+struct log_time_ref {
+	/* the name, in log_time_index.names. */
+	size_t name_off;
+	size_t name_len;
+	/* the runs, in log_time_index.runs. */
+	size_t runs_off;
+	size_t runs_len;
+};
+
+/* The decoded index. Consecutive entries of a ref are merged, and the time
+ * of each run is the oldest time of the ref's log up to its end, so it
+ * decreases along the log. */
+struct log_time_index {
+	struct strbuf names;
+	struct log_time_ref *refs;
+	size_t refs_len;
+	size_t refs_cap;
+	struct log_time_run *runs;
+	size_t runs_len;
+	size_t runs_cap;
+};
+
+/* decodes the encoded index `in`, appending to `idx`. */
+int log_time_index_decode(struct log_time_index *idx, struct string_view in);
+
+/* Sets `*update_index` to the start of the run holding the newest log entry
+ * of `name` at or before `time`. Returns 1 if `name` has no such entry, and
+ * -1 if `name` is not in the index. */
+int log_time_index_lookup(struct log_time_index *idx, const char *name,
+			  uint64_t time, uint64_t *update_index);
+
+void log_time_index_release(struct log_time_index *idx);
+
+#endif
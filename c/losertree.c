@@ -0,0 +1,114 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "losertree.h"
+
+#include "system.h"
+#include "basics.h"
+
+/* Returns whether source `a` beats `b`; done sources lose to all others. */
+static int loser_tree_less(struct loser_tree *lt, size_t a, size_t b)
+{
+	struct loser_tree_entry *ea = &lt->entries[a];
+	struct loser_tree_entry *eb = &lt->entries[b];
+	int cmp = 0;
+	if (ea->done)
+		return 0;
+	if (eb->done)
+		return 1;
+
+	cmp = strbuf_cmp(&ea->key, &eb->key);
+	if (cmp == 0)
+		return a > b;
+	return cmp < 0;
+}
+
+void loser_tree_init(struct loser_tree *lt, size_t len, uint8_t typ)
+{
+	size_t i = 0;
+	lt->len = len;
+	lt->entries = reftable_calloc(sizeof(struct loser_tree_entry) * len);
+	lt->nodes = reftable_calloc(sizeof(size_t) * (len + 1));
+	for (i = 0; i < len; i++) {
+		lt->entries[i].rec = reftable_new_view_record(typ);
+		strbuf_init(&lt->entries[i].key, 0);
+		lt->entries[i].done = 1;
+	}
+}
+
+void loser_tree_build(struct loser_tree *lt)
+{
+	/* winners of the matches at each node. */
+	size_t *winners = NULL;
+	size_t k = 0;
+
+	for (k = 0; k < lt->len; k++) {
+		struct loser_tree_entry *e = &lt->entries[k];
+		if (!e->done)
+			reftable_record_key(&e->rec, &e->key);
+	}
+	if (lt->len <= 1)
+		return;
+
+	winners = reftable_calloc(sizeof(size_t) * 2 * lt->len);
+	for (k = 0; k < lt->len; k++)
+		winners[lt->len + k] = k;
+	for (k = lt->len - 1; k >= 1; k--) {
+		size_t a = winners[2 * k];
+		size_t b = winners[2 * k + 1];
+		if (loser_tree_less(lt, a, b)) {
+			winners[k] = a;
+			lt->nodes[k] = b;
+		} else {
+			winners[k] = b;
+			lt->nodes[k] = a;
+		}
+	}
+	lt->nodes[0] = winners[1];
+	reftable_free(winners);
+}
+
+int loser_tree_is_empty(struct loser_tree *lt)
+{
+	return lt->len == 0 || lt->entries[lt->nodes[0]].done;
+}
+
+size_t loser_tree_top(struct loser_tree *lt)
+{
+	return lt->nodes[0];
+}
+
+void loser_tree_update(struct loser_tree *lt, size_t i)
+{
+	size_t winner = i;
+	size_t k = 0;
+	struct loser_tree_entry *e = &lt->entries[i];
+	if (!e->done)
+		reftable_record_key(&e->rec, &e->key);
+
+	for (k = (lt->len + i) / 2; k >= 1; k /= 2) {
+		if (loser_tree_less(lt, lt->nodes[k], winner)) {
+			size_t tmp = lt->nodes[k];
+			lt->nodes[k] = winner;
+			winner = tmp;
+		}
+	}
+	lt->nodes[0] = winner;
+}
+
+void loser_tree_release(struct loser_tree *lt)
+{
+	size_t i = 0;
+	for (i = 0; i < lt->len; i++) {
+		reftable_record_destroy(&lt->entries[i].rec);
+		strbuf_release(&lt->entries[i].key);
+	}
+	FREE_AND_NULL(lt->entries);
+	FREE_AND_NULL(lt->nodes);
+	lt->len = 0;
+}
@@ -0,0 +1,60 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef LOSERTREE_H
+#define LOSERTREE_H
+
+#include "record.h"
+
+/*
+ * A tournament tree of losers, merging sorted sources. Each source has a
+ * current record with a cached key. When the record of the winning source is
+ * replaced, only the matches on its path to the root are replayed, costing
+ * log2(len) key comparisons.
+ *
+ * On equal keys, the source with the higher index wins, as in pq_less().
+ */
+struct loser_tree_entry {
+	/* the current record of the source, a view (see
+	 * reftable_new_view_record). */
+	struct reftable_record rec;
+	/* the key of `rec`. */
+	struct strbuf key;
+	/* set once the source is exhausted. */
+	int done;
+};
+
+struct loser_tree {
+	struct loser_tree_entry *entries;
+	size_t len;
+
+	/* nodes[0] is the overall winner, nodes[1..len-1] the loser of the
+	 * match at each inner node. Source i is leaf node len + i. */
+	size_t *nodes;
+};
+
+/* Sets up a tree over `len` sources of records of type `typ`, which start
+ * out done. */
+void loser_tree_init(struct loser_tree *lt, size_t len, uint8_t typ);
+
+/* Plays all matches, after the entries have been filled in. */
+void loser_tree_build(struct loser_tree *lt);
+
+/* Returns whether all sources are done. */
+int loser_tree_is_empty(struct loser_tree *lt);
+
+/* Returns the source with the smallest key. */
+size_t loser_tree_top(struct loser_tree *lt);
+
+/* Replays the matches of the top source `i`, after its record was replaced
+ * or it was marked done. */
+void loser_tree_update(struct loser_tree *lt, size_t i);
+
+void loser_tree_release(struct loser_tree *lt);
+
+#endif
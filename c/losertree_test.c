@@ -0,0 +1,109 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "system.h"
+
+#include "basics.h"
+#include "constants.h"
+#include "losertree.h"
+#include "record.h"
+#include "reftable-tests.h"
+#include "test_framework.h"
+
+/* Loads the next name of source `i` into the tree, or marks it done. The
+ * entries are views, so the name is kept in `names`. */
+static void set_source(struct loser_tree *lt, size_t i, char *names,
+		       int *next, int step, int n)
+{
+	struct reftable_ref_record_view *ref =
+		reftable_record_as_ref_view(&lt->entries[i].rec);
+	char *name = names + 20 * i;
+	if (next[i] >= n) {
+		lt->entries[i].done = 1;
+		return;
+	}
+	snprintf(name, 20, "%04d", next[i]);
+	ref->refname = name;
+	ref->refname_len = strlen(name);
+	ref->update_index = i;
+	next[i] += step;
+}
+
+static void test_loser_tree(void)
+{
+	size_t k = 0;
+	for (k = 1; k <= 9; k++) {
+		struct loser_tree lt = { NULL };
+		int *next = reftable_calloc(sizeof(int) * k);
+		char *names = reftable_calloc(20 * k);
+		int n = 100;
+		int count = 0;
+		int want = 0;
+		size_t i = 0;
+		struct strbuf last = STRBUF_INIT;
+		uint64_t last_index = 0;
+
+		loser_tree_init(&lt, k, BLOCK_TYPE_REF);
+		for (i = 0; i < k; i++) {
+			/* source i holds the multiples of i+1, starting at i. */
+			next[i] = i;
+			lt.entries[i].done = 0;
+			set_source(&lt, i, names, next, i + 1, n);
+		}
+		loser_tree_build(&lt);
+
+		while (!loser_tree_is_empty(&lt)) {
+			size_t top = loser_tree_top(&lt);
+			struct loser_tree_entry *e = &lt.entries[top];
+			int cmp = strbuf_cmp(&last, &e->key);
+			if (count > 0) {
+				EXPECT(cmp <= 0);
+				/* on equal keys, newer sources come first. */
+				if (cmp == 0)
+					EXPECT(top < last_index);
+			}
+			strbuf_reset(&last);
+			strbuf_addbuf(&last, &e->key);
+			last_index = top;
+			count++;
+
+			set_source(&lt, top, names, next, top + 1, n);
+			loser_tree_update(&lt, top);
+		}
+
+		for (i = 0; i < k; i++)
+			want += n / (i + 1);
+		EXPECT(count == want);
+
+		strbuf_release(&last);
+		reftable_free(next);
+		reftable_free(names);
+		loser_tree_release(&lt);
+	}
+}
+
+static void test_loser_tree_empty(void)
+{
+	struct loser_tree lt = { NULL };
+	loser_tree_init(&lt, 3, BLOCK_TYPE_LOG);
+	loser_tree_build(&lt);
+	EXPECT(loser_tree_is_empty(&lt));
+	loser_tree_release(&lt);
+
+	loser_tree_init(&lt, 0, BLOCK_TYPE_REF);
+	loser_tree_build(&lt);
+	EXPECT(loser_tree_is_empty(&lt));
+	loser_tree_release(&lt);
+}
+
+int losertree_test_main(int argc, const char *argv[])
+{
+	RUN_TEST(test_loser_tree);
+	RUN_TEST(test_loser_tree_empty);
+	return 0;
+}
@@ -18,13 +18,34 @@ https://developers.google.com/open-source/licenses/bsd
 #include "reftable-error.h"
 #include "system.h"
 
+static int merged_iter_lt_init(struct merged_iter *mi)
+{
+	int i = 0;
+	loser_tree_init(&mi->lt, mi->stack_len, mi->typ);
+	for (i = 0; i < mi->stack_len; i++) {
+		int err = iterator_next(&mi->stack[i], &mi->lt.entries[i].rec);
+		if (err < 0)
+			return err;
+		if (err > 0)
+			reftable_iterator_destroy(&mi->stack[i]);
+		else
+			mi->lt.entries[i].done = 0;
+	}
+	loser_tree_build(&mi->lt);
+	return 0;
+}
+
 static int merged_iter_init(struct merged_iter *mi)
 {
 	int i = 0;
+	if (mi->use_loser_tree)
+		return merged_iter_lt_init(mi);
+
 	for (i = 0; i < mi->stack_len; i++) {
-		struct reftable_record rec = reftable_new_record(mi->typ);
+		struct reftable_record rec = reftable_new_view_record(mi->typ);
 		int err = iterator_next(&mi->stack[i], &rec);
 		if (err < 0) {
+			reftable_record_destroy(&rec);
 			return err;
 		}
 
@@ -48,27 +69,32 @@ static void merged_iter_close(void *p)
 	struct merged_iter *mi = p;
 	int i = 0;
 	merged_iter_pqueue_release(&mi->pq);
+	if (mi->advance_pending && !mi->use_loser_tree)
+		reftable_record_destroy(&mi->pending.rec);
+	loser_tree_release(&mi->lt);
+	strbuf_release(&mi->key);
 	for (i = 0; i < mi->stack_len; i++) {
 		reftable_iterator_destroy(&mi->stack[i]);
 	}
 	reftable_free(mi->stack);
 }
 
-static int merged_iter_advance_nonnull_subiter(struct merged_iter *mi,
-					       size_t idx)
+/* Reads the next record of subiterator `e.index` into `e.rec`, and queues
+ * it. */
+static int merged_iter_advance_subiter(struct merged_iter *mi,
+				       struct pq_entry e)
 {
-	struct reftable_record rec = reftable_new_record(mi->typ);
-	struct pq_entry e = {
-		.rec = rec,
-		.index = idx,
-	};
-	int err = iterator_next(&mi->stack[idx], &rec);
-	if (err < 0)
+	int err = 0;
+	reftable_record_set_key_only(&e.rec, mi->key_only);
+	err = iterator_next(&mi->stack[e.index], &e.rec);
+	if (err < 0) {
+		reftable_record_destroy(&e.rec);
 		return err;
+	}
 
 	if (err > 0) {
-		reftable_iterator_destroy(&mi->stack[idx]);
-		reftable_record_destroy(&rec);
+		reftable_iterator_destroy(&mi->stack[e.index]);
+		reftable_record_destroy(&e.rec);
 		return 0;
 	}
 
@@ -76,62 +102,117 @@ static int merged_iter_advance_nonnull_subiter(struct merged_iter *mi,
 	return 0;
 }
 
-static int merged_iter_advance_subiter(struct merged_iter *mi, size_t idx)
+/* Reads the next record of stack[idx], and replays its matches. */
+static int merged_iter_lt_advance(struct merged_iter *mi, size_t idx)
 {
-	if (iterator_is_null(&mi->stack[idx]))
-		return 0;
-	return merged_iter_advance_nonnull_subiter(mi, idx);
+	struct loser_tree_entry *e = &mi->lt.entries[idx];
+	int err = 0;
+	reftable_record_set_key_only(&e->rec, mi->key_only);
+	err = iterator_next(&mi->stack[idx], &e->rec);
+	if (err < 0)
+		return err;
+	if (err > 0) {
+		reftable_iterator_destroy(&mi->stack[idx]);
+		e->done = 1;
+	}
+	loser_tree_update(&mi->lt, idx);
+	return 0;
 }
 
-static int merged_iter_next_entry(struct merged_iter *mi,
-				  struct reftable_record *rec)
+/* Like merged_iter_next_entry, but the keys are kept in the tree, so no
+ * records or keys are allocated per step. */
+static int merged_iter_lt_next_entry(struct merged_iter *mi,
+				     struct reftable_record *rec)
 {
-	struct strbuf entry_key = STRBUF_INIT;
-	struct pq_entry entry = { 0 };
+	size_t top = 0;
 	int err = 0;
 
-	if (merged_iter_pqueue_is_empty(mi->pq))
+	if (mi->advance_pending) {
+		mi->advance_pending = 0;
+		SWAP(mi->key, mi->lt.entries[mi->pending.index].key);
+		err = merged_iter_lt_advance(mi, mi->pending.index);
+		if (err < 0)
+			return err;
+
+		/* skip shadowed entries of older tables. */
+		while (!loser_tree_is_empty(&mi->lt)) {
+			top = loser_tree_top(&mi->lt);
+			if (strbuf_cmp(&mi->lt.entries[top].key, &mi->key) > 0)
+				break;
+			err = merged_iter_lt_advance(mi, top);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	if (loser_tree_is_empty(&mi->lt))
 		return 1;
 
-	entry = merged_iter_pqueue_remove(&mi->pq);
-	err = merged_iter_advance_subiter(mi, entry.index);
-	if (err < 0)
-		return err;
+	top = loser_tree_top(&mi->lt);
+	reftable_record_copy_from(rec, &mi->lt.entries[top].rec,
+				  hash_size(mi->hash_id));
+	mi->pending.index = top;
+	mi->advance_pending = 1;
+	return 0;
+}
 
-	/*
-	  One can also use reftable as datacenter-local storage, where the ref
-	  database is maintained in globally consistent database (eg.
-	  CockroachDB or Spanner). In this scenario, replication delays together
-	  with compaction may cause newer tables to contain older entries. In
-	  such a deployment, the loop below must be changed to collect all
-	  entries for the same key, and return new the newest one.
-	*/
-	reftable_record_key(&entry.rec, &entry_key);
-	while (!merged_iter_pqueue_is_empty(mi->pq)) {
-		struct pq_entry top = merged_iter_pqueue_top(mi->pq);
-		struct strbuf k = STRBUF_INIT;
-		int err = 0, cmp = 0;
-
-		reftable_record_key(&top.rec, &k);
-
-		cmp = strbuf_cmp(&k, &entry_key);
-		strbuf_release(&k);
-
-		if (cmp > 0) {
-			break;
-		}
+static int merged_iter_next_entry(struct merged_iter *mi,
+				  struct reftable_record *rec)
+{
+	struct pq_entry entry = { 0 };
+	int err = 0;
 
-		merged_iter_pqueue_remove(&mi->pq);
-		err = merged_iter_advance_subiter(mi, top.index);
-		if (err < 0) {
+	mi->key_only = reftable_record_is_key_only(rec);
+	if (mi->use_loser_tree)
+		return merged_iter_lt_next_entry(mi, rec);
+
+	if (mi->advance_pending) {
+		mi->advance_pending = 0;
+		reftable_record_key(&mi->pending.rec, &mi->key);
+		err = merged_iter_advance_subiter(mi, mi->pending);
+		if (err < 0)
 			return err;
+
+		/*
+		  One can also use reftable as datacenter-local storage, where
+		  the ref database is maintained in globally consistent
+		  database (eg. CockroachDB or Spanner). In this scenario,
+		  replication delays together with compaction may cause newer
+		  tables to contain older entries. In such a deployment, the
+		  loop below must be changed to collect all entries for the
+		  same key, and return new the newest one.
+		*/
+		while (!merged_iter_pqueue_is_empty(mi->pq)) {
+			struct pq_entry top = merged_iter_pqueue_top(mi->pq);
+			struct strbuf k = STRBUF_INIT;
+			int cmp = 0;
+
+			reftable_record_key(&top.rec, &k);
+
+			cmp = strbuf_cmp(&k, &mi->key);
+			strbuf_release(&k);
+
+			if (cmp > 0) {
+				break;
+			}
+
+			merged_iter_pqueue_remove(&mi->pq);
+			err = merged_iter_advance_subiter(mi, top);
+			if (err < 0) {
+				return err;
+			}
 		}
-		reftable_record_destroy(&top.rec);
 	}
 
+	if (merged_iter_pqueue_is_empty(mi->pq))
+		return 1;
+
+	/* The subiterator of the returned entry is only advanced on the next
+	 * call, so the views in the entry stay valid until then. */
+	entry = merged_iter_pqueue_remove(&mi->pq);
 	reftable_record_copy_from(rec, &entry.rec, hash_size(mi->hash_id));
-	reftable_record_destroy(&entry.rec);
-	strbuf_release(&entry_key);
+	mi->pending = entry;
+	mi->advance_pending = 1;
 	return 0;
 }
 
@@ -151,9 +232,6 @@ static int merged_iter_next(struct merged_iter *mi, struct reftable_record *rec)
 static int merged_iter_next_void(void *p, struct reftable_record *rec)
 {
 	struct merged_iter *mi = p;
-	if (merged_iter_pqueue_is_empty(mi->pq))
-		return 1;
-
 	return merged_iter_next(mi, rec);
 }
 
@@ -219,6 +297,12 @@ void reftable_merged_table_free(struct reftable_merged_table *mt)
 	reftable_free(mt);
 }
 
+void reftable_merged_table_set_loser_tree(struct reftable_merged_table *mt,
+					  int enable)
+{
+	mt->use_loser_tree = enable;
+}
+
 uint64_t
 reftable_merged_table_max_update_index(struct reftable_merged_table *mt)
 {
@@ -238,9 +322,12 @@ static int reftable_table_seek_record(struct reftable_table *tab,
 	return tab->ops->seek_record(tab->table_arg, it, rec);
 }
 
-static int merged_table_seek_record(struct reftable_merged_table *mt,
-				    struct reftable_iterator *it,
-				    struct reftable_record *rec)
+/* Seeks all subtables to `rec`. If `prefix` is set, the subiterators end
+ * once their keys leave the prefix, so the merge stops there too. */
+static int merged_table_seek(struct reftable_merged_table *mt,
+			     struct reftable_iterator *it,
+			     struct reftable_record *rec,
+			     struct strbuf *prefix)
 {
 	struct reftable_iterator *iters = reftable_calloc(
 		sizeof(struct reftable_iterator) * mt->stack_len);
@@ -249,20 +336,36 @@ static int merged_table_seek_record(struct reftable_merged_table *mt,
 		.typ = reftable_record_type(rec),
 		.hash_id = mt->hash_id,
 		.suppress_deletions = mt->suppress_deletions,
+		.use_loser_tree = mt->use_loser_tree,
+		.key = STRBUF_INIT,
 	};
+	struct strbuf key = STRBUF_INIT;
 	int n = 0;
 	int err = 0;
 	int i = 0;
+	if (merged.typ == BLOCK_TYPE_REF)
+		reftable_record_key(rec, &key);
 	for (i = 0; i < mt->stack_len && err == 0; i++) {
-		int e = reftable_table_seek_record(&mt->stack[i], &iters[n],
-						   rec);
+		struct reftable_table *tab = &mt->stack[i];
+		int e = 0;
+
+		/* skip tables whose key range can't hold what we look for. */
+		if (merged.typ == BLOCK_TYPE_REF && tab->ops->may_have_refs &&
+		    !tab->ops->may_have_refs(tab->table_arg, key.buf, key.len,
+					     !!prefix))
+			continue;
+
+		e = reftable_table_seek_record(tab, &iters[n], rec);
 		if (e < 0) {
 			err = e;
 		}
 		if (e == 0) {
+			if (prefix)
+				iterator_limit_to_prefix(&iters[n], prefix);
 			n++;
 		}
 	}
+	strbuf_release(&key);
 	if (err < 0) {
 		int i = 0;
 		for (i = 0; i < n; i++) {
@@ -286,6 +389,13 @@ static int merged_table_seek_record(struct reftable_merged_table *mt,
 	return 0;
 }
 
+static int merged_table_seek_record(struct reftable_merged_table *mt,
+				    struct reftable_iterator *it,
+				    struct reftable_record *rec)
+{
+	return merged_table_seek(mt, it, rec, NULL);
+}
+
 int reftable_merged_table_seek_ref(struct reftable_merged_table *mt,
 				   struct reftable_iterator *it,
 				   const char *name)
@@ -298,6 +408,24 @@ int reftable_merged_table_seek_ref(struct reftable_merged_table *mt,
 	return merged_table_seek_record(mt, it, &rec);
 }
 
+int reftable_merged_table_seek_ref_prefix(struct reftable_merged_table *mt,
+					  struct reftable_iterator *it,
+					  const char *prefix)
+{
+	struct reftable_ref_record ref = {
+		.refname = (char *)prefix,
+	};
+	struct reftable_record rec = { NULL };
+	struct strbuf want = STRBUF_INIT;
+	int err = 0;
+
+	reftable_record_from_ref(&rec, &ref);
+	strbuf_addstr(&want, prefix);
+	err = merged_table_seek(mt, it, &rec, &want);
+	strbuf_release(&want);
+	return err;
+}
+
 int reftable_merged_table_seek_log_at(struct reftable_merged_table *mt,
 				      struct reftable_iterator *it,
 				      const char *name, uint64_t update_index)
@@ -319,6 +447,65 @@ int reftable_merged_table_seek_log(struct reftable_merged_table *mt,
 	return reftable_merged_table_seek_log_at(mt, it, name, max);
 }
 
+/* Asks the subtables, newest first, as entries of newer tables come first in
+ * the log. */
+static int merged_table_log_time_update_index(struct reftable_merged_table *mt,
+					      const char *name, uint64_t time,
+					      uint64_t *update_index)
+{
+	int i = 0;
+	for (i = mt->stack_len - 1; i >= 0; i--) {
+		struct reftable_table *tab = &mt->stack[i];
+		int err = tab->ops->log_time_update_index(tab->table_arg, name,
+							  time, update_index);
+		if (err <= 0)
+			return err;
+	}
+	return 1;
+}
+
+int reftable_merged_table_seek_log_time(struct reftable_merged_table *mt,
+					struct reftable_iterator *it,
+					const char *name, uint64_t time)
+{
+	uint64_t update_index = 0;
+	int err = merged_table_log_time_update_index(mt, name, time,
+						     &update_index);
+	if (err < 0)
+		return err;
+	if (err > 0) {
+		iterator_set_empty(it);
+		return 0;
+	}
+	return reftable_merged_table_seek_log_at(mt, it, name, update_index);
+}
+
+/* Looks up `names` in the subtables, newest first, so a ref found in a newer
+ * table is not looked for in older ones. */
+static int merged_table_read_refs(struct reftable_merged_table *mt,
+				  const char **names, size_t n,
+				  struct reftable_ref_record *refs, int *done)
+{
+	int i = 0;
+	for (i = mt->stack_len - 1; i >= 0; i--) {
+		struct reftable_table *tab = &mt->stack[i];
+		int err = tab->ops->read_refs(tab->table_arg, names, n, refs,
+					      done);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+int reftable_merged_table_read_refs(struct reftable_merged_table *mt,
+				    const char **names, size_t n,
+				    struct reftable_ref_record *refs)
+{
+	struct reftable_table tab = { NULL };
+	reftable_table_from_merged_table(&tab, mt);
+	return reftable_table_read_refs(&tab, names, n, refs);
+}
+
 uint32_t reftable_merged_table_hash_id(struct reftable_merged_table *mt)
 {
 	return mt->hash_id;
@@ -346,11 +533,44 @@ static uint64_t reftable_merged_table_max_update_index_void(void *tab)
 	return reftable_merged_table_max_update_index(tab);
 }
 
+static int reftable_merged_table_read_refs_void(
+	void *tab, const char **names, size_t n,
+	struct reftable_ref_record *refs, int *done)
+{
+	return merged_table_read_refs(tab, names, n, refs, done);
+}
+
+static int reftable_merged_table_log_time_update_index_void(
+	void *tab, const char *name, uint64_t time, uint64_t *update_index)
+{
+	return merged_table_log_time_update_index(tab, name, time,
+						  update_index);
+}
+
+static int reftable_merged_table_may_have_refs_void(void *tab,
+						    const char *key,
+						    size_t len, int prefix)
+{
+	struct reftable_merged_table *mt = tab;
+	int i = 0;
+	for (i = 0; i < mt->stack_len; i++) {
+		struct reftable_table *sub = &mt->stack[i];
+		if (!sub->ops->may_have_refs ||
+		    sub->ops->may_have_refs(sub->table_arg, key, len, prefix))
+			return 1;
+	}
+	return 0;
+}
+
 static struct reftable_table_vtable merged_table_vtable = {
 	.seek_record = reftable_merged_table_seek_void,
 	.hash_id = reftable_merged_table_hash_id_void,
 	.min_update_index = reftable_merged_table_min_update_index_void,
 	.max_update_index = reftable_merged_table_max_update_index_void,
+	.read_refs = reftable_merged_table_read_refs_void,
+	.log_time_update_index =
+		reftable_merged_table_log_time_update_index_void,
+	.may_have_refs = reftable_merged_table_may_have_refs_void,
 };
 
 void reftable_table_from_merged_table(struct reftable_table *tab,
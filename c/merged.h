@@ -9,6 +9,7 @@ https://developers.google.com/open-source/licenses/bsd
 #ifndef MERGED_H
 #define MERGED_H
 
+#include "losertree.h"
 #include "pq.h"
 
 struct reftable_merged_table {
@@ -17,6 +18,9 @@ struct reftable_merged_table {
 	uint32_t hash_id;
 	int suppress_deletions;
 
+	/* merge with a loser tree rather than the priority queue. */
+	int use_loser_tree;
+
 	uint64_t min;
 	uint64_t max;
 };
@@ -28,6 +32,25 @@ struct merged_iter {
 	uint8_t typ;
 	int suppress_deletions;
 	struct merged_iter_pqueue pq;
+
+	/* if set, `lt` is used instead of `pq`. lt.entries[i] holds the
+	 * current record of stack[i]. */
+	int use_loser_tree;
+	struct loser_tree lt;
+
+	/* key of the last record returned. */
+	struct strbuf key;
+
+	/* The subiterators read views, see reftable_new_view_record. The one
+	 * whose record was returned last, `pending`, is advanced only on the
+	 * next call, so the views stay valid while the caller uses them. With
+	 * the loser tree, only pending.index is used. */
+	int advance_pending;
+	struct pq_entry pending;
+
+	/* whether the caller reads key records; the subiterators then skip
+	 * values too. */
+	int key_only;
 };
 
 void merged_table_release(struct reftable_merged_table *mt);
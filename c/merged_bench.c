@@ -0,0 +1,148 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+/* Microbenchmark for iterating over merged tables, comparing the priority
+ * queue with the loser tree. */
+
+#include "merged.h"
+
+#include "system.h"
+#include "basics.h"
+#include "blocksource.h"
+#include "constants.h"
+#include "reader.h"
+#include "record.h"
+#include "test_framework.h"
+#include "reftable-generic.h"
+#include "reftable-malloc.h"
+#include "reftable-merged.h"
+#include "reftable-tests.h"
+#include "reftable-writer.h"
+
+static uint64_t alloc_count;
+
+static void *counting_malloc(size_t sz)
+{
+	alloc_count++;
+	return malloc(sz);
+}
+
+static void *counting_realloc(void *p, size_t sz)
+{
+	alloc_count++;
+	return realloc(p, sz);
+}
+
+/* Writes the refs with index j mod `k` into `buf`, so the tables of a stack
+ * interleave. */
+static void write_bench_table(struct strbuf *buf, int j, int k, int n)
+{
+	struct reftable_write_options opts = { 0 };
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, buf, &opts);
+	uint8_t hash[GIT_SHA1_RAWSZ] = { 0 };
+	int i;
+
+	reftable_writer_set_limits(w, j + 1, j + 1);
+	for (i = j; i < n; i += k) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = j + 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		snprintf(name, sizeof(name), "refs/heads/branch%07d", i);
+		set_test_hash(hash, i);
+		EXPECT(reftable_writer_add_ref(w, &ref) == 0);
+	}
+	EXPECT(reftable_writer_close(w) == 0);
+	reftable_writer_free(w);
+}
+
+static int iterate_all(struct reftable_merged_table *mt)
+{
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	int count = 0;
+	EXPECT(reftable_merged_table_seek_ref(mt, &it, "") == 0);
+	while (reftable_iterator_next_ref(&it, &ref) == 0)
+		count++;
+	reftable_ref_record_release(&ref);
+	reftable_iterator_destroy(&it);
+	return count;
+}
+
+static void bench_merge(const char *label, struct reftable_merged_table *mt,
+			int n, int rounds, int loser_tree)
+{
+	uint64_t start, elapsed, allocs;
+	uint64_t records = (uint64_t)n * rounds;
+	int j;
+
+	reftable_merged_table_set_loser_tree(mt, loser_tree);
+	EXPECT(iterate_all(mt) == n);
+
+	alloc_count = 0;
+	start = test_now_nsec();
+	for (j = 0; j < rounds; j++)
+		EXPECT(iterate_all(mt) == n);
+	elapsed = test_now_nsec() - start;
+	allocs = alloc_count;
+
+	printf("%-20s %10.0f records/s %8.2f allocs/record\n", label,
+	       records / (elapsed / 1e9), (double)allocs / records);
+}
+
+int merged_bench_main(int argc, const char *argv[])
+{
+	int stack_sizes[] = { 2, 8, 32, 128 };
+	int n = argc > 1 ? atoi(argv[1]) : 65536;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	int s;
+
+	for (s = 0; s < ARRAY_SIZE(stack_sizes); s++) {
+		int k = stack_sizes[s];
+		struct strbuf *bufs = reftable_calloc(sizeof(struct strbuf) * k);
+		struct reftable_block_source *sources =
+			reftable_calloc(sizeof(struct reftable_block_source) * k);
+		struct reftable_reader **readers =
+			reftable_calloc(sizeof(struct reftable_reader *) * k);
+		struct reftable_table *tabs =
+			reftable_calloc(sizeof(struct reftable_table) * k);
+		struct reftable_merged_table *mt = NULL;
+		int j;
+
+		for (j = 0; j < k; j++) {
+			strbuf_init(&bufs[j], 0);
+			write_bench_table(&bufs[j], j, k, n);
+			block_source_from_strbuf(&sources[j], &bufs[j]);
+			EXPECT(reftable_new_reader(&readers[j], &sources[j],
+						   "bench") == 0);
+			reftable_table_from_reader(&tabs[j], readers[j]);
+		}
+		EXPECT(reftable_new_merged_table(&mt, tabs, k,
+						 GIT_SHA1_FORMAT_ID) == 0);
+
+		printf("%d tables, %d refs\n", k, n);
+		reftable_set_alloc(&counting_malloc, &counting_realloc, &free);
+		bench_merge("priority queue", mt, n, rounds, 0);
+		bench_merge("loser tree", mt, n, rounds, 1);
+		reftable_set_alloc(&malloc, &realloc, &free);
+
+		reftable_merged_table_free(mt);
+		for (j = 0; j < k; j++) {
+			reftable_reader_free(readers[j]);
+			strbuf_release(&bufs[j]);
+		}
+		reftable_free(readers);
+		reftable_free(sources);
+		reftable_free(bufs);
+	}
+	return 0;
+}
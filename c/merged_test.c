@@ -22,7 +22,8 @@ https://developers.google.com/open-source/licenses/bsd
 #include "reftable-writer.h"
 
 static void write_test_table(struct strbuf *buf,
-			     struct reftable_ref_record refs[], int n)
+			     struct reftable_ref_record refs[], int n,
+			     int ref_metadata)
 {
 	int min = 0xffffffff;
 	int max = 0;
@@ -31,6 +32,7 @@ static void write_test_table(struct strbuf *buf,
 
 	struct reftable_write_options opts = {
 		.block_size = 256,
+		.ref_metadata = ref_metadata,
 	};
 	struct reftable_writer *w = NULL;
 	for (i = 0; i < n; i++) {
@@ -63,7 +65,7 @@ static struct reftable_merged_table *
 merged_table_from_records(struct reftable_ref_record **refs,
 			  struct reftable_block_source **source,
 			  struct reftable_reader ***readers, int *sizes,
-			  struct strbuf *buf, int n)
+			  struct strbuf *buf, int n, int ref_metadata)
 {
 	int i = 0;
 	struct reftable_merged_table *mt = NULL;
@@ -73,7 +75,7 @@ merged_table_from_records(struct reftable_ref_record **refs,
 	*readers = reftable_calloc(n * sizeof(struct reftable_reader *));
 	*source = reftable_calloc(n * sizeof(**source));
 	for (i = 0; i < n; i++) {
-		write_test_table(&buf[i], refs[i], sizes[i]);
+		write_test_table(&buf[i], refs[i], sizes[i], ref_metadata);
 		block_source_from_strbuf(&(*source)[i], &buf[i]);
 
 		err = reftable_new_reader(&(*readers)[i], &(*source)[i],
@@ -117,7 +119,8 @@ static void test_merged_between(void)
 	struct reftable_block_source *bs = NULL;
 	struct reftable_reader **readers = NULL;
 	struct reftable_merged_table *mt =
-		merged_table_from_records(refs, &bs, &readers, sizes, bufs, 2);
+		merged_table_from_records(refs, &bs, &readers, sizes, bufs, 2,
+					  0);
 	int i;
 	struct reftable_ref_record ref = { NULL };
 	struct reftable_iterator it = { NULL };
@@ -137,7 +140,7 @@ static void test_merged_between(void)
 	reftable_free(bs);
 }
 
-static void test_merged(void)
+static void check_merged(int loser_tree)
 {
 	uint8_t hash1[GIT_SHA1_RAWSZ] = { 1 };
 	uint8_t hash2[GIT_SHA1_RAWSZ] = { 2 };
@@ -194,15 +197,18 @@ static void test_merged(void)
 	struct reftable_block_source *bs = NULL;
 	struct reftable_reader **readers = NULL;
 	struct reftable_merged_table *mt =
-		merged_table_from_records(refs, &bs, &readers, sizes, bufs, 3);
+		merged_table_from_records(refs, &bs, &readers, sizes, bufs, 3,
+					  0);
 
 	struct reftable_iterator it = { NULL };
-	int err = reftable_merged_table_seek_ref(mt, &it, "a");
+	int err = 0;
 	struct reftable_ref_record *out = NULL;
 	size_t len = 0;
 	size_t cap = 0;
 	int i = 0;
 
+	reftable_merged_table_set_loser_tree(mt, loser_tree);
+	err = reftable_merged_table_seek_ref(mt, &it, "a");
 	EXPECT_ERR(err);
 	while (len < 100) { /* cap loops/recursion. */
 		struct reftable_ref_record ref = { NULL };
@@ -224,6 +230,44 @@ static void test_merged(void)
 		EXPECT(reftable_ref_record_equal(&want[i], &out[i],
 						 GIT_SHA1_RAWSZ));
 	}
+
+	/* the same, reading views. */
+	err = reftable_merged_table_seek_ref(mt, &it, "a");
+	EXPECT_ERR(err);
+	for (i = 0; i <= len; i++) {
+		struct reftable_ref_record_view view = { NULL };
+		struct reftable_ref_record ref = { NULL };
+		err = reftable_iterator_next_ref_view(&it, &view);
+		if (i == len) {
+			EXPECT(err > 0);
+			break;
+		}
+		EXPECT_ERR(err);
+		reftable_ref_record_from_view(&ref, &view, GIT_SHA1_RAWSZ);
+		EXPECT(reftable_ref_record_equal(&want[i], &ref,
+						 GIT_SHA1_RAWSZ));
+		reftable_ref_record_release(&ref);
+	}
+	reftable_iterator_destroy(&it);
+
+	/* and reading only keys. */
+	err = reftable_merged_table_seek_ref(mt, &it, "a");
+	EXPECT_ERR(err);
+	for (i = 0; i <= len; i++) {
+		struct reftable_ref_record_view key = { NULL };
+		err = reftable_iterator_next_ref_key(&it, &key);
+		if (i == len) {
+			EXPECT(err > 0);
+			break;
+		}
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(want[i].refname, key.refname));
+		EXPECT(want[i].update_index == key.update_index);
+		EXPECT(want[i].value_type == key.value_type);
+		EXPECT(key.value.val1 == NULL);
+	}
+	reftable_iterator_destroy(&it);
+
 	for (i = 0; i < len; i++) {
 		reftable_ref_record_release(&out[i]);
 	}
@@ -237,6 +281,127 @@ static void test_merged(void)
 	reftable_free(bs);
 }
 
+static void test_merged(void)
+{
+	check_merged(0);
+}
+
+static void test_merged_loser_tree(void)
+{
+	check_merged(1);
+}
+
+static void check_merged_seek_prefix(int ref_metadata)
+{
+	uint8_t hash1[GIT_SHA1_RAWSZ] = { 1 };
+	uint8_t hash2[GIT_SHA1_RAWSZ] = { 2 };
+	struct reftable_ref_record r1[] = {
+		{
+			.refname = "refs/changes/01/1/1",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+		{
+			.refname = "refs/heads/a",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+		{
+			.refname = "refs/heads/b",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+		{
+			.refname = "refs/tags/v1",
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash1,
+		},
+	};
+	struct reftable_ref_record r2[] = {
+		{
+			.refname = "refs/heads/a",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_DELETION,
+		},
+		{
+			.refname = "refs/heads/c",
+			.update_index = 2,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash2,
+		},
+	};
+	struct reftable_ref_record r3[] = { {
+		.refname = "refs/pull/1/head",
+		.update_index = 3,
+		.value_type = REFTABLE_REF_VAL1,
+		.value.val1 = hash2,
+	} };
+
+	struct reftable_ref_record want[] = {
+		r2[0],
+		r1[2],
+		r2[1],
+	};
+
+	struct reftable_ref_record *refs[] = { r1, r2, r3 };
+	int sizes[3] = { 4, 2, 1 };
+	struct strbuf bufs[3] = { STRBUF_INIT, STRBUF_INIT, STRBUF_INIT };
+	struct reftable_block_source *bs = NULL;
+	struct reftable_reader **readers = NULL;
+	struct reftable_merged_table *mt =
+		merged_table_from_records(refs, &bs, &readers, sizes, bufs, 3,
+					  ref_metadata);
+	struct reftable_iterator it = { NULL };
+	struct merged_iter *mi = NULL;
+	int err = reftable_merged_table_seek_ref_prefix(mt, &it, "refs/heads/");
+	int i = 0;
+
+	EXPECT_ERR(err);
+
+	/* the third table has nothing in refs/heads/, so it is not merged. If
+	 * its metadata gives its key range, it is not even sought. */
+	mi = it.iter_arg;
+	EXPECT(mi->stack_len == (ref_metadata ? 2 : 3));
+	EXPECT(mi->pq.len == 2);
+
+	for (i = 0; i < ARRAY_SIZE(want); i++) {
+		struct reftable_ref_record ref = { NULL };
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT(reftable_ref_record_equal(&want[i], &ref,
+						 GIT_SHA1_RAWSZ));
+		reftable_ref_record_release(&ref);
+	}
+	EXPECT(merged_iter_pqueue_is_empty(mi->pq));
+	{
+		struct reftable_ref_record ref = { NULL };
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT(err == 1);
+	}
+	reftable_iterator_destroy(&it);
+
+	for (i = 0; i < 3; i++) {
+		strbuf_release(&bufs[i]);
+	}
+	readers_destroy(readers, 3);
+	reftable_merged_table_free(mt);
+	reftable_free(bs);
+}
+
+static void test_merged_seek_prefix(void)
+{
+	check_merged_seek_prefix(0);
+}
+
+static void test_merged_seek_prefix_key_range(void)
+{
+	check_merged_seek_prefix(1);
+}
+
 static void test_default_write_opts(void)
 {
 	struct reftable_write_options opts = { 0 };
@@ -287,6 +452,9 @@ int merged_test_main(int argc, const char *argv[])
 {
 	RUN_TEST(test_merged_between);
 	RUN_TEST(test_merged);
+	RUN_TEST(test_merged_loser_tree);
+	RUN_TEST(test_merged_seek_prefix);
+	RUN_TEST(test_merged_seek_prefix_key_range);
 	RUN_TEST(test_default_write_opts);
 	return 0;
 }
@@ -10,6 +10,7 @@ https://developers.google.com/open-source/licenses/bsd
 
 #include "system.h"
 #include "block.h"
+#include "budget.h"
 #include "constants.h"
 #include "generic.h"
 #include "iter.h"
@@ -56,6 +57,12 @@ reader_offsets_for(struct reftable_reader *r, uint8_t typ)
 	abort();
 }
 
+static struct block_cache_account *
+reader_cache_account(struct reftable_reader *r)
+{
+	return r->account ? &r->account->blocks : NULL;
+}
+
 static int reader_get_block(struct reftable_reader *r,
 			    struct reftable_block *dest, uint64_t off,
 			    uint32_t sz)
@@ -160,6 +167,132 @@ done:
 	return err;
 }
 
+/* Reads the metadata block at the end of the table, if present. A block that
+ * doesn't check out is ignored, as the metadata only serves to skip work. */
+static int reader_read_metadata(struct reftable_reader *r)
+{
+	struct reftable_block trailer = { NULL };
+	struct reftable_block block = { NULL };
+	struct string_view first = { NULL };
+	struct string_view last = { NULL };
+	struct string_view bloom = { NULL };
+	struct string_view log_times = { NULL };
+	struct string_view in = { NULL };
+	uint32_t len = 0;
+	int err = 0;
+
+	if (r->size < header_size(r->version) + META_TRAILER_SIZE + 4)
+		return 0;
+
+	err = block_source_read_block(&r->source, &trailer,
+				      r->size - META_TRAILER_SIZE,
+				      META_TRAILER_SIZE);
+	if (err != META_TRAILER_SIZE) {
+		err = REFTABLE_IO_ERROR;
+		goto done;
+	}
+	err = 0;
+
+	len = get_be32(trailer.data);
+	if (memcmp(trailer.data + 8, META_MAGIC, 4) ||
+	    len < 4 + META_TRAILER_SIZE ||
+	    len > r->size - header_size(r->version))
+		goto done;
+
+	err = block_source_read_block(&r->source, &block, r->size - len, len);
+	if (err != len) {
+		err = REFTABLE_IO_ERROR;
+		goto done;
+	}
+	err = 0;
+
+	if (block.data[0] != BLOCK_TYPE_META || get_be24(block.data + 1) != len ||
+	    crc32(0, block.data, len - 8) != get_be32(block.data + len - 8))
+		goto done;
+
+	in.buf = block.data + 4;
+	in.len = len - 4 - META_TRAILER_SIZE;
+	while (in.len > 0) {
+		uint64_t tag = 0;
+		uint64_t field_len = 0;
+		struct string_view field = { NULL };
+		int n = get_var_int(&tag, &in);
+		if (n <= 0)
+			goto done;
+		string_view_consume(&in, n);
+
+		n = get_var_int(&field_len, &in);
+		if (n <= 0 || field_len > in.len - n)
+			goto done;
+		string_view_consume(&in, n);
+
+		field.buf = in.buf;
+		field.len = field_len;
+		string_view_consume(&in, field_len);
+
+		/* skip fields written by newer versions. */
+		switch (tag) {
+		case META_FIELD_FIRST_REF:
+			first = field;
+			break;
+		case META_FIELD_LAST_REF:
+			last = field;
+			break;
+		case META_FIELD_REF_BLOOM:
+			bloom = field;
+			break;
+		case META_FIELD_LOG_TIMES:
+			log_times = field;
+			break;
+		}
+	}
+
+	/* the block isn't part of any section. */
+	r->size -= len;
+
+	if (first.len > 0 && last.len > 0) {
+		r->has_ref_range = 1;
+		strbuf_add(&r->first_ref, first.buf, first.len);
+		strbuf_add(&r->last_ref, last.buf, last.len);
+	}
+	if (bloom.len > 1 && bloom.buf[0] > 0) {
+		r->ref_bloom.hashes = bloom.buf[0];
+		r->ref_bloom.len = bloom.len - 1;
+		r->ref_bloom.bits = reftable_malloc(r->ref_bloom.len);
+		memcpy(r->ref_bloom.bits, bloom.buf + 1, r->ref_bloom.len);
+	}
+	if (log_times.len > 0 &&
+	    log_time_index_decode(&r->log_times, log_times) < 0)
+		log_time_index_release(&r->log_times);
+
+done:
+	reftable_block_done(&block);
+	reftable_block_done(&trailer);
+	return err;
+}
+
+static void reader_release_metadata(struct reftable_reader *r)
+{
+	r->has_ref_range = 0;
+	strbuf_release(&r->first_ref);
+	strbuf_release(&r->last_ref);
+	bloom_filter_release(&r->ref_bloom);
+	log_time_index_release(&r->log_times);
+}
+
+/* Returns 0 if the metadata shows that the table has no ref `name`. */
+static int reader_may_have_ref(struct reftable_reader *r, const char *name)
+{
+	if (r->has_ref_range && (strcmp(name, r->first_ref.buf) < 0 ||
+				 strcmp(name, r->last_ref.buf) > 0))
+		return 0;
+	if (r->ref_bloom.len > 0 &&
+	    !bloom_filter_may_contain(&r->ref_bloom,
+				      bloom_hash(name, strlen(name))))
+		return 0;
+	return 1;
+}
+
 int init_reader(struct reftable_reader *r, struct reftable_block_source *source,
 		const char *name)
 {
@@ -171,6 +304,9 @@ int init_reader(struct reftable_reader *r, struct reftable_block_source *source,
 	/* Need +1 to read type of first block. */
 	uint32_t read_size = header_size(2) + 1; /* read v2 because it's larger.  */
 	memset(r, 0, sizeof(struct reftable_reader));
+	strbuf_init(&r->first_ref, 0);
+	strbuf_init(&r->last_ref, 0);
+	strbuf_init(&r->log_times.names, 0);
 
 	if (read_size > file_size) {
 		err = REFTABLE_FORMAT_ERROR;
@@ -206,6 +342,10 @@ int init_reader(struct reftable_reader *r, struct reftable_block_source *source,
 	}
 
 	err = parse_footer(r, footer.data, header.data);
+	if (err < 0)
+		goto done;
+
+	err = reader_read_metadata(r);
 done:
 	reftable_block_done(&footer);
 	reftable_block_done(&header);
@@ -239,8 +379,12 @@ static int table_iter_next_in_block(struct table_iter *ti,
 {
 	int res = block_iter_next(&ti->bi, rec);
 	if (res == 0 && reftable_record_type(rec) == BLOCK_TYPE_REF) {
-		((struct reftable_ref_record *)rec->data)->update_index +=
-			ti->r->min_update_index;
+		if (reftable_record_is_view(rec))
+			reftable_record_as_ref_view(rec)->update_index +=
+				ti->r->min_update_index;
+		else
+			reftable_record_as_ref(rec)->update_index +=
+				ti->r->min_update_index;
 	}
 
 	return res;
@@ -274,8 +418,64 @@ static int32_t extract_block_size(uint8_t *data, uint8_t *typ, uint64_t off,
 	return result;
 }
 
-int reader_init_block_reader(struct reftable_reader *r, struct block_reader *br,
-			     uint64_t next_off, uint8_t want_typ)
+static void pinned_return_block(void *b, struct reftable_block *dest)
+{
+	/* the block is owned by the reader's pinned set. */
+}
+
+static struct reftable_block_source_vtable pinned_vtable = {
+	.return_block = &pinned_return_block,
+};
+
+struct pinned_search_arg {
+	struct reader_pinned_block *pinned;
+	uint64_t off;
+};
+
+static int pinned_block_off_less(size_t k, void *args)
+{
+	struct pinned_search_arg *a = args;
+	return a->off <= a->pinned[k].off;
+}
+
+/* Returns 0 and sets `br` if the block at `off` is pinned, 1 if it is known
+ * not to be an index block, and -1 otherwise. */
+static int reader_get_pinned(struct reftable_reader *r, uint64_t off,
+			     struct block_reader *br, uint8_t want_typ)
+{
+	struct pinned_search_arg args = {
+		.pinned = r->pinned,
+		.off = off,
+	};
+	size_t i;
+	if (!r->pinned_len)
+		return -1;
+
+	if (want_typ == BLOCK_TYPE_INDEX &&
+	    (off == r->ref_offsets.pinned_index_end ||
+	     off == r->obj_offsets.pinned_index_end ||
+	     off == r->log_offsets.pinned_index_end))
+		return 1;
+
+	i = binsearch(r->pinned_len, &pinned_block_off_less, &args);
+	if (i == r->pinned_len || r->pinned[i].off != off)
+		return -1;
+
+	*br = r->pinned[i].br;
+	br->block.source.ops = &pinned_vtable;
+	br->block.source.arg = NULL;
+	if (want_typ != BLOCK_TYPE_ANY && block_reader_type(br) != want_typ)
+		return 1;
+	return 0;
+}
+
+/* Initializes `br` for the block at `next_off`. With `first_key`, a
+ * compressed block that records its stored size is not decompressed: `br` is
+ * left unset, and the block's first key and stored size are returned in
+ * `first_key` and `*stored` instead. */
+static int reader_block_at(struct reftable_reader *r, struct block_reader *br,
+			   uint64_t next_off, uint8_t want_typ,
+			   struct strbuf *first_key, uint32_t *stored)
 {
 	int32_t guess_block_size = r->block_size ? r->block_size :
 							 DEFAULT_BLOCK_SIZE;
@@ -284,10 +484,25 @@ int reader_init_block_reader(struct reftable_reader *r, struct block_reader *br,
 	int err = 0;
 	uint32_t header_off = next_off ? 0 : header_size(r->version);
 	int32_t block_size = 0;
+	uint32_t stored_size = 0;
 
 	if (next_off >= r->size)
 		return 1;
 
+	err = reader_get_pinned(r, next_off, br, want_typ);
+	if (err >= 0)
+		return err;
+
+	if (r->cache && !block_cache_lookup(r->cache, reader_cache_account(r),
+					    r->name, next_off, br)) {
+		if (want_typ != BLOCK_TYPE_ANY &&
+		    block_reader_type(br) != want_typ) {
+			reftable_block_done(&br->block);
+			return 1;
+		}
+		return 0;
+	}
+
 	err = reader_get_block(r, &block, next_off, guess_block_size);
 	if (err < 0)
 		return err;
@@ -310,8 +525,39 @@ int reader_init_block_reader(struct reftable_reader *r, struct block_reader *br,
 		}
 	}
 
-	return block_reader_init(br, &block, header_off, r->block_size,
-				 hash_size(r->hash_id));
+	/* compressed blocks may take more room than their uncompressed size.
+	 */
+	stored_size = block_stored_size(block.data, block.len, header_off);
+	if (stored_size > block.len) {
+		reftable_block_done(&block);
+		err = reader_get_block(r, &block, next_off, stored_size);
+		if (err < 0)
+			return err;
+	}
+
+	if (first_key && stored_size) {
+		err = block_peek_first_key(block.data, stored_size, header_off,
+					   first_key);
+		reftable_block_done(&block);
+		*stored = stored_size;
+		return err;
+	}
+
+	err = block_reader_init(br, &block, header_off, r->block_size,
+				hash_size(r->hash_id));
+	if (err < 0)
+		return err;
+
+	if (r->cache)
+		block_cache_insert(r->cache, reader_cache_account(r), r->name,
+				   next_off, br);
+	return 0;
+}
+
+int reader_init_block_reader(struct reftable_reader *r, struct block_reader *br,
+			     uint64_t next_off, uint8_t want_typ)
+{
+	return reader_block_at(r, br, next_off, want_typ, NULL, NULL);
 }
 
 static int table_iter_next_block(struct table_iter *dest,
@@ -398,23 +644,30 @@ static void iterator_from_table_iter(struct reftable_iterator *it,
 	it->ops = &table_iter_vtable;
 }
 
+/* positions `ti` at the start of `br`, the block at `off`, taking ownership
+ * of it. */
+static void table_iter_start_block(struct table_iter *ti,
+				   struct reftable_reader *r, uint64_t off,
+				   struct block_reader *br)
+{
+	struct block_reader *brp = reftable_malloc(sizeof(struct block_reader));
+	*brp = *br;
+	ti->r = r;
+	ti->typ = block_reader_type(brp);
+	ti->block_off = off;
+	block_reader_start(brp, &ti->bi);
+}
+
 static int reader_table_iter_at(struct reftable_reader *r,
 				struct table_iter *ti, uint64_t off,
 				uint8_t typ)
 {
 	struct block_reader br = { 0 };
-	struct block_reader *brp = NULL;
-
 	int err = reader_init_block_reader(r, &br, off, typ);
 	if (err != 0)
 		return err;
 
-	brp = reftable_malloc(sizeof(struct block_reader));
-	*brp = br;
-	ti->r = r;
-	ti->typ = block_reader_type(brp);
-	ti->block_off = off;
-	block_reader_start(brp, &ti->bi);
+	table_iter_start_block(ti, r, off, &br);
 	return 0;
 }
 
@@ -434,38 +687,62 @@ static int reader_start(struct reftable_reader *r, struct table_iter *ti,
 	return reader_table_iter_at(r, ti, off, typ);
 }
 
+/* Positions `ti` at `want` in the `typ` blocks starting at `off`. Blocks
+ * before the one holding `want` are only looked at for their first key, so
+ * compressed blocks recording their stored size are skipped without
+ * decompressing them. Returns 1 if there is no `typ` block at `off`. */
 static int reader_seek_linear(struct reftable_reader *r, struct table_iter *ti,
+			      uint64_t off, uint8_t typ,
 			      struct reftable_record *want)
 {
-	struct reftable_record rec =
-		reftable_new_record(reftable_record_type(want));
 	struct strbuf want_key = STRBUF_INIT;
 	struct strbuf got_key = STRBUF_INIT;
-	struct table_iter next = TABLE_ITER_INIT;
-	int err = -1;
+	uint64_t start = off;
+	uint64_t found = off;
+	int err = 0;
 
 	reftable_record_key(want, &want_key);
 
 	while (1) {
-		err = table_iter_next_block(&next, ti);
+		struct block_reader br = { 0 };
+		uint32_t stored = 0;
+
+		err = reader_block_at(r, &br, off, typ, &got_key, &stored);
 		if (err < 0)
 			goto done;
-
-		if (err > 0) {
+		if (err > 0)
 			break;
-		}
 
-		err = block_reader_first_key(next.bi.br, &got_key);
-		if (err < 0)
-			goto done;
+		if (br.block.data) {
+			stored = br.full_block_size;
+			err = block_reader_first_key(&br, &got_key);
+			if (err < 0) {
+				reftable_block_done(&br.block);
+				goto done;
+			}
+		}
 
-		if (strbuf_cmp(&got_key, &want_key) > 0) {
-			table_iter_block_done(&next);
+		if (off > start && strbuf_cmp(&got_key, &want_key) > 0) {
+			reftable_block_done(&br.block);
 			break;
 		}
 
+		/* keep blocks that had to be decoded to be looked at. */
 		table_iter_block_done(ti);
-		table_iter_copy_from(ti, &next);
+		if (br.block.data)
+			table_iter_start_block(ti, r, off, &br);
+		found = off;
+		off += stored;
+	}
+
+	if (off == start) {
+		err = 1;
+		goto done;
+	}
+	if (!ti->bi.br) {
+		err = reader_table_iter_at(r, ti, found, typ);
+		if (err != 0)
+			goto done;
 	}
 
 	err = block_iter_seek(&ti->bi, &want_key);
@@ -474,8 +751,6 @@ static int reader_seek_linear(struct reftable_reader *r, struct table_iter *ti,
 	err = 0;
 
 done:
-	block_iter_close(&next.bi);
-	reftable_record_destroy(&rec);
 	strbuf_release(&want_key);
 	strbuf_release(&got_key);
 	return err;
@@ -497,11 +772,13 @@ static int reader_seek_indexed(struct reftable_reader *r,
 	reftable_record_from_index(&want_index_rec, &want_index);
 	reftable_record_from_index(&index_result_rec, &index_result);
 
-	err = reader_start(r, &index_iter, reftable_record_type(rec), 1);
-	if (err < 0)
+	err = reader_seek_linear(
+		r, &index_iter,
+		reader_offsets_for(r, reftable_record_type(rec))->index_offset,
+		BLOCK_TYPE_INDEX, &want_index_rec);
+	if (err != 0)
 		goto done;
 
-	err = reader_seek_linear(r, &index_iter, &want_index_rec);
 	while (1) {
 		err = table_iter_next(&index_iter, &index_result_rec);
 		table_iter_block_done(&index_iter);
@@ -557,13 +834,14 @@ static int reader_seek_internal(struct reftable_reader *r,
 	if (idx > 0)
 		return reader_seek_indexed(r, it, rec);
 
-	err = reader_start(r, &ti, reftable_record_type(rec), 0);
-	if (err < 0)
-		return err;
-	err = reader_seek_linear(r, &ti, rec);
-	if (err < 0)
+	err = reader_seek_linear(r, &ti, offs->offset, reftable_record_type(rec),
+				 rec);
+	if (err < 0) {
+		table_iter_close(&ti);
 		return err;
-	else {
+	} else if (err > 0) {
+		iterator_set_empty(it);
+	} else {
 		struct table_iter *p =
 			reftable_malloc(sizeof(struct table_iter));
 		*p = ti;
@@ -577,13 +855,29 @@ int reader_seek(struct reftable_reader *r, struct reftable_iterator *it,
 		struct reftable_record *rec)
 {
 	uint8_t typ = reftable_record_type(rec);
+	struct reftable_reader_offsets *offs = NULL;
+	int err = reader_open(r);
+	if (err < 0)
+		return err;
 
-	struct reftable_reader_offsets *offs = reader_offsets_for(r, typ);
+	offs = reader_offsets_for(r, typ);
 	if (!offs->is_present) {
 		iterator_set_empty(it);
 		return 0;
 	}
 
+	if (typ == BLOCK_TYPE_REF && r->has_ref_range) {
+		struct strbuf key = STRBUF_INIT;
+		int past_end = 0;
+		reftable_record_key(rec, &key);
+		past_end = strbuf_cmp(&key, &r->last_ref) > 0;
+		strbuf_release(&key);
+		if (past_end) {
+			iterator_set_empty(it);
+			return 0;
+		}
+	}
+
 	return reader_seek_internal(r, it, rec);
 }
 
@@ -598,6 +892,27 @@ int reftable_reader_seek_ref(struct reftable_reader *r,
 	return reader_seek(r, it, &rec);
 }
 
+int reftable_reader_seek_ref_prefix(struct reftable_reader *r,
+				    struct reftable_iterator *it,
+				    const char *prefix)
+{
+	struct reftable_ref_record ref = {
+		.refname = (char *)prefix,
+	};
+	struct reftable_record rec = { NULL };
+	struct strbuf want = STRBUF_INIT;
+	int err = 0;
+
+	reftable_record_from_ref(&rec, &ref);
+	err = reader_seek(r, it, &rec);
+	if (err == 0) {
+		strbuf_addstr(&want, prefix);
+		iterator_limit_to_prefix(it, &want);
+		strbuf_release(&want);
+	}
+	return err;
+}
+
 int reftable_reader_seek_log_at(struct reftable_reader *r,
 				struct reftable_iterator *it, const char *name,
 				uint64_t update_index)
@@ -618,10 +933,315 @@ int reftable_reader_seek_log(struct reftable_reader *r,
 	return reftable_reader_seek_log_at(r, it, name, max);
 }
 
+/* Sets `*update_index` to that of the newest log entry of `name` at or
+ * before `time`. Returns 1 if there is none. */
+static int reader_log_time_update_index(struct reftable_reader *r,
+					const char *name, uint64_t time,
+					uint64_t *update_index)
+{
+	struct reftable_iterator it = { NULL };
+	struct reftable_log_record log = { NULL };
+	uint64_t start = ~((uint64_t)0);
+	int err = reader_open(r);
+	if (err < 0)
+		return err;
+
+	err = log_time_index_lookup(&r->log_times, name, time, &start);
+	if (err > 0)
+		return 1;
+
+	/* without the index, read the whole log of `name`. */
+	err = reftable_reader_seek_log_at(r, &it, name, start);
+	while (err == 0) {
+		err = reftable_iterator_next_log(&it, &log);
+		if (err != 0)
+			break;
+		if (strcmp(log.refname, name)) {
+			err = 1;
+			break;
+		}
+		if (!reftable_log_record_is_deletion(&log) &&
+		    log.value.update.time <= time) {
+			*update_index = log.update_index;
+			break;
+		}
+	}
+	reftable_log_record_release(&log);
+	reftable_iterator_destroy(&it);
+	return err;
+}
+
+int reftable_reader_seek_log_time(struct reftable_reader *r,
+				  struct reftable_iterator *it,
+				  const char *name, uint64_t time)
+{
+	uint64_t update_index = 0;
+	int err = reader_log_time_update_index(r, name, time, &update_index);
+	if (err < 0)
+		return err;
+	if (err > 0) {
+		iterator_set_empty(it);
+		return 0;
+	}
+	return reftable_reader_seek_log_at(r, it, name, update_index);
+}
+
+static int reader_pin_block(struct reftable_reader *r, uint64_t off)
+{
+	struct block_reader br = { 0 };
+	int err = reader_init_block_reader(r, &br, off, BLOCK_TYPE_INDEX);
+	if (err != 0)
+		return err;
+
+	if (r->pinned_len == r->pinned_cap) {
+		r->pinned_cap = 2 * r->pinned_cap + 1;
+		r->pinned = reftable_realloc(
+			r->pinned, sizeof(struct reader_pinned_block) *
+					   r->pinned_cap);
+	}
+	r->pinned[r->pinned_len].off = off;
+	r->pinned[r->pinned_len].br = br;
+	r->pinned_len++;
+	return 0;
+}
+
+static int reader_pin_section(struct reftable_reader *r,
+			      struct reftable_reader_offsets *offs, int levels)
+{
+	uint64_t off = offs->index_offset;
+	size_t level_start = r->pinned_len;
+	size_t level_end = 0;
+	size_t i = 0;
+	int err = 0;
+
+	/* The top-level index may span several blocks. */
+	while (1) {
+		err = reader_pin_block(r, off);
+		if (err < 0)
+			return err;
+		if (err > 0)
+			break;
+		off += r->pinned[r->pinned_len - 1].br.full_block_size;
+	}
+	offs->pinned_index_end = off;
+	level_end = r->pinned_len;
+
+	/* Each pass pins the blocks that the previous level points to. */
+	for (; levels > 1; levels--) {
+		for (i = level_start; i < level_end; i++) {
+			/* copy: pinning more blocks may move the array. */
+			struct block_reader br = r->pinned[i].br;
+			struct block_iter bi = { .last_key = STRBUF_INIT };
+			struct reftable_index_record idx = {
+				.last_key = STRBUF_INIT
+			};
+			struct reftable_record rec = { NULL };
+			reftable_record_from_index(&rec, &idx);
+
+			block_reader_start(&br, &bi);
+			while (1) {
+				err = block_iter_next(&bi, &rec);
+				if (err != 0)
+					break;
+
+				err = reader_pin_block(r, idx.offset);
+				if (err != 0)
+					break;
+			}
+			block_iter_close(&bi);
+			reftable_record_release(&rec);
+			if (err < 0)
+				return err;
+			/* yields 1 for data blocks: the previous level was
+			   the last index level. */
+			if (err > 0 && r->pinned_len == level_end)
+				return 0;
+		}
+		level_start = level_end;
+		level_end = r->pinned_len;
+	}
+
+	return 0;
+}
+
+struct index_level {
+	struct reftable_index_record *recs;
+	size_t len;
+	size_t cap;
+};
+
+static void index_level_release(struct index_level *l)
+{
+	size_t i = 0;
+	for (i = 0; i < l->len; i++)
+		strbuf_release(&l->recs[i].last_key);
+	FREE_AND_NULL(l->recs);
+	l->len = 0;
+	l->cap = 0;
+}
+
+/* Appends the records of the index block at `off` to `dest`, and those of the
+ * index blocks following it if `whole_level` is set. Returns 1 if `off` is
+ * not an index block. */
+static int reader_read_index_level(struct reftable_reader *r, uint64_t off,
+				   int whole_level, struct index_level *dest)
+{
+	struct table_iter ti = TABLE_ITER_INIT;
+	struct reftable_index_record idx = { .last_key = STRBUF_INIT };
+	struct reftable_record rec = { NULL };
+	int err = reader_table_iter_at(r, &ti, off, BLOCK_TYPE_INDEX);
+	if (err != 0)
+		return err;
+
+	reftable_record_from_index(&rec, &idx);
+	while (1) {
+		struct reftable_index_record copy = { .last_key = STRBUF_INIT };
+		err = whole_level ? table_iter_next(&ti, &rec) :
+					  table_iter_next_in_block(&ti, &rec);
+		if (err != 0)
+			break;
+
+		if (dest->len == dest->cap) {
+			dest->cap = 2 * dest->cap + 1;
+			dest->recs = reftable_realloc(
+				dest->recs, sizeof(*dest->recs) * dest->cap);
+		}
+		copy.offset = idx.offset;
+		strbuf_addbuf(&copy.last_key, &idx.last_key);
+		dest->recs[dest->len++] = copy;
+	}
+	table_iter_close(&ti);
+	reftable_record_release(&rec);
+	return err < 0 ? err : 0;
+}
+
+int reader_index_keys(struct reftable_reader *r, uint8_t typ, size_t want,
+		      struct strbuf **keys, size_t *len)
+{
+	struct reftable_reader_offsets *offs = NULL;
+	struct index_level level = { NULL };
+	struct index_level next = { NULL };
+	size_t i = 0;
+	int err = reader_open(r);
+
+	*keys = NULL;
+	*len = 0;
+	if (err < 0)
+		return err;
+	offs = reader_offsets_for(r, typ);
+	if (!offs->is_present || !offs->index_offset)
+		return 0;
+
+	err = reader_read_index_level(r, offs->index_offset, 1, &level);
+	while (err == 0 && level.len < want) {
+		for (i = 0; i < level.len; i++) {
+			err = reader_read_index_level(r, level.recs[i].offset,
+						      0, &next);
+			if (err != 0)
+				break;
+		}
+		if (err != 0)
+			break;
+		index_level_release(&level);
+		level = next;
+		memset(&next, 0, sizeof(next));
+	}
+	index_level_release(&next);
+	if (err < 0)
+		goto done;
+
+	/* hand out the keys of the deepest level read. */
+	err = 0;
+	*keys = reftable_calloc(sizeof(struct strbuf) * (level.len + 1));
+	for (i = 0; i < level.len; i++) {
+		(*keys)[i] = level.recs[i].last_key;
+		strbuf_init(&level.recs[i].last_key, 0);
+	}
+	*len = level.len;
+
+done:
+	index_level_release(&level);
+	return err;
+}
+
+static int pinned_block_cmp(const void *a, const void *b)
+{
+	const struct reader_pinned_block *pa = a;
+	const struct reader_pinned_block *pb = b;
+	if (pa->off < pb->off)
+		return -1;
+	return pa->off > pb->off;
+}
+
+static void reader_unpin_blocks(struct reftable_reader *r)
+{
+	size_t i;
+	for (i = 0; i < r->pinned_len; i++)
+		reftable_block_done(&r->pinned[i].br.block);
+	FREE_AND_NULL(r->pinned);
+	r->pinned_len = 0;
+	r->pinned_cap = 0;
+	r->ref_offsets.pinned_index_end = 0;
+	r->obj_offsets.pinned_index_end = 0;
+	r->log_offsets.pinned_index_end = 0;
+}
+
+static int reader_pin_index_blocks(struct reftable_reader *r, int levels)
+{
+	struct reftable_reader_offsets *sections[] = {
+		&r->ref_offsets,
+		&r->obj_offsets,
+		&r->log_offsets,
+	};
+	int err = 0;
+	int i;
+
+	reader_unpin_blocks(r);
+	if (levels <= 0)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		if (!sections[i]->is_present || !sections[i]->index_offset)
+			continue;
+		err = reader_pin_section(r, sections[i], levels);
+		if (err < 0) {
+			reader_unpin_blocks(r);
+			return err;
+		}
+	}
+
+	QSORT(r->pinned, r->pinned_len, pinned_block_cmp);
+	return 0;
+}
+
+int reftable_reader_pin_index_blocks(struct reftable_reader *r, int levels)
+{
+	int err = reader_open(r);
+	if (err < 0)
+		return err;
+	err = reader_pin_index_blocks(r, levels);
+	reader_charge(r);
+	return err;
+}
+
 void reader_close(struct reftable_reader *r)
 {
+	if (r->account)
+		memory_account_charge(r->account, -(int64_t)r->charged_pinned,
+				      -(int64_t)r->charged_metadata);
+	r->charged_pinned = 0;
+	r->charged_metadata = 0;
+	reader_unpin_blocks(r);
+	reader_release_metadata(r);
 	block_source_close(&r->source);
 	FREE_AND_NULL(r->name);
+	if (r->lazy) {
+#ifndef NO_PTHREADS
+		pthread_mutex_destroy(&r->lazy->mutex);
+#endif
+		reftable_free(r->lazy->path);
+		FREE_AND_NULL(r->lazy);
+	}
 }
 
 int reftable_new_reader(struct reftable_reader **p,
@@ -645,6 +1265,171 @@ void reftable_reader_free(struct reftable_reader *r)
 	reftable_free(r);
 }
 
+struct reftable_reader *reader_new_lazy(const char *path, const char *name,
+					uint64_t min_update_index,
+					uint64_t max_update_index,
+					uint32_t hash_id, int pin_index_levels)
+{
+	struct reftable_reader *r =
+		reftable_calloc(sizeof(struct reftable_reader));
+	struct reader_lazy *lazy = reftable_calloc(sizeof(struct reader_lazy));
+
+	lazy->path = xstrdup(path);
+	lazy->pin_index_levels = pin_index_levels;
+#ifndef NO_PTHREADS
+	pthread_mutex_init(&lazy->mutex, NULL);
+#endif
+
+	strbuf_init(&r->first_ref, 0);
+	strbuf_init(&r->last_ref, 0);
+	strbuf_init(&r->log_times.names, 0);
+	r->name = xstrdup(name);
+	r->min_update_index = min_update_index;
+	r->max_update_index = max_update_index;
+	r->hash_id = hash_id;
+	r->lazy = lazy;
+	return r;
+}
+
+/* Moves what init_reader() read from the file from `src` to `r`. The name,
+ * update index range and hash ID are known, and may be read by other threads
+ * meanwhile. So are the fields the stack maintains. */
+static void reader_take_loaded(struct reftable_reader *r,
+			       struct reftable_reader *src)
+{
+	r->source = src->source;
+	r->size = src->size;
+	r->block_size = src->block_size;
+	r->object_id_len = src->object_id_len;
+	r->version = src->version;
+	r->ref_offsets = src->ref_offsets;
+	r->obj_offsets = src->obj_offsets;
+	r->log_offsets = src->log_offsets;
+	r->has_ref_range = src->has_ref_range;
+	r->first_ref = src->first_ref;
+	r->last_ref = src->last_ref;
+	r->ref_bloom = src->ref_bloom;
+	r->log_times = src->log_times;
+	reftable_free(src->name);
+}
+
+static int reader_open_locked(struct reftable_reader *r)
+{
+	struct reader_lazy *lazy = r->lazy;
+	struct reftable_block_source src = { NULL };
+	struct reftable_reader loaded = { NULL };
+	int err = reftable_block_source_from_mmap_file(&src, lazy->path);
+	if (err < 0)
+		return err;
+
+	err = init_reader(&loaded, &src, r->name);
+	if (err == 0 && (loaded.hash_id != r->hash_id ||
+			 loaded.min_update_index != r->min_update_index ||
+			 loaded.max_update_index != r->max_update_index))
+		err = REFTABLE_FORMAT_ERROR;
+	if (err < 0) {
+		block_source_close(&src);
+		reader_release_metadata(&loaded);
+		reftable_free(loaded.name);
+		return err;
+	}
+
+	reader_take_loaded(r, &loaded);
+	lazy->open = 1;
+	if (lazy->pin_index_levels > 0)
+		err = reader_pin_index_blocks(r, lazy->pin_index_levels);
+	reader_charge(r);
+	return err;
+}
+
+int reader_open(struct reftable_reader *r)
+{
+	int err = 0;
+
+	if (!r->lazy)
+		return 0;
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&r->lazy->mutex);
+#endif
+	if (!r->lazy->open)
+		err = reader_open_locked(r);
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&r->lazy->mutex);
+#endif
+	return err;
+}
+
+static uint64_t reader_pinned_bytes(struct reftable_reader *r)
+{
+	uint64_t bytes = sizeof(struct reader_pinned_block) * r->pinned_cap;
+	size_t i = 0;
+	for (i = 0; i < r->pinned_len; i++)
+		bytes += r->pinned[i].br.block.len;
+	return bytes;
+}
+
+static uint64_t reader_metadata_bytes(struct reftable_reader *r)
+{
+	uint64_t bytes = sizeof(struct reftable_reader) + strlen(r->name) + 1;
+	bytes += r->first_ref.cap + r->last_ref.cap + r->ref_bloom.len;
+	bytes += r->log_times.names.cap +
+		 sizeof(struct log_time_ref) * r->log_times.refs_cap +
+		 sizeof(struct log_time_run) * r->log_times.runs_cap;
+	if (r->lazy)
+		bytes += sizeof(struct reader_lazy) + strlen(r->lazy->path) + 1;
+	return bytes;
+}
+
+void reader_charge(struct reftable_reader *r)
+{
+	uint64_t pinned = 0;
+	uint64_t metadata = 0;
+
+	if (!r->account)
+		return;
+	pinned = reader_pinned_bytes(r);
+	metadata = reader_metadata_bytes(r);
+	if (memory_account_charge(r->account,
+				  (int64_t)(pinned - r->charged_pinned),
+				  (int64_t)(metadata - r->charged_metadata)) &&
+	    r->pinned_len > 0) {
+		/* the index is read through the block cache instead. */
+		reader_unpin_blocks(r);
+		memory_account_charge(r->account, -(int64_t)pinned, 0);
+		pinned = 0;
+	}
+	r->charged_pinned = pinned;
+	r->charged_metadata = metadata;
+}
+
+int reader_size(struct reftable_reader *r, uint64_t *size)
+{
+	struct stat st;
+	int open = 1;
+
+	if (r->lazy) {
+#ifndef NO_PTHREADS
+		pthread_mutex_lock(&r->lazy->mutex);
+#endif
+		open = r->lazy->open;
+#ifndef NO_PTHREADS
+		pthread_mutex_unlock(&r->lazy->mutex);
+#endif
+	}
+	/* r->size leaves out the footer and metadata, which can't be known
+	 * for lazy readers without opening them. */
+	if (open) {
+		*size = block_source_size(&r->source);
+		return 0;
+	}
+
+	if (stat(r->lazy->path, &st) < 0)
+		return errno == ENOENT ? REFTABLE_NOT_EXIST_ERROR :
+					 REFTABLE_IO_ERROR;
+	*size = st.st_size;
+	return 0;
+}
+
 static int reftable_reader_refs_for_indexed(struct reftable_reader *r,
 					    struct reftable_iterator *it,
 					    uint8_t *oid)
@@ -726,6 +1511,9 @@ static int reftable_reader_refs_for_unindexed(struct reftable_reader *r,
 int reftable_reader_refs_for(struct reftable_reader *r,
 			     struct reftable_iterator *it, uint8_t *oid)
 {
+	int err = reader_open(r);
+	if (err < 0)
+		return err;
 	if (r->obj_offsets.is_present)
 		return reftable_reader_refs_for_indexed(r, it, oid);
 	return reftable_reader_refs_for_unindexed(r, it, oid);
@@ -741,6 +1529,91 @@ uint64_t reftable_reader_min_update_index(struct reftable_reader *r)
 	return r->min_update_index;
 }
 
+/* Looks up `names` in a single forward sweep. Consecutive names are sought in
+ * the block of the previous one, and the table is only sought again when a
+ * name falls beyond the end of that block. */
+static int reader_read_refs(struct reftable_reader *r, const char **names,
+			    size_t n, struct reftable_ref_record *refs,
+			    int *done)
+{
+	struct reftable_iterator it = { NULL };
+	struct table_iter *ti = NULL;
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_record rec = { NULL };
+	struct strbuf want = STRBUF_INIT;
+	int err = 0;
+	size_t i = 0;
+
+	/* don't open lazy readers that have nothing left to find. */
+	while (i < n && done[i])
+		i++;
+	if (i == n)
+		return 0;
+	err = reader_open(r);
+	if (err < 0)
+		return err;
+	if (!r->ref_offsets.is_present)
+		return 0;
+
+	reftable_record_from_ref(&rec, &ref);
+	for (i = 0; i < n; i++) {
+		if (done[i])
+			continue;
+		if (r->has_ref_range && strcmp(names[i], r->last_ref.buf) > 0)
+			break;
+		if (!reader_may_have_ref(r, names[i]))
+			continue;
+
+		strbuf_reset(&want);
+		strbuf_addstr(&want, names[i]);
+		err = 1;
+		if (ti && ti->bi.br) {
+			err = block_iter_seek(&ti->bi, &want);
+			if (err < 0)
+				goto done;
+			if (ti->bi.next_off >= ti->bi.br->block_len)
+				err = 1;
+		}
+
+		if (err > 0) {
+			struct reftable_ref_record want_ref = {
+				.refname = (char *)names[i],
+			};
+			struct reftable_record want_rec = { NULL };
+			reftable_record_from_ref(&want_rec, &want_ref);
+
+			reftable_iterator_destroy(&it);
+			err = reader_seek(r, &it, &want_rec);
+			if (err < 0)
+				goto done;
+			ti = it.iter_arg;
+		}
+
+		if (err == 0)
+			err = table_iter_next(ti, &rec);
+		if (err < 0)
+			goto done;
+		if (err > 0) {
+			/* the remaining names sort after the last ref. */
+			err = 0;
+			break;
+		}
+
+		if (!strcmp(ref.refname, names[i])) {
+			struct reftable_ref_record empty = { NULL };
+			refs[i] = ref;
+			ref = empty;
+			done[i] = 1;
+		}
+	}
+
+done:
+	reftable_iterator_destroy(&it);
+	reftable_ref_record_release(&ref);
+	strbuf_release(&want);
+	return err;
+}
+
 /* generic table interface. */
 
 static int reftable_reader_seek_void(void *tab, struct reftable_iterator *it,
@@ -764,11 +1637,63 @@ static uint64_t reftable_reader_max_update_index_void(void *tab)
 	return reftable_reader_max_update_index(tab);
 }
 
+static int reftable_reader_read_refs_void(void *tab, const char **names,
+					  size_t n,
+					  struct reftable_ref_record *refs,
+					  int *done)
+{
+	return reader_read_refs(tab, names, n, refs, done);
+}
+
+static int reftable_reader_log_time_update_index_void(void *tab,
+						      const char *name,
+						      uint64_t time,
+						      uint64_t *update_index)
+{
+	return reader_log_time_update_index(tab, name, time, update_index);
+}
+
+/* compares `a` to the `len` bytes at `key`, like strbuf_cmp. */
+static int strbuf_cmp_key(const struct strbuf *a, const char *key, size_t len)
+{
+	size_t min = a->len < len ? a->len : len;
+	int res = min > 0 ? memcmp(a->buf, key, min) : 0;
+	if (res != 0)
+		return res;
+	if (a->len < len)
+		return -1;
+	return a->len > len;
+}
+
+static int strbuf_starts_with_key(const struct strbuf *a, const char *key,
+				  size_t len)
+{
+	return a->len >= len && (len == 0 || !memcmp(a->buf, key, len));
+}
+
+/* Errors opening the table are left for the seek to report. */
+static int reftable_reader_may_have_refs_void(void *tab, const char *key,
+					      size_t len, int prefix)
+{
+	struct reftable_reader *r = tab;
+	if (reader_open(r) < 0 || !r->has_ref_range)
+		return 1;
+	if (strbuf_cmp_key(&r->last_ref, key, len) < 0)
+		return 0;
+	if (prefix && strbuf_cmp_key(&r->first_ref, key, len) > 0 &&
+	    !strbuf_starts_with_key(&r->first_ref, key, len))
+		return 0;
+	return 1;
+}
+
 static struct reftable_table_vtable reader_vtable = {
 	.seek_record = reftable_reader_seek_void,
 	.hash_id = reftable_reader_hash_id_void,
 	.min_update_index = reftable_reader_min_update_index_void,
 	.max_update_index = reftable_reader_max_update_index_void,
+	.read_refs = reftable_reader_read_refs_void,
+	.log_time_update_index = reftable_reader_log_time_update_index_void,
+	.may_have_refs = reftable_reader_may_have_refs_void,
 };
 
 void reftable_table_from_reader(struct reftable_table *tab,
@@ -10,6 +10,9 @@ https://developers.google.com/open-source/licenses/bsd
 #define READER_H
 
 #include "block.h"
+#include "blockcache.h"
+#include "bloom.h"
+#include "logtime.h"
 #include "record.h"
 #include "reftable-iterator.h"
 #include "reftable-reader.h"
@@ -26,6 +29,17 @@ struct reftable_reader_offsets {
 	int is_present;
 	uint64_t offset;
 	uint64_t index_offset;
+
+	/* offset of the first block after the top-level index, if the index
+	 * is pinned. Used to avoid reading that block when seeking through
+	 * the top-level index. */
+	uint64_t pinned_index_end;
+};
+
+/* a block kept in memory for the life of the reader. */
+struct reader_pinned_block {
+	uint64_t off;
+	struct block_reader br;
 };
 
 /* The state for reading a reftable file. */
@@ -34,7 +48,7 @@ struct reftable_reader {
 	char *name;
 	struct reftable_block_source source;
 
-	/* Size of the file, excluding the footer. */
+	/* Size of the file, excluding the footer and metadata block. */
 	uint64_t size;
 
 	/* 'sha1' for SHA1, 's256' for SHA-256 */
@@ -50,10 +64,78 @@ struct reftable_reader {
 	struct reftable_reader_offsets ref_offsets;
 	struct reftable_reader_offsets obj_offsets;
 	struct reftable_reader_offsets log_offsets;
+
+	/* If set, blocks are looked up in and added to this cache. Not owned
+	 * by the reader. */
+	struct block_cache *cache;
+
+	/* From the optional metadata block. If has_ref_range is set, all
+	 * refs sort between first_ref and last_ref inclusive. */
+	int has_ref_range;
+	struct strbuf first_ref;
+	struct strbuf last_ref;
+	/* filter over all ref names; zero if absent. */
+	struct bloom_filter ref_bloom;
+	/* where the logs of refs reach back to given times; empty if
+	 * absent. */
+	struct log_time_index log_times;
+
+	/* index blocks kept in memory, sorted by offset. */
+	struct reader_pinned_block *pinned;
+	size_t pinned_len;
+	size_t pinned_cap;
+
+	/* For stacks: the snapshots using the reader, and whether its table
+	 * was dropped from the stack, to be deleted once the reader is
+	 * closed. Guarded by the stack, see stack.h. */
+	int refcount;
+	int dropped;
+
+	/* set if the table is opened on first use, see reader_new_lazy. */
+	struct reader_lazy *lazy;
+
+	/* the account charged for the memory of the reader, and the amounts
+	 * charged; see reader_charge. */
+	struct memory_account *account;
+	uint64_t charged_pinned;
+	uint64_t charged_metadata;
 };
 
 int init_reader(struct reftable_reader *r, struct reftable_block_source *source,
 		const char *name);
+
+/* The table of a reader that is opened on first use. */
+struct reader_lazy {
+	char *path;
+	int pin_index_levels;
+	int open;
+#ifndef NO_PTHREADS
+	/* guards opening, which may happen on any thread using the reader. */
+	pthread_mutex_t mutex;
+#endif
+};
+
+/* Returns a reader for table `name` in the file at `path`, which is only
+ * opened, and its top `pin_index_levels` index levels pinned, when the reader
+ * is first used. Until then, the update index range and hash ID are the ones
+ * given, and reader_open() tells whether the file can be read. */
+struct reftable_reader *reader_new_lazy(const char *path, const char *name,
+					uint64_t min_update_index,
+					uint64_t max_update_index,
+					uint32_t hash_id, int pin_index_levels);
+
+/* Opens the table of a lazy reader, if that didn't happen yet. Returns 0 for
+ * other readers. */
+int reader_open(struct reftable_reader *r);
+
+/* Sets `*size` to the size of the table file, footer included, for open and
+ * lazy readers alike. Lazy readers are not opened. */
+int reader_size(struct reftable_reader *r, uint64_t *size);
+
+/* Charges the memory of the reader to its account, if it has one. Pinned
+ * index blocks are dropped if they don't fit in the memory budget. Readers
+ * uncharge themselves when closed. */
+void reader_charge(struct reftable_reader *r);
 int reader_seek(struct reftable_reader *r, struct reftable_iterator *it,
 		struct reftable_record *rec);
 void reader_close(struct reftable_reader *r);
@@ -63,4 +145,12 @@ const char *reader_name(struct reftable_reader *r);
 int reader_init_block_reader(struct reftable_reader *r, struct block_reader *br,
 			     uint64_t next_off, uint8_t want_typ);
 
+/* Sets `keys` to the last keys of `len` consecutive key ranges covering
+ * section `typ`, in order. The keys are read from the section index, which
+ * is descended until there are at least `want` ranges, or the data blocks are
+ * reached. Sets `len` to 0 if the section has no index. Release each key, and
+ * free the array. */
+int reader_index_keys(struct reftable_reader *r, uint8_t typ, size_t want,
+		      struct strbuf **keys, size_t *len);
+
 #endif
@@ -0,0 +1,176 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+/* Microbenchmark for looking up refs in tables with raw and compressed ref
+ * blocks, reporting the latency and the number of bytes read per lookup. */
+
+#include "reader.h"
+
+#include "system.h"
+#include "basics.h"
+#include "blockcache.h"
+#include "blocksource.h"
+#include "constants.h"
+#include "test_framework.h"
+#include "reftable-tests.h"
+#include "reftable-writer.h"
+
+/* wraps a block source, counting the bytes read from it. */
+struct counting_source {
+	struct reftable_block_source inner;
+	uint64_t bytes;
+};
+
+static uint64_t counting_size(void *arg)
+{
+	struct counting_source *c = arg;
+	return block_source_size(&c->inner);
+}
+
+static int counting_read_block(void *arg, struct reftable_block *dest,
+			       uint64_t off, uint32_t size)
+{
+	struct counting_source *c = arg;
+	int n = block_source_read_block(&c->inner, dest, off, size);
+	if (n > 0)
+		c->bytes += n;
+	return n;
+}
+
+static void counting_return_block(void *arg, struct reftable_block *block)
+{
+	struct counting_source *c = arg;
+	c->inner.ops->return_block(c->inner.arg, block);
+}
+
+static void counting_close(void *arg)
+{
+	struct counting_source *c = arg;
+	block_source_close(&c->inner);
+}
+
+static struct reftable_block_source_vtable counting_vtable = {
+	.size = &counting_size,
+	.read_block = &counting_read_block,
+	.return_block = &counting_return_block,
+	.close = &counting_close,
+};
+
+static void bench_name(char *dest, size_t sz, int i)
+{
+	snprintf(dest, sz, "refs/changes/%02d/%06d/%d", (i / 7) % 100, i,
+		 i % 7 + 1);
+}
+
+static int bench_name_compare(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void write_bench_table(struct strbuf *buf, char **names, int n,
+			      enum reftable_compression compression,
+			      int compress_blocks)
+{
+	struct reftable_write_options opts = {
+		.log_compression = compression,
+		.compress_blocks = compress_blocks,
+	};
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, buf, &opts);
+	uint8_t hash[GIT_SHA1_RAWSZ] = { 0 };
+	int i;
+
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < n; i++) {
+		struct reftable_ref_record ref = {
+			.refname = names[i],
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		set_test_hash(hash, i);
+		EXPECT(reftable_writer_add_ref(w, &ref) == 0);
+	}
+	EXPECT(reftable_writer_close(w) == 0);
+	reftable_writer_free(w);
+}
+
+static void bench_lookups(const char *label, char **names, int n,
+			  int lookups, enum reftable_compression compression,
+			  int compress_blocks)
+{
+	struct strbuf buf = STRBUF_INIT;
+	struct counting_source counter = { { NULL } };
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader *r = NULL;
+	struct reftable_ref_record ref = { NULL };
+	uint64_t start, elapsed;
+	int cached = 0;
+	int i;
+
+	if (!reftable_compression_supported(compression))
+		return;
+
+	write_bench_table(&buf, names, n, compression, compress_blocks);
+	block_source_from_strbuf(&counter.inner, &buf);
+	source.ops = &counting_vtable;
+	source.arg = &counter;
+	EXPECT(reftable_new_reader(&r, &source, "bench") == 0);
+
+	for (cached = 0; cached <= 1; cached++) {
+		if (cached)
+			r->cache = block_cache_new(64 << 20);
+
+		counter.bytes = 0;
+		start = test_now_nsec();
+		for (i = 0; i < lookups; i++) {
+			struct reftable_iterator it = { NULL };
+			const char *want = names[(i * 7919) % n];
+			EXPECT(reftable_reader_seek_ref(r, &it, want) == 0);
+			EXPECT(reftable_iterator_next_ref(&it, &ref) == 0);
+			EXPECT(!strcmp(want, ref.refname));
+			reftable_iterator_destroy(&it);
+		}
+		elapsed = test_now_nsec() - start;
+
+		printf("%-6s %-8s %10" PRIuMAX " bytes %8.0f ns/lookup "
+		       "%8.0f bytes read/lookup\n",
+		       label, cached ? "cached" : "uncached",
+		       (uintmax_t)buf.len, (double)elapsed / lookups,
+		       (double)counter.bytes / lookups);
+	}
+
+	reftable_ref_record_release(&ref);
+	block_cache_free(r->cache);
+	reftable_reader_free(r);
+	strbuf_release(&buf);
+}
+
+int reader_bench_main(int argc, const char *argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 200000;
+	int lookups = argc > 2 ? atoi(argv[2]) : 100000;
+	char **names = reftable_calloc(sizeof(char *) * (n + 1));
+	int i;
+
+	for (i = 0; i < n; i++) {
+		char name[100];
+		bench_name(name, sizeof(name), i);
+		names[i] = xstrdup(name);
+	}
+	QSORT(names, n, bench_name_compare);
+
+	printf("%d refs, %d lookups\n", n, lookups);
+	bench_lookups("raw", names, n, lookups, REFTABLE_COMPRESSION_ZLIB, 0);
+	bench_lookups("zlib", names, n, lookups, REFTABLE_COMPRESSION_ZLIB, 1);
+	bench_lookups("zstd", names, n, lookups, REFTABLE_COMPRESSION_ZSTD, 1);
+	bench_lookups("lz4", names, n, lookups, REFTABLE_COMPRESSION_LZ4, 1);
+
+	free_names(names);
+	return 0;
+}
@@ -15,6 +15,7 @@ https://developers.google.com/open-source/licenses/bsd
 #include "reader.h"
 #include "record.h"
 #include "test_framework.h"
+#include "reftable-generic.h"
 #include "reftable-tests.h"
 #include "reftable-writer.h"
 
@@ -44,48 +45,60 @@ static void test_buffer(void)
 	strbuf_release(&buf);
 }
 
-static void write_table(char ***names, struct strbuf *buf, int N,
-			int block_size, uint32_t hash_id)
+/* Fills `name` and `hash` for the `i`th ref of a test table. */
+typedef void (*test_ref_fn)(char *name, size_t len, uint8_t *hash, int i);
+
+static void branch_ref(char *name, size_t len, uint8_t *hash, int i)
+{
+	snprintf(name, len, "refs/heads/branch%02d", i);
+	set_test_hash(hash, i);
+}
+
+/*
+ * Writes N refs named by `fn` (branch_ref if NULL), and a log entry for
+ * each if `with_logs` is set, and returns the writer's stats. `names` may
+ * be NULL.
+ */
+static struct reftable_stats
+write_table(char ***names, struct strbuf *buf, int N, int with_logs,
+	    struct reftable_write_options *opts, test_ref_fn fn)
 {
-	struct reftable_write_options opts = {
-		.block_size = block_size,
-		.hash_id = hash_id,
-	};
 	struct reftable_writer *w =
-		reftable_new_writer(&strbuf_add_void, buf, &opts);
+		reftable_new_writer(&strbuf_add_void, buf, opts);
 	struct reftable_ref_record ref = { NULL };
 	int i = 0, n;
 	struct reftable_log_record log = { NULL };
 	const struct reftable_stats *stats = NULL;
-	*names = reftable_calloc(sizeof(char *) * (N + 1));
+	struct reftable_stats result;
+	if (!fn)
+		fn = &branch_ref;
+	if (names)
+		*names = reftable_calloc(sizeof(char *) * (N + 1));
 	reftable_writer_set_limits(w, update_index, update_index);
 	for (i = 0; i < N; i++) {
 		uint8_t hash[GIT_SHA256_RAWSZ] = { 0 };
 		char name[100];
 		int n;
 
-		set_test_hash(hash, i);
-
-		snprintf(name, sizeof(name), "refs/heads/branch%02d", i);
+		fn(name, sizeof(name), hash, i);
 
 		ref.refname = name;
 		ref.update_index = update_index;
 		ref.value_type = REFTABLE_REF_VAL1;
 		ref.value.val1 = hash;
-		(*names)[i] = xstrdup(name);
+		if (names)
+			(*names)[i] = xstrdup(name);
 
 		n = reftable_writer_add_ref(w, &ref);
 		EXPECT(n == 0);
 	}
 
-	for (i = 0; i < N; i++) {
+	for (i = 0; with_logs && i < N; i++) {
 		uint8_t hash[GIT_SHA256_RAWSZ] = { 0 };
 		char name[100];
 		int n;
 
-		set_test_hash(hash, i);
-
-		snprintf(name, sizeof(name), "refs/heads/branch%02d", i);
+		fn(name, sizeof(name), hash, i);
 
 		log.refname = name;
 		log.update_index = update_index;
@@ -101,17 +114,21 @@ static void write_table(char ***names, struct strbuf *buf, int N,
 	EXPECT(n == 0);
 
 	stats = writer_stats(w);
-	for (i = 0; i < stats->ref_stats.blocks; i++) {
-		int off = i * opts.block_size;
+	/* compressed blocks are stored unpadded. */
+	for (i = 0; !opts->compress_blocks && i < stats->ref_stats.blocks;
+	     i++) {
+		int off = i * opts->block_size;
 		if (off == 0) {
 			off = header_size(
-				(hash_id == GIT_SHA256_FORMAT_ID) ? 2 : 1);
+				opts->hash_id == GIT_SHA256_FORMAT_ID ? 2 : 1);
 		}
 		EXPECT(buf->buf[off] == 'r');
 	}
 
-	EXPECT(stats->log_stats.blocks > 0);
+	EXPECT(!with_logs || stats->log_stats.blocks > 0);
+	result = *stats;
 	reftable_writer_free(w);
+	return result;
 }
 
 static void test_log_buffer_size(void)
@@ -256,6 +273,9 @@ static void test_log_write_read(void)
 
 static void test_table_read_write_sequential(void)
 {
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
 	char **names;
 	struct strbuf buf = STRBUF_INIT;
 	int N = 50;
@@ -265,7 +285,7 @@ static void test_table_read_write_sequential(void)
 	int err = 0;
 	int j = 0;
 
-	write_table(&names, &buf, N, 256, GIT_SHA1_FORMAT_ID);
+	write_table(&names, &buf, N, 1, &opts, NULL);
 
 	block_source_from_strbuf(&source, &buf);
 
@@ -296,12 +316,163 @@ static void test_table_read_write_sequential(void)
 	reader_close(&rd);
 }
 
+static void test_table_read_mmap(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
+	char **names;
+	struct strbuf buf = STRBUF_INIT;
+	char fn[] = "/tmp/readwrite_test.XXXXXX";
+	int N = 50;
+	int fd = mkstemp(fn);
+	struct reftable_iterator it = { NULL };
+	struct reftable_block_source source = { NULL };
+	struct reftable_block_source empty = { NULL };
+	struct reftable_block_source missing = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_log_record log = { NULL };
+	int err = 0;
+	int j = 0;
+
+	EXPECT(fd > 0);
+	write_table(&names, &buf, N, 1, &opts, NULL);
+	EXPECT(write(fd, buf.buf, buf.len) == buf.len);
+	close(fd);
+
+	err = reftable_block_source_from_mmap_file(&source, fn);
+	EXPECT_ERR(err);
+	EXPECT(block_source_size(&source) == buf.len);
+
+	err = reftable_new_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+
+	err = reftable_reader_seek_ref(rd, &it, "");
+	EXPECT_ERR(err);
+
+	while (1) {
+		struct reftable_ref_record ref = { NULL };
+		int r = reftable_iterator_next_ref(&it, &ref);
+		EXPECT(r >= 0);
+		if (r > 0) {
+			break;
+		}
+		EXPECT(0 == strcmp(names[j], ref.refname));
+		j++;
+		reftable_ref_record_release(&ref);
+	}
+	EXPECT(j == N);
+	reftable_iterator_destroy(&it);
+
+	err = reftable_reader_seek_log(rd, &it, names[N - 1]);
+	EXPECT_ERR(err);
+	err = reftable_iterator_next_log(&it, &log);
+	EXPECT_ERR(err);
+	EXPECT(0 == strcmp(names[N - 1], log.refname));
+	reftable_log_record_release(&log);
+	reftable_iterator_destroy(&it);
+	reftable_reader_free(rd);
+
+	/* empty files cannot be mapped, and fall back to pread. */
+	EXPECT(0 == truncate(fn, 0));
+	err = reftable_block_source_from_mmap_file(&empty, fn);
+	EXPECT_ERR(err);
+	EXPECT(block_source_size(&empty) == 0);
+	block_source_close(&empty);
+
+	unlink(fn);
+	err = reftable_block_source_from_mmap_file(&missing, fn);
+	EXPECT(err == REFTABLE_NOT_EXIST_ERROR);
+
+	strbuf_release(&buf);
+	free_names(names);
+}
+
+static void test_table_read_open_files_limit(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
+	char **names;
+	struct strbuf buf = STRBUF_INIT;
+	char fns[3][30];
+	struct reftable_reader *rds[3] = { NULL };
+	struct reftable_open_files_stats before = { 0 };
+	struct reftable_open_files_stats after = { 0 };
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	int N = 50;
+	int err = 0;
+	int i = 0;
+	int j = 0;
+
+	write_table(&names, &buf, N, 1, &opts, NULL);
+	reftable_get_open_files_stats(&before);
+	reftable_set_open_files_limit(2);
+	for (i = 0; i < 3; i++) {
+		struct reftable_block_source source = { NULL };
+		int fd = -1;
+
+		strcpy(fns[i], "/tmp/readwrite_test.XXXXXX");
+		fd = mkstemp(fns[i]);
+		EXPECT(fd > 0);
+		EXPECT(write(fd, buf.buf, buf.len) == buf.len);
+		close(fd);
+
+		EXPECT_ERR(reftable_block_source_from_file(&source, fns[i]));
+		EXPECT_ERR(reftable_new_reader(&rds[i], &source, "file.ref"));
+	}
+	reftable_get_open_files_stats(&after);
+	EXPECT(after.open <= 2);
+	EXPECT(after.limit == 2);
+	EXPECT(after.opens == before.opens + 3);
+	EXPECT(after.evictions > before.evictions);
+
+	/* the evicted files are reopened transparently. */
+	for (i = 0; i < 3; i++) {
+		EXPECT_ERR(reftable_reader_seek_ref(rds[i], &it, ""));
+		for (j = 0; j < N; j++) {
+			EXPECT_ERR(reftable_iterator_next_ref(&it, &ref));
+			EXPECT(0 == strcmp(names[j], ref.refname));
+		}
+		reftable_iterator_destroy(&it);
+	}
+	reftable_get_open_files_stats(&after);
+	EXPECT(after.open <= 2);
+	EXPECT(after.reopens > before.reopens);
+
+	/* the least recently read file was closed, and is gone now. */
+	unlink(fns[0]);
+	err = reftable_reader_seek_ref(rds[0], &it, names[0]);
+	if (err == 0)
+		err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT(err == REFTABLE_NOT_EXIST_ERROR);
+	reftable_iterator_destroy(&it);
+	reftable_get_open_files_stats(&after);
+	EXPECT(after.reopen_failures == before.reopen_failures + 1);
+
+	reftable_set_open_files_limit(0);
+	for (i = 0; i < 3; i++) {
+		reftable_reader_free(rds[i]);
+		unlink(fns[i]);
+	}
+	reftable_get_open_files_stats(&after);
+	EXPECT(after.open == before.open);
+
+	reftable_ref_record_release(&ref);
+	strbuf_release(&buf);
+	free_names(names);
+}
+
 static void test_table_write_small_table(void)
 {
+	struct reftable_write_options opts = {
+		.block_size = 4096,
+	};
 	char **names;
 	struct strbuf buf = STRBUF_INIT;
 	int N = 1;
-	write_table(&names, &buf, N, 4096, GIT_SHA1_FORMAT_ID);
+	write_table(&names, &buf, N, 1, &opts, NULL);
 	EXPECT(buf.len < 200);
 	strbuf_release(&buf);
 	free_names(names);
@@ -309,6 +480,9 @@ static void test_table_write_small_table(void)
 
 static void test_table_read_api(void)
 {
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
 	char **names;
 	struct strbuf buf = STRBUF_INIT;
 	int N = 50;
@@ -319,7 +493,7 @@ static void test_table_read_api(void)
 	struct reftable_log_record log = { NULL };
 	struct reftable_iterator it = { NULL };
 
-	write_table(&names, &buf, N, 256, GIT_SHA1_FORMAT_ID);
+	write_table(&names, &buf, N, 1, &opts, NULL);
 
 	block_source_from_strbuf(&source, &buf);
 
@@ -344,6 +518,10 @@ static void test_table_read_api(void)
 
 static void test_table_read_write_seek(int index, int hash_id)
 {
+	struct reftable_write_options opts = {
+		.block_size = 256,
+		.hash_id = hash_id,
+	};
 	char **names;
 	struct strbuf buf = STRBUF_INIT;
 	int N = 50;
@@ -356,7 +534,7 @@ static void test_table_read_write_seek(int index, int hash_id)
 	struct strbuf pastLast = STRBUF_INIT;
 	struct reftable_ref_record ref = { NULL };
 
-	write_table(&names, &buf, N, 256, hash_id);
+	write_table(&names, &buf, N, 1, &opts, NULL);
 
 	block_source_from_strbuf(&source, &buf);
 
@@ -421,115 +599,1167 @@ static void test_table_read_write_seek_index(void)
 	test_table_read_write_seek(1, GIT_SHA1_FORMAT_ID);
 }
 
-static void test_table_refs_for(int indexed)
+struct counting_block_source {
+	struct reftable_block_source inner;
+	int reads;
+};
+
+static uint64_t counting_size(void *arg)
 {
-	int N = 50;
-	char **want_names = reftable_calloc(sizeof(char *) * (N + 1));
-	int want_names_len = 0;
-	uint8_t want_hash[GIT_SHA1_RAWSZ];
+	struct counting_block_source *c = arg;
+	return block_source_size(&c->inner);
+}
 
-	struct reftable_write_options opts = {
-		.block_size = 256,
-	};
-	struct reftable_ref_record ref = { NULL };
-	int i = 0;
-	int n;
-	int err;
-	struct reftable_reader rd;
-	struct reftable_block_source source = { NULL };
+static int counting_read_block(void *arg, struct reftable_block *dest,
+			       uint64_t off, uint32_t size)
+{
+	struct counting_block_source *c = arg;
+	c->reads++;
+	return block_source_read_block(&c->inner, dest, off, size);
+}
 
-	struct strbuf buf = STRBUF_INIT;
-	struct reftable_writer *w =
-		reftable_new_writer(&strbuf_add_void, &buf, &opts);
+static void counting_return_block(void *arg, struct reftable_block *dest)
+{
+	struct counting_block_source *c = arg;
+	c->inner.ops->return_block(c->inner.arg, dest);
+}
 
-	struct reftable_iterator it = { NULL };
-	int j;
+static void counting_close(void *arg)
+{
+	struct counting_block_source *c = arg;
+	block_source_close(&c->inner);
+}
 
-	set_test_hash(want_hash, 4);
+static struct reftable_block_source_vtable counting_vtable = {
+	.size = &counting_size,
+	.read_block = &counting_read_block,
+	.return_block = &counting_return_block,
+	.close = &counting_close,
+};
 
-	for (i = 0; i < N; i++) {
-		uint8_t hash[GIT_SHA1_RAWSZ];
-		char fill[51] = { 0 };
-		char name[100];
-		uint8_t hash1[GIT_SHA1_RAWSZ];
-		uint8_t hash2[GIT_SHA1_RAWSZ];
-		struct reftable_ref_record ref = { NULL };
+static void test_table_seek_ref_prefix(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 128,
+	};
+	char **names;
+	struct strbuf buf = STRBUF_INIT;
+	int N = 99;
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	int err;
+	int i;
 
-		memset(hash, i, sizeof(hash));
-		memset(fill, 'x', 50);
-		/* Put the variable part in the start */
-		snprintf(name, sizeof(name), "br%02d%s", i, fill);
-		name[40] = 0;
-		ref.refname = name;
+	write_table(&names, &buf, N, 1, &opts, NULL);
+	block_source_from_strbuf(&source, &buf);
 
-		set_test_hash(hash1, i / 4);
-		set_test_hash(hash2, 3 + i / 4);
-		ref.value_type = REFTABLE_REF_VAL2;
-		ref.value.val2.value = hash1;
-		ref.value.val2.target_value = hash2;
+	err = reftable_new_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
 
-		/* 80 bytes / entry, so 3 entries per block. Yields 17
-		 */
-		/* blocks. */
-		n = reftable_writer_add_ref(w, &ref);
-		EXPECT(n == 0);
+	err = reftable_reader_seek_ref_prefix(rd, &it, "refs/heads/branch5");
+	EXPECT_ERR(err);
+	for (i = 50; i < 60; i++) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(names[i], ref.refname));
+	}
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT(err == 1);
+	err = reftable_iterator_next_ref(&it, &ref);
+	EXPECT(err == 1);
+	reftable_iterator_destroy(&it);
 
-		if (!memcmp(hash1, want_hash, GIT_SHA1_RAWSZ) ||
-		    !memcmp(hash2, want_hash, GIT_SHA1_RAWSZ)) {
-			want_names[want_names_len++] = xstrdup(name);
-		}
+	/* nothing sorts after the prefix. */
+	err = reftable_reader_seek_ref_prefix(rd, &it, "zzz");
+	EXPECT(err >= 0);
+	if (err == 0) {
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT(err == 1);
 	}
+	reftable_iterator_destroy(&it);
 
-	n = reftable_writer_close(w);
-	EXPECT(n == 0);
+	reftable_ref_record_release(&ref);
+	reftable_reader_free(rd);
+	strbuf_release(&buf);
+	free_names(names);
+}
 
-	reftable_writer_free(w);
-	w = NULL;
+static void test_table_read_refs(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 128,
+	};
+	char **names;
+	struct strbuf buf = STRBUF_INIT;
+	int N = 99;
+	struct counting_block_source counter = { { NULL } };
+	struct reftable_block_source source = {
+		.ops = &counting_vtable,
+		.arg = &counter,
+	};
+	struct reftable_reader *rd = NULL;
+	struct reftable_table tab = { NULL };
+	struct reftable_ref_record *refs = NULL;
+	const char **want = NULL;
+	int err;
+	int i;
 
-	block_source_from_strbuf(&source, &buf);
+	write_table(&names, &buf, N, 1, &opts, NULL);
+	block_source_from_strbuf(&counter.inner, &buf);
 
-	err = init_reader(&rd, &source, "file.ref");
+	err = reftable_new_reader(&rd, &source, "file.ref");
 	EXPECT_ERR(err);
-	if (!indexed) {
-		rd.obj_offsets.is_present = 0;
-	}
+	err = reftable_reader_pin_index_blocks(rd, 2);
+	EXPECT_ERR(err);
+	reftable_table_from_reader(&tab, rd);
+
+	want = reftable_calloc(sizeof(*want) * (N + 1));
+	refs = reftable_calloc(sizeof(*refs) * (N + 1));
+	for (i = 0; i < N; i++)
+		want[N - 1 - i] = names[i];
+	want[N] = "zzz";
+
+	/* looking up each ref separately reads one block per ref, but
+	 * consecutive refs share a block here. */
+	counter.reads = 0;
+	err = reftable_table_read_refs(&tab, want, N + 1, refs);
+	EXPECT(err == 1);
+	EXPECT(counter.reads < N / 2);
+	for (i = 0; i < N; i++)
+		EXPECT(0 == strcmp(want[i], refs[i].refname));
+	EXPECT(!refs[N].refname);
+
+	for (i = 0; i <= N; i++)
+		reftable_ref_record_release(&refs[i]);
+	reftable_free(refs);
+	reftable_free(want);
+	reftable_reader_free(rd);
+	strbuf_release(&buf);
+	free_names(names);
+}
 
-	err = reftable_reader_seek_ref(&rd, &it, "");
+static void check_metadata_table(struct reftable_reader *rd, int N,
+				 int with_logs)
+{
+	struct reftable_iterator it = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_log_record log = { NULL };
+	int i = 0;
+	int err = reftable_reader_seek_ref(rd, &it, "");
 	EXPECT_ERR(err);
+	for (i = 0; reftable_iterator_next_ref(&it, &ref) == 0; i++)
+		;
+	EXPECT(i == N);
 	reftable_iterator_destroy(&it);
 
-	err = reftable_reader_refs_for(&rd, &it, want_hash);
+	err = reftable_reader_seek_log(rd, &it, "");
 	EXPECT_ERR(err);
+	for (i = 0; reftable_iterator_next_log(&it, &log) == 0; i++)
+		;
+	EXPECT(i == (with_logs ? N : 0));
+	reftable_iterator_destroy(&it);
 
-	j = 0;
-	while (1) {
-		int err = reftable_iterator_next_ref(&it, &ref);
-		EXPECT(err >= 0);
-		if (err > 0) {
-			break;
-		}
-
-		EXPECT(j < want_names_len);
-		EXPECT(0 == strcmp(ref.refname, want_names[j]));
-		j++;
-		reftable_ref_record_release(&ref);
+	for (i = 0; i < N; i += 7) {
+		char name[100];
+		struct reftable_table tab = { NULL };
+		snprintf(name, sizeof(name), "refs/heads/branch%02d", i);
+		reftable_table_from_reader(&tab, rd);
+		err = reftable_table_read_ref(&tab, name, &ref);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(name, ref.refname));
 	}
-	EXPECT(j == want_names_len);
 
-	strbuf_release(&buf);
-	free_names(want_names);
-	reftable_iterator_destroy(&it);
-	reader_close(&rd);
+	reftable_ref_record_release(&ref);
+	reftable_log_record_release(&log);
 }
 
-static void test_table_refs_for_no_index(void)
+static void test_table_ref_metadata(void)
 {
-	test_table_refs_for(0);
+	int N = 50;
+	int with_logs = 0;
+
+	for (with_logs = 0; with_logs <= 1; with_logs++) {
+		struct strbuf buf = STRBUF_INIT;
+		struct counting_block_source counter = { { NULL } };
+		struct reftable_block_source source = {
+			.ops = &counting_vtable,
+			.arg = &counter,
+		};
+		struct reftable_block_source plain = { NULL };
+		struct reftable_write_options opts = {
+			.block_size = 256,
+			.ref_metadata = 1,
+		};
+		struct reftable_reader *rd = NULL;
+		struct reftable_reader *old = NULL;
+		struct reftable_table tab = { NULL };
+		struct reftable_ref_record ref = { NULL };
+		int i = 0;
+		int err = 0;
+
+		write_table(NULL, &buf, N, with_logs, &opts, NULL);
+		block_source_from_strbuf(&counter.inner, &buf);
+		err = reftable_new_reader(&rd, &source, "file.ref");
+		EXPECT_ERR(err);
+
+		EXPECT(rd->has_ref_range);
+		EXPECT(0 == strcmp(rd->first_ref.buf, "refs/heads/branch00"));
+		EXPECT(0 == strcmp(rd->last_ref.buf, "refs/heads/branch49"));
+		EXPECT(rd->ref_bloom.len > 0);
+		check_metadata_table(rd, N, with_logs);
+
+		/* lookups outside the range don't read the table. */
+		reftable_table_from_reader(&tab, rd);
+		counter.reads = 0;
+		EXPECT(1 == reftable_table_read_ref(&tab, "refs/heads/a", &ref));
+		EXPECT(1 == reftable_table_read_ref(&tab, "refs/tags/v1", &ref));
+		EXPECT(counter.reads == 0);
+
+		/* nor do most lookups inside it. */
+		for (i = 0; i < 200; i++) {
+			char name[100];
+			snprintf(name, sizeof(name), "refs/heads/branch%02dx", i % N);
+			err = reftable_table_read_ref(&tab, name, &ref);
+			EXPECT(err == 1);
+		}
+		EXPECT(counter.reads < 40);
+
+		/* readers that don't know the metadata block take it for the
+		 * tail of the last section, and must still see the same
+		 * table. */
+		block_source_from_strbuf(&plain, &buf);
+		err = reftable_new_reader(&old, &plain, "file.ref");
+		EXPECT_ERR(err);
+		old->size = buf.len - footer_size(old->version);
+		EXPECT(old->size > rd->size);
+		old->has_ref_range = 0;
+		bloom_filter_release(&old->ref_bloom);
+		log_time_index_release(&old->log_times);
+		check_metadata_table(old, N, with_logs);
+
+		reftable_reader_free(old);
+		reftable_reader_free(rd);
+		strbuf_release(&buf);
+	}
 }
 
-static void test_table_refs_for_obj_index(void)
+static void test_table_pin_index_blocks(void)
 {
-	test_table_refs_for(1);
+	struct reftable_write_options opts = {
+		.block_size = 128,
+	};
+	char **names;
+	struct strbuf buf = STRBUF_INIT;
+	int N = 99;
+	struct counting_block_source counter = { { NULL } };
+	struct reftable_block_source source = {
+		.ops = &counting_vtable,
+		.arg = &counter,
+	};
+	struct reftable_reader *rd = NULL;
+	struct reftable_iterator it = { NULL };
+	int err;
+	int i;
+
+	write_table(&names, &buf, N, 1, &opts, NULL);
+	block_source_from_strbuf(&counter.inner, &buf);
+
+	err = reftable_new_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+
+	err = reftable_reader_pin_index_blocks(rd, 2);
+	EXPECT_ERR(err);
+	EXPECT(rd->pinned_len > 1);
+
+	for (i = 0; i < N; i += 3) {
+		struct reftable_ref_record ref = { NULL };
+		struct reftable_log_record log = { NULL };
+
+		/* the ref section has a 2-level index. */
+		counter.reads = 0;
+		err = reftable_reader_seek_ref(rd, &it, names[i]);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(names[i], ref.refname));
+		EXPECT(counter.reads == 1);
+		reftable_ref_record_release(&ref);
+		reftable_iterator_destroy(&it);
+
+		err = reftable_reader_seek_log(rd, &it, names[i]);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_log(&it, &log);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(names[i], log.refname));
+		reftable_log_record_release(&log);
+		reftable_iterator_destroy(&it);
+	}
+
+	/* unpinning gives the same results. */
+	err = reftable_reader_pin_index_blocks(rd, 0);
+	EXPECT_ERR(err);
+	EXPECT(rd->pinned_len == 0);
+	for (i = 0; i < N; i += 3) {
+		struct reftable_ref_record ref = { NULL };
+		err = reftable_reader_seek_ref(rd, &it, names[i]);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(names[i], ref.refname));
+		reftable_ref_record_release(&ref);
+		reftable_iterator_destroy(&it);
+	}
+
+	reftable_reader_free(rd);
+	strbuf_release(&buf);
+	free_names(names);
+}
+
+static void test_table_seek_log_after_ref_index(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
+	struct strbuf buf = STRBUF_INIT;
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, &buf, &opts);
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader rd = { NULL };
+	struct reftable_log_record log = { NULL };
+	int N = 120;
+	int i = 0;
+
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < N; i++) {
+		uint8_t hash[GIT_SHA1_RAWSZ];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		set_test_hash(hash, i);
+		snprintf(name, sizeof(name), "refs/heads/%06d", i);
+		EXPECT_ERR(reftable_writer_add_ref(w, &ref));
+	}
+	/* messages that don't compress well, so the logs have an index. */
+	for (i = 0; i < N; i++) {
+		uint8_t hash[GIT_SHA1_RAWSZ];
+		char name[100];
+		char message[100];
+		struct reftable_log_record log = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_LOG_UPDATE,
+			.value.update = {
+				.new_hash = hash,
+				.old_hash = hash,
+				.message = message,
+			},
+		};
+		set_test_hash(hash, i);
+		snprintf(name, sizeof(name), "refs/heads/%06d", i);
+		snprintf(message, sizeof(message), "%x %x %x", i * 7919,
+			 i * 104729, i * 31337);
+		EXPECT_ERR(reftable_writer_add_log(w, &log));
+	}
+	EXPECT_ERR(reftable_writer_close(w));
+	EXPECT(writer_stats(w)->ref_stats.index_blocks > 0);
+	EXPECT(writer_stats(w)->log_stats.index_blocks > 0);
+	reftable_writer_free(w);
+
+	/* the index of the ref section must not leak into the log index. */
+	block_source_from_strbuf(&source, &buf);
+	EXPECT_ERR(init_reader(&rd, &source, "file.ref"));
+	for (i = 0; i < N; i++) {
+		struct reftable_iterator it = { NULL };
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/%06d", i);
+		EXPECT_ERR(reftable_reader_seek_log(&rd, &it, name));
+		EXPECT_ERR(reftable_iterator_next_log(&it, &log));
+		EXPECT(0 == strcmp(log.refname, name));
+		reftable_iterator_destroy(&it);
+	}
+
+	reftable_log_record_release(&log);
+	reader_close(&rd);
+	strbuf_release(&buf);
+}
+
+static void test_table_refs_for(int indexed, int value_type)
+{
+	int N = 50;
+	char **want_names = reftable_calloc(sizeof(char *) * (N + 1));
+	int want_names_len = 0;
+	uint8_t want_hash[GIT_SHA1_RAWSZ];
+
+	struct reftable_write_options opts = {
+		.block_size = 256,
+	};
+	struct reftable_ref_record ref = { NULL };
+	int i = 0;
+	int n;
+	int err;
+	struct reftable_reader rd;
+	struct reftable_block_source source = { NULL };
+
+	struct strbuf buf = STRBUF_INIT;
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, &buf, &opts);
+
+	struct reftable_iterator it = { NULL };
+	int j;
+
+	set_test_hash(want_hash, 4);
+
+	for (i = 0; i < N; i++) {
+		uint8_t hash[GIT_SHA1_RAWSZ];
+		char fill[51] = { 0 };
+		char name[100];
+		uint8_t hash1[GIT_SHA1_RAWSZ];
+		uint8_t hash2[GIT_SHA1_RAWSZ];
+		struct reftable_ref_record ref = { NULL };
+
+		memset(hash, i, sizeof(hash));
+		memset(fill, 'x', 50);
+		/* Put the variable part in the start */
+		snprintf(name, sizeof(name), "br%02d%s", i, fill);
+		name[40] = 0;
+		ref.refname = name;
+
+		set_test_hash(hash1, i / 4);
+		set_test_hash(hash2, 3 + i / 4);
+		ref.value_type = value_type;
+		if (value_type == REFTABLE_REF_VAL1) {
+			ref.value.val1 = hash1;
+			/* only hash1 is in the table. */
+			memcpy(hash2, hash1, sizeof(hash2));
+		} else {
+			ref.value.val2.value = hash1;
+			ref.value.val2.target_value = hash2;
+		}
+
+		/* 80 bytes / entry, so 3 entries per block. Yields 17
+		 */
+		/* blocks. */
+		n = reftable_writer_add_ref(w, &ref);
+		EXPECT(n == 0);
+
+		if (!memcmp(hash1, want_hash, GIT_SHA1_RAWSZ) ||
+		    !memcmp(hash2, want_hash, GIT_SHA1_RAWSZ)) {
+			want_names[want_names_len++] = xstrdup(name);
+		}
+	}
+
+	n = reftable_writer_close(w);
+	EXPECT(n == 0);
+
+	reftable_writer_free(w);
+	w = NULL;
+
+	block_source_from_strbuf(&source, &buf);
+
+	err = init_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+	if (!indexed) {
+		rd.obj_offsets.is_present = 0;
+	}
+
+	err = reftable_reader_seek_ref(&rd, &it, "");
+	EXPECT_ERR(err);
+	reftable_iterator_destroy(&it);
+
+	err = reftable_reader_refs_for(&rd, &it, want_hash);
+	EXPECT_ERR(err);
+
+	j = 0;
+	while (1) {
+		int err = reftable_iterator_next_ref(&it, &ref);
+		EXPECT(err >= 0);
+		if (err > 0) {
+			break;
+		}
+
+		EXPECT(j < want_names_len);
+		EXPECT(0 == strcmp(ref.refname, want_names[j]));
+		j++;
+		reftable_ref_record_release(&ref);
+	}
+	EXPECT(j == want_names_len);
+
+	reftable_ref_record_release(&ref);
+	strbuf_release(&buf);
+	free_names(want_names);
+	reftable_iterator_destroy(&it);
+	reader_close(&rd);
+}
+
+static void test_table_refs_for_no_index(void)
+{
+	test_table_refs_for(0, REFTABLE_REF_VAL2);
+}
+
+static void test_table_refs_for_obj_index(void)
+{
+	test_table_refs_for(1, REFTABLE_REF_VAL2);
+}
+
+static void test_table_refs_for_obj_index_val1(void)
+{
+	test_table_refs_for(1, REFTABLE_REF_VAL1);
+}
+
+/* Fills `hash` with bytes derived from `i`, spread out like object ids. */
+static void set_spread_hash(uint8_t *hash, uint32_t i)
+{
+	uint32_t x = i * 2654435761u + 1;
+	int j = 0;
+	for (j = 0; j < GIT_SHA1_RAWSZ; j++) {
+		x = x * 1103515245u + 12345;
+		hash[j] = x >> 24;
+	}
+}
+
+static void test_table_refs_for_large_obj_index(void)
+{
+	/* enough object ids to sort them in buckets. */
+	int N = 3 * 30000;
+	struct reftable_write_options opts = { 0 };
+	struct strbuf buf = STRBUF_INIT;
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, &buf, &opts);
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader rd = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_iterator it = { NULL };
+	int i = 0;
+	int err = 0;
+
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; i < N; i++) {
+		uint8_t hash[GIT_SHA1_RAWSZ];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		/* three refs per object. */
+		set_spread_hash(hash, i / 3);
+		snprintf(name, sizeof(name), "refs/heads/%06d", i);
+		EXPECT_ERR(reftable_writer_add_ref(w, &ref));
+	}
+	EXPECT_ERR(reftable_writer_close(w));
+	EXPECT(writer_stats(w)->obj_stats.blocks > 0);
+	reftable_writer_free(w);
+
+	block_source_from_strbuf(&source, &buf);
+	err = init_reader(&rd, &source, "file.ref");
+	EXPECT_ERR(err);
+
+	for (i = 0; i < N / 3; i += 997) {
+		uint8_t want_hash[GIT_SHA1_RAWSZ];
+		int j = 0;
+		set_spread_hash(want_hash, i);
+		err = reftable_reader_refs_for(&rd, &it, want_hash);
+		EXPECT_ERR(err);
+		for (j = 0;; j++) {
+			char name[100];
+			err = reftable_iterator_next_ref(&it, &ref);
+			EXPECT(err >= 0);
+			if (err > 0)
+				break;
+			snprintf(name, sizeof(name), "refs/heads/%06d",
+				 3 * i + j);
+			EXPECT(0 == strcmp(ref.refname, name));
+		}
+		EXPECT(j == 3);
+		reftable_iterator_destroy(&it);
+	}
+
+	reftable_ref_record_release(&ref);
+	reader_close(&rd);
+	strbuf_release(&buf);
+}
+
+static void spill_ref(char *name, size_t len, uint8_t *hash, int i)
+{
+	snprintf(name, len, "refs/heads/%06d", i);
+	set_spread_hash(hash, i / 2);
+}
+
+static void write_spill_table(struct strbuf *buf, uint64_t index_memory,
+			      const char *spill_dir)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+		.max_index_memory = index_memory,
+		.spill_dir = spill_dir,
+	};
+	struct reftable_stats stats =
+		write_table(NULL, buf, 2000, 1, &opts, &spill_ref);
+	EXPECT(stats.ref_stats.max_index_level > 1);
+}
+
+static void test_write_spilled_index(void)
+{
+	struct strbuf want = STRBUF_INIT;
+	struct strbuf got = STRBUF_INIT;
+	char dir[] = "/tmp/readwrite_test.XXXXXX";
+	struct reftable_write_options opts = {
+		.block_size = 256,
+		.max_index_memory = 1,
+		.spill_dir = dir,
+	};
+	struct reftable_writer *w = NULL;
+	int err = 0;
+	int i = 0;
+
+	write_spill_table(&want, 0, NULL);
+	/* spills every index record and object id. */
+	write_spill_table(&got, 1, NULL);
+	EXPECT(0 == strbuf_cmp(&want, &got));
+
+	strbuf_reset(&got);
+	write_spill_table(&got, 4096, NULL);
+	EXPECT(0 == strbuf_cmp(&want, &got));
+
+	/* spill files go to spill_dir, and are gone once written. */
+	EXPECT(mkdtemp(dir));
+	strbuf_reset(&got);
+	write_spill_table(&got, 1, dir);
+	EXPECT(0 == strbuf_cmp(&want, &got));
+	EXPECT(0 == rmdir(dir));
+
+	/* so a missing spill_dir fails the write. */
+	strbuf_reset(&got);
+	w = reftable_new_writer(&strbuf_add_void, &got, &opts);
+	reftable_writer_set_limits(w, 1, 1);
+	for (i = 0; err == 0 && i < 2000; i++) {
+		uint8_t hash[GIT_SHA1_RAWSZ];
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		spill_ref(name, sizeof(name), hash, i);
+		err = reftable_writer_add_ref(w, &ref);
+	}
+	if (err == 0)
+		err = reftable_writer_close(w);
+	EXPECT(err == REFTABLE_IO_ERROR);
+	reftable_writer_free(w);
+
+	strbuf_release(&want);
+	strbuf_release(&got);
+}
+
+static void test_table_seek_multi_level_index(void)
+{
+	struct strbuf buf = STRBUF_INIT;
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader rd = { NULL };
+	struct reftable_ref_record ref = { NULL };
+	int i = 0;
+
+	write_spill_table(&buf, 0, NULL);
+	block_source_from_strbuf(&source, &buf);
+	EXPECT_ERR(init_reader(&rd, &source, "file.ref"));
+
+	/* every ref must be reachable through all index levels. */
+	for (i = 0; i < 2000; i++) {
+		struct reftable_iterator it = { NULL };
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/%06d", i);
+		EXPECT_ERR(reftable_reader_seek_ref(&rd, &it, name));
+		EXPECT_ERR(reftable_iterator_next_ref(&it, &ref));
+		EXPECT(0 == strcmp(ref.refname, name));
+		reftable_iterator_destroy(&it);
+	}
+
+	reftable_ref_record_release(&ref);
+	reader_close(&rd);
+	strbuf_release(&buf);
+}
+
+static void test_table_pin_deep_index(void)
+{
+	struct reftable_write_options opts = {
+		.block_size = 128,
+	};
+	struct strbuf buf = STRBUF_INIT;
+	struct counting_block_source counter = { { NULL } };
+	struct reftable_block_source source = {
+		.ops = &counting_vtable,
+		.arg = &counter,
+	};
+	struct reftable_reader *rd = NULL;
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_stats stats =
+		write_table(NULL, &buf, 5000, 0, &opts, &spill_ref);
+	int i = 0;
+
+	EXPECT(stats.ref_stats.max_index_level > 2);
+	block_source_from_strbuf(&counter.inner, &buf);
+	EXPECT_ERR(reftable_new_reader(&rd, &source, "file.ref"));
+	EXPECT_ERR(reftable_reader_pin_index_blocks(
+		rd, stats.ref_stats.max_index_level));
+
+	/* with all index levels pinned, a lookup reads just the ref block. */
+	for (i = 0; i < 5000; i += 7) {
+		struct reftable_iterator it = { NULL };
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/%06d", i);
+		counter.reads = 0;
+		EXPECT_ERR(reftable_reader_seek_ref(rd, &it, name));
+		EXPECT_ERR(reftable_iterator_next_ref(&it, &ref));
+		EXPECT_STREQ(name, ref.refname);
+		EXPECT(counter.reads == 1);
+		reftable_iterator_destroy(&it);
+	}
+
+	reftable_ref_record_release(&ref);
+	reftable_reader_free(rd);
+	strbuf_release(&buf);
+}
+
+/* writes `n` logs, returning the writer's stats. */
+static struct reftable_stats write_logs(struct strbuf *buf, int with_refs,
+					int n,
+					struct reftable_write_options *opts)
+{
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, buf, opts);
+	struct reftable_stats stats = { 0 };
+	struct reftable_ref_record ref = {
+		.refname = "HEAD",
+		.update_index = 1,
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "refs/heads/master",
+	};
+	int i = 0;
+
+	reftable_writer_set_limits(w, 1, 1);
+	if (with_refs)
+		EXPECT_ERR(reftable_writer_add_ref(w, &ref));
+	for (i = 0; i < n; i++) {
+		uint8_t hash1[GIT_SHA1_RAWSZ], hash2[GIT_SHA1_RAWSZ];
+		char name[100];
+		struct reftable_log_record log = {
+			.refname = name,
+			.update_index = 1,
+			.value_type = REFTABLE_LOG_UPDATE,
+			.value.update = {
+				.new_hash = hash1,
+				.old_hash = hash2,
+				.name = "name",
+				.email = "email",
+				.message = "message",
+			},
+		};
+		set_spread_hash(hash1, i);
+		set_spread_hash(hash2, i + 1);
+		snprintf(name, sizeof(name), "refs/heads/%06d", i);
+		EXPECT_ERR(reftable_writer_add_log(w, &log));
+	}
+	EXPECT_ERR(reftable_writer_close(w));
+	stats = *writer_stats(w);
+	reftable_writer_free(w);
+	return stats;
+}
+
+static void write_log_table(struct strbuf *buf, int with_refs,
+			    enum reftable_compression compression, int threads,
+			    int in_flight)
+{
+	struct reftable_write_options opts = {
+		.block_size = 256,
+		.log_compression = compression,
+		.log_compression_threads = threads,
+		.log_blocks_in_flight = in_flight,
+	};
+	struct reftable_stats stats = write_logs(buf, with_refs, 3000, &opts);
+	EXPECT(stats.log_stats.index_blocks > 0);
+	EXPECT(stats.log_compress_nsec > 0);
+}
+
+static void test_write_log_compression_threads(void)
+{
+	struct strbuf want = STRBUF_INIT;
+	struct strbuf got = STRBUF_INIT;
+	int with_refs = 0;
+
+	for (with_refs = 0; with_refs <= 1; with_refs++) {
+		strbuf_reset(&want);
+		write_log_table(&want, with_refs, REFTABLE_COMPRESSION_ZLIB,
+				0, 0);
+
+		strbuf_reset(&got);
+		write_log_table(&got, with_refs, REFTABLE_COMPRESSION_ZLIB,
+				4, 0);
+		EXPECT(0 == strbuf_cmp(&want, &got));
+
+		/* a single block in flight waits for every block. */
+		strbuf_reset(&got);
+		write_log_table(&got, with_refs, REFTABLE_COMPRESSION_ZLIB,
+				1, 1);
+		EXPECT(0 == strbuf_cmp(&want, &got));
+	}
+
+	strbuf_release(&want);
+	strbuf_release(&got);
+}
+
+static void test_log_compression(void)
+{
+	enum reftable_compression compressions[] = {
+		REFTABLE_COMPRESSION_ZLIB,
+		REFTABLE_COMPRESSION_NONE,
+		REFTABLE_COMPRESSION_ZSTD,
+		REFTABLE_COMPRESSION_LZ4,
+	};
+	struct strbuf want = STRBUF_INIT;
+	struct strbuf got = STRBUF_INIT;
+	int i = 0;
+
+	for (i = 0; i < ARRAY_SIZE(compressions); i++) {
+		struct reftable_block_source source = { NULL };
+		struct reftable_reader *rd = NULL;
+		struct reftable_iterator it = { NULL };
+		struct reftable_log_record log = { NULL };
+		int n = 0;
+
+		if (!reftable_compression_supported(compressions[i]))
+			continue;
+
+		strbuf_reset(&want);
+		write_log_table(&want, 1, compressions[i], 0, 0);
+		strbuf_reset(&got);
+		write_log_table(&got, 1, compressions[i], 2, 0);
+		EXPECT(0 == strbuf_cmp(&want, &got));
+
+		block_source_from_strbuf(&source, &want);
+		EXPECT_ERR(reftable_new_reader(&rd, &source, "file.log"));
+		EXPECT_ERR(reftable_reader_seek_log(rd, &it, ""));
+		while (1) {
+			char name[100];
+			int err = reftable_iterator_next_log(&it, &log);
+			if (err > 0)
+				break;
+			EXPECT_ERR(err);
+			snprintf(name, sizeof(name), "refs/heads/%06d", n);
+			EXPECT_STREQ(name, log.refname);
+			n++;
+		}
+		EXPECT(n == 3000);
+		reftable_iterator_destroy(&it);
+
+		/* seeking goes through the log index. */
+		EXPECT_ERR(reftable_reader_seek_log(rd, &it,
+						    "refs/heads/002500"));
+		EXPECT_ERR(reftable_iterator_next_log(&it, &log));
+		EXPECT_STREQ("refs/heads/002500", log.refname);
+		reftable_iterator_destroy(&it);
+		reftable_log_record_release(&log);
+		reftable_reader_free(rd);
+	}
+
+	strbuf_release(&want);
+	strbuf_release(&got);
+}
+
+/* seeks to every `step`th of the `n` logs of the table in `buf`. */
+static void seek_logs(struct strbuf *buf, int n, int step)
+{
+	struct reftable_block_source source = { NULL };
+	struct reftable_reader *rd = NULL;
+	struct reftable_log_record log = { NULL };
+	int i = 0;
+
+	block_source_from_strbuf(&source, buf);
+	EXPECT_ERR(reftable_new_reader(&rd, &source, "file.log"));
+	for (i = 0; i < n; i += step) {
+		struct reftable_iterator it = { NULL };
+		char name[100];
+		snprintf(name, sizeof(name), "refs/heads/%06d", i);
+		EXPECT_ERR(reftable_reader_seek_log_at(rd, &it, name, 1));
+		EXPECT_ERR(reftable_iterator_next_log(&it, &log));
+		EXPECT_STREQ(name, log.refname);
+		reftable_iterator_destroy(&it);
+	}
+	reftable_log_record_release(&log);
+	reftable_reader_free(rd);
+}
+
+static void test_log_sized_blocks(void)
+{
+	enum reftable_compression compressions[] = {
+		REFTABLE_COMPRESSION_ZLIB,
+		REFTABLE_COMPRESSION_ZSTD,
+		REFTABLE_COMPRESSION_LZ4,
+	};
+	struct reftable_write_options bare_opts = {
+		.block_size = 256,
+	};
+	struct strbuf buf = STRBUF_INIT;
+	int i = 0;
+
+	/* zlib log blocks without their size are inflated to be skipped. */
+	write_logs(&buf, 1, 8, &bare_opts);
+	seek_logs(&buf, 8, 1);
+
+	for (i = 0; i < ARRAY_SIZE(compressions); i++) {
+		struct reftable_write_options opts = {
+			.block_size = 256,
+			.log_compression = compressions[i],
+			.sized_log_blocks = 1,
+		};
+		struct reftable_stats stats = { 0 };
+
+		if (!reftable_compression_supported(compressions[i]))
+			continue;
+
+		/* few enough blocks to be seeked linearly. */
+		strbuf_reset(&buf);
+		stats = write_logs(&buf, 1, 8, &opts);
+		EXPECT(stats.log_stats.blocks > 1);
+		EXPECT(stats.log_stats.index_blocks == 0);
+		seek_logs(&buf, 8, 1);
+
+		strbuf_reset(&buf);
+		stats = write_logs(&buf, 1, 3000, &opts);
+		EXPECT(stats.log_stats.index_blocks > 0);
+		seek_logs(&buf, 3000, 7);
+
+		/* compressed index blocks are seeked linearly too. */
+		opts.compress_blocks = 1;
+		strbuf_reset(&buf);
+		write_logs(&buf, 1, 3000, &opts);
+		seek_logs(&buf, 3000, 7);
+	}
+
+	strbuf_release(&buf);
+}
+
+/* times of the log entries of test_log_time_index, which go back and forth. */
+static uint64_t log_time_at(int update_index)
+{
+	return 1000 + 100 * update_index - 150 * (update_index % 4);
+}
+
+static int log_time_is_deletion(int ref, int update_index)
+{
+	return ref == 1 && update_index % 17 == 0;
+}
+
+static void write_log_times(struct strbuf *buf, int refs, int n,
+			    struct reftable_write_options *opts)
+{
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, buf, opts);
+	uint8_t hash[GIT_SHA1_RAWSZ] = { 0 };
+	int i = 0;
+	int j = 0;
+
+	reftable_writer_set_limits(w, 1, n);
+	for (i = 0; i < refs; i++) {
+		for (j = n; j > 0; j--) {
+			char name[100];
+			struct reftable_log_record log = {
+				.refname = name,
+				.update_index = j,
+				.value_type = REFTABLE_LOG_UPDATE,
+				.value.update = {
+					.new_hash = hash,
+					.old_hash = hash,
+					.name = "name",
+					.email = "email",
+					.time = log_time_at(j),
+					.message = "message",
+				},
+			};
+			snprintf(name, sizeof(name), "refs/heads/%06d", i);
+			set_test_hash(hash, j);
+			if (log_time_is_deletion(i, j))
+				log.value_type = REFTABLE_LOG_DELETION;
+			EXPECT_ERR(reftable_writer_add_log(w, &log));
+		}
+	}
+	EXPECT_ERR(reftable_writer_close(w));
+	reftable_writer_free(w);
+}
+
+static void test_log_time_index(void)
+{
+	int refs = 3;
+	int n = 200;
+	int indexed = 0;
+
+	for (indexed = 0; indexed <= 1; indexed++) {
+		struct reftable_write_options opts = {
+			.block_size = 256,
+			.log_time_index = indexed,
+		};
+		struct strbuf buf = STRBUF_INIT;
+		struct reftable_block_source source = { NULL };
+		struct reftable_reader *rd = NULL;
+		struct reftable_log_record log = { NULL };
+		int i = 0;
+		int t = 0;
+
+		write_log_times(&buf, refs, n, &opts);
+		block_source_from_strbuf(&source, &buf);
+		EXPECT_ERR(reftable_new_reader(&rd, &source, "file.log"));
+		EXPECT((rd->log_times.refs_len == refs) == indexed);
+
+		for (i = 0; i <= refs; i++) {
+			for (t = 0; t < 100 * n + 1200; t += 37) {
+				struct reftable_iterator it = { NULL };
+				char name[100];
+				int want = 0;
+				int j = 0;
+				int err = 0;
+
+				snprintf(name, sizeof(name), "refs/heads/%06d",
+					 i);
+				for (j = n; i < refs && j > 0 && !want; j--) {
+					if (!log_time_is_deletion(i, j) &&
+					    log_time_at(j) <= t)
+						want = j;
+				}
+
+				EXPECT_ERR(reftable_reader_seek_log_time(
+					rd, &it, name, t));
+				err = reftable_iterator_next_log(&it, &log);
+				if (want) {
+					EXPECT_ERR(err);
+					EXPECT_STREQ(name, log.refname);
+					EXPECT(log.update_index == want);
+				} else {
+					EXPECT(err == 1);
+				}
+				reftable_iterator_destroy(&it);
+			}
+		}
+
+		reftable_log_record_release(&log);
+		reftable_reader_free(rd);
+		strbuf_release(&buf);
+	}
+}
+
+static void test_log_compression_unsupported(void)
+{
+	struct reftable_write_options opts = {
+		.log_compression = 42,
+	};
+	struct strbuf buf = STRBUF_INIT;
+	struct reftable_writer *w =
+		reftable_new_writer(&strbuf_add_void, &buf, &opts);
+	struct reftable_log_record log = {
+		.refname = "refs/heads/master",
+		.update_index = 1,
+		.value_type = REFTABLE_LOG_DELETION,
+	};
+
+	reftable_writer_set_limits(w, 1, 1);
+	EXPECT(REFTABLE_API_ERROR == reftable_writer_add_log(w, &log));
+	reftable_writer_free(w);
+	strbuf_release(&buf);
+}
+
+static void change_ref(char *name, size_t len, uint8_t *hash, int i)
+{
+	snprintf(name, len, "refs/changes/%02d/%06d/1", i / 30, i);
+	set_spread_hash(hash, i / 2);
+}
+
+static void write_compressed_table(struct strbuf *buf,
+				   enum reftable_compression compression,
+				   int compress_blocks)
+{
+	struct reftable_write_options opts = {
+		.block_size = 512,
+		.log_compression = compression,
+		.compress_blocks = compress_blocks,
+	};
+	struct reftable_stats stats =
+		write_table(NULL, buf, 3000, 0, &opts, &change_ref);
+	EXPECT(stats.ref_stats.max_index_level > 0);
+	EXPECT(stats.obj_stats.blocks > 0);
+}
+
+static void test_table_compressed_blocks(void)
+{
+	enum reftable_compression compressions[] = {
+		REFTABLE_COMPRESSION_ZLIB,
+		REFTABLE_COMPRESSION_ZSTD,
+		REFTABLE_COMPRESSION_LZ4,
+	};
+	struct strbuf raw = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	int i = 0;
+
+	write_compressed_table(&raw, REFTABLE_COMPRESSION_ZLIB, 0);
+	for (i = 0; i < ARRAY_SIZE(compressions); i++) {
+		struct reftable_block_source source = { NULL };
+		struct reftable_reader *rd = NULL;
+		struct reftable_iterator it = { NULL };
+		struct reftable_ref_record ref = { NULL };
+		uint8_t want_hash[GIT_SHA1_RAWSZ];
+		char name[100];
+		int n = 0;
+
+		if (!reftable_compression_supported(compressions[i]))
+			continue;
+
+		strbuf_reset(&buf);
+		write_compressed_table(&buf, compressions[i], 1);
+		EXPECT(buf.len < raw.len * 3 / 4);
+
+		block_source_from_strbuf(&source, &buf);
+		EXPECT_ERR(reftable_new_reader(&rd, &source, "file.ref"));
+		EXPECT_ERR(reftable_reader_seek_ref(rd, &it, ""));
+		while (1) {
+			int err = reftable_iterator_next_ref(&it, &ref);
+			if (err > 0)
+				break;
+			EXPECT_ERR(err);
+			n++;
+		}
+		EXPECT(n == 3000);
+		reftable_iterator_destroy(&it);
+
+		/* seeking goes through the ref index. */
+		EXPECT_ERR(reftable_reader_seek_ref(rd, &it,
+						    "refs/changes/68/002042/1"));
+		EXPECT_ERR(reftable_iterator_next_ref(&it, &ref));
+		EXPECT_STREQ("refs/changes/68/002042/1", ref.refname);
+		reftable_iterator_destroy(&it);
+
+		/* and the obj index. */
+		set_spread_hash(want_hash, 1021);
+		EXPECT_ERR(reftable_reader_refs_for(rd, &it, want_hash));
+		for (n = 0; reftable_iterator_next_ref(&it, &ref) == 0; n++) {
+			snprintf(name, sizeof(name), "refs/changes/%02d/%06d/1",
+				 (2042 + n) / 30, 2042 + n);
+			EXPECT_STREQ(name, ref.refname);
+		}
+		EXPECT(n == 2);
+		reftable_iterator_destroy(&it);
+
+		reftable_ref_record_release(&ref);
+		reftable_reader_free(rd);
+	}
+
+	strbuf_release(&raw);
+	strbuf_release(&buf);
 }
 
 static void test_write_empty_table(void)
@@ -643,10 +1873,28 @@ int readwrite_test_main(int argc, const char *argv[])
 	RUN_TEST(test_buffer);
 	RUN_TEST(test_table_read_api);
 	RUN_TEST(test_table_read_write_sequential);
+	RUN_TEST(test_table_read_mmap);
+	RUN_TEST(test_table_read_open_files_limit);
 	RUN_TEST(test_table_read_write_seek_linear);
 	RUN_TEST(test_table_read_write_seek_index);
+	RUN_TEST(test_table_pin_index_blocks);
+	RUN_TEST(test_table_read_refs);
+	RUN_TEST(test_table_ref_metadata);
+	RUN_TEST(test_table_seek_ref_prefix);
+	RUN_TEST(test_table_seek_log_after_ref_index);
 	RUN_TEST(test_table_refs_for_no_index);
 	RUN_TEST(test_table_refs_for_obj_index);
+	RUN_TEST(test_table_refs_for_obj_index_val1);
+	RUN_TEST(test_table_refs_for_large_obj_index);
+	RUN_TEST(test_write_spilled_index);
+	RUN_TEST(test_table_seek_multi_level_index);
+	RUN_TEST(test_table_pin_deep_index);
+	RUN_TEST(test_write_log_compression_threads);
+	RUN_TEST(test_log_compression);
+	RUN_TEST(test_log_compression_unsupported);
+	RUN_TEST(test_log_sized_blocks);
+	RUN_TEST(test_log_time_index);
+	RUN_TEST(test_table_compressed_blocks);
 	RUN_TEST(test_write_empty_table);
 	return 0;
 }
@@ -22,11 +22,17 @@ int get_var_int(uint64_t *dest, struct string_view *in)
 
 	if (in->len == 0)
 		return -1;
-	val = in->buf[ptr] & 0x7f;
 
+	/* key lengths and update indices mostly fit in a single byte. */
+	if (!(in->buf[0] & 0x80)) {
+		*dest = in->buf[0];
+		return 1;
+	}
+
+	val = in->buf[ptr] & 0x7f;
 	while (in->buf[ptr] & 0x80) {
 		ptr++;
-		if (ptr > in->len) {
+		if (ptr >= in->len) {
 			return -1;
 		}
 		val = (val + 1) << 7 | (uint64_t)(in->buf[ptr] & 0x7f);
@@ -112,10 +118,44 @@ static int decode_string(struct strbuf *dest, struct string_view in)
 	return start_len - in.len;
 }
 
-static int encode_string(char *str, struct string_view s)
+/* Like decode_string, but points `dest` into `in`. */
+static int decode_string_view(const char **dest, size_t *len,
+			      struct string_view in)
+{
+	int start_len = in.len;
+	uint64_t tsize = 0;
+	int n = get_var_int(&tsize, &in);
+	if (n <= 0)
+		return -1;
+	string_view_consume(&in, n);
+	if (in.len < tsize)
+		return -1;
+
+	*dest = (const char *)in.buf;
+	*len = tsize;
+	string_view_consume(&in, tsize);
+
+	return start_len - in.len;
+}
+
+static int skip_string(struct string_view in)
+{
+	int start_len = in.len;
+	uint64_t tsize = 0;
+	int n = get_var_int(&tsize, &in);
+	if (n <= 0)
+		return -1;
+	string_view_consume(&in, n);
+	if (in.len < tsize)
+		return -1;
+	string_view_consume(&in, tsize);
+
+	return start_len - in.len;
+}
+
+static int encode_bytes(const char *str, size_t l, struct string_view s)
 {
 	struct string_view start = s;
-	int l = strlen(str);
 	int n = put_var_int(&s, l);
 	if (n < 0)
 		return -1;
@@ -128,6 +168,11 @@ static int encode_string(char *str, struct string_view s)
 	return start.len - s.len;
 }
 
+static int encode_string(char *str, struct string_view s)
+{
+	return encode_bytes(str, strlen(str), s);
+}
+
 int reftable_encode_key(int *restart, struct string_view dest,
 			struct strbuf prev_key, struct strbuf key,
 			uint8_t extra)
@@ -155,13 +200,36 @@ int reftable_encode_key(int *restart, struct string_view dest,
 	return start.len - dest.len;
 }
 
+int reftable_decode_keylen(struct string_view in, uint64_t *prefix_len,
+			   uint64_t *suffix_len, uint8_t *extra)
+{
+	int start_len = in.len;
+	int n = get_var_int(prefix_len, &in);
+	if (n < 0)
+		return -1;
+	string_view_consume(&in, n);
+
+	n = get_var_int(suffix_len, &in);
+	if (n <= 0)
+		return -1;
+	string_view_consume(&in, n);
+
+	*extra = (uint8_t)(*suffix_len & 0x7);
+	*suffix_len >>= 3;
+
+	if (in.len < *suffix_len)
+		return -1;
+
+	return start_len - in.len;
+}
+
 int reftable_decode_key(struct strbuf *key, uint8_t *extra,
 			struct strbuf last_key, struct string_view in)
 {
 	int start_len = in.len;
 	uint64_t prefix_len = 0;
 	uint64_t suffix_len = 0;
-	int n = get_var_int(&prefix_len, &in);
+	int n = reftable_decode_keylen(in, &prefix_len, &suffix_len, extra);
 	if (n < 0)
 		return -1;
 	string_view_consume(&in, n);
@@ -169,19 +237,30 @@ int reftable_decode_key(struct strbuf *key, uint8_t *extra,
 	if (prefix_len > last_key.len)
 		return -1;
 
-	n = get_var_int(&suffix_len, &in);
-	if (n <= 0)
+	strbuf_reset(key);
+	strbuf_add(key, last_key.buf, prefix_len);
+	strbuf_add(key, in.buf, suffix_len);
+	string_view_consume(&in, suffix_len);
+
+	return start_len - in.len;
+}
+
+int reftable_decode_next_key(struct strbuf *key, uint8_t *extra,
+			     struct string_view in)
+{
+	int start_len = in.len;
+	uint64_t prefix_len = 0;
+	uint64_t suffix_len = 0;
+	int n = reftable_decode_keylen(in, &prefix_len, &suffix_len, extra);
+	if (n < 0)
 		return -1;
 	string_view_consume(&in, n);
 
-	*extra = (uint8_t)(suffix_len & 0x7);
-	suffix_len >>= 3;
-
-	if (in.len < suffix_len)
+	if (prefix_len > key->len)
 		return -1;
 
-	strbuf_reset(key);
-	strbuf_add(key, last_key.buf, prefix_len);
+	if (prefix_len < key->len)
+		strbuf_setlen(key, prefix_len);
 	strbuf_add(key, in.buf, suffix_len);
 	string_view_consume(&in, suffix_len);
 
@@ -926,6 +1005,397 @@ static struct reftable_record_vtable reftable_log_record_vtable = {
 	.is_deletion = &reftable_log_record_is_deletion_void,
 };
 
+static void reftable_ref_record_view_key(const void *r, struct strbuf *dest)
+{
+	const struct reftable_ref_record_view *rec = r;
+	strbuf_reset(dest);
+	strbuf_add(dest, rec->refname, rec->refname_len);
+}
+
+static void reftable_ref_record_view_copy_from(void *rec, const void *src_rec,
+					       int hash_size)
+{
+	struct reftable_ref_record_view *dst = rec;
+	const struct reftable_ref_record_view *src = src_rec;
+	*dst = *src;
+}
+
+static void reftable_ref_record_view_copy_to_full(void *rec,
+						  const void *src_rec,
+						  int hash_size)
+{
+	reftable_ref_record_from_view(rec, src_rec, hash_size);
+}
+
+void reftable_ref_record_from_view(struct reftable_ref_record *dest,
+				   const struct reftable_ref_record_view *src,
+				   int hash_size)
+{
+	assert(hash_size > 0);
+	reftable_ref_record_release(dest);
+	if (src->refname) {
+		dest->refname = reftable_malloc(src->refname_len + 1);
+		memcpy(dest->refname, src->refname, src->refname_len);
+		dest->refname[src->refname_len] = 0;
+	}
+	dest->update_index = src->update_index;
+	dest->value_type = src->value_type;
+	switch (src->value_type) {
+	case REFTABLE_REF_DELETION:
+		break;
+	case REFTABLE_REF_VAL1:
+		dest->value.val1 = reftable_malloc(hash_size);
+		memcpy(dest->value.val1, src->value.val1, hash_size);
+		break;
+	case REFTABLE_REF_VAL2:
+		dest->value.val2.value = reftable_malloc(hash_size);
+		memcpy(dest->value.val2.value, src->value.val2.value,
+		       hash_size);
+		dest->value.val2.target_value = reftable_malloc(hash_size);
+		memcpy(dest->value.val2.target_value,
+		       src->value.val2.target_value, hash_size);
+		break;
+	case REFTABLE_REF_SYMREF:
+		dest->value.symref =
+			reftable_malloc(src->value.symref.len + 1);
+		memcpy(dest->value.symref, src->value.symref.target,
+		       src->value.symref.len);
+		dest->value.symref[src->value.symref.len] = 0;
+		break;
+	}
+}
+
+static uint8_t reftable_ref_record_view_val_type(const void *rec)
+{
+	const struct reftable_ref_record_view *r = rec;
+	return r->value_type;
+}
+
+static int reftable_ref_record_view_encode(const void *rec,
+					   struct string_view s, int hash_size)
+{
+	const struct reftable_ref_record_view *r = rec;
+	struct string_view start = s;
+	int n = put_var_int(&s, r->update_index);
+	assert(hash_size > 0);
+	if (n < 0)
+		return -1;
+	string_view_consume(&s, n);
+
+	switch (r->value_type) {
+	case REFTABLE_REF_SYMREF:
+		n = encode_bytes(r->value.symref.target, r->value.symref.len,
+				 s);
+		if (n < 0)
+			return -1;
+		string_view_consume(&s, n);
+		break;
+	case REFTABLE_REF_VAL2:
+		if (s.len < 2 * hash_size)
+			return -1;
+		memcpy(s.buf, r->value.val2.value, hash_size);
+		string_view_consume(&s, hash_size);
+		memcpy(s.buf, r->value.val2.target_value, hash_size);
+		string_view_consume(&s, hash_size);
+		break;
+	case REFTABLE_REF_VAL1:
+		if (s.len < hash_size)
+			return -1;
+		memcpy(s.buf, r->value.val1, hash_size);
+		string_view_consume(&s, hash_size);
+		break;
+	case REFTABLE_REF_DELETION:
+		break;
+	default:
+		abort();
+	}
+
+	return start.len - s.len;
+}
+
+/* The refname points into `key`, so the caller must keep it intact, as
+ * block_iter_next does. */
+static int reftable_ref_record_view_decode(void *rec, struct strbuf key,
+					   uint8_t val_type,
+					   struct string_view in,
+					   int hash_size)
+{
+	struct reftable_ref_record_view *r = rec;
+	struct string_view start = in;
+	uint64_t update_index = 0;
+	int n = get_var_int(&update_index, &in);
+	if (n < 0)
+		return n;
+	string_view_consume(&in, n);
+
+	memset(r, 0, sizeof(*r));
+	r->refname = (const char *)key.buf;
+	r->refname_len = key.len;
+	r->update_index = update_index;
+	r->value_type = val_type;
+	switch (val_type) {
+	case REFTABLE_REF_VAL1:
+		if (in.len < hash_size)
+			return -1;
+		r->value.val1 = in.buf;
+		string_view_consume(&in, hash_size);
+		break;
+	case REFTABLE_REF_VAL2:
+		if (in.len < 2 * hash_size)
+			return -1;
+		r->value.val2.value = in.buf;
+		r->value.val2.target_value = in.buf + hash_size;
+		string_view_consume(&in, 2 * hash_size);
+		break;
+	case REFTABLE_REF_SYMREF:
+		n = decode_string_view(&r->value.symref.target,
+				       &r->value.symref.len, in);
+		if (n < 0)
+			return -1;
+		string_view_consume(&in, n);
+		break;
+	case REFTABLE_REF_DELETION:
+		break;
+	default:
+		return -1;
+	}
+
+	return start.len - in.len;
+}
+
+static void reftable_ref_record_view_release(void *rec)
+{
+	memset(rec, 0, sizeof(struct reftable_ref_record_view));
+}
+
+static int reftable_ref_record_view_is_deletion(const void *rec)
+{
+	const struct reftable_ref_record_view *r = rec;
+	return r->value_type == REFTABLE_REF_DELETION;
+}
+
+static struct reftable_record_vtable reftable_ref_record_view_vtable = {
+	.key = &reftable_ref_record_view_key,
+	.type = BLOCK_TYPE_REF,
+	.copy_from = &reftable_ref_record_view_copy_from,
+	.copy_to_full = &reftable_ref_record_view_copy_to_full,
+	.val_type = &reftable_ref_record_view_val_type,
+	.encode = &reftable_ref_record_view_encode,
+	.decode = &reftable_ref_record_view_decode,
+	.release = &reftable_ref_record_view_release,
+	.is_deletion = &reftable_ref_record_view_is_deletion,
+};
+
+static void reftable_log_record_view_key(const void *r, struct strbuf *dest)
+{
+	const struct reftable_log_record_view *rec = r;
+	uint8_t i64[8];
+	uint64_t ts = 0;
+	strbuf_reset(dest);
+	strbuf_add(dest, rec->refname, rec->refname_len + 1);
+
+	ts = (~ts) - rec->update_index;
+	put_be64(&i64[0], ts);
+	strbuf_add(dest, i64, sizeof(i64));
+}
+
+static void reftable_log_record_view_copy_from(void *rec, const void *src_rec,
+					       int hash_size)
+{
+	struct reftable_log_record_view *dst = rec;
+	const struct reftable_log_record_view *src = src_rec;
+	*dst = *src;
+}
+
+static void reftable_log_record_view_copy_to_full(void *rec,
+						  const void *src_rec,
+						  int hash_size)
+{
+	reftable_log_record_from_view(rec, src_rec, hash_size);
+}
+
+/* Returns a malloced, 0-terminated copy of `len` bytes at `str`. */
+static char *copy_bytes(const char *str, size_t len)
+{
+	char *dest = reftable_malloc(len + 1);
+	memcpy(dest, str, len);
+	dest[len] = 0;
+	return dest;
+}
+
+void reftable_log_record_from_view(struct reftable_log_record *dest,
+				   const struct reftable_log_record_view *src,
+				   int hash_size)
+{
+	reftable_log_record_release(dest);
+	if (src->refname)
+		dest->refname = copy_bytes(src->refname, src->refname_len);
+	dest->update_index = src->update_index;
+	dest->value_type = src->value_type;
+	if (src->value_type != REFTABLE_LOG_UPDATE)
+		return;
+
+	dest->value.update.new_hash = reftable_malloc(hash_size);
+	memcpy(dest->value.update.new_hash, src->value.update.new_hash,
+	       hash_size);
+	dest->value.update.old_hash = reftable_malloc(hash_size);
+	memcpy(dest->value.update.old_hash, src->value.update.old_hash,
+	       hash_size);
+	dest->value.update.name =
+		copy_bytes(src->value.update.name, src->value.update.name_len);
+	dest->value.update.email = copy_bytes(src->value.update.email,
+					      src->value.update.email_len);
+	dest->value.update.time = src->value.update.time;
+	dest->value.update.tz_offset = src->value.update.tz_offset;
+	dest->value.update.message = copy_bytes(src->value.update.message,
+						src->value.update.message_len);
+}
+
+static uint8_t reftable_log_record_view_val_type(const void *rec)
+{
+	const struct reftable_log_record_view *log = rec;
+	return log->value_type == REFTABLE_LOG_DELETION ? 0 : 1;
+}
+
+static int reftable_log_record_view_encode(const void *rec,
+					   struct string_view s, int hash_size)
+{
+	const struct reftable_log_record_view *r = rec;
+	struct string_view start = s;
+	int n = 0;
+	if (r->value_type == REFTABLE_LOG_DELETION)
+		return 0;
+
+	if (s.len < 2 * hash_size)
+		return -1;
+
+	memcpy(s.buf, r->value.update.old_hash ? r->value.update.old_hash : zero,
+	       hash_size);
+	memcpy(s.buf + hash_size,
+	       r->value.update.new_hash ? r->value.update.new_hash : zero,
+	       hash_size);
+	string_view_consume(&s, 2 * hash_size);
+
+	n = encode_bytes(r->value.update.name ? r->value.update.name : "",
+			 r->value.update.name_len, s);
+	if (n < 0)
+		return -1;
+	string_view_consume(&s, n);
+
+	n = encode_bytes(r->value.update.email ? r->value.update.email : "",
+			 r->value.update.email_len, s);
+	if (n < 0)
+		return -1;
+	string_view_consume(&s, n);
+
+	n = put_var_int(&s, r->value.update.time);
+	if (n < 0)
+		return -1;
+	string_view_consume(&s, n);
+
+	if (s.len < 2)
+		return -1;
+
+	put_be16(s.buf, r->value.update.tz_offset);
+	string_view_consume(&s, 2);
+
+	n = encode_bytes(r->value.update.message ? r->value.update.message :
+						   "",
+			 r->value.update.message_len, s);
+	if (n < 0)
+		return -1;
+	string_view_consume(&s, n);
+
+	return start.len - s.len;
+}
+
+/* The refname points into `key`, see reftable_ref_record_view_decode. */
+static int reftable_log_record_view_decode(void *rec, struct strbuf key,
+					   uint8_t val_type,
+					   struct string_view in,
+					   int hash_size)
+{
+	struct string_view start = in;
+	struct reftable_log_record_view *r = rec;
+	uint64_t max = 0;
+	uint64_t ts = 0;
+	int n;
+
+	if (key.len <= 9 || key.buf[key.len - 9] != 0)
+		return REFTABLE_FORMAT_ERROR;
+
+	memset(r, 0, sizeof(*r));
+	r->refname = (const char *)key.buf;
+	r->refname_len = key.len - 9;
+	ts = get_be64(key.buf + key.len - 8);
+	r->update_index = (~max) - ts;
+	r->value_type = val_type;
+	if (val_type == REFTABLE_LOG_DELETION)
+		return 0;
+
+	if (in.len < 2 * hash_size)
+		return REFTABLE_FORMAT_ERROR;
+
+	r->value.update.old_hash = in.buf;
+	r->value.update.new_hash = in.buf + hash_size;
+	string_view_consume(&in, 2 * hash_size);
+
+	n = decode_string_view(&r->value.update.name,
+			       &r->value.update.name_len, in);
+	if (n < 0)
+		return REFTABLE_FORMAT_ERROR;
+	string_view_consume(&in, n);
+
+	n = decode_string_view(&r->value.update.email,
+			       &r->value.update.email_len, in);
+	if (n < 0)
+		return REFTABLE_FORMAT_ERROR;
+	string_view_consume(&in, n);
+
+	ts = 0;
+	n = get_var_int(&ts, &in);
+	if (n < 0)
+		return REFTABLE_FORMAT_ERROR;
+	string_view_consume(&in, n);
+	r->value.update.time = ts;
+	if (in.len < 2)
+		return REFTABLE_FORMAT_ERROR;
+
+	r->value.update.tz_offset = get_be16(in.buf);
+	string_view_consume(&in, 2);
+
+	n = decode_string_view(&r->value.update.message,
+			       &r->value.update.message_len, in);
+	if (n < 0)
+		return REFTABLE_FORMAT_ERROR;
+	string_view_consume(&in, n);
+
+	return start.len - in.len;
+}
+
+static void reftable_log_record_view_release(void *rec)
+{
+	memset(rec, 0, sizeof(struct reftable_log_record_view));
+}
+
+static int reftable_log_record_view_is_deletion(const void *rec)
+{
+	const struct reftable_log_record_view *r = rec;
+	return r->value_type == REFTABLE_LOG_DELETION;
+}
+
+static struct reftable_record_vtable reftable_log_record_view_vtable = {
+	.key = &reftable_log_record_view_key,
+	.type = BLOCK_TYPE_LOG,
+	.copy_from = &reftable_log_record_view_copy_from,
+	.copy_to_full = &reftable_log_record_view_copy_to_full,
+	.val_type = &reftable_log_record_view_val_type,
+	.encode = &reftable_log_record_view_encode,
+	.decode = &reftable_log_record_view_decode,
+	.release = &reftable_log_record_view_release,
+	.is_deletion = &reftable_log_record_view_is_deletion,
+};
+
 struct reftable_record reftable_new_record(uint8_t typ)
 {
 	struct reftable_record rec = { NULL };
@@ -963,6 +1433,24 @@ struct reftable_record reftable_new_record(uint8_t typ)
 	return rec;
 }
 
+struct reftable_record reftable_new_view_record(uint8_t typ)
+{
+	struct reftable_record rec = { NULL };
+	switch (typ) {
+	case BLOCK_TYPE_REF:
+		reftable_record_from_ref_view(
+			&rec, reftable_calloc(
+				      sizeof(struct reftable_ref_record_view)));
+		return rec;
+	case BLOCK_TYPE_LOG:
+		reftable_record_from_log_view(
+			&rec, reftable_calloc(
+				      sizeof(struct reftable_log_record_view)));
+		return rec;
+	}
+	return reftable_new_record(typ);
+}
+
 /* clear out the record, yielding the reftable_record data that was
  * encapsulated. */
 static void *reftable_record_yield(struct reftable_record *rec)
@@ -978,6 +1466,216 @@ void reftable_record_destroy(struct reftable_record *rec)
 	reftable_free(reftable_record_yield(rec));
 }
 
+static int reftable_ref_record_skip_value(uint8_t val_type,
+					  struct string_view in, int hash_size)
+{
+	struct string_view start = in;
+	uint64_t update_index = 0;
+	int n = get_var_int(&update_index, &in);
+	if (n < 0)
+		return n;
+	string_view_consume(&in, n);
+
+	switch (val_type) {
+	case REFTABLE_REF_VAL1:
+		n = hash_size;
+		break;
+	case REFTABLE_REF_VAL2:
+		n = 2 * hash_size;
+		break;
+	case REFTABLE_REF_SYMREF:
+		n = skip_string(in);
+		if (n < 0)
+			return -1;
+		break;
+	case REFTABLE_REF_DELETION:
+		n = 0;
+		break;
+	default:
+		return -1;
+	}
+	if (in.len < n)
+		return -1;
+	string_view_consume(&in, n);
+	return start.len - in.len;
+}
+
+static int reftable_obj_record_skip_value(uint8_t val_type,
+					  struct string_view in)
+{
+	struct string_view start = in;
+	uint64_t count = val_type;
+	uint64_t unused = 0;
+	int n = 0;
+	if (val_type == 0) {
+		n = get_var_int(&count, &in);
+		if (n < 0)
+			return n;
+		string_view_consume(&in, n);
+	}
+
+	for (; count > 0; count--) {
+		n = get_var_int(&unused, &in);
+		if (n < 0)
+			return n;
+		string_view_consume(&in, n);
+	}
+	return start.len - in.len;
+}
+
+static int reftable_log_record_skip_value(uint8_t val_type,
+					  struct string_view in, int hash_size)
+{
+	struct string_view start = in;
+	uint64_t unused = 0;
+	int n = 0;
+	int i = 0;
+	if (val_type == REFTABLE_LOG_DELETION)
+		return 0;
+
+	if (in.len < 2 * hash_size)
+		return -1;
+	string_view_consume(&in, 2 * hash_size);
+
+	/* name, email */
+	for (i = 0; i < 2; i++) {
+		n = skip_string(in);
+		if (n < 0)
+			return -1;
+		string_view_consume(&in, n);
+	}
+
+	/* time, tz_offset */
+	n = get_var_int(&unused, &in);
+	if (n < 0 || in.len < n + 2)
+		return -1;
+	string_view_consume(&in, n + 2);
+
+	/* message */
+	n = skip_string(in);
+	if (n < 0)
+		return -1;
+	string_view_consume(&in, n);
+	return start.len - in.len;
+}
+
+int reftable_record_skip_value(uint8_t typ, uint8_t extra,
+			       struct string_view in, int hash_size)
+{
+	uint64_t unused = 0;
+	switch (typ) {
+	case BLOCK_TYPE_REF:
+		return reftable_ref_record_skip_value(extra, in, hash_size);
+	case BLOCK_TYPE_OBJ:
+		return reftable_obj_record_skip_value(extra, in);
+	case BLOCK_TYPE_LOG:
+		return reftable_log_record_skip_value(extra, in, hash_size);
+	case BLOCK_TYPE_INDEX:
+		return get_var_int(&unused, &in);
+	}
+	return -1;
+}
+
+/* Key records are views that only hold the key, update index and value
+ * type; the value is skipped over. They can't be encoded. */
+static int reftable_key_record_encode(const void *rec, struct string_view s,
+				      int hash_size)
+{
+	return -1;
+}
+
+static void reftable_ref_key_record_copy_from(void *rec, const void *src_rec,
+					      int hash_size)
+{
+	struct reftable_ref_record_view *dst = rec;
+	const struct reftable_ref_record_view *src = src_rec;
+	memset(dst, 0, sizeof(*dst));
+	dst->refname = src->refname;
+	dst->refname_len = src->refname_len;
+	dst->update_index = src->update_index;
+	dst->value_type = src->value_type;
+}
+
+static int reftable_ref_key_record_decode(void *rec, struct strbuf key,
+					  uint8_t val_type,
+					  struct string_view in, int hash_size)
+{
+	struct reftable_ref_record_view *r = rec;
+	struct string_view value = in;
+	uint64_t update_index = 0;
+	int n = get_var_int(&update_index, &value);
+	if (n < 0)
+		return n;
+
+	n = reftable_ref_record_skip_value(val_type, in, hash_size);
+	if (n < 0)
+		return n;
+
+	memset(r, 0, sizeof(*r));
+	r->refname = (const char *)key.buf;
+	r->refname_len = key.len;
+	r->update_index = update_index;
+	r->value_type = val_type;
+	return n;
+}
+
+static struct reftable_record_vtable reftable_ref_key_record_vtable = {
+	.key = &reftable_ref_record_view_key,
+	.type = BLOCK_TYPE_REF,
+	.copy_from = &reftable_ref_key_record_copy_from,
+	.val_type = &reftable_ref_record_view_val_type,
+	.encode = &reftable_key_record_encode,
+	.decode = &reftable_ref_key_record_decode,
+	.release = &reftable_ref_record_view_release,
+	.is_deletion = &reftable_ref_record_view_is_deletion,
+};
+
+static void reftable_log_key_record_copy_from(void *rec, const void *src_rec,
+					      int hash_size)
+{
+	struct reftable_log_record_view *dst = rec;
+	const struct reftable_log_record_view *src = src_rec;
+	memset(dst, 0, sizeof(*dst));
+	dst->refname = src->refname;
+	dst->refname_len = src->refname_len;
+	dst->update_index = src->update_index;
+	dst->value_type = src->value_type;
+}
+
+static int reftable_log_key_record_decode(void *rec, struct strbuf key,
+					  uint8_t val_type,
+					  struct string_view in, int hash_size)
+{
+	struct reftable_log_record_view *r = rec;
+	uint64_t max = 0;
+	int n = 0;
+
+	if (key.len <= 9 || key.buf[key.len - 9] != 0)
+		return REFTABLE_FORMAT_ERROR;
+
+	n = reftable_log_record_skip_value(val_type, in, hash_size);
+	if (n < 0)
+		return REFTABLE_FORMAT_ERROR;
+
+	memset(r, 0, sizeof(*r));
+	r->refname = (const char *)key.buf;
+	r->refname_len = key.len - 9;
+	r->update_index = (~max) - get_be64(key.buf + key.len - 8);
+	r->value_type = val_type;
+	return n;
+}
+
+static struct reftable_record_vtable reftable_log_key_record_vtable = {
+	.key = &reftable_log_record_view_key,
+	.type = BLOCK_TYPE_LOG,
+	.copy_from = &reftable_log_key_record_copy_from,
+	.val_type = &reftable_log_record_view_val_type,
+	.encode = &reftable_key_record_encode,
+	.decode = &reftable_log_key_record_decode,
+	.release = &reftable_log_record_view_release,
+	.is_deletion = &reftable_log_record_view_is_deletion,
+};
+
 static void reftable_index_record_key(const void *r, struct strbuf *dest)
 {
 	const struct reftable_index_record *rec = r;
@@ -1074,6 +1772,14 @@ void reftable_record_copy_from(struct reftable_record *rec,
 {
 	assert(src->ops->type == rec->ops->type);
 
+	if (src->ops != rec->ops && !reftable_record_is_view(rec)) {
+		assert(src->ops->copy_to_full);
+		src->ops->copy_to_full(rec->data, src->data, hash_size);
+		return;
+	}
+	/* a view can be copied into a key record, but not the reverse. */
+	assert(src->ops == rec->ops || (reftable_record_is_key_only(rec) &&
+					reftable_record_is_view(src)));
 	rec->ops->copy_from(rec->data, src->data, hash_size);
 }
 
@@ -1130,6 +1836,70 @@ void reftable_record_from_log(struct reftable_record *rec,
 	rec->ops = &reftable_log_record_vtable;
 }
 
+void reftable_record_from_ref_view(struct reftable_record *rec,
+				   struct reftable_ref_record_view *view)
+{
+	assert(!rec->ops);
+	rec->data = view;
+	rec->ops = &reftable_ref_record_view_vtable;
+}
+
+void reftable_record_from_log_view(struct reftable_record *rec,
+				   struct reftable_log_record_view *view)
+{
+	assert(!rec->ops);
+	rec->data = view;
+	rec->ops = &reftable_log_record_view_vtable;
+}
+
+void reftable_record_from_ref_key(struct reftable_record *rec,
+				  struct reftable_ref_record_view *view)
+{
+	assert(!rec->ops);
+	rec->data = view;
+	rec->ops = &reftable_ref_key_record_vtable;
+}
+
+void reftable_record_from_log_key(struct reftable_record *rec,
+				  struct reftable_log_record_view *view)
+{
+	assert(!rec->ops);
+	rec->data = view;
+	rec->ops = &reftable_log_key_record_vtable;
+}
+
+int reftable_record_is_view(struct reftable_record *rec)
+{
+	return rec->ops->copy_to_full != NULL ||
+	       reftable_record_is_key_only(rec);
+}
+
+int reftable_record_is_key_only(struct reftable_record *rec)
+{
+	return rec->ops == &reftable_ref_key_record_vtable ||
+	       rec->ops == &reftable_log_key_record_vtable;
+}
+
+void reftable_record_set_key_only(struct reftable_record *rec, int key_only)
+{
+	if (rec->ops == &reftable_ref_record_view_vtable ||
+	    rec->ops == &reftable_ref_key_record_vtable)
+		rec->ops = key_only ? &reftable_ref_key_record_vtable :
+				      &reftable_ref_record_view_vtable;
+	else if (rec->ops == &reftable_log_record_view_vtable ||
+		 rec->ops == &reftable_log_key_record_vtable)
+		rec->ops = key_only ? &reftable_log_key_record_vtable :
+				      &reftable_log_record_view_vtable;
+}
+
+struct reftable_ref_record_view *
+reftable_record_as_ref_view(struct reftable_record *rec)
+{
+	assert(rec->ops == &reftable_ref_record_view_vtable ||
+	       rec->ops == &reftable_ref_key_record_vtable);
+	return rec->data;
+}
+
 struct reftable_ref_record *reftable_record_as_ref(struct reftable_record *rec)
 {
 	assert(reftable_record_type(rec) == BLOCK_TYPE_REF);
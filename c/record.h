@@ -42,6 +42,10 @@ struct reftable_record_vtable {
 
 	void (*copy_from)(void *dest, const void *src, int hash_size);
 
+	/* For views: copies the view `src` into a full record of the same
+	 * type. NULL for full records. */
+	void (*copy_to_full)(void *dest, const void *src, int hash_size);
+
 	/* a value of [0..7], indicating record subvariants (eg. ref vs. symref
 	 * vs ref deletion) */
 	uint8_t (*val_type)(const void *rec);
@@ -72,16 +76,35 @@ int reftable_is_block_type(uint8_t typ);
 /* creates a malloced record of the given type. Dispose with record_destroy */
 struct reftable_record reftable_new_record(uint8_t typ);
 
+/* like reftable_new_record, but creates a view for the types that have one
+ * (refs and logs). */
+struct reftable_record reftable_new_view_record(uint8_t typ);
+
 /* Encode `key` into `dest`. Sets `is_restart` to indicate a restart. Returns
  * number of bytes written. */
 int reftable_encode_key(int *is_restart, struct string_view dest,
 			struct strbuf prev_key, struct strbuf key,
 			uint8_t extra);
 
+/* Decodes the prefix length, suffix length and `extra` of a key. The suffix
+ * itself follows the returned number of bytes in `in`. */
+int reftable_decode_keylen(struct string_view in, uint64_t *prefix_len,
+			   uint64_t *suffix_len, uint8_t *extra);
+
 /* Decode into `key` and `extra` from `in` */
 int reftable_decode_key(struct strbuf *key, uint8_t *extra,
 			struct strbuf last_key, struct string_view in);
 
+/* Like reftable_decode_key, but decodes the key following `key` in place. */
+int reftable_decode_next_key(struct strbuf *key, uint8_t *extra,
+			     struct string_view in);
+
+/* Returns the size of the value of a record of type `typ` and value type
+ * `extra` encoded at the start of `in`, without decoding it, or -1 for
+ * malformed input. */
+int reftable_record_skip_value(uint8_t typ, uint8_t extra,
+			       struct string_view in, int hash_size);
+
 /* reftable_index_record are used internally to speed up lookups. */
 struct reftable_index_record {
 	uint64_t offset; /* Offset of block */
@@ -127,8 +150,30 @@ void reftable_record_from_ref(struct reftable_record *rec,
 			      struct reftable_ref_record *refrec);
 void reftable_record_from_log(struct reftable_record *rec,
 			      struct reftable_log_record *logrec);
+void reftable_record_from_ref_view(struct reftable_record *rec,
+				   struct reftable_ref_record_view *view);
+void reftable_record_from_log_view(struct reftable_record *rec,
+				   struct reftable_log_record_view *view);
+void reftable_record_from_ref_key(struct reftable_record *rec,
+				  struct reftable_ref_record_view *view);
+void reftable_record_from_log_key(struct reftable_record *rec,
+				  struct reftable_log_record_view *view);
 struct reftable_ref_record *reftable_record_as_ref(struct reftable_record *ref);
 struct reftable_log_record *reftable_record_as_log(struct reftable_record *ref);
+struct reftable_ref_record_view *
+reftable_record_as_ref_view(struct reftable_record *rec);
+
+/* returns whether `rec` is a view, see struct reftable_ref_record_view. Copying
+ * a view into a full record is supported, but not the reverse. */
+int reftable_record_is_view(struct reftable_record *rec);
+
+/* returns whether `rec` is a key record, a view whose value is skipped when
+ * decoding, see reftable_iterator_next_ref_key. */
+int reftable_record_is_key_only(struct reftable_record *rec);
+
+/* switches the view `rec` between key records and full views. Has no effect on
+ * other records. */
+void reftable_record_set_key_only(struct reftable_record *rec, int key_only);
 
 /* for qsort. */
 int reftable_ref_record_compare_name(const void *a, const void *b);
@@ -65,6 +65,10 @@ static void test_varint_roundtrip(void)
 		EXPECT(n > 0);
 
 		EXPECT(got == in);
+
+		/* a truncated varint is an error. */
+		out.len = n - 1;
+		EXPECT(get_var_int(&got, &out) < 0);
 	}
 }
 
@@ -78,6 +82,10 @@ static void test_common_prefix(void)
 		{ "", "abc", 0 },
 		{ "abc", "abd", 2 },
 		{ "abc", "pqr", 0 },
+		{ "refs/heads/master", "refs/heads/main", 13 },
+		{ "refs/heads/master", "refs/heads/master", 17 },
+		{ "refs/heads/", "refs/heads/master", 11 },
+		{ "refs/tags/v1.0", "refs/heads/master", 5 },
 	};
 
 	int i = 0;
@@ -258,6 +266,160 @@ static void test_reftable_log_record_roundtrip(void)
 	}
 }
 
+/* Decodes `encoded` into a view, and checks that it converts back to `in`
+ * and encodes to the same bytes. */
+static void check_view_roundtrip(struct reftable_record *in,
+				 struct reftable_record *view,
+				 struct reftable_record *out,
+				 struct string_view encoded, int n)
+{
+	struct strbuf key = STRBUF_INIT;
+	struct strbuf view_key = STRBUF_INIT;
+	uint8_t buffer[1024] = { 0 };
+	struct string_view dest = {
+		.buf = buffer,
+		.len = sizeof(buffer),
+	};
+	uint8_t val_type = reftable_record_val_type(in);
+
+	reftable_record_key(in, &key);
+	EXPECT(reftable_record_decode(view, key, val_type, encoded,
+				      GIT_SHA1_RAWSZ) == n);
+	EXPECT(reftable_record_is_view(view));
+	EXPECT(reftable_record_val_type(view) == val_type);
+	reftable_record_key(view, &view_key);
+	EXPECT(!strbuf_cmp(&key, &view_key));
+
+	EXPECT(reftable_record_encode(view, dest, GIT_SHA1_RAWSZ) == n);
+	EXPECT(!memcmp(buffer, encoded.buf, n));
+
+	reftable_record_copy_from(out, view, GIT_SHA1_RAWSZ);
+
+	/* key records skip over the same bytes. */
+	reftable_record_set_key_only(view, 1);
+	EXPECT(reftable_record_is_key_only(view));
+	EXPECT(reftable_record_decode(view, key, val_type, encoded,
+				      GIT_SHA1_RAWSZ) == n);
+	EXPECT(reftable_record_val_type(view) == val_type);
+	reftable_record_key(view, &view_key);
+	EXPECT(!strbuf_cmp(&key, &view_key));
+	reftable_record_set_key_only(view, 0);
+
+	strbuf_release(&key);
+	strbuf_release(&view_key);
+}
+
+static void test_reftable_ref_record_view_roundtrip(void)
+{
+	int i = 0;
+
+	for (i = REFTABLE_REF_DELETION; i < REFTABLE_NR_REF_VALUETYPES; i++) {
+		struct reftable_ref_record in = {
+			.refname = "refs/heads/master",
+			.update_index = 42,
+			.value_type = i,
+		};
+		uint8_t h1[GIT_SHA1_RAWSZ];
+		uint8_t h2[GIT_SHA1_RAWSZ];
+		struct reftable_ref_record_view view = { NULL };
+		struct reftable_ref_record out = { NULL };
+		struct reftable_record rec = { NULL };
+		struct reftable_record rec_view = { NULL };
+		struct reftable_record rec_out = { NULL };
+		uint8_t buffer[1024] = { 0 };
+		struct string_view dest = {
+			.buf = buffer,
+			.len = sizeof(buffer),
+		};
+		int n;
+
+		set_hash(h1, 1);
+		set_hash(h2, 2);
+		switch (i) {
+		case REFTABLE_REF_VAL1:
+			in.value.val1 = h1;
+			break;
+		case REFTABLE_REF_VAL2:
+			in.value.val2.value = h1;
+			in.value.val2.target_value = h2;
+			break;
+		case REFTABLE_REF_SYMREF:
+			in.value.symref = "target";
+			break;
+		}
+
+		reftable_record_from_ref(&rec, &in);
+		reftable_record_from_ref_view(&rec_view, &view);
+		reftable_record_from_ref(&rec_out, &out);
+		n = reftable_record_encode(&rec, dest, GIT_SHA1_RAWSZ);
+		EXPECT(n > 0);
+		dest.len = n;
+
+		check_view_roundtrip(&rec, &rec_view, &rec_out, dest, n);
+		EXPECT(view.refname_len == strlen(in.refname));
+		EXPECT(reftable_ref_record_equal(&in, &out, GIT_SHA1_RAWSZ));
+		reftable_ref_record_release(&out);
+	}
+}
+
+static void test_reftable_log_record_view_roundtrip(void)
+{
+	uint8_t h1[GIT_SHA1_RAWSZ];
+	uint8_t h2[GIT_SHA1_RAWSZ];
+	struct reftable_log_record in[2] = {
+		{
+			.refname = "refs/heads/master",
+			.update_index = 42,
+			.value_type = REFTABLE_LOG_UPDATE,
+			.value = {
+				.update = {
+					.old_hash = h1,
+					.new_hash = h2,
+					.name = "han-wen",
+					.email = "hanwen@google.com",
+					.message = "test",
+					.time = 1577123507,
+					.tz_offset = 100,
+				},
+			},
+		},
+		{
+			.refname = "refs/heads/master",
+			.update_index = 22,
+			.value_type = REFTABLE_LOG_DELETION,
+		}
+	};
+	int i;
+
+	set_test_hash(h1, 1);
+	set_test_hash(h2, 2);
+	for (i = 0; i < ARRAY_SIZE(in); i++) {
+		struct reftable_log_record_view view = { NULL };
+		struct reftable_log_record out = { NULL };
+		struct reftable_record rec = { NULL };
+		struct reftable_record rec_view = { NULL };
+		struct reftable_record rec_out = { NULL };
+		uint8_t buffer[1024] = { 0 };
+		struct string_view dest = {
+			.buf = buffer,
+			.len = sizeof(buffer),
+		};
+		int n;
+
+		reftable_record_from_log(&rec, &in[i]);
+		reftable_record_from_log_view(&rec_view, &view);
+		reftable_record_from_log(&rec_out, &out);
+		n = reftable_record_encode(&rec, dest, GIT_SHA1_RAWSZ);
+		EXPECT(n >= 0);
+		dest.len = n;
+
+		check_view_roundtrip(&rec, &rec_view, &rec_out, dest, n);
+		EXPECT(view.update_index == in[i].update_index);
+		EXPECT(reftable_log_record_equal(&in[i], &out, GIT_SHA1_RAWSZ));
+		reftable_log_record_release(&out);
+	}
+}
+
 static void test_u24_roundtrip(void)
 {
 	uint32_t in = 0x112233;
@@ -402,6 +564,8 @@ int record_test_main(int argc, const char *argv[])
 	RUN_TEST(test_reftable_log_record_equal);
 	RUN_TEST(test_reftable_log_record_roundtrip);
 	RUN_TEST(test_reftable_ref_record_roundtrip);
+	RUN_TEST(test_reftable_ref_record_view_roundtrip);
+	RUN_TEST(test_reftable_log_record_view_roundtrip);
 	RUN_TEST(test_varint_roundtrip);
 	RUN_TEST(test_key_roundtrip);
 	RUN_TEST(test_common_prefix);
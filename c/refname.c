@@ -69,7 +69,8 @@ static int modification_has_ref_with_prefix(struct modification *mod,
 					    const char *prefix)
 {
 	struct reftable_iterator it = { NULL };
-	struct reftable_ref_record ref = { NULL };
+	/* only names are needed, so don't decode values. */
+	struct reftable_ref_record_view ref = { NULL };
 	int err = 0;
 
 	if (mod->add_len > 0) {
@@ -87,7 +88,7 @@ static int modification_has_ref_with_prefix(struct modification *mod,
 		goto done;
 
 	while (1) {
-		err = reftable_iterator_next_ref(&it, &ref);
+		err = reftable_iterator_next_ref_key(&it, &ref);
 		if (err)
 			goto done;
 
@@ -112,7 +113,6 @@ static int modification_has_ref_with_prefix(struct modification *mod,
 	}
 
 done:
-	reftable_ref_record_release(&ref);
 	reftable_iterator_destroy(&it);
 	return err;
 }
@@ -0,0 +1,153 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "spill.h"
+
+#include "basics.h"
+#include "reftable-error.h"
+
+/* amount of appended data to collect before writing it out. */
+#define SPILL_WRITE_BUFFER (64 * 1024)
+
+static FILE *spill_create(const char *dir)
+{
+	struct strbuf name = STRBUF_INIT;
+	FILE *f = NULL;
+	int fd = 0;
+	if (!dir)
+		return tmpfile();
+
+	strbuf_addstr(&name, dir);
+	strbuf_addstr(&name, "/spill.temp.XXXXXX");
+	fd = mkstemp(name.buf);
+	if (fd >= 0) {
+		unlink(name.buf);
+		f = fdopen(fd, "w+");
+		if (!f)
+			close(fd);
+	}
+	strbuf_release(&name);
+	return f;
+}
+
+static int spill_flush(struct spill_file *s)
+{
+	int fd = 0;
+	uint64_t off = 0;
+	size_t done = 0;
+	if (s->buf.len == 0)
+		return 0;
+
+	if (!s->file) {
+		s->file = spill_create(s->dir);
+		if (!s->file)
+			return REFTABLE_IO_ERROR;
+	}
+
+	fd = fileno(s->file);
+	off = s->len - s->buf.len;
+	while (done < s->buf.len) {
+		ssize_t n = pwrite(fd, s->buf.buf + done, s->buf.len - done,
+				   off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return REFTABLE_IO_ERROR;
+		done += n;
+	}
+	strbuf_reset(&s->buf);
+	return 0;
+}
+
+int spill_append(struct spill_file *s, const void *data, size_t sz)
+{
+	strbuf_add(&s->buf, data, sz);
+	s->len += sz;
+	if (s->buf.len >= SPILL_WRITE_BUFFER)
+		return spill_flush(s);
+	return 0;
+}
+
+void spill_file_release(struct spill_file *s)
+{
+	if (s->file)
+		fclose(s->file);
+	s->file = NULL;
+	s->len = 0;
+	strbuf_release(&s->buf);
+}
+
+int spill_reader_init(struct spill_reader *r, struct spill_file *s,
+		      uint64_t off, uint64_t end, size_t buf_size)
+{
+	struct spill_reader empty = { NULL };
+	int err = spill_flush(s);
+	*r = empty;
+	if (err < 0)
+		return err;
+
+	assert(off <= end && end <= s->len);
+	r->file = s;
+	r->off = off;
+	r->end = end;
+	r->buf_cap = buf_size;
+	r->buf = reftable_malloc(buf_size);
+	return 0;
+}
+
+static int spill_reader_fill(struct spill_reader *r)
+{
+	size_t want = r->buf_cap;
+	ssize_t n = 0;
+	if (r->end - r->off < want)
+		want = r->end - r->off;
+	if (want == 0)
+		return 1;
+
+	do {
+		n = pread(fileno(r->file->file), r->buf, want, r->off);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return REFTABLE_IO_ERROR;
+
+	r->off += n;
+	r->buf_len = n;
+	r->buf_off = 0;
+	return 0;
+}
+
+int spill_read(struct spill_reader *r, void *dest, size_t sz)
+{
+	uint8_t *out = dest;
+	size_t done = 0;
+	while (done < sz) {
+		size_t avail = r->buf_len - r->buf_off;
+		if (avail == 0) {
+			int err = spill_reader_fill(r);
+			if (err > 0 && done == 0)
+				return 1;
+			if (err != 0)
+				return REFTABLE_IO_ERROR;
+			continue;
+		}
+		if (avail > sz - done)
+			avail = sz - done;
+		memcpy(out + done, r->buf + r->buf_off, avail);
+		r->buf_off += avail;
+		done += avail;
+	}
+	return 0;
+}
+
+void spill_reader_release(struct spill_reader *r)
+{
+	FREE_AND_NULL(r->buf);
+	r->buf_cap = 0;
+	r->buf_len = 0;
+	r->buf_off = 0;
+}
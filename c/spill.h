@@ -0,0 +1,65 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include "system.h"
+
+/*
+ * A spill file is an anonymous temporary file for data that doesn't fit in
+ * memory. Data is appended, and read back with spill_readers. The file is
+ * created in `dir` on the first append, and unlinked right away, so it goes
+ * away when released, or if the process dies.
+ */
+struct spill_file {
+	/* directory for the file, not owned. If NULL, the system's temporary
+	 * directory. */
+	const char *dir;
+	FILE *file;
+	/* number of bytes appended, including those still in `buf`. */
+	uint64_t len;
+	/* appended bytes not yet written to `file`. */
+	struct strbuf buf;
+};
+
+#define SPILL_FILE_INIT            \
+	{                          \
+		.buf = STRBUF_INIT \
+	}
+
+/* appends `sz` bytes of `data`. Returns REFTABLE_IO_ERROR on failure. */
+int spill_append(struct spill_file *s, const void *data, size_t sz);
+
+/* closes and removes the file, and resets `s` to empty, keeping `dir`. */
+void spill_file_release(struct spill_file *s);
+
+/* reads the bytes [off, end) of a spill file in order, buffered. */
+struct spill_reader {
+	struct spill_file *file;
+	uint64_t off;
+	uint64_t end;
+
+	uint8_t *buf;
+	size_t buf_cap;
+	size_t buf_len;
+	size_t buf_off;
+};
+
+/* initializes `r` to read [off, end) of `s` through a buffer of `buf_size`
+ * bytes. Returns REFTABLE_IO_ERROR if pending data can't be written out. */
+int spill_reader_init(struct spill_reader *r, struct spill_file *s,
+		      uint64_t off, uint64_t end, size_t buf_size);
+
+/* reads the next `sz` bytes into `dest`. Returns 1 at the end of the range,
+ * and REFTABLE_IO_ERROR on failure or if the range ends within the read. */
+int spill_read(struct spill_reader *r, void *dest, size_t sz);
+
+void spill_reader_release(struct spill_reader *r);
+
+#endif
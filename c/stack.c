@@ -9,9 +9,14 @@ https://developers.google.com/open-source/licenses/bsd
 #include "stack.h"
 
 #include "system.h"
+#include "budget.h"
+#include "compactor.h"
+#include "constants.h"
 #include "merged.h"
 #include "reader.h"
 #include "refname.h"
+#include "threadpool.h"
+#include "watcher.h"
 #include "reftable-error.h"
 #include "reftable-record.h"
 #include "reftable-merged.h"
@@ -47,11 +52,20 @@ static ssize_t reftable_fd_write(void *arg, const void *data, size_t sz)
 
 int reftable_new_stack(struct reftable_stack **dest, const char *dir,
 		       struct reftable_write_options config)
+{
+	return stack_new(dest, dir, config, 1);
+}
+
+int stack_new(struct reftable_stack **dest, const char *dir,
+	      struct reftable_write_options config, int use_budget)
 {
 	struct reftable_stack *p =
 		reftable_calloc(sizeof(struct reftable_stack));
 	struct strbuf list_file_name = STRBUF_INIT;
 	int err = 0;
+#ifndef NO_PTHREADS
+	pthread_mutexattr_t attr;
+#endif
 
 	if (config.hash_id == 0) {
 		config.hash_id = GIT_SHA1_FORMAT_ID;
@@ -66,8 +80,28 @@ int reftable_new_stack(struct reftable_stack **dest, const char *dir,
 	p->list_file = strbuf_detach(&list_file_name, NULL);
 	p->reftable_dir = xstrdup(dir);
 	p->config = config;
+	if (!p->config.spill_dir)
+		p->config.spill_dir = p->reftable_dir;
+#ifndef NO_PTHREADS
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&p->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&p->snapshot_mutex, NULL);
+#endif
+	if (use_budget)
+		p->block_cache = memory_budget_register(&p->account);
+	if (!p->block_cache && config.block_cache_size > 0)
+		p->block_cache = block_cache_new(config.block_cache_size);
+	/* watch before loading, so no change goes unnoticed. */
+	if (config.watch_tables_list)
+		stack_watcher_start(&p->watcher, dir);
 
 	err = reftable_stack_reload_maybe_reuse(p, 1);
+	if (err >= 0 && config.background_compaction) {
+		err = stack_compactor_start(&p->compactor, dir, config);
+		p->owns_compactor = 1;
+	}
 	if (err < 0) {
 		reftable_stack_destroy(p);
 	} else {
@@ -105,6 +139,78 @@ done:
 	return err;
 }
 
+/* fills `dest` from the stat data of tables.list. */
+static void stack_list_stat_fill(struct stack_list_stat *dest,
+				 struct stat *st)
+{
+	struct timeval now = { 0 };
+
+	gettimeofday(&now, NULL);
+	dest->exists = 1;
+	dest->dev = st->st_dev;
+	dest->ino = st->st_ino;
+	dest->size = st->st_size;
+	dest->mtime_sec = st->st_mtime;
+	dest->mtime_nsec = ST_MTIME_NSEC(*st);
+	/* leave a second of slack for file systems with coarse clocks. */
+	dest->valid = dest->mtime_sec + 1 < now.tv_sec;
+}
+
+static int stack_list_stat_equal(struct stack_list_stat *a,
+				 struct stack_list_stat *b)
+{
+	if (a->exists != b->exists)
+		return 0;
+	return !a->exists ||
+	       (a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec);
+}
+
+/* stats tables.list of `st` into `dest`. */
+static int stack_stat_list(struct reftable_stack *st,
+			   struct stack_list_stat *dest)
+{
+	struct stat buf = { 0 };
+
+	memset(dest, 0, sizeof(*dest));
+	if (stat(st->list_file, &buf) < 0) {
+		if (errno != ENOENT)
+			return REFTABLE_IO_ERROR;
+		dest->valid = 1;
+		return 0;
+	}
+	stack_list_stat_fill(dest, &buf);
+	return 0;
+}
+
+/* like read_lines() for tables.list of `st`, also returning its stat data. */
+static int stack_read_list(struct reftable_stack *st, char ***namesp,
+			   struct stack_list_stat *dest)
+{
+	struct stat buf = { 0 };
+	int fd = open(st->list_file, O_RDONLY);
+	int err = 0;
+
+	memset(dest, 0, sizeof(*dest));
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			*namesp = reftable_calloc(sizeof(char *));
+			dest->valid = 1;
+			return 0;
+		}
+
+		return REFTABLE_IO_ERROR;
+	}
+	if (fstat(fd, &buf) < 0) {
+		close(fd);
+		return REFTABLE_IO_ERROR;
+	}
+	stack_list_stat_fill(dest, &buf);
+	err = fd_read_lines(fd, namesp);
+	close(fd);
+	return err;
+}
+
 int read_lines(const char *filename, char ***namesp)
 {
 	int fd = open(filename, O_RDONLY);
@@ -138,41 +244,170 @@ static int has_name(char **names, const char *name)
 	return 0;
 }
 
+static void stack_lock(struct reftable_stack *st)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&st->mutex);
+#endif
+}
+
+static void stack_unlock(struct reftable_stack *st)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&st->mutex);
+#endif
+}
+
+static void stack_lock_snapshots(struct reftable_stack *st)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&st->snapshot_mutex);
+#endif
+}
+
+static void stack_unlock_snapshots(struct reftable_stack *st)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&st->snapshot_mutex);
+#endif
+}
+
+/* Marks the readers of `snap` whose tables are not in `names` as dropped.
+ * Call with the snapshots locked. */
+static void stack_snapshot_drop_missing(struct reftable_stack_snapshot *snap,
+					char **names)
+{
+	size_t i = 0;
+	for (i = 0; i < snap->readers_len; i++) {
+		if (!has_name(names, reader_name(snap->readers[i])))
+			snap->readers[i]->dropped = 1;
+	}
+}
+
+/* Returns whether `snap` holds exactly the tables in `names`, in order. */
+static int stack_snapshot_has_names(struct reftable_stack_snapshot *snap,
+				    char **names)
+{
+	size_t i = 0;
+	for (i = 0; i < snap->readers_len; i++) {
+		if (!names[i] || strcmp(names[i], reader_name(snap->readers[i])))
+			return 0;
+	}
+	return !names[i];
+}
+
+/* Closes and frees a reader no snapshot uses anymore. */
+static void stack_close_reader(struct reftable_stack *st,
+			       struct reftable_reader *rd)
+{
+	struct strbuf filename = STRBUF_INIT;
+
+	if (rd->dropped) {
+		/* tables are immutable, so cached blocks stay valid if the
+		   table is reopened. Only drop the blocks of tables that are
+		   gone. */
+		if (st->block_cache)
+			block_cache_purge(st->block_cache, &st->account.blocks,
+					  reader_name(rd));
+		stack_filename(&filename, st, reader_name(rd));
+	}
+	reftable_reader_free(rd);
+
+	if (filename.len) {
+		/* On Windows, can only unlink after closing. */
+		unlink(filename.buf);
+	}
+	strbuf_release(&filename);
+}
+
+struct reftable_stack_snapshot *
+reftable_stack_snapshot_acquire(struct reftable_stack *st)
+{
+	struct reftable_stack_snapshot *snap = NULL;
+	stack_lock_snapshots(st);
+	snap = st->snapshot;
+	snap->refcount++;
+	stack_unlock_snapshots(st);
+	return snap;
+}
+
+struct reftable_merged_table *
+reftable_stack_snapshot_merged_table(struct reftable_stack_snapshot *snap)
+{
+	return snap->merged;
+}
+
+uint64_t
+reftable_stack_snapshot_generation(struct reftable_stack_snapshot *snap)
+{
+	return snap->generation;
+}
+
+void reftable_stack_snapshot_release(struct reftable_stack_snapshot *snap)
+{
+	struct reftable_stack *st = snap->stack;
+	size_t unused = 0;
+	size_t i = 0;
+
+	stack_lock_snapshots(st);
+	snap->refcount--;
+	if (snap->refcount > 0) {
+		stack_unlock_snapshots(st);
+		return;
+	}
+	/* collect the readers this was the last user of. */
+	for (i = 0; i < snap->readers_len; i++) {
+		struct reftable_reader *rd = snap->readers[i];
+		rd->refcount--;
+		if (rd->refcount == 0)
+			snap->readers[unused++] = rd;
+	}
+	stack_unlock_snapshots(st);
+
+	reftable_merged_table_free(snap->merged);
+	for (i = 0; i < unused; i++)
+		stack_close_reader(st, snap->readers[i]);
+	reftable_free(snap->readers);
+	reftable_free(snap);
+}
+
 /* Close and free the stack */
 void reftable_stack_destroy(struct reftable_stack *st)
 {
 	char **names = NULL;
 	int err = 0;
-	if (st->merged) {
-		reftable_merged_table_free(st->merged);
-		st->merged = NULL;
+	if (st->owns_compactor) {
+		stack_compactor_stop(st->compactor);
+		st->compactor = NULL;
 	}
 
-	err = read_lines(st->list_file, &names);
-	if (err < 0) {
-		FREE_AND_NULL(names);
-	}
+	if (st->snapshot) {
+		err = read_lines(st->list_file, &names);
+		if (err < 0) {
+			FREE_AND_NULL(names);
+		}
 
-	if (st->readers) {
-		int i = 0;
-		struct strbuf filename = STRBUF_INIT;
-		for (i = 0; i < st->readers_len; i++) {
-			const char *name = reader_name(st->readers[i]);
-			strbuf_reset(&filename);
-			if (names && !has_name(names, name)) {
-				stack_filename(&filename, st, name);
-			}
-			reftable_reader_free(st->readers[i]);
+		stack_lock_snapshots(st);
+		if (names)
+			stack_snapshot_drop_missing(st->snapshot, names);
+		stack_unlock_snapshots(st);
 
-			if (filename.len) {
-				/* On Windows, can only unlink after closing. */
-				unlink(filename.buf);
-			}
-		}
-		strbuf_release(&filename);
+		assert(st->snapshot->refcount == 1);
+		reftable_stack_snapshot_release(st->snapshot);
+		st->snapshot = NULL;
+		st->merged = NULL;
+		st->readers = NULL;
 		st->readers_len = 0;
-		FREE_AND_NULL(st->readers);
 	}
+	if (st->account.registered)
+		memory_budget_unregister(&st->account);
+	else
+		block_cache_free(st->block_cache);
+	stack_watcher_stop(st->watcher);
+#ifndef NO_PTHREADS
+	pthread_mutex_destroy(&st->mutex);
+	pthread_mutex_destroy(&st->snapshot_mutex);
+#endif
 	FREE_AND_NULL(st->list_file);
 	FREE_AND_NULL(st->reftable_dir);
 	reftable_free(st);
@@ -191,6 +426,82 @@ static struct reftable_reader **stack_copy_readers(struct reftable_stack *st,
 	return cur;
 }
 
+/* parses the update index range from a table name made by format_name(),
+ * followed by ".ref". */
+static int parse_table_name(const char *name, uint64_t *min, uint64_t *max)
+{
+	unsigned int rnd = 0;
+	int n = 0;
+	if (sscanf(name, "0x%12" SCNx64 "-0x%12" SCNx64 "-%8x%n", min, max,
+		   &rnd, &n) != 3 ||
+	    strcmp(name + n, ".ref"))
+		return -1;
+	return 0;
+}
+
+static int stack_open_reader(struct reftable_stack *st, const char *name,
+			     struct reftable_reader **dest)
+{
+	struct reftable_block_source src = { NULL };
+	struct strbuf table_path = STRBUF_INIT;
+	struct reftable_reader *rd = NULL;
+	uint64_t min = 0;
+	uint64_t max = 0;
+	int err = 0;
+
+	stack_filename(&table_path, st, name);
+	if (st->config.lazy_open_tables &&
+	    !parse_table_name(name, &min, &max)) {
+		rd = reader_new_lazy(table_path.buf, name, min, max,
+				     st->config.hash_id,
+				     st->config.pin_index_levels);
+		goto done;
+	}
+
+	err = reftable_block_source_from_mmap_file(&src, table_path.buf);
+	if (err < 0)
+		goto done;
+
+	err = reftable_new_reader(&rd, &src, name);
+	if (err < 0)
+		goto done;
+	if (st->config.pin_index_levels > 0) {
+		err = reftable_reader_pin_index_blocks(
+			rd, st->config.pin_index_levels);
+		if (err < 0) {
+			reftable_reader_free(rd);
+			rd = NULL;
+			goto done;
+		}
+	}
+
+done:
+	if (rd) {
+		rd->cache = st->block_cache;
+		rd->account = &st->account;
+		reader_charge(rd);
+		*dest = rd;
+	}
+	strbuf_release(&table_path);
+	return err;
+}
+
+/* the tables reftable_stack_reload_once() opens, with open_threads. */
+struct stack_open_tasks {
+	struct reftable_stack *st;
+	char **names;
+	struct reftable_reader **readers;
+	int *todo;
+	int *errs;
+};
+
+static void stack_open_task_run(void *arg, size_t i)
+{
+	struct stack_open_tasks *o = arg;
+	int j = o->todo[i];
+	o->errs[i] = stack_open_reader(o->st, o->names[j], &o->readers[j]);
+}
+
 static int reftable_stack_reload_once(struct reftable_stack *st, char **names,
 				      int reuse_open)
 {
@@ -202,47 +513,47 @@ static int reftable_stack_reload_once(struct reftable_stack *st, char **names,
 		reftable_calloc(sizeof(struct reftable_reader *) * names_len);
 	struct reftable_table *new_tables =
 		reftable_calloc(sizeof(struct reftable_table) * names_len);
-	int new_readers_len = 0;
+	int new_readers_len = names_len;
+	struct stack_open_tasks open = {
+		.st = st,
+		.names = names,
+		.readers = new_readers,
+		.todo = reftable_calloc(sizeof(int) * names_len),
+		.errs = reftable_calloc(sizeof(int) * names_len),
+	};
+	size_t todo_len = 0;
 	struct reftable_merged_table *new_merged = NULL;
+	struct reftable_stack_snapshot *snap = NULL;
+	struct reftable_stack_snapshot *old = NULL;
 	int i;
 
-	while (*names) {
-		struct reftable_reader *rd = NULL;
-		char *name = *names++;
-
+	for (i = 0; i < names_len; i++) {
 		/* this is linear; we assume compaction keeps the number of
 		   tables under control so this is not quadratic. */
 		int j = 0;
 		for (j = 0; reuse_open && j < cur_len; j++) {
-			if (cur[j] && 0 == strcmp(cur[j]->name, name)) {
-				rd = cur[j];
+			if (cur[j] && 0 == strcmp(cur[j]->name, names[i])) {
+				new_readers[i] = cur[j];
 				cur[j] = NULL;
 				break;
 			}
 		}
+		if (!new_readers[i])
+			open.todo[todo_len++] = i;
+	}
 
-		if (!rd) {
-			struct reftable_block_source src = { NULL };
-			struct strbuf table_path = STRBUF_INIT;
-			stack_filename(&table_path, st, name);
-
-			err = reftable_block_source_from_file(&src,
-							      table_path.buf);
-			strbuf_release(&table_path);
-
-			if (err < 0)
-				goto done;
-
-			err = reftable_new_reader(&rd, &src, name);
-			if (err < 0)
-				goto done;
+	threadpool_run(st->config.open_threads, todo_len, &stack_open_task_run,
+		       &open);
+	for (i = 0; i < todo_len; i++) {
+		if (open.errs[i] < 0) {
+			err = open.errs[i];
+			goto done;
 		}
-
-		new_readers[new_readers_len] = rd;
-		reftable_table_from_reader(&new_tables[new_readers_len], rd);
-		new_readers_len++;
 	}
 
+	for (i = 0; i < names_len; i++)
+		reftable_table_from_reader(&new_tables[i], new_readers[i]);
+
 	/* success! */
 	err = reftable_new_merged_table(&new_merged, new_tables,
 					new_readers_len, st->config.hash_id);
@@ -250,41 +561,50 @@ static int reftable_stack_reload_once(struct reftable_stack *st, char **names,
 		goto done;
 
 	new_tables = NULL;
-	st->readers_len = new_readers_len;
-	if (st->merged) {
-		merged_table_release(st->merged);
-		reftable_merged_table_free(st->merged);
-	}
-	if (st->readers) {
-		reftable_free(st->readers);
-	}
-	st->readers = new_readers;
+	new_merged->suppress_deletions = 1;
+	reftable_merged_table_set_loser_tree(new_merged,
+					     st->config.loser_tree_merge);
+
+	snap = reftable_calloc(sizeof(struct reftable_stack_snapshot));
+	snap->refcount = 1;
+	snap->stack = st;
+	snap->generation = 1;
+	if (st->snapshot) {
+		snap->generation = st->snapshot->generation;
+		if (!stack_snapshot_has_names(st->snapshot, names))
+			snap->generation++;
+	}
+	snap->readers = new_readers;
+	snap->readers_len = new_readers_len;
+	snap->merged = new_merged;
 	new_readers = NULL;
 	new_readers_len = 0;
 
-	new_merged->suppress_deletions = 1;
-	st->merged = new_merged;
-	for (i = 0; i < cur_len; i++) {
-		if (cur[i]) {
-			const char *name = reader_name(cur[i]);
-			struct strbuf filename = STRBUF_INIT;
-			stack_filename(&filename, st, name);
-
-			reader_close(cur[i]);
-			reftable_reader_free(cur[i]);
-
-			/* On Windows, can only unlink after closing. */
-			unlink(filename.buf);
-
-			strbuf_release(&filename);
-		}
-	}
+	/* publish the new version. The previous one lives on while other
+	   snapshots of it are in use. */
+	stack_lock_snapshots(st);
+	for (i = 0; i < snap->readers_len; i++)
+		snap->readers[i]->refcount++;
+	old = st->snapshot;
+	if (old)
+		stack_snapshot_drop_missing(old, names);
+	st->snapshot = snap;
+	stack_unlock_snapshots(st);
+
+	st->readers = snap->readers;
+	st->readers_len = snap->readers_len;
+	st->merged = snap->merged;
+	if (old)
+		reftable_stack_snapshot_release(old);
 
 done:
+	/* readers used by snapshots were reused, not opened here. */
 	for (i = 0; i < new_readers_len; i++) {
-		reader_close(new_readers[i]);
-		reftable_reader_free(new_readers[i]);
+		if (new_readers[i] && !new_readers[i]->refcount)
+			reftable_reader_free(new_readers[i]);
 	}
+	reftable_free(open.todo);
+	reftable_free(open.errs);
 	reftable_free(new_readers);
 	reftable_free(new_tables);
 	reftable_free(cur);
@@ -303,8 +623,8 @@ static int tv_cmp(struct timeval *a, struct timeval *b)
 	return udiff;
 }
 
-static int reftable_stack_reload_maybe_reuse(struct reftable_stack *st,
-					     int reuse_open)
+/* Reloads the stack. Call with the stack locked. */
+static int stack_reload_locked(struct reftable_stack *st, int reuse_open)
 {
 	struct timeval deadline = { 0 };
 	int err = gettimeofday(&deadline, NULL);
@@ -317,6 +637,7 @@ static int reftable_stack_reload_maybe_reuse(struct reftable_stack *st,
 	while (1) {
 		char **names = NULL;
 		char **names_after = NULL;
+		struct stack_list_stat list_stat = { 0 };
 		struct timeval now = { 0 };
 		int err = gettimeofday(&now, NULL);
 		int err2 = 0;
@@ -331,13 +652,14 @@ static int reftable_stack_reload_maybe_reuse(struct reftable_stack *st,
 			break;
 		}
 
-		err = read_lines(st->list_file, &names);
+		err = stack_read_list(st, &names, &list_stat);
 		if (err < 0) {
 			free_names(names);
 			return err;
 		}
 		err = reftable_stack_reload_once(st, names, reuse_open);
 		if (err == 0) {
+			st->list_stat = list_stat;
 			free_names(names);
 			break;
 		}
@@ -376,9 +698,21 @@ static int reftable_stack_reload_maybe_reuse(struct reftable_stack *st,
  1 = changed. */
 static int stack_uptodate(struct reftable_stack *st)
 {
+	struct stack_list_stat list_stat = { 0 };
 	char **names = NULL;
-	int err = read_lines(st->list_file, &names);
+	int err = 0;
 	int i = 0;
+
+	/* a new version of tables.list is a new file. */
+	if (st->list_stat.valid) {
+		err = stack_stat_list(st, &list_stat);
+		if (err < 0)
+			return err;
+		if (stack_list_stat_equal(&list_stat, &st->list_stat))
+			return 0;
+	}
+
+	err = stack_read_list(st, &names, &list_stat);
 	if (err < 0)
 		return err;
 
@@ -399,19 +733,49 @@ static int stack_uptodate(struct reftable_stack *st)
 		goto done;
 	}
 
+	/* the same tables; recognize this version from now on. */
+	st->list_stat = list_stat;
+
 done:
 	free_names(names);
 	return err;
 }
 
+static int reftable_stack_reload_maybe_reuse(struct reftable_stack *st,
+					     int reuse_open)
+{
+	int err = 0;
+	stack_lock(st);
+	err = stack_reload_locked(st, reuse_open);
+	stack_unlock(st);
+	return err;
+}
+
 int reftable_stack_reload(struct reftable_stack *st)
 {
-	int err = stack_uptodate(st);
+	int err = 0;
+	stack_lock(st);
+	if (!stack_watcher_changed(st->watcher))
+		goto done;
+	err = stack_uptodate(st);
 	if (err > 0)
-		return reftable_stack_reload_maybe_reuse(st, 1);
+		err = stack_reload_locked(st, 1);
+	if (err == 0)
+		stack_watcher_clear(st->watcher);
+done:
+	stack_unlock(st);
 	return err;
 }
 
+uint64_t reftable_stack_generation(struct reftable_stack *st)
+{
+	uint64_t generation = 0;
+	stack_lock_snapshots(st);
+	generation = st->snapshot->generation;
+	stack_unlock_snapshots(st);
+	return generation;
+}
+
 int reftable_stack_add(struct reftable_stack *st,
 		       int (*write)(struct reftable_writer *wr, void *arg),
 		       void *arg)
@@ -427,10 +791,22 @@ int reftable_stack_add(struct reftable_stack *st,
 		return err;
 	}
 
-	if (!st->disable_auto_compact)
-		return reftable_stack_auto_compact(st);
+	if (st->disable_auto_compact)
+		return 0;
 
-	return 0;
+	if (st->compactor) {
+		stack_compactor_schedule(st->compactor);
+		return 0;
+	}
+
+	return reftable_stack_auto_compact(st);
+}
+
+int reftable_stack_wait_for_compaction(struct reftable_stack *st)
+{
+	if (!st->compactor)
+		return 0;
+	return stack_compactor_wait(st->compactor);
 }
 
 static void format_name(struct strbuf *dest, uint64_t min, uint64_t max)
@@ -447,6 +823,10 @@ struct reftable_addition {
 	int lock_file_fd;
 	struct strbuf lock_file_name;
 	struct reftable_stack *stack;
+	/* whether we hold the stack lock, and the list lock of the stack's
+	 * compactor. */
+	int stack_locked;
+	int list_locked;
 
 	char **new_tables;
 	int new_tables_len;
@@ -468,6 +848,11 @@ static int reftable_stack_init_addition(struct reftable_addition *add,
 	strbuf_addstr(&add->lock_file_name, st->list_file);
 	strbuf_addstr(&add->lock_file_name, ".lock");
 
+	stack_lock(st);
+	add->stack_locked = 1;
+	stack_compactor_lock_list(st->compactor);
+	add->list_locked = 1;
+
 	add->lock_file_fd = open(add->lock_file_name.buf,
 				 O_EXCL | O_CREAT | O_WRONLY, 0644);
 	if (add->lock_file_fd < 0) {
@@ -482,6 +867,18 @@ static int reftable_stack_init_addition(struct reftable_addition *add,
 	if (err < 0)
 		goto done;
 
+	if (err > 0 && st->compactor) {
+		/* Our own compactor rewrites the stack behind our back. That
+		 * doesn't change its contents, so just catch up. */
+		uint64_t next_update_index =
+			reftable_stack_next_update_index(st);
+		err = reftable_stack_reload(st);
+		if (err < 0)
+			goto done;
+		if (next_update_index != reftable_stack_next_update_index(st))
+			err = 1;
+	}
+
 	if (err > 1) {
 		err = REFTABLE_LOCK_ERROR;
 		goto done;
@@ -517,6 +914,14 @@ static void reftable_addition_close(struct reftable_addition *add)
 		unlink(add->lock_file_name.buf);
 		strbuf_release(&add->lock_file_name);
 	}
+	if (add->list_locked) {
+		stack_compactor_unlock_list(add->stack->compactor);
+		add->list_locked = 0;
+	}
+	if (add->stack_locked) {
+		stack_unlock(add->stack);
+		add->stack_locked = 0;
+	}
 
 	strbuf_release(&nm);
 }
@@ -713,11 +1118,16 @@ done:
 
 uint64_t reftable_stack_next_update_index(struct reftable_stack *st)
 {
-	int sz = st->merged->stack_len;
+	uint64_t next = 1;
+	int sz = 0;
+
+	stack_lock(st);
+	sz = st->merged->stack_len;
 	if (sz > 0)
-		return reftable_reader_max_update_index(st->readers[sz - 1]) +
+		next = reftable_reader_max_update_index(st->readers[sz - 1]) +
 		       1;
-	return 1;
+	stack_unlock(st);
+	return next;
 }
 
 static int stack_compact_locked(struct reftable_stack *st, int first, int last,
@@ -763,38 +1173,16 @@ done:
 	return err;
 }
 
-static int stack_write_compact(struct reftable_stack *st,
-			       struct reftable_writer *wr, int first, int last,
-			       struct reftable_log_expiry_config *config)
+/* Merges the refs of `mt` with names in [start, end) into `wr`. A NULL `end`
+ * is unbounded. */
+static int stack_write_compact_refs(struct reftable_merged_table *mt,
+				    struct reftable_writer *wr,
+				    int drop_deletions, const char *start,
+				    struct strbuf *end, uint64_t *entries)
 {
-	int subtabs_len = last - first + 1;
-	struct reftable_table *subtabs = reftable_calloc(
-		sizeof(struct reftable_table) * (last - first + 1));
-	struct reftable_merged_table *mt = NULL;
-	int err = 0;
 	struct reftable_iterator it = { NULL };
 	struct reftable_ref_record ref = { NULL };
-	struct reftable_log_record log = { NULL };
-
-	uint64_t entries = 0;
-
-	int i = 0, j = 0;
-	for (i = first, j = 0; i <= last; i++) {
-		struct reftable_reader *t = st->readers[i];
-		reftable_table_from_reader(&subtabs[j++], t);
-		st->stats.bytes += t->size;
-	}
-	reftable_writer_set_limits(wr, st->readers[first]->min_update_index,
-				   st->readers[last]->max_update_index);
-
-	err = reftable_new_merged_table(&mt, subtabs, subtabs_len,
-					st->config.hash_id);
-	if (err < 0) {
-		reftable_free(subtabs);
-		goto done;
-	}
-
-	err = reftable_merged_table_seek_ref(mt, &it, "");
+	int err = reftable_merged_table_seek_ref(mt, &it, start);
 	if (err < 0)
 		goto done;
 
@@ -807,8 +1195,11 @@ static int stack_write_compact(struct reftable_stack *st,
 		if (err < 0) {
 			break;
 		}
+		if (end && strcmp(ref.refname, end->buf) >= 0) {
+			break;
+		}
 
-		if (first == 0 && reftable_ref_record_is_deletion(&ref)) {
+		if (drop_deletions && reftable_ref_record_is_deletion(&ref)) {
 			continue;
 		}
 
@@ -816,14 +1207,44 @@ static int stack_write_compact(struct reftable_stack *st,
 		if (err < 0) {
 			break;
 		}
-		entries++;
+		(*entries)++;
 	}
+
+done:
 	reftable_iterator_destroy(&it);
+	reftable_ref_record_release(&ref);
+	return err;
+}
+
+/* Merges the logs of `mt` with keys in [start, end) into `wr`. NULL bounds
+ * are unbounded. */
+static int stack_write_compact_logs(struct reftable_merged_table *mt,
+				    struct reftable_writer *wr,
+				    int drop_deletions, struct strbuf *start,
+				    struct strbuf *end,
+				    struct reftable_log_expiry_config *config,
+				    uint64_t *entries)
+{
+	struct reftable_iterator it = { NULL };
+	struct reftable_log_record log = { NULL };
+	struct reftable_record rec = { NULL };
+	struct strbuf key = STRBUF_INIT;
+	int err = 0;
 
-	err = reftable_merged_table_seek_log(mt, &it, "");
+	if (start) {
+		/* a log key is the name, NUL, and the inverted update index.
+		 */
+		uint64_t update_index =
+			~get_be64((uint8_t *)start->buf + start->len - 8);
+		err = reftable_merged_table_seek_log_at(mt, &it, start->buf,
+							update_index);
+	} else {
+		err = reftable_merged_table_seek_log(mt, &it, "");
+	}
 	if (err < 0)
 		goto done;
 
+	reftable_record_from_log(&rec, &log);
 	while (1) {
 		err = reftable_iterator_next_log(&it, &log);
 		if (err > 0) {
@@ -833,7 +1254,13 @@ static int stack_write_compact(struct reftable_stack *st,
 		if (err < 0) {
 			break;
 		}
-		if (first == 0 && reftable_log_record_is_deletion(&log)) {
+		if (end) {
+			reftable_record_key(&rec, &key);
+			if (strbuf_cmp(&key, end) >= 0)
+				break;
+		}
+
+		if (drop_deletions && reftable_log_record_is_deletion(&log)) {
 			continue;
 		}
 
@@ -851,17 +1278,263 @@ static int stack_write_compact(struct reftable_stack *st,
 		if (err < 0) {
 			break;
 		}
-		entries++;
+		(*entries)++;
 	}
 
 done:
 	reftable_iterator_destroy(&it);
+	reftable_log_record_release(&log);
+	strbuf_release(&key);
+	return err;
+}
+
+/* A key range of the ref or log section, merged into a partition. */
+struct compact_task {
+	uint8_t typ;
+	/* the range [start, end); NULL bounds are unbounded. */
+	struct strbuf *start;
+	struct strbuf *end;
+	int first;
+
+	struct reftable_writer *wr;
+	struct strbuf data;
+	uint64_t entries;
+	int err;
+};
+
+struct compact_tasks {
+	struct reftable_stack *st;
+	struct reftable_writer *wr;
+	int first, last;
+	struct reftable_log_expiry_config *config;
+	struct compact_task *tasks;
+};
+
+static void compact_task_release(struct compact_task *t)
+{
+	if (t->wr)
+		reftable_writer_free(t->wr);
+	t->wr = NULL;
+	strbuf_release(&t->data);
+	t->entries = 0;
+	t->err = 0;
+}
+
+static void compact_task_run(void *arg, size_t i)
+{
+	struct compact_tasks *c = arg;
+	struct compact_task *t = &c->tasks[i];
+	int len = c->last - c->first + 1;
+	struct reftable_table *subtabs =
+		reftable_calloc(sizeof(struct reftable_table) * len);
+	struct reftable_merged_table *mt = NULL;
+	int j = 0;
+
+	for (j = 0; j < len; j++)
+		reftable_table_from_reader(&subtabs[j],
+					   c->st->readers[c->first + j]);
+	t->err = reftable_new_merged_table(&mt, subtabs, len,
+					   c->st->config.hash_id);
+	if (t->err < 0) {
+		reftable_free(subtabs);
+		return;
+	}
+	reftable_merged_table_set_loser_tree(mt, 1);
+
+	t->wr = writer_new_partition(c->wr, t->typ, t->first, &t->data);
+	if (t->typ == BLOCK_TYPE_REF)
+		t->err = stack_write_compact_refs(
+			mt, t->wr, c->first == 0, t->start ? t->start->buf : "",
+			t->end, &t->entries);
+	else
+		t->err = stack_write_compact_logs(mt, t->wr, c->first == 0,
+						  t->start, t->end, c->config,
+						  &t->entries);
+	if (t->err == 0)
+		t->err = writer_finish_partition(t->wr);
+
+	reftable_merged_table_free(mt);
+}
+
+/* Picks up to `want` - 1 keys splitting section `typ` of `r` into ranges of
+ * similar size. */
+static int stack_split_keys(struct reftable_reader *r, uint8_t typ,
+			    size_t want, struct strbuf **splits, size_t *len)
+{
+	struct strbuf *keys = NULL;
+	size_t keys_len = 0;
+	size_t usable = 0;
+	size_t i = 0;
+	int err = reader_index_keys(r, typ, want, &keys, &keys_len);
+	if (err < 0)
+		return err;
+
+	/* the last key ends the table. */
+	usable = keys_len > 0 ? keys_len - 1 : 0;
+	*len = usable < want - 1 ? usable : want - 1;
+	*splits = reftable_calloc(sizeof(struct strbuf) * (*len + 1));
+	for (i = 0; i < *len; i++) {
+		size_t k = (i + 1) * usable / (*len + 1);
+		(*splits)[i] = keys[k];
+		strbuf_init(&keys[k], 0);
+	}
+
+	for (i = 0; i < keys_len; i++)
+		strbuf_release(&keys[i]);
+	reftable_free(keys);
+	return 0;
+}
+
+static int stack_write_compact_parallel(struct reftable_stack *st,
+					struct reftable_writer *wr, int first,
+					int last,
+					struct reftable_log_expiry_config *config,
+					uint64_t *entries)
+{
+	int threads = st->config.compaction_threads;
+	struct reftable_reader *largest = st->readers[first];
+	struct strbuf *ref_splits = NULL;
+	size_t ref_splits_len = 0;
+	struct strbuf *log_splits = NULL;
+	size_t log_splits_len = 0;
+	struct compact_tasks c = {
+		.st = st,
+		.wr = wr,
+		.first = first,
+		.last = last,
+		.config = config,
+	};
+	size_t tasks_len = 0;
+	size_t ref_tasks = 0;
+	size_t i = 0;
+	int seen_data = 0;
+	int err = 0;
+
+	for (i = first; i <= last; i++) {
+		if (st->readers[i]->size > largest->size)
+			largest = st->readers[i];
+	}
+
+	/* several ranges per thread, to even out their sizes. */
+	err = stack_split_keys(largest, BLOCK_TYPE_REF, 4 * threads,
+			       &ref_splits, &ref_splits_len);
+	if (err < 0)
+		goto done;
+	err = stack_split_keys(largest, BLOCK_TYPE_LOG, 4 * threads,
+			       &log_splits, &log_splits_len);
+	if (err < 0)
+		goto done;
+
+	ref_tasks = ref_splits_len + 1;
+	tasks_len = ref_tasks + log_splits_len + 1;
+	c.tasks = reftable_calloc(sizeof(struct compact_task) * tasks_len);
+	for (i = 0; i < tasks_len; i++) {
+		struct compact_task *t = &c.tasks[i];
+		struct strbuf *splits = i < ref_tasks ? ref_splits : log_splits;
+		size_t splits_len =
+			i < ref_tasks ? ref_splits_len : log_splits_len;
+		size_t j = i < ref_tasks ? i : i - ref_tasks;
+
+		strbuf_init(&t->data, 0);
+		t->typ = i < ref_tasks ? BLOCK_TYPE_REF : BLOCK_TYPE_LOG;
+		t->start = j > 0 ? &splits[j - 1] : NULL;
+		t->end = j < splits_len ? &splits[j] : NULL;
+		t->first = i == 0;
+	}
+
+	threadpool_run(threads, tasks_len, &compact_task_run, &c);
+
+	for (i = 0; i < tasks_len; i++) {
+		struct compact_task *t = &c.tasks[i];
+		if (t->err < 0) {
+			err = t->err;
+			goto done;
+		}
+
+		if (!seen_data && t->wr->next > 0 && !t->first) {
+			/* Earlier ranges came out empty, so this one starts
+			 * the table after all. */
+			compact_task_release(t);
+			t->first = 1;
+			compact_task_run(&c, i);
+			if (t->err < 0) {
+				err = t->err;
+				goto done;
+			}
+		}
+		seen_data |= t->wr->next > 0;
+
+		err = writer_append_partition(wr, t->wr, &t->data);
+		if (err < 0)
+			goto done;
+		*entries += t->entries;
+		compact_task_release(t);
+	}
+
+done:
+	for (i = 0; c.tasks && i < tasks_len; i++)
+		compact_task_release(&c.tasks[i]);
+	reftable_free(c.tasks);
+	for (i = 0; i < ref_splits_len; i++)
+		strbuf_release(&ref_splits[i]);
+	reftable_free(ref_splits);
+	for (i = 0; i < log_splits_len; i++)
+		strbuf_release(&log_splits[i]);
+	reftable_free(log_splits);
+	return err;
+}
+
+static int stack_write_compact(struct reftable_stack *st,
+			       struct reftable_writer *wr, int first, int last,
+			       struct reftable_log_expiry_config *config)
+{
+	int subtabs_len = last - first + 1;
+	struct reftable_table *subtabs = NULL;
+	struct reftable_merged_table *mt = NULL;
+	int err = 0;
+	uint64_t entries = 0;
+	int i = 0;
+
+	for (i = first; i <= last; i++) {
+		err = reader_open(st->readers[i]);
+		if (err < 0)
+			return err;
+		st->stats.bytes += st->readers[i]->size;
+	}
+	reftable_writer_set_limits(wr, st->readers[first]->min_update_index,
+				   st->readers[last]->max_update_index);
+
+	if (st->config.compaction_threads > 1) {
+		st->stats.parallel_compactions++;
+		err = stack_write_compact_parallel(st, wr, first, last, config,
+						   &entries);
+		goto done;
+	}
+
+	subtabs = reftable_calloc(sizeof(struct reftable_table) * subtabs_len);
+	for (i = 0; i < subtabs_len; i++) {
+		reftable_table_from_reader(&subtabs[i], st->readers[first + i]);
+	}
+	err = reftable_new_merged_table(&mt, subtabs, subtabs_len,
+					st->config.hash_id);
+	if (err < 0) {
+		reftable_free(subtabs);
+		goto done;
+	}
+	reftable_merged_table_set_loser_tree(mt, 1);
+
+	err = stack_write_compact_refs(mt, wr, first == 0, "", NULL, &entries);
+	if (err < 0)
+		goto done;
+
+	err = stack_write_compact_logs(mt, wr, first == 0, NULL, NULL, config,
+				       &entries);
+
+done:
 	if (mt) {
 		merged_table_release(mt);
 		reftable_merged_table_free(mt);
 	}
-	reftable_ref_record_release(&ref);
-	reftable_log_record_release(&log);
 	st->stats.entries_written += entries;
 	return err;
 }
@@ -877,8 +1550,12 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	struct strbuf new_table_path = STRBUF_INIT;
 	int err = 0;
 	int have_lock = 0;
+	int list_locked = 0;
 	int lock_file_fd = 0;
 	int compact_count = last - first + 1;
+	char **names = NULL;
+	int names_len = 0;
+	int new_first = 0;
 	char **listp = NULL;
 	char **delete_on_success =
 		reftable_calloc(sizeof(char *) * (compact_count + 1));
@@ -899,6 +1576,9 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	strbuf_addstr(&lock_file_name, st->list_file);
 	strbuf_addstr(&lock_file_name, ".lock");
 
+	stack_compactor_lock_list(st->compactor);
+	list_locked = 1;
+
 	lock_file_fd =
 		open(lock_file_name.buf, O_EXCL | O_CREAT | O_WRONLY, 0644);
 	if (lock_file_fd < 0) {
@@ -954,6 +1634,8 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	if (err < 0)
 		goto done;
 	have_lock = 0;
+	stack_compactor_unlock_list(st->compactor);
+	list_locked = 0;
 
 	err = stack_compact_locked(st, first, last, &temp_tab_file_name,
 				   expiry);
@@ -966,6 +1648,9 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	if (err < 0)
 		goto done;
 
+	stack_compactor_lock_list(st->compactor);
+	list_locked = 1;
+
 	lock_file_fd =
 		open(lock_file_name.buf, O_EXCL | O_CREAT | O_WRONLY, 0644);
 	if (lock_file_fd < 0) {
@@ -978,6 +1663,25 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 	}
 	have_lock = 1;
 
+	/* Tables may have been added, or compacted outside our range, while
+	 * we were not holding the lock. The tables we locked are still there,
+	 * in order. */
+	err = read_lines(st->list_file, &names);
+	if (err < 0)
+		goto done;
+	names_len = names_length(names);
+	for (new_first = 0; new_first < names_len; new_first++) {
+		if (!strcmp(names[new_first], st->readers[first]->name))
+			break;
+	}
+	for (i = 0; i < compact_count; i++) {
+		if (new_first + i >= names_len ||
+		    strcmp(names[new_first + i], st->readers[first + i]->name)) {
+			err = 1;
+			goto done;
+		}
+	}
+
 	format_name(&new_table_name, st->readers[first]->min_update_index,
 		    st->readers[last]->max_update_index);
 	strbuf_addstr(&new_table_name, ".ref");
@@ -993,16 +1697,16 @@ static int stack_compact_range(struct reftable_stack *st, int first, int last,
 		}
 	}
 
-	for (i = 0; i < first; i++) {
-		strbuf_addstr(&ref_list_contents, st->readers[i]->name);
+	for (i = 0; i < new_first; i++) {
+		strbuf_addstr(&ref_list_contents, names[i]);
 		strbuf_addstr(&ref_list_contents, "\n");
 	}
 	if (!is_empty_table) {
 		strbuf_addbuf(&ref_list_contents, &new_table_name);
 		strbuf_addstr(&ref_list_contents, "\n");
 	}
-	for (i = last + 1; i < st->merged->stack_len; i++) {
-		strbuf_addstr(&ref_list_contents, st->readers[i]->name);
+	for (i = new_first + compact_count; i < names_len; i++) {
+		strbuf_addstr(&ref_list_contents, names[i]);
 		strbuf_addstr(&ref_list_contents, "\n");
 	}
 
@@ -1057,6 +1761,14 @@ done:
 	if (have_lock) {
 		unlink(lock_file_name.buf);
 	}
+	if (list_locked) {
+		stack_compactor_unlock_list(st->compactor);
+	}
+	if (temp_tab_file_name.len > 0) {
+		/* only left if we failed to install it. */
+		unlink(temp_tab_file_name.buf);
+	}
+	free_names(names);
 	strbuf_release(&new_table_name);
 	strbuf_release(&new_table_path);
 	strbuf_release(&ref_list_contents);
@@ -1068,7 +1780,11 @@ done:
 int reftable_stack_compact_all(struct reftable_stack *st,
 			       struct reftable_log_expiry_config *config)
 {
-	return stack_compact_range(st, 0, st->merged->stack_len - 1, config);
+	int err = 0;
+	stack_lock(st);
+	err = stack_compact_range(st, 0, st->merged->stack_len - 1, config);
+	stack_unlock(st);
+	return err;
 }
 
 static int stack_compact_range_stats(struct reftable_stack *st, int first,
@@ -1161,38 +1877,85 @@ struct segment suggest_compaction_segment(uint64_t *sizes, int n)
 	return min_seg;
 }
 
-static uint64_t *stack_table_sizes_for_compaction(struct reftable_stack *st)
+static int stack_table_sizes_for_compaction(struct reftable_stack *st,
+					    uint64_t **dest)
 {
 	uint64_t *sizes =
 		reftable_calloc(sizeof(uint64_t) * st->merged->stack_len);
 	int version = (st->config.hash_id == GIT_SHA1_FORMAT_ID) ? 1 : 2;
-	int overhead = header_size(version) - 1;
+	/* reader_size() counts the file, footer included. */
+	int overhead = header_size(version) - 1 + footer_size(version);
 	int i = 0;
 	for (i = 0; i < st->merged->stack_len; i++) {
-		sizes[i] = st->readers[i]->size - overhead;
+		int err = reader_size(st->readers[i], &sizes[i]);
+		if (err < 0) {
+			reftable_free(sizes);
+			return err;
+		}
+		sizes[i] -= overhead;
 	}
-	return sizes;
+	*dest = sizes;
+	return 0;
 }
 
 int reftable_stack_auto_compact(struct reftable_stack *st)
 {
-	uint64_t *sizes = stack_table_sizes_for_compaction(st);
-	struct segment seg =
-		suggest_compaction_segment(sizes, st->merged->stack_len);
+	uint64_t *sizes = NULL;
+	struct segment seg = { 0 };
+	int err = 0;
+
+	stack_lock(st);
+	err = stack_table_sizes_for_compaction(st, &sizes);
+	if (err == REFTABLE_NOT_EXIST_ERROR) {
+		/* lazy tables are only stat'ed here. One is gone, so another
+		 * process changed the stack since it was loaded. */
+		err = stack_reload_locked(st, 1);
+		if (err == 0)
+			err = stack_table_sizes_for_compaction(st, &sizes);
+		if (err == REFTABLE_NOT_EXIST_ERROR) {
+			/* still changing; leave compaction to the next
+			 * addition. */
+			stack_unlock(st);
+			return 0;
+		}
+	}
+	if (err < 0) {
+		stack_unlock(st);
+		return err;
+	}
+	seg = suggest_compaction_segment(sizes, st->merged->stack_len);
 	reftable_free(sizes);
 	if (segment_size(&seg) > 0)
-		return stack_compact_range_stats(st, seg.start, seg.end - 1,
-						 NULL);
-
-	return 0;
+		err = stack_compact_range_stats(st, seg.start, seg.end - 1,
+						NULL);
+	stack_unlock(st);
+	return err;
 }
 
 struct reftable_compaction_stats *
 reftable_stack_compaction_stats(struct reftable_stack *st)
 {
+	if (st->compactor)
+		return stack_compactor_stats(st->compactor, &st->stats);
 	return &st->stats;
 }
 
+void reftable_stack_memory_usage(struct reftable_stack *st,
+				 struct reftable_memory_usage *dest)
+{
+	memory_account_usage(&st->account, st->block_cache, dest);
+}
+
+void reftable_stack_block_cache_stats(struct reftable_stack *st,
+				      struct reftable_block_cache_stats *dest)
+{
+	struct reftable_block_cache_stats empty = { 0 };
+	if (st->block_cache)
+		block_cache_stats(st->block_cache, dest);
+	else
+		*dest = empty;
+}
+
 int reftable_stack_read_ref(struct reftable_stack *st, const char *refname,
 			    struct reftable_ref_record *ref)
 {
@@ -1201,6 +1964,21 @@ int reftable_stack_read_ref(struct reftable_stack *st, const char *refname,
 	return reftable_table_read_ref(&tab, refname, ref);
 }
 
+int reftable_stack_seek_ref_prefix(struct reftable_stack *st,
+				   struct reftable_iterator *it,
+				   const char *prefix)
+{
+	return reftable_merged_table_seek_ref_prefix(
+		reftable_stack_merged_table(st), it, prefix);
+}
+
+int reftable_stack_read_refs(struct reftable_stack *st, const char **names,
+			     size_t n, struct reftable_ref_record *refs)
+{
+	return reftable_merged_table_read_refs(reftable_stack_merged_table(st),
+					       names, n, refs);
+}
+
 int reftable_stack_read_log(struct reftable_stack *st, const char *refname,
 			    struct reftable_log_record *log)
 {
@@ -1228,6 +2006,14 @@ done:
 	return err;
 }
 
+int reftable_stack_seek_log_time(struct reftable_stack *st,
+				 struct reftable_iterator *it,
+				 const char *refname, uint64_t time)
+{
+	return reftable_merged_table_seek_log_time(
+		reftable_stack_merged_table(st), it, refname, time);
+}
+
 static int stack_check_addition(struct reftable_stack *st,
 				const char *new_tab_name)
 {
@@ -10,9 +10,27 @@ https://developers.google.com/open-source/licenses/bsd
 #define STACK_H
 
 #include "system.h"
+#include "blockcache.h"
+#include "budget.h"
 #include "reftable-writer.h"
 #include "reftable-stack.h"
 
+/* Identifies a version of tables.list, which is replaced by renaming a new
+ * file over it. */
+struct stack_list_stat {
+	/* whether the fields below can tell the version apart from the next
+	 * one. That is not the case for a version that was read while the
+	 * clock still showed its mtime: the next may have the same. */
+	int valid;
+
+	int exists;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime_sec;
+	long mtime_nsec;
+};
+
 struct reftable_stack {
 	char *list_file;
 	char *reftable_dir;
@@ -20,12 +38,61 @@ struct reftable_stack {
 
 	struct reftable_write_options config;
 
+	/* the readers and merged table of `snapshot`, for the thread that
+	 * reloads the stack. */
 	struct reftable_reader **readers;
 	size_t readers_len;
 	struct reftable_merged_table *merged;
 	struct reftable_compaction_stats stats;
+
+	/* the current version of the stack. The stack holds a reference on
+	 * it. */
+	struct reftable_stack_snapshot *snapshot;
+
+	/* the version of tables.list the stack was loaded from. */
+	struct stack_list_stat list_stat;
+	/* watches tables.list; NULL if disabled or unavailable. */
+	struct stack_watcher *watcher;
+
+#ifndef NO_PTHREADS
+	/* serializes reloads with each other, and with writes, which use the
+	 * readers of the current version. Recursive, as writes reload. */
+	pthread_mutex_t mutex;
+	/* guards `snapshot`, and the reference counts of snapshots and
+	 * readers. */
+	pthread_mutex_t snapshot_mutex;
+#endif
+
+	/* shared by all readers; NULL if disabled. With a memory budget, it is
+	 * the cache shared by all registered stacks. */
+	struct block_cache *block_cache;
+	/* the memory used by the tables of the stack. */
+	struct memory_account account;
+
+	/* compacts in the background; NULL if disabled. */
+	struct stack_compactor *compactor;
+	/* whether destroying the stack stops the compactor. */
+	int owns_compactor;
+};
+
+/* A version of the stack. Each snapshot holds a reference on its readers,
+ * which are closed with the last snapshot using them. */
+struct reftable_stack_snapshot {
+	int refcount;
+	struct reftable_stack *stack;
+	/* counts the versions of the stack, starting at 1. */
+	uint64_t generation;
+
+	struct reftable_reader **readers;
+	size_t readers_len;
+	struct reftable_merged_table *merged;
 };
 
+/* Creates a stack like reftable_new_stack. With `use_budget` unset, it doesn't
+ * register with the memory budget, and gets no shared block cache. */
+int stack_new(struct reftable_stack **dest, const char *dir,
+	      struct reftable_write_options config, int use_budget);
+
 int read_lines(const char *filename, char ***lines);
 
 struct segment {
@@ -10,8 +10,10 @@ https://developers.google.com/open-source/licenses/bsd
 
 #include "system.h"
 
+#include "reftable-merged.h"
 #include "reftable-reader.h"
 #include "merged.h"
+#include "reader.h"
 #include "basics.h"
 #include "constants.h"
 #include "record.h"
@@ -135,6 +137,20 @@ static int write_test_log(struct reftable_writer *wr, void *arg)
 	return reftable_writer_add_log(wr, wla->log);
 }
 
+struct write_refs_arg {
+	struct reftable_ref_record *refs;
+	int n;
+	uint64_t update_index;
+};
+
+static int write_test_refs(struct reftable_writer *wr, void *arg)
+{
+	struct write_refs_arg *wra = arg;
+
+	reftable_writer_set_limits(wr, wra->update_index, wra->update_index);
+	return reftable_writer_add_refs(wr, wra->refs, wra->n);
+}
+
 static void test_reftable_stack_add_one(void)
 {
 	char *dir = get_tmp_dir(__LINE__);
@@ -440,6 +456,688 @@ static void test_reftable_stack_add(void)
 	clear_dir(dir);
 }
 
+static void test_reftable_stack_block_cache(void)
+{
+	struct reftable_write_options cfg = {
+		.block_cache_size = 1 << 20,
+	};
+	struct reftable_stack *st = NULL;
+	struct reftable_block_cache_stats before = { 0 };
+	struct reftable_block_cache_stats after = { 0 };
+	char *dir = get_tmp_dir(__LINE__);
+	char names[5][100];
+	int N = ARRAY_SIZE(names);
+	int err, i, j;
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	for (i = 0; i < N; i++) {
+		uint8_t hash[GIT_SHA1_RAWSZ] = { 0 };
+		struct reftable_ref_record ref = {
+			.refname = names[i],
+			.update_index = reftable_stack_next_update_index(st),
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		struct reftable_log_record log = {
+			.refname = names[i],
+			.update_index = ref.update_index + 1,
+			.value_type = REFTABLE_LOG_UPDATE,
+			.value.update.new_hash = hash,
+		};
+		struct write_log_arg arg = {
+			.log = &log,
+			.update_index = log.update_index,
+		};
+		snprintf(names[i], sizeof(names[i]), "refs/heads/branch%02d", i);
+		set_test_hash(hash, i);
+
+		err = reftable_stack_add(st, &write_test_ref, &ref);
+		EXPECT_ERR(err);
+		err = reftable_stack_add(st, &write_test_log, &arg);
+		EXPECT_ERR(err);
+	}
+
+	for (j = 0; j < 2; j++) {
+		reftable_stack_block_cache_stats(st, &before);
+		for (i = 0; i < N; i++) {
+			struct reftable_ref_record ref = { NULL };
+			struct reftable_log_record log = { NULL };
+			err = reftable_stack_read_ref(st, names[i], &ref);
+			EXPECT_ERR(err);
+			err = reftable_stack_read_log(st, names[i], &log);
+			EXPECT_ERR(err);
+			reftable_ref_record_release(&ref);
+			reftable_log_record_release(&log);
+		}
+		reftable_stack_block_cache_stats(st, &after);
+		EXPECT(after.hits > before.hits);
+	}
+	/* the second round is served from the cache. */
+	EXPECT(after.misses == before.misses);
+	EXPECT(after.evictions == 0);
+	EXPECT(after.entries > 0);
+	EXPECT(after.bytes <= after.capacity);
+
+	/* blocks of the compacted tables are dropped. */
+	err = reftable_stack_compact_all(st, NULL);
+	EXPECT_ERR(err);
+	reftable_stack_block_cache_stats(st, &after);
+	EXPECT(after.entries == 0);
+	EXPECT(after.bytes == 0);
+	reftable_stack_destroy(st);
+
+	/* a small cache evicts, but still gives correct results. */
+	cfg.block_cache_size = 512;
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < N; i++) {
+			struct reftable_log_record log = { NULL };
+			err = reftable_stack_read_log(st, names[i], &log);
+			EXPECT_ERR(err);
+			EXPECT(0 == strcmp(log.refname, names[i]));
+			reftable_log_record_release(&log);
+		}
+	}
+	reftable_stack_block_cache_stats(st, &after);
+	EXPECT(after.bytes <= 512);
+	reftable_stack_destroy(st);
+
+	clear_dir(dir);
+}
+
+static void test_reftable_stack_read_refs(void)
+{
+	struct reftable_write_options cfg = {
+		.block_size = 256,
+	};
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_dir(__LINE__);
+	struct reftable_ref_record base[100] = { { NULL } };
+	struct reftable_ref_record updates[100] = { { NULL } };
+	struct write_refs_arg arg = { NULL };
+	const char *names[ARRAY_SIZE(base) + 4];
+	struct reftable_ref_record got[ARRAY_SIZE(names)] = { { NULL } };
+	int N = ARRAY_SIZE(base);
+	int n_updates = 0;
+	int missing = 0;
+	int err = 0;
+	int i = 0;
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	/* the first table has all refs, the second deletes every third
+	 * ref, and updates every fifth one. */
+	for (i = 0; i < N; i++) {
+		char buf[256];
+		snprintf(buf, sizeof(buf), "refs/heads/b%03d", i);
+		base[i].refname = xstrdup(buf);
+		base[i].update_index = 1;
+		base[i].value_type = REFTABLE_REF_VAL1;
+		base[i].value.val1 = reftable_malloc(GIT_SHA1_RAWSZ);
+		set_test_hash(base[i].value.val1, i);
+
+		if (i % 3 == 0 || i % 5 == 0) {
+			struct reftable_ref_record *u = &updates[n_updates++];
+			u->refname = xstrdup(buf);
+			u->update_index = 2;
+			u->value_type = REFTABLE_REF_DELETION;
+			if (i % 3 != 0) {
+				u->value_type = REFTABLE_REF_VAL1;
+				u->value.val1 = reftable_malloc(GIT_SHA1_RAWSZ);
+				set_test_hash(u->value.val1, i + N);
+			}
+		}
+	}
+
+	arg.refs = base;
+	arg.n = N;
+	arg.update_index = 1;
+	err = reftable_stack_add(st, &write_test_refs, &arg);
+	EXPECT_ERR(err);
+
+	arg.refs = updates;
+	arg.n = n_updates;
+	arg.update_index = 2;
+	err = reftable_stack_add(st, &write_test_refs, &arg);
+	EXPECT_ERR(err);
+	EXPECT(st->merged->stack_len == 2);
+
+	/* look up in descending order, plus a duplicate and refs that
+	 * don't exist, before, between and after the existing ones. */
+	for (i = 0; i < N; i++)
+		names[i] = base[N - 1 - i].refname;
+	names[N] = "refs/heads/a";
+	names[N + 1] = "refs/heads/b050x";
+	names[N + 2] = "refs/heads/c";
+	names[N + 3] = base[10].refname;
+
+	err = reftable_stack_read_refs(st, names, ARRAY_SIZE(names), got);
+	EXPECT(err >= 0);
+
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		struct reftable_ref_record want = { NULL };
+		int want_err = reftable_stack_read_ref(st, names[i], &want);
+		EXPECT(want_err >= 0);
+		if (want_err > 0) {
+			missing++;
+			EXPECT(!got[i].refname);
+		} else {
+			EXPECT(reftable_ref_record_equal(&want, &got[i],
+							 GIT_SHA1_RAWSZ));
+		}
+		reftable_ref_record_release(&want);
+	}
+	EXPECT(err == missing);
+	EXPECT(missing == 3 + (N + 2) / 3);
+
+	/* the result records are released before they're overwritten. */
+	err = reftable_stack_read_refs(st, names, ARRAY_SIZE(names), got);
+	EXPECT(err == missing);
+
+	for (i = 0; i < ARRAY_SIZE(got); i++)
+		reftable_ref_record_release(&got[i]);
+	for (i = 0; i < N; i++) {
+		reftable_ref_record_release(&base[i]);
+		reftable_ref_record_release(&updates[i]);
+	}
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+static void test_reftable_stack_ref_metadata(void)
+{
+	struct reftable_write_options cfg = {
+		.ref_metadata = 1,
+		.block_cache_size = 1 << 20,
+	};
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_dir(__LINE__);
+	struct reftable_block_cache_stats before = { 0 };
+	struct reftable_block_cache_stats after = { 0 };
+	int N = 20;
+	int err = 0;
+	int i = 0;
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	for (i = 0; i < N; i++) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = reftable_stack_next_update_index(st),
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		};
+		snprintf(name, sizeof(name), "refs/heads/branch%02d", i);
+		err = reftable_stack_add(st, &write_test_ref, &ref);
+		EXPECT_ERR(err);
+	}
+	EXPECT(st->merged->stack_len == N);
+
+	/* each lookup only reads the table that has the ref. */
+	reftable_stack_block_cache_stats(st, &before);
+	for (i = 0; i < N; i++) {
+		char name[100];
+		struct reftable_ref_record ref = { NULL };
+		snprintf(name, sizeof(name), "refs/heads/branch%02d", i);
+		err = reftable_stack_read_ref(st, name, &ref);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(ref.value.symref, "master"));
+		reftable_ref_record_release(&ref);
+
+		err = reftable_stack_read_ref(st, "refs/heads/missing", &ref);
+		EXPECT(err == 1);
+	}
+	reftable_stack_block_cache_stats(st, &after);
+	EXPECT(after.hits + after.misses - before.hits - before.misses == N);
+
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+static uint64_t stack_log_time_at(uint64_t update_index)
+{
+	return 1000 + 10 * update_index - 25 * (update_index % 3);
+}
+
+static int write_test_log_times(struct reftable_writer *wr, void *arg)
+{
+	uint64_t update_index = *(uint64_t *)arg;
+	uint8_t hash[GIT_SHA1_RAWSZ] = { 0 };
+	int err = 0;
+	int i = 0;
+
+	reftable_writer_set_limits(wr, update_index, update_index);
+	for (i = 0; err == 0 && i < 5; i++) {
+		char name[100];
+		struct reftable_log_record log = {
+			.refname = name,
+			.update_index = update_index,
+			.value_type = REFTABLE_LOG_UPDATE,
+			.value.update = {
+				.new_hash = hash,
+				.old_hash = hash,
+				.name = "Ada",
+				.email = "ada@invalid",
+				.time = stack_log_time_at(update_index),
+				.message = "update",
+			},
+		};
+		snprintf(name, sizeof(name), "refs/heads/branch%d", i);
+		set_test_hash(hash, update_index);
+		err = reftable_writer_add_log(wr, &log);
+	}
+	return err;
+}
+
+static void check_log_times(struct reftable_stack *st, uint64_t n)
+{
+	struct reftable_log_record log = { NULL };
+	uint64_t t = 0;
+
+	for (t = 900; t < stack_log_time_at(n) + 100; t += 7) {
+		struct reftable_iterator it = { NULL };
+		uint64_t want = 0;
+		uint64_t j = 0;
+		int err = 0;
+
+		for (j = n; j > 0 && !want; j--) {
+			if (stack_log_time_at(j) <= t)
+				want = j;
+		}
+
+		err = reftable_stack_seek_log_time(st, &it,
+						   "refs/heads/branch2", t);
+		EXPECT_ERR(err);
+		err = reftable_iterator_next_log(&it, &log);
+		if (want) {
+			EXPECT_ERR(err);
+			EXPECT_STREQ("refs/heads/branch2", log.refname);
+			EXPECT(log.update_index == want);
+		} else {
+			EXPECT(err == 1);
+		}
+		reftable_iterator_destroy(&it);
+	}
+	reftable_log_record_release(&log);
+}
+
+static void test_reftable_stack_log_time_index(void)
+{
+	struct reftable_write_options cfg = {
+		.block_size = 256,
+		.log_time_index = 1,
+		.compaction_threads = 3,
+	};
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_dir(__LINE__);
+	uint64_t n = 60;
+	uint64_t i = 0;
+	int err = 0;
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+	st->disable_auto_compact = 1;
+
+	for (i = 1; i <= n; i++) {
+		err = reftable_stack_add(st, &write_test_log_times, &i);
+		EXPECT_ERR(err);
+	}
+	check_log_times(st, n);
+
+	/* the compacted logs span several blocks, and are indexed. */
+	err = reftable_stack_compact_all(st, NULL);
+	EXPECT_ERR(err);
+	EXPECT(st->merged->stack_len == 1);
+	EXPECT(st->readers[0]->log_times.refs_len > 0);
+	check_log_times(st, n);
+
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+static void add_branch(struct reftable_stack *st, int i)
+{
+	char name[100];
+	struct reftable_ref_record ref = {
+		.refname = name,
+		.update_index = reftable_stack_next_update_index(st),
+		.value_type = REFTABLE_REF_SYMREF,
+		.value.symref = "master",
+	};
+	snprintf(name, sizeof(name), "refs/heads/branch%04d", i);
+	EXPECT_ERR(reftable_stack_add(st, &write_test_ref, &ref));
+}
+
+/* returns whether `snap` has branch `i`. */
+static int snapshot_has_branch(struct reftable_stack_snapshot *snap, int i)
+{
+	struct reftable_ref_record ref = { NULL };
+	char name[100];
+	const char *names[] = { name };
+	int missing = 0;
+
+	snprintf(name, sizeof(name), "refs/heads/branch%04d", i);
+	missing = reftable_merged_table_read_refs(
+		reftable_stack_snapshot_merged_table(snap), names, 1, &ref);
+	EXPECT(missing >= 0);
+	reftable_ref_record_release(&ref);
+	return !missing;
+}
+
+static void test_reftable_stack_snapshot(void)
+{
+	struct reftable_write_options cfg = { 0 };
+	struct reftable_stack *st = NULL;
+	struct reftable_stack_snapshot *old = NULL;
+	struct reftable_stack_snapshot *cur = NULL;
+	char *dir = get_tmp_dir(__LINE__);
+	int i = 0;
+
+	EXPECT_ERR(reftable_new_stack(&st, dir, cfg));
+	st->disable_auto_compact = 1;
+	for (i = 0; i < 3; i++)
+		add_branch(st, i);
+
+	old = reftable_stack_snapshot_acquire(st);
+	add_branch(st, 3);
+	EXPECT_ERR(reftable_stack_compact_all(st, NULL));
+	EXPECT(st->merged->stack_len == 1);
+	cur = reftable_stack_snapshot_acquire(st);
+
+	/* the old snapshot keeps its tables open, though they were compacted
+	 * away. */
+	EXPECT(snapshot_has_branch(old, 0));
+	EXPECT(!snapshot_has_branch(old, 3));
+	EXPECT(snapshot_has_branch(cur, 0));
+	EXPECT(snapshot_has_branch(cur, 3));
+
+	reftable_stack_snapshot_release(old);
+	EXPECT(count_dir_entries(dir) == 1 + 1);
+	EXPECT(snapshot_has_branch(cur, 3));
+	reftable_stack_snapshot_release(cur);
+
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+#ifndef NO_PTHREADS
+static void *snapshot_reader_main(void *arg)
+{
+	struct reftable_stack *st = arg;
+	int i = 0;
+
+	for (i = 0; i < 200; i++) {
+		struct reftable_stack_snapshot *snap = NULL;
+		EXPECT_ERR(reftable_stack_reload(st));
+		snap = reftable_stack_snapshot_acquire(st);
+		EXPECT(snapshot_has_branch(snap, 0));
+		EXPECT(snapshot_has_branch(snap, i % 5));
+		reftable_stack_snapshot_release(snap);
+	}
+	return NULL;
+}
+
+static void test_reftable_stack_snapshot_threads(void)
+{
+	struct reftable_write_options cfg = {
+		.block_cache_size = 1 << 20,
+	};
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_dir(__LINE__);
+	pthread_t threads[4];
+	int i = 0;
+
+	EXPECT_ERR(reftable_new_stack(&st, dir, cfg));
+	for (i = 0; i < 5; i++)
+		add_branch(st, i);
+
+	/* writes and compactions replace the tables being read. */
+	for (i = 0; i < ARRAY_SIZE(threads); i++)
+		EXPECT(!pthread_create(&threads[i], NULL,
+				       &snapshot_reader_main, st));
+	for (i = 5; i < 50; i++)
+		add_branch(st, i);
+	for (i = 0; i < ARRAY_SIZE(threads); i++)
+		pthread_join(threads[i], NULL);
+
+	EXPECT_ERR(reftable_stack_compact_all(st, NULL));
+	EXPECT(count_dir_entries(dir) == 1 + 1);
+
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+#endif
+
+/* moves the mtime of tables.list into the past, as if it was written long
+ * before it was last read. */
+static void backdate_tables_list(const char *dir)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct timeval times[2] = { { 0 } };
+
+	strbuf_addstr(&path, dir);
+	strbuf_addstr(&path, "/tables.list");
+	gettimeofday(&times[0], NULL);
+	times[0].tv_sec -= 10;
+	times[1] = times[0];
+	EXPECT(!utimes(path.buf, times));
+	strbuf_release(&path);
+}
+
+static void test_reftable_stack_uptodate_stat(void)
+{
+	int watch = 0;
+
+	for (watch = 0; watch <= 1; watch++) {
+		struct reftable_write_options cfg = {
+			.watch_tables_list = watch,
+		};
+		struct reftable_stack *st1 = NULL;
+		struct reftable_stack *st2 = NULL;
+		struct reftable_stack_snapshot *snap = NULL;
+		char *dir = get_tmp_dir(__LINE__);
+		uint64_t generation = 0;
+
+		EXPECT_ERR(reftable_new_stack(&st1, dir, cfg));
+		EXPECT_ERR(reftable_new_stack(&st2, dir, cfg));
+		st2->disable_auto_compact = 1;
+#ifndef NO_INOTIFY
+		EXPECT(!st1->watcher == !watch);
+#endif
+		add_branch(st1, 0);
+		backdate_tables_list(dir);
+
+		/* the version read right after it was written is checked by
+		 * its contents, and recognized by its stat data after. With
+		 * the watcher, it isn't checked at all. */
+		EXPECT(!st1->list_stat.valid);
+		EXPECT_ERR(reftable_stack_reload(st1));
+		EXPECT(!st1->list_stat.valid == !!st1->watcher);
+		generation = reftable_stack_generation(st1);
+		EXPECT_ERR(reftable_stack_reload(st1));
+		EXPECT(reftable_stack_generation(st1) == generation);
+
+		EXPECT_ERR(reftable_stack_reload(st2));
+		add_branch(st2, 1);
+		EXPECT_ERR(reftable_stack_reload(st1));
+		EXPECT(reftable_stack_generation(st1) == generation + 1);
+		EXPECT(st1->merged->stack_len == 2);
+
+		snap = reftable_stack_snapshot_acquire(st1);
+		EXPECT(reftable_stack_snapshot_generation(snap) ==
+		       generation + 1);
+		EXPECT(snapshot_has_branch(snap, 1));
+		reftable_stack_snapshot_release(snap);
+
+		reftable_stack_destroy(st1);
+		reftable_stack_destroy(st2);
+		clear_dir(dir);
+	}
+}
+
+static void test_reftable_stack_lazy_open(void)
+{
+	int lazy = 0;
+
+	for (lazy = 0; lazy <= 1; lazy++) {
+		struct reftable_write_options cfg = {
+			.lazy_open_tables = lazy,
+			.open_threads = 4,
+		};
+		struct reftable_stack *st1 = NULL;
+		struct reftable_stack *st2 = NULL;
+		struct reftable_stack_snapshot *snap = NULL;
+		struct reftable_ref_record ref = { NULL };
+		const char *names[] = { "refs/heads/branch0000" };
+		char *dir = get_tmp_dir(__LINE__);
+		uint64_t size = 0;
+		uint64_t open_size = 0;
+		int i = 0;
+
+		EXPECT_ERR(reftable_new_stack(&st1, dir, cfg));
+		st1->disable_auto_compact = 1;
+		for (i = 0; i < 5; i++)
+			add_branch(st1, i);
+
+		EXPECT_ERR(reftable_new_stack(&st2, dir, cfg));
+		EXPECT(st2->merged->stack_len == 5);
+		for (i = 0; i < st2->readers_len; i++) {
+			struct reftable_reader *rd = st2->readers[i];
+			EXPECT(!rd->lazy == !lazy);
+			EXPECT(!rd->lazy || !rd->lazy->open);
+			EXPECT(rd->min_update_index == i + 1);
+			EXPECT(rd->max_update_index == i + 1);
+		}
+		EXPECT_ERR(reader_size(st2->readers[4], &size));
+		snap = reftable_stack_snapshot_acquire(st2);
+		EXPECT(snapshot_has_branch(snap, 4));
+		reftable_stack_snapshot_release(snap);
+		EXPECT(!lazy || st2->readers[4]->lazy->open);
+		/* the size doesn't depend on whether the table is open. */
+		EXPECT_ERR(reader_size(st2->readers[4], &open_size));
+		EXPECT(size == open_size);
+		EXPECT(!lazy || !st2->readers[0]->lazy->open);
+
+		/* the tables st2 didn't open yet are gone after this. */
+		EXPECT_ERR(reftable_stack_auto_compact(st1));
+		EXPECT_ERR(reftable_stack_compact_all(st1, NULL));
+		EXPECT(st1->merged->stack_len == 1);
+		EXPECT(reftable_merged_table_read_refs(st2->merged, names, 1,
+						       &ref) ==
+		       (lazy ? REFTABLE_NOT_EXIST_ERROR : 0));
+		EXPECT_ERR(reftable_stack_reload(st2));
+		EXPECT(reftable_merged_table_read_refs(st2->merged, names, 1,
+						       &ref) == 0);
+		EXPECT(!strcmp(ref.refname, names[0]));
+
+		reftable_ref_record_release(&ref);
+		reftable_stack_destroy(st1);
+		reftable_stack_destroy(st2);
+		clear_dir(dir);
+	}
+}
+
+static void test_reftable_stack_lazy_auto_compact_removed(void)
+{
+	struct reftable_write_options cfg = {
+		.lazy_open_tables = 1,
+	};
+	struct reftable_stack *st1 = NULL;
+	struct reftable_stack *st2 = NULL;
+	char *dir = get_tmp_dir(__LINE__);
+	int i = 0;
+
+	EXPECT_ERR(reftable_new_stack(&st1, dir, cfg));
+	st1->disable_auto_compact = 1;
+	for (i = 0; i < 5; i++)
+		add_branch(st1, i);
+	EXPECT_ERR(reftable_new_stack(&st2, dir, cfg));
+
+	/* removes the tables st2 knows, but never opened. */
+	EXPECT_ERR(reftable_stack_compact_all(st1, NULL));
+	EXPECT(st2->merged->stack_len == 5);
+	EXPECT_ERR(reftable_stack_auto_compact(st2));
+	EXPECT(st2->merged->stack_len == 1);
+	EXPECT(snapshot_has_branch(st2->snapshot, 4));
+
+	reftable_stack_destroy(st1);
+	reftable_stack_destroy(st2);
+	clear_dir(dir);
+}
+
+static void test_reftable_stack_memory_budget(void)
+{
+	struct reftable_write_options cfg = {
+		.block_cache_size = 1 << 20,
+	};
+	struct reftable_stack *st[2] = { NULL };
+	char *dirs[2] = { NULL };
+	struct reftable_memory_budget_stats stats = { 0 };
+	struct reftable_memory_usage usage[2] = { { 0 } };
+	struct reftable_stack_snapshot *snap = NULL;
+	uint64_t budget = 64 << 10;
+	int i = 0;
+	int j = 0;
+
+	reftable_set_memory_budget(budget);
+	for (i = 0; i < 2; i++) {
+		dirs[i] = get_tmp_dir(__LINE__);
+		EXPECT_ERR(reftable_new_stack(&st[i], dirs[i], cfg));
+		for (j = 0; j < 20; j++)
+			add_branch(st[i], j);
+
+		snap = reftable_stack_snapshot_acquire(st[i]);
+		for (j = 0; j < 20; j++)
+			EXPECT(snapshot_has_branch(snap, j));
+		reftable_stack_snapshot_release(snap);
+	}
+	/* both read through the shared cache. */
+	EXPECT(st[0]->block_cache == st[1]->block_cache);
+
+	reftable_get_memory_budget_stats(&stats);
+	EXPECT(stats.budget == budget);
+	EXPECT(stats.stacks == 2);
+	EXPECT(stats.usage.blocks + stats.usage.pinned + stats.usage.readers <=
+	       budget);
+	for (i = 0; i < 2; i++) {
+		reftable_stack_memory_usage(st[i], &usage[i]);
+		EXPECT(usage[i].blocks > 0);
+		EXPECT(usage[i].readers > 0);
+	}
+	EXPECT(usage[0].blocks + usage[1].blocks == stats.usage.blocks);
+	EXPECT(usage[0].readers + usage[1].readers == stats.usage.readers);
+
+	/* a smaller budget leaves no room for blocks. */
+	reftable_set_memory_budget(stats.usage.readers + 1);
+	reftable_get_memory_budget_stats(&stats);
+	EXPECT(stats.usage.blocks == 0);
+	EXPECT(stats.evictions > 0);
+	reftable_stack_memory_usage(st[0], &usage[0]);
+	EXPECT(usage[0].blocks == 0);
+
+	reftable_stack_destroy(st[0]);
+	reftable_get_memory_budget_stats(&stats);
+	EXPECT(stats.stacks == 1);
+	EXPECT(stats.usage.readers == usage[1].readers);
+
+	reftable_set_memory_budget(0);
+	reftable_stack_destroy(st[1]);
+	reftable_get_memory_budget_stats(&stats);
+	EXPECT(stats.stacks == 0);
+	EXPECT(stats.usage.readers == 0);
+	for (i = 0; i < 2; i++)
+		clear_dir(dirs[i]);
+}
+
 static void test_reftable_stack_log_normalize(void)
 {
 	int err = 0;
@@ -822,6 +1520,292 @@ static void test_reftable_stack_auto_compaction(void)
 	clear_dir(dir);
 }
 
+static void test_reftable_stack_background_compaction(void)
+{
+	struct reftable_write_options cfg = {
+		.background_compaction = 1,
+	};
+	struct reftable_stack *st = NULL;
+	struct reftable_compaction_stats *stats = NULL;
+	char *dir = get_tmp_dir(__LINE__);
+
+	int err, i;
+	int N = 100;
+
+	err = reftable_new_stack(&st, dir, cfg);
+	EXPECT_ERR(err);
+
+	for (i = 0; i < N; i++) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = reftable_stack_next_update_index(st),
+			.value_type = REFTABLE_REF_SYMREF,
+			.value.symref = "master",
+		};
+		snprintf(name, sizeof(name), "branch%04d", i);
+
+		err = reftable_stack_add(st, &write_test_ref, &ref);
+		EXPECT_ERR(err);
+	}
+
+	err = reftable_stack_wait_for_compaction(st);
+	EXPECT_ERR(err);
+	err = reftable_stack_reload(st);
+	EXPECT_ERR(err);
+
+	EXPECT(st->merged->stack_len < 2 * fastlog2(N));
+	for (i = 0; i < N; i++) {
+		char name[100];
+		struct reftable_ref_record dest = { NULL };
+		snprintf(name, sizeof(name), "branch%04d", i);
+
+		err = reftable_stack_read_ref(st, name, &dest);
+		EXPECT_ERR(err);
+		EXPECT(0 == strcmp(dest.value.symref, "master"));
+		reftable_ref_record_release(&dest);
+	}
+
+	stats = reftable_stack_compaction_stats(st);
+	EXPECT(stats->attempts > 0);
+	EXPECT(stats->queue_depth == 0);
+	EXPECT(stats->max_duration_us <= stats->duration_us);
+
+	/* the tables and tables.list; no locks or temporary files. */
+	EXPECT(count_dir_entries(dir) == st->merged->stack_len + 1);
+
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+}
+
+struct write_range_arg {
+	int start, end, step;
+	int delete;
+	uint64_t update_index;
+};
+
+static int write_test_range(struct reftable_writer *wr, void *arg)
+{
+	struct write_range_arg *wra = arg;
+	uint8_t hash[GIT_SHA1_RAWSZ];
+	int err = 0;
+	int i = 0;
+
+	reftable_writer_set_limits(wr, wra->update_index, wra->update_index);
+	for (i = wra->start; err == 0 && i < wra->end; i += wra->step) {
+		char name[100];
+		struct reftable_ref_record ref = {
+			.refname = name,
+			.update_index = wra->update_index,
+			.value_type = REFTABLE_REF_VAL1,
+			.value.val1 = hash,
+		};
+		snprintf(name, sizeof(name), "refs/heads/branch%05d", i);
+		set_test_hash(hash, i + wra->update_index);
+		if (wra->delete)
+			ref.value_type = REFTABLE_REF_DELETION;
+		err = reftable_writer_add_ref(wr, &ref);
+	}
+	for (i = wra->start; err == 0 && i < wra->end; i += wra->step) {
+		char name[100];
+		struct reftable_log_record log = {
+			.refname = name,
+			.update_index = wra->update_index,
+			.value_type = REFTABLE_LOG_UPDATE,
+			.value.update = {
+				.new_hash = hash,
+				.old_hash = hash,
+				.name = "Ada",
+				.email = "ada@invalid",
+				.time = 1577123507 + wra->update_index,
+				.message = "update",
+			},
+		};
+		snprintf(name, sizeof(name), "refs/heads/branch%05d", i);
+		set_test_hash(hash, i);
+		err = reftable_writer_add_log(wr, &log);
+	}
+	return err;
+}
+
+static struct reftable_stack *parallel_compaction_stack(const char *dir,
+							int threads,
+							uint64_t index_memory)
+{
+	struct reftable_write_options cfg = {
+		.block_size = 256,
+		.compaction_threads = threads,
+		.max_index_memory = index_memory,
+	};
+	struct write_range_arg tables[] = {
+		{ .start = 0, .end = 500, .step = 1 },
+		{ .start = 101, .end = 500, .step = 3 },
+		/* leaves no refs in the first key ranges of the largest
+		 * table. */
+		{ .start = 0, .end = 100, .step = 1, .delete = 1 },
+		{ .start = 2, .end = 500, .step = 5, .delete = 1 },
+		{ .start = 100, .end = 500, .step = 2 },
+	};
+	struct reftable_stack *st = NULL;
+	int err = reftable_new_stack(&st, dir, cfg);
+	int i = 0;
+	EXPECT_ERR(err);
+	/* spill files go next to the tables. */
+	EXPECT_STREQ(st->config.spill_dir, dir);
+
+	st->disable_auto_compact = 1;
+	for (i = 0; i < ARRAY_SIZE(tables); i++) {
+		tables[i].update_index = reftable_stack_next_update_index(st);
+		err = reftable_stack_add(st, &write_test_range, &tables[i]);
+		EXPECT_ERR(err);
+	}
+
+	err = reftable_stack_compact_all(st, NULL);
+	EXPECT_ERR(err);
+	EXPECT(st->merged->stack_len == 1);
+	return st;
+}
+
+static void test_reftable_stack_parallel_compaction(void)
+{
+	/* get_tmp_dir() returns a static buffer. */
+	char *dir1 = xstrdup(get_tmp_dir(__LINE__));
+	char *dir2 = xstrdup(get_tmp_dir(__LINE__));
+	struct reftable_stack *serial = parallel_compaction_stack(dir1, 1, 0);
+	/* also spill the partitions' indexes. */
+	struct reftable_stack *parallel =
+		parallel_compaction_stack(dir2, 4, 1);
+	struct reftable_iterator it1 = { NULL };
+	struct reftable_iterator it2 = { NULL };
+	struct reftable_ref_record ref1 = { NULL };
+	struct reftable_ref_record ref2 = { NULL };
+	struct reftable_log_record log1 = { NULL };
+	struct reftable_log_record log2 = { NULL };
+	uint8_t hash[GIT_SHA1_RAWSZ];
+	struct reftable_compaction_stats *stats = NULL;
+	int err1, err2, n;
+
+	stats = reftable_stack_compaction_stats(serial);
+	EXPECT(stats->parallel_compactions == 0);
+	stats = reftable_stack_compaction_stats(parallel);
+	EXPECT(stats->parallel_compactions == 1);
+	err1 = reftable_merged_table_seek_ref(serial->merged, &it1, "");
+	err2 = reftable_merged_table_seek_ref(parallel->merged, &it2, "");
+	EXPECT_ERR(err1);
+	EXPECT_ERR(err2);
+	for (n = 0;; n++) {
+		err1 = reftable_iterator_next_ref(&it1, &ref1);
+		err2 = reftable_iterator_next_ref(&it2, &ref2);
+		EXPECT(err1 == err2);
+		if (err1 != 0)
+			break;
+		EXPECT(reftable_ref_record_equal(&ref1, &ref2, GIT_SHA1_RAWSZ));
+	}
+	EXPECT(n > 200);
+	reftable_iterator_destroy(&it1);
+	reftable_iterator_destroy(&it2);
+
+	err1 = reftable_merged_table_seek_log(serial->merged, &it1, "");
+	err2 = reftable_merged_table_seek_log(parallel->merged, &it2, "");
+	EXPECT_ERR(err1);
+	EXPECT_ERR(err2);
+	for (n = 0;; n++) {
+		err1 = reftable_iterator_next_log(&it1, &log1);
+		err2 = reftable_iterator_next_log(&it2, &log2);
+		EXPECT(err1 == err2);
+		if (err1 != 0)
+			break;
+		EXPECT(reftable_log_record_equal(&log1, &log2, GIT_SHA1_RAWSZ));
+	}
+	EXPECT(n > 1000);
+	reftable_iterator_destroy(&it1);
+	reftable_iterator_destroy(&it2);
+
+	/* the stitched table has a valid index, and object index. */
+	err1 = reftable_stack_read_ref(parallel, "refs/heads/branch00250",
+				       &ref2);
+	EXPECT_ERR(err1);
+	EXPECT(ref2.update_index == 5);
+	err1 = reftable_stack_read_ref(parallel, "refs/heads/branch00051",
+				       &ref2);
+	EXPECT(err1 == 1);
+
+	/* branch00240 and branch00496, as set_test_hash() only uses the lower
+	 * byte. */
+	set_test_hash(hash, 499 + 2);
+	err1 = reftable_reader_refs_for(serial->readers[0], &it1, hash);
+	err2 = reftable_reader_refs_for(parallel->readers[0], &it2, hash);
+	EXPECT_ERR(err1);
+	EXPECT_ERR(err2);
+	for (n = 0;; n++) {
+		err1 = reftable_iterator_next_ref(&it1, &ref1);
+		err2 = reftable_iterator_next_ref(&it2, &ref2);
+		EXPECT(err1 == err2);
+		if (err1 != 0)
+			break;
+		EXPECT(0 == strcmp(ref1.refname, ref2.refname));
+	}
+	EXPECT(n == 2);
+	reftable_iterator_destroy(&it1);
+	reftable_iterator_destroy(&it2);
+
+	reftable_ref_record_release(&ref1);
+	reftable_ref_record_release(&ref2);
+	reftable_log_record_release(&log1);
+	reftable_log_record_release(&log2);
+	reftable_stack_destroy(serial);
+	reftable_stack_destroy(parallel);
+	clear_dir(dir1);
+	clear_dir(dir2);
+	reftable_free(dir1);
+	reftable_free(dir2);
+}
+
+static void test_reftable_stack_parallel_compaction_budget(void)
+{
+	struct reftable_memory_budget_stats stats = { 0 };
+	struct reftable_ref_record ref = { NULL };
+	struct reftable_stack *st = NULL;
+	char *dir = get_tmp_dir(__LINE__);
+
+	reftable_set_memory_budget(64 << 10);
+	st = parallel_compaction_stack(dir, 4, 0);
+	/* the stack reads through the shared cache, and still merges on
+	 * several threads. */
+	EXPECT(st->block_cache != NULL);
+	EXPECT(reftable_stack_compaction_stats(st)->parallel_compactions == 1);
+	EXPECT_ERR(reftable_stack_read_ref(st, "refs/heads/branch00250", &ref));
+	EXPECT(ref.update_index == 5);
+	reftable_get_memory_budget_stats(&stats);
+	EXPECT(stats.stacks == 1);
+	reftable_stack_destroy(st);
+	clear_dir(dir);
+
+#ifndef NO_PTHREADS
+	{
+		struct reftable_write_options cfg = {
+			.background_compaction = 1,
+			.compaction_threads = 4,
+		};
+		int i = 0;
+
+		/* the compactor's stack isn't counted again. */
+		dir = get_tmp_dir(__LINE__);
+		EXPECT_ERR(reftable_new_stack(&st, dir, cfg));
+		for (i = 0; i < 20; i++)
+			add_branch(st, i);
+		EXPECT_ERR(reftable_stack_wait_for_compaction(st));
+		reftable_get_memory_budget_stats(&stats);
+		EXPECT(stats.stacks == 1);
+		reftable_stack_destroy(st);
+		clear_dir(dir);
+	}
+#endif
+
+	reftable_set_memory_budget(0);
+	reftable_ref_record_release(&ref);
+}
+
 static void test_reftable_stack_compaction_concurrent(void)
 {
 	struct reftable_write_options cfg = { 0 };
@@ -864,12 +1848,15 @@ static void test_reftable_stack_compaction_concurrent(void)
 static void unclean_stack_close(struct reftable_stack *st)
 {
 	/* break abstraction boundary to simulate unclean shutdown. */
+	struct reftable_stack_snapshot *snap = st->snapshot;
 	int i = 0;
-	for (; i < st->readers_len; i++) {
-		reftable_reader_free(st->readers[i]);
+	for (; i < snap->readers_len; i++) {
+		reftable_reader_free(snap->readers[i]);
 	}
+	snap->readers_len = 0;
+	FREE_AND_NULL(snap->readers);
 	st->readers_len = 0;
-	FREE_AND_NULL(st->readers);
+	st->readers = NULL;
 }
 
 static void test_reftable_stack_compaction_concurrent_clean(void)
@@ -932,11 +1919,26 @@ int stack_test_main(int argc, const char *argv[])
 	RUN_TEST(test_reftable_stack_add);
 	RUN_TEST(test_reftable_stack_add_one);
 	RUN_TEST(test_reftable_stack_auto_compaction);
+	RUN_TEST(test_reftable_stack_background_compaction);
+	RUN_TEST(test_reftable_stack_block_cache);
 	RUN_TEST(test_reftable_stack_compaction_concurrent);
 	RUN_TEST(test_reftable_stack_compaction_concurrent_clean);
 	RUN_TEST(test_reftable_stack_hash_id);
 	RUN_TEST(test_reftable_stack_lock_failure);
+	RUN_TEST(test_reftable_stack_lazy_open);
+	RUN_TEST(test_reftable_stack_lazy_auto_compact_removed);
 	RUN_TEST(test_reftable_stack_log_normalize);
+	RUN_TEST(test_reftable_stack_memory_budget);
+	RUN_TEST(test_reftable_stack_parallel_compaction);
+	RUN_TEST(test_reftable_stack_parallel_compaction_budget);
+	RUN_TEST(test_reftable_stack_read_refs);
+	RUN_TEST(test_reftable_stack_ref_metadata);
+	RUN_TEST(test_reftable_stack_log_time_index);
+	RUN_TEST(test_reftable_stack_snapshot);
+#ifndef NO_PTHREADS
+	RUN_TEST(test_reftable_stack_snapshot_threads);
+#endif
+	RUN_TEST(test_reftable_stack_uptodate_stat);
 	RUN_TEST(test_reftable_stack_tombstone);
 	RUN_TEST(test_reftable_stack_transaction_api);
 	RUN_TEST(test_reftable_stack_update_index_check);
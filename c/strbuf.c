@@ -67,7 +67,9 @@ void strbuf_addbuf(struct strbuf *s, const struct strbuf *a)
 	int end = s->len;
 	assert(s->canary == STRBUF_CANARY);
 	strbuf_resize(s, s->len + a->len);
-	memcpy(s->buf + end, a->buf, a->len);
+	/* released buffers are NULL, which memcpy may not be passed. */
+	if (a->len > 0)
+		memcpy(s->buf + end, a->buf, a->len);
 }
 
 char *strbuf_detach(struct strbuf *s, size_t *sz)
@@ -94,7 +96,7 @@ void strbuf_release(struct strbuf *s)
 int strbuf_cmp(const struct strbuf *a, const struct strbuf *b)
 {
 	int min = a->len < b->len ? a->len : b->len;
-	int res = memcmp(a->buf, b->buf, min);
+	int res = min > 0 ? memcmp(a->buf, b->buf, min) : 0;
 	assert(a->canary == STRBUF_CANARY);
 	assert(b->canary == STRBUF_CANARY);
 	if (res != 0)
@@ -111,7 +113,8 @@ ssize_t strbuf_add(struct strbuf *b, const void *data, size_t sz)
 {
 	assert(b->canary == STRBUF_CANARY);
 	strbuf_grow(b, sz);
-	memcpy(b->buf + b->len, data, sz);
+	if (sz > 0)
+		memcpy(b->buf + b->len, data, sz);
 	b->len += sz;
 	b->buf[b->len] = 0;
 	return sz;
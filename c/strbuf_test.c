@@ -30,8 +30,23 @@ static void test_strbuf(void)
 	strbuf_release(&t);
 }
 
+static void test_strbuf_addbuf_empty(void)
+{
+	struct strbuf s = STRBUF_INIT;
+	struct strbuf empty = STRBUF_INIT;
+
+	/* the result is a string, even if nothing was added. */
+	strbuf_addbuf(&s, &empty);
+	EXPECT(s.buf != NULL);
+	EXPECT(s.len == 0);
+	EXPECT(0 == strcmp("", s.buf));
+
+	strbuf_release(&s);
+}
+
 int strbuf_test_main(int argc, const char *argv[])
 {
 	RUN_TEST(test_strbuf);
+	RUN_TEST(test_strbuf_addbuf_empty);
 	return 0;
 }
@@ -27,6 +27,15 @@ int uncompress2(Bytef *dest, uLongf *destLen, const Bytef *source,
 		uLong *sourceLen);
 #endif
 
+/* Optional codecs for log blocks, see reftable_write_options.log_compression
+ */
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
 int hash_size(uint32_t id);
 
 #endif
@@ -11,6 +11,8 @@ https://developers.google.com/open-source/licenses/bsd
 
 #include "basics.h"
 
+#include <time.h>
+
 void set_test_hash(uint8_t *p, int i)
 {
 	memset(p, (uint8_t)i, hash_size(GIT_SHA1_FORMAT_ID));
@@ -21,3 +23,10 @@ ssize_t strbuf_add_void(void *b, const void *data, size_t sz)
 	strbuf_add(b, data, sz);
 	return sz;
 }
+
+uint64_t test_now_nsec(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -50,4 +50,7 @@ void set_test_hash(uint8_t *p, int i);
  */
 ssize_t strbuf_add_void(void *b, const void *data, size_t sz);
 
+/* monotonic clock in nanoseconds, for benchmarks. */
+uint64_t test_now_nsec(void);
+
 #endif
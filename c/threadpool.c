@@ -0,0 +1,86 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "threadpool.h"
+
+#include "basics.h"
+
+#ifndef NO_PTHREADS
+
+struct threadpool {
+	pthread_mutex_t mutex;
+	size_t next;
+	size_t n;
+	void (*task)(void *arg, size_t i);
+	void *arg;
+};
+
+static void *threadpool_worker(void *p)
+{
+	struct threadpool *pool = p;
+	while (1) {
+		size_t i = 0;
+
+		pthread_mutex_lock(&pool->mutex);
+		i = pool->next;
+		if (i < pool->n)
+			pool->next++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (i >= pool->n)
+			break;
+		pool->task(pool->arg, i);
+	}
+	return NULL;
+}
+
+void threadpool_run(int threads, size_t n, void (*task)(void *arg, size_t i),
+		    void *arg)
+{
+	struct threadpool pool = {
+		.n = n,
+		.task = task,
+		.arg = arg,
+	};
+	pthread_t *workers = NULL;
+	int started = 0;
+	int i = 0;
+
+	if (threads > n)
+		threads = n;
+
+	pthread_mutex_init(&pool.mutex, NULL);
+	if (threads > 1) {
+		workers = reftable_calloc(sizeof(pthread_t) * (threads - 1));
+		for (i = 0; i < threads - 1; i++) {
+			if (pthread_create(&workers[i], NULL,
+					   &threadpool_worker, &pool))
+				break;
+			started++;
+		}
+	}
+
+	threadpool_worker(&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	reftable_free(workers);
+	pthread_mutex_destroy(&pool.mutex);
+}
+
+#else
+
+void threadpool_run(int threads, size_t n, void (*task)(void *arg, size_t i),
+		    void *arg)
+{
+	size_t i = 0;
+	for (i = 0; i < n; i++)
+		task(arg, i);
+}
+
+#endif
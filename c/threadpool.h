@@ -0,0 +1,21 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "system.h"
+
+/* Runs task(arg, i) for all i in [0, n), using up to `threads` threads
+ * including the calling one. Tasks are handed out in order of i. Without
+ * thread support, or if threads can't be started, all tasks run on the
+ * calling thread. */
+void threadpool_run(int threads, size_t n, void (*task)(void *arg, size_t i),
+		    void *arg);
+
+#endif
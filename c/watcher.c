@@ -0,0 +1,122 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#include "watcher.h"
+
+#include "system.h"
+#include "basics.h"
+
+#ifndef NO_INOTIFY
+
+struct stack_watcher {
+	int fd;
+	int changed;
+	/* set if events were lost, or the directory went away. */
+	int broken;
+};
+
+void stack_watcher_start(struct stack_watcher **dest, const char *dir)
+{
+	struct stack_watcher *w = NULL;
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	*dest = NULL;
+	if (fd < 0)
+		return;
+	/* tables.list is replaced by renaming the lock file over it, so watch
+	 * the directory rather than the file. */
+	if (inotify_add_watch(fd, dir,
+			      IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+				      IN_DELETE | IN_CLOSE_WRITE |
+				      IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		close(fd);
+		return;
+	}
+
+	w = reftable_calloc(sizeof(struct stack_watcher));
+	w->fd = fd;
+	w->changed = 1;
+	*dest = w;
+}
+
+void stack_watcher_stop(struct stack_watcher *w)
+{
+	if (!w)
+		return;
+	close(w->fd);
+	reftable_free(w);
+}
+
+/* reads the queued events. */
+static void stack_watcher_drain(struct stack_watcher *w)
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+
+	while (!w->broken) {
+		ssize_t n = read(w->fd, u.buf, sizeof(u.buf));
+		ssize_t off = 0;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0) {
+			w->broken = 1;
+			break;
+		}
+
+		while (off < n) {
+			struct inotify_event *ev =
+				(struct inotify_event *)(u.buf + off);
+			off += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED |
+					IN_DELETE_SELF | IN_MOVE_SELF))
+				w->broken = 1;
+			else if (ev->len > 0 && !strcmp(ev->name, "tables.list"))
+				w->changed = 1;
+		}
+	}
+}
+
+int stack_watcher_changed(struct stack_watcher *w)
+{
+	if (!w)
+		return 1;
+	stack_watcher_drain(w);
+	return w->changed || w->broken;
+}
+
+void stack_watcher_clear(struct stack_watcher *w)
+{
+	if (w)
+		w->changed = 0;
+}
+
+#else
+
+void stack_watcher_start(struct stack_watcher **dest, const char *dir)
+{
+	*dest = NULL;
+}
+
+void stack_watcher_stop(struct stack_watcher *w)
+{
+}
+
+int stack_watcher_changed(struct stack_watcher *w)
+{
+	return 1;
+}
+
+void stack_watcher_clear(struct stack_watcher *w)
+{
+}
+
+#endif
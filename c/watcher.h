@@ -0,0 +1,36 @@
+/*
+Copyright 2020 Google LLC
+
+Use of this source code is governed by a BSD-style
+license that can be found in the LICENSE file or at
+https://developers.google.com/open-source/licenses/bsd
+*/
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+/*
+ * Watches the directory of a stack for changes of tables.list, so checking
+ * whether the stack is up to date doesn't look at the file. Events are queued
+ * by the kernel while tables.list is replaced, so a change is seen by the
+ * next check once the writer is done.
+ */
+struct stack_watcher;
+
+/* Starts watching the stack in `dir`. Sets `dest` to NULL if inotify is not
+ * available, or the watch can't be set up, eg. for lack of inotify
+ * instances. */
+void stack_watcher_start(struct stack_watcher **dest, const char *dir);
+
+/* Stops watching, and frees `w`. */
+void stack_watcher_stop(struct stack_watcher *w);
+
+/* Returns whether tables.list may have changed since the last call to
+ * stack_watcher_clear, or since the watch started. Always returns 1 if `w`
+ * is NULL. */
+int stack_watcher_changed(struct stack_watcher *w);
+
+/* Records that the stack was found to be up to date with tables.list. */
+void stack_watcher_clear(struct stack_watcher *w);
+
+#endif
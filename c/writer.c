@@ -11,13 +11,17 @@ https://developers.google.com/open-source/licenses/bsd
 #include "system.h"
 
 #include "block.h"
+#include "bloom.h"
 #include "constants.h"
 #include "record.h"
-#include "tree.h"
 #include "reftable-error.h"
 
 /* finishes a block, and writes it to storage */
 static int writer_flush_block(struct reftable_writer *w);
+static int writer_flush_nonempty_block(struct reftable_writer *w);
+
+/* writes out log blocks compressed by the deflater */
+static int writer_write_deflated(struct reftable_writer *w, int all);
 
 /* deallocates memory related to the index */
 static void writer_clear_index(struct reftable_writer *w);
@@ -105,7 +109,7 @@ static int writer_write_header(struct reftable_writer *w, uint8_t *dest)
 static void writer_reinit_block_writer(struct reftable_writer *w, uint8_t typ)
 {
 	int block_start = 0;
-	if (w->next == 0) {
+	if (w->next == 0 && !w->no_header) {
 		block_start = header_size(writer_version(w));
 	}
 
@@ -126,6 +130,13 @@ reftable_new_writer(ssize_t (*writer_func)(void *, const void *, size_t),
 	struct reftable_writer *wp =
 		reftable_calloc(sizeof(struct reftable_writer));
 	strbuf_init(&wp->block_writer_data.last_key, 0);
+	strbuf_init(&wp->first_ref, 0);
+	strbuf_init(&wp->last_ref, 0);
+	strbuf_init(&wp->index_spill.buf, 0);
+	strbuf_init(&wp->obj_spill.buf, 0);
+	strbuf_init(&wp->compressed, 0);
+	strbuf_init(&wp->log_times.out, 0);
+	strbuf_init(&wp->log_times.name, 0);
 	options_set_defaults(opts);
 	if (opts->block_size >= (1 << 24)) {
 		/* TODO - error return? */
@@ -136,6 +147,8 @@ reftable_new_writer(ssize_t (*writer_func)(void *, const void *, size_t),
 	wp->write = writer_func;
 	wp->write_arg = writer_arg;
 	wp->opts = *opts;
+	wp->index_spill.dir = opts->spill_dir;
+	wp->obj_spill.dir = opts->spill_dir;
 	writer_reinit_block_writer(wp, BLOCK_TYPE_REF);
 
 	return wp;
@@ -148,63 +161,335 @@ void reftable_writer_set_limits(struct reftable_writer *w, uint64_t min,
 	w->max_update_index = max;
 }
 
+static void writer_release_ref_metadata(struct reftable_writer *w)
+{
+	strbuf_release(&w->first_ref);
+	strbuf_release(&w->last_ref);
+	FREE_AND_NULL(w->ref_hashes);
+	w->ref_hashes_len = 0;
+	w->ref_hashes_cap = 0;
+	log_time_writer_release(&w->log_times);
+}
+
+static void writer_free_obj_index(struct reftable_writer *w);
+
 void reftable_writer_free(struct reftable_writer *w)
 {
+	/* all but the block are released by reftable_writer_close, which
+	 * partitions skip. */
+	if (w->deflater)
+		block_deflater_free(w->deflater);
+	block_writer_release(&w->block_writer_data);
+	writer_clear_index(w);
+	writer_free_obj_index(w);
+	strbuf_release(&w->last_key);
+	strbuf_release(&w->compressed);
+	writer_release_ref_metadata(w);
 	reftable_free(w->block);
 	reftable_free(w);
 }
 
-struct obj_index_tree_node {
-	struct strbuf hash;
-	uint64_t *offsets;
-	size_t offset_len;
-	size_t offset_cap;
-};
+static int obj_index_entry_compare(const void *a, const void *b)
+{
+	const struct obj_index_entry *ea = a;
+	const struct obj_index_entry *eb = b;
+	int cmp = memcmp(ea->hash, eb->hash, sizeof(ea->hash));
+	if (cmp)
+		return cmp;
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+	return 0;
+}
+
+#define OBJ_INDEX_BUCKETS 65536
+
+/* Sorts the object index by hash, and then by offset. Object ids are
+ * uniformly distributed, so a counting sort on their first two bytes leaves
+ * buckets of a few entries, which are then sorted by comparison. */
+static void writer_sort_obj_index(struct reftable_writer *w)
+{
+	struct obj_index_entry *sorted = NULL;
+	size_t *ends = NULL;
+	size_t i = 0;
+
+	if (w->obj_index_len < OBJ_INDEX_BUCKETS) {
+		if (w->obj_index_len > 1)
+			QSORT(w->obj_index, w->obj_index_len,
+			      obj_index_entry_compare);
+		return;
+	}
 
-#define OBJ_INDEX_TREE_NODE_INIT    \
-	{                           \
-		.hash = STRBUF_INIT \
+	ends = reftable_calloc(sizeof(size_t) * OBJ_INDEX_BUCKETS);
+	for (i = 0; i < w->obj_index_len; i++)
+		ends[get_be16(w->obj_index[i].hash)]++;
+	for (i = 1; i < OBJ_INDEX_BUCKETS; i++)
+		ends[i] += ends[i - 1];
+
+	/* fill the buckets back to front, so `ends` ends up holding their
+	 * starts. */
+	sorted = reftable_malloc(sizeof(struct obj_index_entry) *
+				 w->obj_index_len);
+	for (i = w->obj_index_len; i > 0; i--) {
+		struct obj_index_entry *e = &w->obj_index[i - 1];
+		sorted[--ends[get_be16(e->hash)]] = *e;
 	}
 
-static int obj_index_tree_node_compare(const void *a, const void *b)
+	for (i = 0; i < OBJ_INDEX_BUCKETS; i++) {
+		size_t end = i + 1 < OBJ_INDEX_BUCKETS ? ends[i + 1] :
+							 w->obj_index_len;
+		struct obj_index_entry *bucket = sorted + ends[i];
+		if (end - ends[i] > 1)
+			QSORT(bucket, end - ends[i], obj_index_entry_compare);
+	}
+
+	reftable_free(w->obj_index);
+	w->obj_index = sorted;
+	w->obj_index_cap = w->obj_index_len;
+	reftable_free(ends);
+}
+
+/* sorts the object index, and moves it to the spill file as a new run. */
+static int writer_spill_obj_index(struct reftable_writer *w)
 {
-	return strbuf_cmp(&((const struct obj_index_tree_node *)a)->hash,
-			  &((const struct obj_index_tree_node *)b)->hash);
+	struct obj_index_run run = {
+		.off = w->obj_spill.len,
+		.len = w->obj_index_len,
+	};
+	int err = 0;
+
+	writer_sort_obj_index(w);
+	err = spill_append(&w->obj_spill, w->obj_index,
+			   sizeof(struct obj_index_entry) * w->obj_index_len);
+	if (err < 0)
+		return err;
+
+	if (w->obj_runs_len == w->obj_runs_cap) {
+		w->obj_runs_cap = 2 * w->obj_runs_cap + 1;
+		w->obj_runs = reftable_realloc(
+			w->obj_runs,
+			sizeof(struct obj_index_run) * w->obj_runs_cap);
+	}
+	w->obj_runs[w->obj_runs_len++] = run;
+	w->obj_index_len = 0;
+	return 0;
 }
 
-static void writer_index_hash(struct reftable_writer *w, struct strbuf *hash)
+/* records that object `hash` is referenced from the block at `off`. */
+static int writer_index_hash(struct reftable_writer *w, const uint8_t *hash,
+			     uint64_t off)
 {
-	uint64_t off = w->next;
+	struct obj_index_entry *e = NULL;
+	int len = hash_size(w->opts.hash_id);
+	if (w->obj_index_len > 0) {
+		e = &w->obj_index[w->obj_index_len - 1];
+		if (e->offset == off && !memcmp(e->hash, hash, len))
+			return 0;
+	}
 
-	struct obj_index_tree_node want = { .hash = *hash };
+	if (w->obj_index_len == w->obj_index_cap) {
+		w->obj_index_cap = 2 * w->obj_index_cap + 1;
+		w->obj_index = reftable_realloc(
+			w->obj_index,
+			sizeof(struct obj_index_entry) * w->obj_index_cap);
+	}
+	e = &w->obj_index[w->obj_index_len++];
+	memset(e, 0, sizeof(*e));
+	memcpy(e->hash, hash, len);
+	e->offset = off;
+
+	if (w->opts.max_index_memory &&
+	    w->obj_index_len * sizeof(struct obj_index_entry) >
+		    w->opts.max_index_memory)
+		return writer_spill_obj_index(w);
+	return 0;
+}
 
-	struct tree_node *node = tree_search(&want, &w->obj_index_tree,
-					     &obj_index_tree_node_compare, 0);
-	struct obj_index_tree_node *key = NULL;
-	if (node == NULL) {
-		struct obj_index_tree_node empty = OBJ_INDEX_TREE_NODE_INIT;
-		key = reftable_malloc(sizeof(struct obj_index_tree_node));
-		*key = empty;
+/* the most sorted sources merged at once. Beyond that, runs are first merged
+ * into longer runs, so reading them back takes bounded memory. */
+#define OBJ_INDEX_MERGE_WAYS 16
+
+/* a sorted source of object ids: a run in the spill file, or the entries in
+ * memory. */
+struct obj_index_source {
+	struct spill_reader reader;
+	struct obj_index_entry *mem;
+	size_t left;
+	struct obj_index_entry cur;
+};
 
-		strbuf_reset(&key->hash);
-		strbuf_addbuf(&key->hash, hash);
-		tree_search((void *)key, &w->obj_index_tree,
-			    &obj_index_tree_node_compare, 1);
+/* merges sorted runs, and optionally the entries in memory, which must be
+ * sorted too. The sources form a binary min-heap on their current entries. */
+struct obj_index_merge {
+	struct obj_index_source *sources;
+	size_t len;
+};
+
+/* reads the next entry of `src` into src->cur. Returns 1 at the end. */
+static int obj_index_source_next(struct obj_index_source *src)
+{
+	int err = 0;
+	if (src->left == 0)
+		return 1;
+	if (src->mem) {
+		src->cur = *src->mem++;
 	} else {
-		key = node->key;
+		err = spill_read(&src->reader, &src->cur, sizeof(src->cur));
+		if (err != 0)
+			return REFTABLE_IO_ERROR;
+	}
+	src->left--;
+	return 0;
+}
+
+static void obj_index_merge_sift_down(struct obj_index_merge *m, size_t i)
+{
+	while (1) {
+		size_t min = i;
+		size_t j = 2 * i + 1;
+		struct obj_index_source tmp;
+		if (j < m->len && obj_index_entry_compare(&m->sources[j].cur,
+							  &m->sources[min].cur) < 0)
+			min = j;
+		j++;
+		if (j < m->len && obj_index_entry_compare(&m->sources[j].cur,
+							  &m->sources[min].cur) < 0)
+			min = j;
+		if (min == i)
+			return;
+
+		tmp = m->sources[i];
+		m->sources[i] = m->sources[min];
+		m->sources[min] = tmp;
+		i = min;
 	}
+}
 
-	if (key->offset_len > 0 && key->offsets[key->offset_len - 1] == off) {
-		return;
+static void obj_index_merge_drop(struct obj_index_merge *m, size_t i)
+{
+	spill_reader_release(&m->sources[i].reader);
+	m->sources[i] = m->sources[--m->len];
+}
+
+/* the number of entries to read from a run at a time, so that the buffers of
+ * a merge fit in max_index_memory. */
+static size_t obj_index_merge_chunk(struct reftable_writer *w)
+{
+	size_t chunk = w->opts.max_index_memory /
+		       ((OBJ_INDEX_MERGE_WAYS + 1) *
+			sizeof(struct obj_index_entry));
+	if (chunk > 256)
+		chunk = 256;
+	return chunk ? chunk : 1;
+}
+
+/* sets up `m` to merge the `n` runs starting at `runs`, and the `mem_len`
+ * entries at `mem`. */
+static int obj_index_merge_start(struct reftable_writer *w,
+				 struct obj_index_merge *m,
+				 struct obj_index_run *runs, size_t n,
+				 struct obj_index_entry *mem, size_t mem_len)
+{
+	size_t chunk = obj_index_merge_chunk(w);
+	size_t i = 0;
+	int err = 0;
+
+	m->sources = reftable_calloc(sizeof(struct obj_index_source) * (n + 1));
+	m->len = 0;
+	for (i = 0; i < n; i++) {
+		struct obj_index_source *src = &m->sources[m->len++];
+		uint64_t sz = sizeof(struct obj_index_entry) * runs[i].len;
+		err = spill_reader_init(&src->reader, &w->obj_spill,
+					runs[i].off, runs[i].off + sz,
+					sizeof(struct obj_index_entry) * chunk);
+		if (err < 0)
+			return err;
+		src->left = runs[i].len;
+	}
+	if (mem_len > 0) {
+		m->sources[m->len].mem = mem;
+		m->sources[m->len].left = mem_len;
+		m->len++;
 	}
 
-	if (key->offset_len == key->offset_cap) {
-		key->offset_cap = 2 * key->offset_cap + 1;
-		key->offsets = reftable_realloc(
-			key->offsets, sizeof(uint64_t) * key->offset_cap);
+	for (i = m->len; i > 0; i--) {
+		err = obj_index_source_next(&m->sources[i - 1]);
+		if (err < 0)
+			return err;
+		if (err > 0)
+			obj_index_merge_drop(m, i - 1);
+	}
+	for (i = m->len / 2; i > 0; i--)
+		obj_index_merge_sift_down(m, i - 1);
+	return 0;
+}
+
+/* reads the smallest entry into `dest`. Returns 1 at the end. */
+static int obj_index_merge_next(struct obj_index_merge *m,
+				struct obj_index_entry *dest)
+{
+	int err = 0;
+	if (m->len == 0)
+		return 1;
+
+	*dest = m->sources[0].cur;
+	err = obj_index_source_next(&m->sources[0]);
+	if (err < 0)
+		return err;
+	if (err > 0)
+		obj_index_merge_drop(m, 0);
+	obj_index_merge_sift_down(m, 0);
+	return 0;
+}
+
+static void obj_index_merge_release(struct obj_index_merge *m)
+{
+	while (m->len > 0)
+		obj_index_merge_drop(m, m->len - 1);
+	FREE_AND_NULL(m->sources);
+}
+
+/* merges the oldest runs into one, appended to the spill file, until at most
+ * OBJ_INDEX_MERGE_WAYS are left. Taking the oldest first merges runs of
+ * similar length, so each entry is copied log(runs) times. */
+static int writer_reduce_obj_runs(struct reftable_writer *w)
+{
+	while (w->obj_runs_len > OBJ_INDEX_MERGE_WAYS) {
+		struct obj_index_merge merge = { NULL };
+		struct obj_index_entry e = { 0 };
+		struct obj_index_run run = {
+			.off = w->obj_spill.len,
+		};
+		int err = obj_index_merge_start(w, &merge, w->obj_runs,
+						OBJ_INDEX_MERGE_WAYS, NULL, 0);
+		while (err == 0) {
+			err = obj_index_merge_next(&merge, &e);
+			if (err == 0) {
+				err = spill_append(&w->obj_spill, &e,
+						   sizeof(e));
+				run.len++;
+			}
+		}
+		obj_index_merge_release(&merge);
+		if (err < 0)
+			return err;
+
+		w->obj_runs_len -= OBJ_INDEX_MERGE_WAYS;
+		memmove(w->obj_runs, w->obj_runs + OBJ_INDEX_MERGE_WAYS,
+			sizeof(struct obj_index_run) * w->obj_runs_len);
+		w->obj_runs[w->obj_runs_len++] = run;
 	}
+	return 0;
+}
 
-	key->offsets[key->offset_len++] = off;
+/* sets up `m` to merge all runs and the entries in memory. */
+static int obj_index_merge_init(struct reftable_writer *w,
+				struct obj_index_merge *m)
+{
+	int err = writer_reduce_obj_runs(w);
+	if (err < 0)
+		return err;
+	return obj_index_merge_start(w, m, w->obj_runs, w->obj_runs_len,
+				     w->obj_index, w->obj_index_len);
 }
 
 static int writer_add_record(struct reftable_writer *w,
@@ -268,21 +553,32 @@ int reftable_writer_add_ref(struct reftable_writer *w,
 	if (err < 0)
 		return err;
 
-	if (!w->opts.skip_index_objects && reftable_ref_record_val1(ref)) {
-		struct strbuf h = STRBUF_INIT;
-		strbuf_add(&h, (char *)reftable_ref_record_val1(ref),
-			   hash_size(w->opts.hash_id));
-		writer_index_hash(w, &h);
-		strbuf_release(&h);
+	if (w->opts.ref_metadata) {
+		if (w->ref_hashes_len == 0)
+			strbuf_addstr(&w->first_ref, ref->refname);
+		strbuf_reset(&w->last_ref);
+		strbuf_addstr(&w->last_ref, ref->refname);
+
+		if (w->ref_hashes_len == w->ref_hashes_cap) {
+			w->ref_hashes_cap = 2 * w->ref_hashes_cap + 1;
+			w->ref_hashes = reftable_realloc(
+				w->ref_hashes,
+				sizeof(uint64_t) * w->ref_hashes_cap);
+		}
+		w->ref_hashes[w->ref_hashes_len++] =
+			bloom_hash(ref->refname, strlen(ref->refname));
 	}
 
-	if (!w->opts.skip_index_objects && reftable_ref_record_val2(ref)) {
-		struct strbuf h = STRBUF_INIT;
-		strbuf_add(&h, reftable_ref_record_val2(ref),
-			   hash_size(w->opts.hash_id));
-		writer_index_hash(w, &h);
-		strbuf_release(&h);
+	if (!w->opts.skip_index_objects && reftable_ref_record_val1(ref)) {
+		err = writer_index_hash(w, reftable_ref_record_val1(ref),
+					w->next);
+		if (err < 0)
+			return err;
 	}
+
+	if (!w->opts.skip_index_objects && reftable_ref_record_val2(ref))
+		return writer_index_hash(w, reftable_ref_record_val2(ref),
+					 w->next);
 	return 0;
 }
 
@@ -302,9 +598,14 @@ static int reftable_writer_add_log_verbatim(struct reftable_writer *w,
 					    struct reftable_log_record *log)
 {
 	struct reftable_record rec = { NULL };
+	uint64_t start = 0;
+	uint64_t stall = 0;
+	int err = 0;
+	if (!reftable_compression_supported(w->opts.log_compression))
+		return REFTABLE_API_ERROR;
 	if (w->block_writer &&
 	    block_writer_type(w->block_writer) == BLOCK_TYPE_REF) {
-		int err = writer_finish_public_section(w);
+		err = writer_finish_public_section(w);
 		if (err < 0)
 			return err;
 	}
@@ -312,8 +613,18 @@ static int reftable_writer_add_log_verbatim(struct reftable_writer *w,
 	w->next -= w->pending_padding;
 	w->pending_padding = 0;
 
+	start = monotonic_nsec();
+	stall = w->log_stall_nsec;
 	reftable_record_from_log(&rec, log);
-	return writer_add_record(w, &rec);
+	err = writer_add_record(w, &rec);
+	w->stats.log_encode_nsec +=
+		monotonic_nsec() - start - (w->log_stall_nsec - stall);
+	if (err == 0 && w->opts.log_time_index &&
+	    log->value_type == REFTABLE_LOG_UPDATE)
+		log_time_writer_add(&w->log_times, log->refname,
+				    log->update_index, log->value.update.time,
+				    w->block_writer->entries == 1);
+	return err;
 }
 
 int reftable_writer_add_log(struct reftable_writer *w,
@@ -365,6 +676,135 @@ int reftable_writer_add_logs(struct reftable_writer *w,
 	return err;
 }
 
+/* moves the pending index records to the spill file. */
+static int writer_spill_index(struct reftable_writer *w)
+{
+	int err = 0;
+	size_t i = 0;
+	for (i = 0; i < w->index_len; i++) {
+		struct reftable_index_record *ir = &w->index[i];
+		uint8_t hdr[12];
+		put_be64(hdr, ir->offset);
+		put_be32(hdr + 8, ir->last_key.len);
+		if (err == 0)
+			err = spill_append(&w->index_spill, hdr, sizeof(hdr));
+		if (err == 0)
+			err = spill_append(&w->index_spill, ir->last_key.buf,
+					   ir->last_key.len);
+		strbuf_release(&ir->last_key);
+	}
+	w->index_spilled += w->index_len;
+	w->index_len = 0;
+	w->index_bytes = 0;
+	return err;
+}
+
+/* adds an index record for the block at `offset` ending in `last_key`. */
+static int writer_add_index_record(struct reftable_writer *w, uint64_t offset,
+				   struct strbuf *last_key)
+{
+	struct reftable_index_record ir = { .last_key = STRBUF_INIT };
+	if (w->index_cap == w->index_len) {
+		w->index_cap = 2 * w->index_cap + 1;
+		w->index = reftable_realloc(
+			w->index,
+			sizeof(struct reftable_index_record) * w->index_cap);
+	}
+
+	ir.offset = offset;
+	strbuf_addbuf(&ir.last_key, last_key);
+	w->index[w->index_len++] = ir;
+	w->index_bytes += sizeof(ir) + last_key->len;
+
+	if (w->opts.max_index_memory &&
+	    w->index_bytes > w->opts.max_index_memory)
+		return writer_spill_index(w);
+	return 0;
+}
+
+/* the index records of one level, spilled or not, in order. */
+struct index_level {
+	struct spill_file spill;
+	struct spill_reader reader;
+	size_t spilled;
+
+	struct reftable_index_record *index;
+	size_t len;
+
+	size_t next;
+};
+
+/* moves the pending index records of `w` into `level`. */
+static int writer_take_index(struct reftable_writer *w,
+			     struct index_level *level)
+{
+	struct spill_file empty = SPILL_FILE_INIT;
+	size_t buf_size = 64 * 1024;
+
+	level->spill = w->index_spill;
+	level->spilled = w->index_spilled;
+	level->index = w->index;
+	level->len = w->index_len;
+	level->next = 0;
+
+	w->index_spill = empty;
+	w->index_spill.dir = level->spill.dir;
+	w->index_spilled = 0;
+	w->index = NULL;
+	w->index_len = 0;
+	w->index_cap = 0;
+	w->index_bytes = 0;
+
+	if (level->spill.len < buf_size)
+		buf_size = level->spill.len;
+	return spill_reader_init(&level->reader, &level->spill, 0,
+				 level->spill.len, buf_size);
+}
+
+/* reads the next record of `level` into `dest`. Returns 1 at the end. */
+static int index_level_next(struct index_level *level,
+			    struct reftable_index_record *dest)
+{
+	if (level->next < level->spilled) {
+		uint8_t hdr[12];
+		uint32_t len = 0;
+		int err = spill_read(&level->reader, hdr, sizeof(hdr));
+		if (err != 0)
+			return REFTABLE_IO_ERROR;
+
+		dest->offset = get_be64(hdr);
+		len = get_be32(hdr + 8);
+		strbuf_reset(&dest->last_key);
+		strbuf_grow(&dest->last_key, len);
+		err = spill_read(&level->reader, dest->last_key.buf, len);
+		if (err != 0)
+			return REFTABLE_IO_ERROR;
+		strbuf_setlen(&dest->last_key, len);
+	} else if (level->next < level->spilled + level->len) {
+		struct reftable_index_record *src =
+			&level->index[level->next - level->spilled];
+		dest->offset = src->offset;
+		strbuf_reset(&dest->last_key);
+		strbuf_addbuf(&dest->last_key, &src->last_key);
+	} else {
+		return 1;
+	}
+
+	level->next++;
+	return 0;
+}
+
+static void index_level_release(struct index_level *level)
+{
+	size_t i = 0;
+	for (i = 0; i < level->len; i++)
+		strbuf_release(&level->index[i].last_key);
+	FREE_AND_NULL(level->index);
+	level->len = 0;
+	spill_reader_release(&level->reader);
+	spill_file_release(&level->spill);
+}
+
 static int writer_finish_section(struct reftable_writer *w)
 {
 	uint8_t typ = block_writer_type(w->block_writer);
@@ -373,35 +813,33 @@ static int writer_finish_section(struct reftable_writer *w)
 	int threshold = w->opts.unpadded ? 1 : 3;
 	int before_blocks = w->stats.idx_stats.blocks;
 	int err = writer_flush_block(w);
-	int i = 0;
 	struct reftable_block_stats *bstats = NULL;
+	if (err == 0 && w->deflater)
+		err = writer_write_deflated(w, 1);
 	if (err < 0)
 		return err;
 
-	while (w->index_len > threshold) {
-		struct reftable_index_record *idx = NULL;
-		int idx_len = 0;
+	while (w->index_spilled + w->index_len > threshold) {
+		struct index_level level = { NULL };
+		struct reftable_index_record idx = { .last_key = STRBUF_INIT };
+		struct reftable_record rec = { NULL };
 
 		max_level++;
 		index_start = w->next;
 		writer_reinit_block_writer(w, BLOCK_TYPE_INDEX);
 
-		idx = w->index;
-		idx_len = w->index_len;
-
-		w->index = NULL;
-		w->index_len = 0;
-		w->index_cap = 0;
-		for (i = 0; i < idx_len; i++) {
-			struct reftable_record rec = { NULL };
-			reftable_record_from_index(&rec, idx + i);
-			if (block_writer_add(w->block_writer, &rec) == 0) {
+		reftable_record_from_index(&rec, &idx);
+		err = writer_take_index(w, &level);
+		while (err == 0) {
+			err = index_level_next(&level, &idx);
+			if (err != 0)
+				break;
+			if (block_writer_add(w->block_writer, &rec) == 0)
 				continue;
-			}
 
 			err = writer_flush_block(w);
 			if (err < 0)
-				return err;
+				break;
 
 			writer_reinit_block_writer(w, BLOCK_TYPE_INDEX);
 
@@ -412,18 +850,26 @@ static int writer_finish_section(struct reftable_writer *w)
 				abort();
 			}
 		}
-		for (i = 0; i < idx_len; i++) {
-			strbuf_release(&idx[i].last_key);
-		}
-		reftable_free(idx);
-	}
+		strbuf_release(&idx.last_key);
+		index_level_release(&level);
+		if (err < 0)
+			return err;
 
-	writer_clear_index(w);
+		/* Flush the last block of this level, so the next level (if
+		 * any) has an index record for it. */
+		err = writer_flush_block(w);
+		if (err < 0)
+			return err;
+	}
 
 	err = writer_flush_block(w);
 	if (err < 0)
 		return err;
 
+	/* Flushing the top-level index adds a record for it; clear after, so
+	 * it doesn't end up in the index of the next section. */
+	writer_clear_index(w);
+
 	bstats = writer_reftable_block_stats(w, typ);
 	bstats->index_blocks = w->stats.idx_stats.blocks - before_blocks;
 	bstats->index_offset = index_start;
@@ -435,92 +881,125 @@ static int writer_finish_section(struct reftable_writer *w)
 	return 0;
 }
 
-struct common_prefix_arg {
-	struct strbuf *last;
-	int max;
-};
-
-static void update_common(void *void_arg, void *key)
-{
-	struct common_prefix_arg *arg = void_arg;
-	struct obj_index_tree_node *entry = key;
-	if (arg->last) {
-		int n = common_prefix_size(&entry->hash, arg->last);
-		if (n > arg->max) {
-			arg->max = n;
-		}
-	}
-	arg->last = &entry->hash;
-}
-
-struct write_record_arg {
-	struct reftable_writer *w;
-	int err;
-};
-
-static void write_object_record(void *void_arg, void *key)
+static int writer_write_object_record(struct reftable_writer *w,
+				      uint8_t *hash, uint64_t *offsets,
+				      size_t offset_len)
 {
-	struct write_record_arg *arg = void_arg;
-	struct obj_index_tree_node *entry = key;
 	struct reftable_obj_record obj_rec = {
-		.hash_prefix = (uint8_t *)entry->hash.buf,
-		.hash_prefix_len = arg->w->stats.object_id_len,
-		.offsets = entry->offsets,
-		.offset_len = entry->offset_len,
+		.hash_prefix = hash,
+		.hash_prefix_len = w->stats.object_id_len,
+		.offsets = offsets,
+		.offset_len = offset_len,
 	};
 	struct reftable_record rec = { NULL };
-	if (arg->err < 0)
-		goto done;
+	int err = 0;
 
 	reftable_record_from_obj(&rec, &obj_rec);
-	arg->err = block_writer_add(arg->w->block_writer, &rec);
-	if (arg->err == 0)
-		goto done;
+	err = block_writer_add(w->block_writer, &rec);
+	if (err == 0)
+		return 0;
 
-	arg->err = writer_flush_block(arg->w);
-	if (arg->err < 0)
-		goto done;
+	err = writer_flush_block(w);
+	if (err < 0)
+		return err;
 
-	writer_reinit_block_writer(arg->w, BLOCK_TYPE_OBJ);
-	arg->err = block_writer_add(arg->w->block_writer, &rec);
-	if (arg->err == 0)
-		goto done;
+	writer_reinit_block_writer(w, BLOCK_TYPE_OBJ);
+	err = block_writer_add(w->block_writer, &rec);
+	if (err == 0)
+		return 0;
 	obj_rec.offset_len = 0;
-	arg->err = block_writer_add(arg->w->block_writer, &rec);
+	err = block_writer_add(w->block_writer, &rec);
 
 	/* Should be able to write into a fresh block. */
-	assert(arg->err == 0);
-
-done:;
-}
-
-static void object_record_free(void *void_arg, void *key)
-{
-	struct obj_index_tree_node *entry = key;
-
-	FREE_AND_NULL(entry->offsets);
-	strbuf_release(&entry->hash);
-	reftable_free(entry);
+	assert(err == 0);
+	return err;
 }
 
 static int writer_dump_object_index(struct reftable_writer *w)
 {
-	struct write_record_arg closure = { .w = w };
-	struct common_prefix_arg common = { NULL };
-	if (w->obj_index_tree) {
-		infix_walk(w->obj_index_tree, &update_common, &common);
+	struct obj_index_merge merge = { NULL };
+	struct obj_index_entry prev = { 0 };
+	struct obj_index_entry cur = { 0 };
+	int len = hash_size(w->opts.hash_id);
+	uint64_t *offsets = NULL;
+	size_t offset_len = 0;
+	size_t offset_cap = 0;
+	size_t count = 0;
+	int max = 0;
+	int err = 0;
+
+	writer_sort_obj_index(w);
+
+	/* the shortest prefix that tells all object ids apart. */
+	err = obj_index_merge_init(w, &merge);
+	while (err == 0) {
+		err = obj_index_merge_next(&merge, &cur);
+		if (err != 0)
+			break;
+		if (count++ > 0) {
+			int n = 0;
+			while (n < len && prev.hash[n] == cur.hash[n])
+				n++;
+			if (n < len && n > max)
+				max = n;
+		}
+		prev = cur;
 	}
-	w->stats.object_id_len = common.max + 1;
+	obj_index_merge_release(&merge);
+	if (err < 0)
+		goto done;
+	w->stats.object_id_len = max + 1;
 
 	writer_reinit_block_writer(w, BLOCK_TYPE_OBJ);
 
-	if (w->obj_index_tree) {
-		infix_walk(w->obj_index_tree, &write_object_record, &closure);
+	err = obj_index_merge_init(w, &merge);
+	while (err == 0) {
+		err = obj_index_merge_next(&merge, &cur);
+		if (err < 0)
+			break;
+		if (offset_len > 0 &&
+		    (err > 0 || memcmp(cur.hash, prev.hash, len))) {
+			int write_err = writer_write_object_record(
+				w, prev.hash, offsets, offset_len);
+			if (write_err < 0) {
+				err = write_err;
+				break;
+			}
+			offset_len = 0;
+		}
+		if (err > 0)
+			break;
+
+		if (offset_len == 0)
+			prev = cur;
+		else if (offsets[offset_len - 1] == cur.offset)
+			continue;
+		if (offset_len == offset_cap) {
+			offset_cap = 2 * offset_cap + 1;
+			offsets = reftable_realloc(offsets,
+						   sizeof(uint64_t) * offset_cap);
+		}
+		offsets[offset_len++] = cur.offset;
 	}
+	obj_index_merge_release(&merge);
+	if (err < 0)
+		goto done;
 
-	if (closure.err < 0)
-		return closure.err;
-	return writer_finish_section(w);
+	err = writer_finish_section(w);
+done:
+	reftable_free(offsets);
+	return err;
+}
+
+static void writer_free_obj_index(struct reftable_writer *w)
+{
+	FREE_AND_NULL(w->obj_index);
+	w->obj_index_len = 0;
+	w->obj_index_cap = 0;
+	spill_file_release(&w->obj_spill);
+	FREE_AND_NULL(w->obj_runs);
+	w->obj_runs_len = 0;
+	w->obj_runs_cap = 0;
 }
 
 static int writer_finish_public_section(struct reftable_writer *w)
@@ -542,16 +1021,85 @@ static int writer_finish_public_section(struct reftable_writer *w)
 			return err;
 	}
 
-	if (w->obj_index_tree) {
-		infix_walk(w->obj_index_tree, &object_record_free, NULL);
-		tree_free(w->obj_index_tree);
-		w->obj_index_tree = NULL;
-	}
+	writer_free_obj_index(w);
 
 	w->block_writer = NULL;
 	return 0;
 }
 
+static void meta_add_field(struct strbuf *dest, uint64_t tag,
+			   const void *data, size_t len)
+{
+	uint8_t buf[10];
+	struct string_view sv = { buf, sizeof(buf) };
+	int n = put_var_int(&sv, tag);
+	strbuf_add(dest, buf, n);
+	n = put_var_int(&sv, len);
+	strbuf_add(dest, buf, n);
+	strbuf_add(dest, data, len);
+}
+
+/* writes the metadata block; see BLOCK_TYPE_META. */
+static int writer_write_metadata(struct reftable_writer *w)
+{
+	struct strbuf block = STRBUF_INIT;
+	struct strbuf bloom_field = STRBUF_INIT;
+	struct bloom_filter bloom = { NULL };
+	uint8_t trailer[META_TRAILER_SIZE];
+	uint8_t hashes = 0;
+	size_t i = 0;
+	int err = 0;
+
+	strbuf_add(&block, "m\0\0\0", 4);
+	if (w->ref_hashes_len > 0) {
+		meta_add_field(&block, META_FIELD_FIRST_REF, w->first_ref.buf,
+			       w->first_ref.len);
+		meta_add_field(&block, META_FIELD_LAST_REF, w->last_ref.buf,
+			       w->last_ref.len);
+
+		bloom_filter_init(&bloom, w->ref_hashes_len,
+				  META_BLOOM_BITS_PER_KEY);
+		for (i = 0; i < w->ref_hashes_len; i++)
+			bloom_filter_add(&bloom, w->ref_hashes[i]);
+		hashes = bloom.hashes;
+		strbuf_add(&bloom_field, &hashes, 1);
+		strbuf_add(&bloom_field, bloom.bits, bloom.len);
+		meta_add_field(&block, META_FIELD_REF_BLOOM, bloom_field.buf,
+			       bloom_field.len);
+	}
+	if (w->log_times.out.len > 0)
+		meta_add_field(&block, META_FIELD_LOG_TIMES,
+			       w->log_times.out.buf, w->log_times.out.len);
+
+	if (block.len + META_TRAILER_SIZE >= (1 << 24)) {
+		/* too large to describe; the metadata is optional. */
+		goto done;
+	}
+
+	put_be24((uint8_t *)block.buf + 1, block.len + META_TRAILER_SIZE);
+	put_be32(trailer, block.len + META_TRAILER_SIZE);
+	put_be32(trailer + 4,
+		 crc32(crc32(0, (uint8_t *)block.buf, block.len), trailer, 4));
+	memcpy(trailer + 8, META_MAGIC, 4);
+	strbuf_add(&block, trailer, sizeof(trailer));
+
+	/* Readers detect that the block is unaligned, as for the first log
+	 * block. */
+	w->next -= w->pending_padding;
+	w->pending_padding = 0;
+
+	err = padded_write(w, (uint8_t *)block.buf, block.len, 0);
+	if (err < 0)
+		goto done;
+	w->next += block.len;
+
+done:
+	bloom_filter_release(&bloom);
+	strbuf_release(&bloom_field);
+	strbuf_release(&block);
+	return err;
+}
+
 int reftable_writer_close(struct reftable_writer *w)
 {
 	uint8_t footer[72];
@@ -560,6 +1108,13 @@ int reftable_writer_close(struct reftable_writer *w)
 	int empty_table = w->next == 0;
 	if (err != 0)
 		goto done;
+	log_time_writer_flush(&w->log_times);
+	if (!empty_table &&
+	    (w->ref_hashes_len > 0 || w->log_times.out.len > 0)) {
+		err = writer_write_metadata(w);
+		if (err < 0)
+			goto done;
+	}
 	w->pending_padding = 0;
 	if (empty_table) {
 		/* Empty tables need a header anyway. */
@@ -597,9 +1152,15 @@ int reftable_writer_close(struct reftable_writer *w)
 
 done:
 	/* free up memory. */
+	if (w->deflater) {
+		block_deflater_free(w->deflater);
+		w->deflater = NULL;
+	}
 	block_writer_release(&w->block_writer_data);
 	writer_clear_index(w);
+	writer_release_ref_metadata(w);
 	strbuf_release(&w->last_key);
+	strbuf_release(&w->compressed);
 	return err;
 }
 
@@ -613,68 +1174,192 @@ static void writer_clear_index(struct reftable_writer *w)
 	FREE_AND_NULL(w->index);
 	w->index_len = 0;
 	w->index_cap = 0;
+	w->index_bytes = 0;
+	spill_file_release(&w->index_spill);
+	w->index_spilled = 0;
 }
 
 static const int debug = 0;
 
-static int writer_flush_nonempty_block(struct reftable_writer *w)
+/* writes out a finished block of `len` bytes at `data`, which has room for
+ * the file header if it starts the table, followed by `padding` zeros. */
+static int writer_write_block(struct reftable_writer *w, uint8_t typ,
+			      uint8_t *data, int len, int padding, int entries,
+			      int restarts, struct strbuf *last_key)
 {
-	uint8_t typ = block_writer_type(w->block_writer);
 	struct reftable_block_stats *bstats =
 		writer_reftable_block_stats(w, typ);
 	uint64_t block_typ_off = (bstats->blocks == 0) ? w->next : 0;
-	int raw_bytes = block_writer_finish(w->block_writer);
-	int padding = 0;
+	uint64_t start = 0;
 	int err = 0;
-	struct reftable_index_record ir = { .last_key = STRBUF_INIT };
-	if (raw_bytes < 0)
-		return raw_bytes;
-
-	if (!w->opts.unpadded && typ != BLOCK_TYPE_LOG) {
-		padding = w->opts.block_size - raw_bytes;
-	}
 
 	if (block_typ_off > 0) {
 		bstats->offset = block_typ_off;
 	}
 
-	bstats->entries += w->block_writer->entries;
-	bstats->restarts += w->block_writer->restart_len;
+	bstats->entries += entries;
+	bstats->restarts += restarts;
 	bstats->blocks++;
 	w->stats.blocks++;
 
 	if (debug) {
-		fprintf(stderr, "block %c off %" PRIu64 " sz %d (%d)\n", typ,
-			w->next, raw_bytes,
-			get_be24(w->block + w->block_writer->header_off + 1));
+		fprintf(stderr, "block %c off %" PRIu64 " sz %d\n", typ,
+			w->next, len);
 	}
 
-	if (w->next == 0) {
-		writer_write_header(w, w->block);
+	if (w->next == 0 && !w->no_header) {
+		writer_write_header(w, data);
 	}
 
-	err = padded_write(w, w->block, raw_bytes, padding);
+	if (typ == BLOCK_TYPE_LOG)
+		start = monotonic_nsec();
+	err = padded_write(w, data, len, padding);
 	if (err < 0)
 		return err;
+	if (typ == BLOCK_TYPE_LOG) {
+		uint64_t nsec = monotonic_nsec() - start;
+		w->stats.log_write_nsec += nsec;
+		w->log_stall_nsec += nsec;
+	}
 
-	if (w->index_cap == w->index_len) {
-		w->index_cap = 2 * w->index_cap + 1;
-		w->index = reftable_realloc(
-			w->index,
-			sizeof(struct reftable_index_record) * w->index_cap);
+	err = writer_add_index_record(w, w->next, last_key);
+	if (err < 0)
+		return err;
+
+	w->next += padding + len;
+	return 0;
+}
+
+/* writes out the compressed log blocks at the head of the deflater. Waits
+ * for the oldest block while no more blocks can be submitted, or, with
+ * `all`, until all blocks are written. */
+static int writer_write_deflated(struct reftable_writer *w, int all)
+{
+	while (block_deflater_in_flight(w->deflater) > 0) {
+		int wait = all || !block_deflater_slot(w->deflater);
+		uint64_t start = wait ? monotonic_nsec() : 0;
+		struct deflate_job *job = block_deflater_peek(w->deflater, wait);
+		int err = 0;
+
+		if (wait) {
+			uint64_t nsec = monotonic_nsec() - start;
+			w->stats.log_wait_nsec += nsec;
+			w->log_stall_nsec += nsec;
+		}
+		if (!job)
+			break;
+
+		w->stats.log_compress_nsec += job->nsec;
+		err = job->err;
+		if (err == 0)
+			err = writer_write_block(w, BLOCK_TYPE_LOG,
+						 (uint8_t *)job->out.buf,
+						 job->out.len, 0, job->entries,
+						 job->restarts, &job->last_key);
+		block_deflater_pop(w->deflater);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/* hands the current log block to the deflater. */
+static int writer_submit_log_block(struct reftable_writer *w)
+{
+	struct block_writer *bw = w->block_writer;
+	struct deflate_job *job = NULL;
+	int raw_bytes = 0;
+	int err = 0;
+
+	if (!w->deflater) {
+		int in_flight = w->opts.log_blocks_in_flight;
+		if (in_flight <= 0)
+			in_flight = 2 * w->opts.log_compression_threads;
+		w->deflater = block_deflater_new(
+			w->opts.log_compression_threads, in_flight,
+			w->opts.log_compression, w->opts.sized_log_blocks);
+		if (!w->deflater) {
+			/* compress on this thread instead. */
+			w->opts.log_compression_threads = 0;
+			return writer_flush_nonempty_block(w);
+		}
 	}
 
-	ir.offset = w->next;
-	strbuf_reset(&ir.last_key);
-	strbuf_addbuf(&ir.last_key, &w->block_writer->last_key);
-	w->index[w->index_len] = ir;
+	/* make room, and write out what is compressed already. */
+	err = writer_write_deflated(w, 0);
+	if (err < 0)
+		return err;
+
+	raw_bytes = block_writer_finish_uncompressed(bw);
+	job = block_deflater_slot(w->deflater);
+	strbuf_reset(&job->raw);
+	strbuf_add(&job->raw, w->block, raw_bytes);
+	strbuf_reset(&job->last_key);
+	strbuf_addbuf(&job->last_key, &bw->last_key);
+	job->entries = bw->entries;
+	job->restarts = bw->restart_len;
+	block_deflater_submit(w->deflater);
 
-	w->index_len++;
-	w->next += padding + raw_bytes;
 	w->block_writer = NULL;
 	return 0;
 }
 
+static int writer_flush_nonempty_block(struct reftable_writer *w)
+{
+	struct block_writer *bw = w->block_writer;
+	uint8_t typ = block_writer_type(bw);
+	uint8_t *data = w->block;
+	uint64_t start = 0;
+	int raw_bytes = 0;
+	int padding = 0;
+	int err = 0;
+
+	/* the first block has the file header; it is written right away, so
+	 * the next blocks know they don't start the table. */
+	if (typ == BLOCK_TYPE_LOG && bw->header_off == 0 &&
+	    w->opts.log_compression_threads > 0)
+		return writer_submit_log_block(w);
+
+	if (typ == BLOCK_TYPE_LOG) {
+		uint64_t nsec = 0;
+		start = monotonic_nsec();
+		raw_bytes = block_writer_finish_uncompressed(bw);
+		raw_bytes = block_compress(&w->compressed, w->block, raw_bytes,
+					   bw->header_off,
+					   w->opts.log_compression,
+					   w->opts.sized_log_blocks);
+		data = (uint8_t *)w->compressed.buf;
+		nsec = monotonic_nsec() - start;
+		w->stats.log_compress_nsec += nsec;
+		w->log_stall_nsec += nsec;
+	} else {
+		raw_bytes = block_writer_finish(bw);
+		if (raw_bytes > 0 && w->opts.compress_blocks &&
+		    w->opts.log_compression != REFTABLE_COMPRESSION_NONE) {
+			int n = block_compress(&w->compressed, w->block,
+					       raw_bytes, bw->header_off,
+					       w->opts.log_compression, 1);
+			if (n < 0)
+				return n;
+			/* keep blocks that don't compress as they are. */
+			if (n < raw_bytes) {
+				data = (uint8_t *)w->compressed.buf;
+				raw_bytes = n;
+			}
+		}
+		/* compressed blocks are stored unpadded, as log blocks. */
+		if (!w->opts.unpadded && data == w->block)
+			padding = w->opts.block_size - raw_bytes;
+	}
+	if (raw_bytes < 0)
+		return raw_bytes;
+
+	err = writer_write_block(w, typ, data, raw_bytes, padding, bw->entries,
+				 bw->restart_len, &bw->last_key);
+	w->block_writer = NULL;
+	return err;
+}
+
 static int writer_flush_block(struct reftable_writer *w)
 {
 	if (w->block_writer == NULL)
@@ -688,3 +1373,138 @@ const struct reftable_stats *writer_stats(struct reftable_writer *w)
 {
 	return &w->stats;
 }
+
+static ssize_t partition_write(void *arg, const void *data, size_t sz)
+{
+	strbuf_add((struct strbuf *)arg, data, sz);
+	return sz;
+}
+
+struct reftable_writer *writer_new_partition(struct reftable_writer *w,
+					     uint8_t typ, int first,
+					     struct strbuf *dest)
+{
+	struct reftable_write_options opts = w->opts;
+	struct reftable_writer *p = NULL;
+	/* partitions are encoded concurrently already. */
+	opts.log_compression_threads = 0;
+	p = reftable_new_writer(&partition_write, dest, &opts);
+	reftable_writer_set_limits(p, w->min_update_index,
+				   w->max_update_index);
+	p->partition_typ = typ;
+	p->no_header = !first;
+	p->log_times.keep_edges = 1;
+	writer_reinit_block_writer(p, typ);
+	return p;
+}
+
+int writer_finish_partition(struct reftable_writer *p)
+{
+	int err = writer_flush_block(p);
+	p->block_writer = NULL;
+	log_time_writer_flush(&p->log_times);
+	return err;
+}
+
+/* appends the index records and object ids of partition `p`, relocated to
+ * `base`. */
+static int writer_append_partition_index(struct reftable_writer *w,
+					 struct reftable_writer *p,
+					 uint64_t base)
+{
+	struct index_level level = { NULL };
+	struct reftable_index_record idx = { .last_key = STRBUF_INIT };
+	struct obj_index_merge merge = { NULL };
+	struct obj_index_entry e = { 0 };
+	int err = writer_take_index(p, &level);
+	while (err == 0) {
+		err = index_level_next(&level, &idx);
+		if (err == 0)
+			err = writer_add_index_record(w, base + idx.offset,
+						      &idx.last_key);
+	}
+	strbuf_release(&idx.last_key);
+	index_level_release(&level);
+	if (err < 0)
+		return err;
+
+	/* the order doesn't matter, but the entries must be sorted to be
+	 * merged with the runs. */
+	writer_sort_obj_index(p);
+	err = obj_index_merge_init(p, &merge);
+	while (err == 0) {
+		err = obj_index_merge_next(&merge, &e);
+		if (err == 0)
+			err = writer_index_hash(w, e.hash, base + e.offset);
+	}
+	obj_index_merge_release(&merge);
+	writer_free_obj_index(p);
+	return err < 0 ? err : 0;
+}
+
+int writer_append_partition(struct reftable_writer *w,
+			    struct reftable_writer *p, struct strbuf *data)
+{
+	uint8_t typ = p->partition_typ;
+	struct reftable_block_stats *bstats = writer_reftable_block_stats(w, typ);
+	struct reftable_block_stats *pstats = writer_reftable_block_stats(p, typ);
+	uint64_t base = 0;
+	size_t i = 0;
+	int err = 0;
+
+	if (w->block_writer && block_writer_type(w->block_writer) != typ) {
+		err = writer_finish_public_section(w);
+		if (err < 0)
+			return err;
+	}
+	if (typ == BLOCK_TYPE_LOG) {
+		w->next -= w->pending_padding;
+		w->pending_padding = 0;
+	}
+	if (!w->block_writer)
+		writer_reinit_block_writer(w, typ);
+	assert(w->block_writer->entries == 0);
+	if (p->next == 0)
+		return 0;
+	/* only the partition starting the table has room for the header. */
+	if ((w->next == 0) == p->no_header)
+		return REFTABLE_API_ERROR;
+
+	base = w->next;
+	err = padded_write(w, (uint8_t *)data->buf, data->len,
+			   p->pending_padding);
+	if (err < 0)
+		return err;
+	w->next += p->next;
+
+	if (bstats->blocks == 0)
+		bstats->offset = base + pstats->offset;
+	bstats->entries += pstats->entries;
+	bstats->restarts += pstats->restarts;
+	bstats->blocks += pstats->blocks;
+	w->stats.blocks += p->stats.blocks;
+
+	err = writer_append_partition_index(w, p, base);
+	if (err < 0)
+		return err;
+
+	if (p->ref_hashes_len > 0) {
+		if (w->ref_hashes_len == 0)
+			strbuf_addbuf(&w->first_ref, &p->first_ref);
+		strbuf_reset(&w->last_ref);
+		strbuf_addbuf(&w->last_ref, &p->last_ref);
+		for (i = 0; i < p->ref_hashes_len; i++) {
+			if (w->ref_hashes_len == w->ref_hashes_cap) {
+				w->ref_hashes_cap = 2 * w->ref_hashes_cap + 1;
+				w->ref_hashes = reftable_realloc(
+					w->ref_hashes,
+					sizeof(uint64_t) * w->ref_hashes_cap);
+			}
+			w->ref_hashes[w->ref_hashes_len++] = p->ref_hashes[i];
+		}
+	}
+	/* the log time index refers to update indices, which need no
+	 * relocation. */
+	strbuf_addbuf(&w->log_times.out, &p->log_times.out);
+	return 0;
+}
@@ -11,9 +11,25 @@ https://developers.google.com/open-source/licenses/bsd
 
 #include "basics.h"
 #include "block.h"
-#include "tree.h"
+#include "deflater.h"
+#include "hash.h"
+#include "logtime.h"
+#include "spill.h"
 #include "reftable-writer.h"
 
+/* records that object `hash` is referenced from the ref block at `offset`.
+ * The hash is zero-padded to GIT_SHA256_RAWSZ. */
+struct obj_index_entry {
+	uint64_t offset;
+	uint8_t hash[GIT_SHA256_RAWSZ];
+};
+
+/* a sorted run of obj_index_entry in the object id spill file. */
+struct obj_index_run {
+	uint64_t off;
+	size_t len;
+};
+
 struct reftable_writer {
 	ssize_t (*write)(void *, const void *, size_t);
 	void *write_arg;
@@ -27,6 +43,8 @@ struct reftable_writer {
 
 	/* memory buffer for writing */
 	uint8_t *block;
+	/* log blocks, once compressed. */
+	struct strbuf compressed;
 
 	/* writer for the current section. NULL or points to
 	 * block_writer_data */
@@ -39,12 +57,76 @@ struct reftable_writer {
 	size_t index_len;
 	size_t index_cap;
 
+	/* With max_index_memory, older index records of the current section
+	 * are moved to `index_spill`; they precede those in `index`.
+	 * `index_bytes` estimates the memory used by `index`. */
+	struct spill_file index_spill;
+	size_t index_spilled;
+	size_t index_bytes;
+
 	/*
-	 * tree for use with tsearch; used to populate the 'o' inverse OID
-	 * map */
-	struct tree_node *obj_index_tree;
+	 * objects referenced by the refs written so far, in write order; used
+	 * to populate the 'o' inverse OID map. They are sorted only once, when
+	 * the map is written. */
+	struct obj_index_entry *obj_index;
+	size_t obj_index_len;
+	size_t obj_index_cap;
+
+	/* With max_index_memory, `obj_index` is sorted and moved to
+	 * `obj_spill` whenever it gets too large, as one of `obj_runs`. */
+	struct spill_file obj_spill;
+	struct obj_index_run *obj_runs;
+	size_t obj_runs_len;
+	size_t obj_runs_cap;
+
+	/* ref names seen, for the metadata block. */
+	struct strbuf first_ref;
+	struct strbuf last_ref;
+	uint64_t *ref_hashes;
+	size_t ref_hashes_len;
+	size_t ref_hashes_cap;
+
+	/* With log_time_index, the log time runs for the metadata block. */
+	struct log_time_writer log_times;
 
 	struct reftable_stats stats;
+
+	/* With log_compression_threads, compresses log blocks. Blocks in
+	 * flight are not yet counted in `next`. Started with the first block
+	 * it can take. */
+	struct block_deflater *deflater;
+	/* time spent compressing, waiting and writing while adding logs, to
+	 * tell apart the time spent encoding. */
+	uint64_t log_stall_nsec;
+
+	/* For partitions, the type of the section being encoded; 0 otherwise.
+	 */
+	uint8_t partition_typ;
+	/* Set for partitions that don't start the table, and thus don't leave
+	 * room for the file header in their first block. */
+	int no_header;
 };
 
+/*
+ * Partitions encode a key range of a section into a buffer of their own, so
+ * ranges can be encoded concurrently. They are then stitched into the table
+ * with writer_append_partition, relocating their block offsets.
+ */
+
+/* Creates a writer encoding records of section `typ` into `dest`, with the
+ * options and limits of `w`. `first` must be set for the first partition
+ * with records, which starts the table. */
+struct reftable_writer *writer_new_partition(struct reftable_writer *w,
+					     uint8_t typ, int first,
+					     struct strbuf *dest);
+
+/* Flushes the last block of partition `p`. */
+int writer_finish_partition(struct reftable_writer *p);
+
+/* Appends partition `p`, encoded into `data`, to `w`. Partitions must be
+ * appended in key order, refs before logs, and the records of a section
+ * must either all come from partitions or all be added directly. */
+int writer_append_partition(struct reftable_writer *w,
+			    struct reftable_writer *p, struct strbuf *data);
+
 #endif